@@ -8,7 +8,9 @@
 
 typedef enum {
     kSuccess,
-    kCouldNotEstabilishXPCConnection
+    kCouldNotEstabilishXPCConnection,
+    /* The master rejects requests that don't fit into its in-flight window */
+    kTooManyRequestsInFlight
 } RDIWConnectionError;
 
 typedef void (^RDIWDaemonConnectionCallback)(id reply, RDIWConnectionError error);
@@ -20,6 +22,24 @@ typedef void (^RDIWDaemonConnectionCallback)(id reply, RDIWConnectionError error
  */
 + (instancetype)sharedMaster __attribute__((const));
 
+/**
+ * @abstract
+ * Creates a deamon master with its own connections to the privileged injector helper.
+ *
+ * @discussion
+ * The shared master uses a single connection and a window of 64 injections, and
+ * blocks the caller of a request that doesn't fit into the window until it does.
+ * Requests that don't inject anything (statistics, prelaunch) don't count.
+ *
+ * @param connections a number of XPC connections to spread the requests over
+ * @param window      a maximum number of injections in flight (0 means no limit)
+ * @param reject      whether to fail requests that don't fit into the window with
+ *                    kTooManyRequestsInFlight instead of blocking the caller
+ */
+- (instancetype)initWithConnections: (NSUInteger)connections
+                             window: (NSUInteger)window
+                  rejectingOverflow: (BOOL)reject;
+
 /**
  * @abstract
  * Asynchronously sends a "plese, inject this into that" message to the privileged
@@ -36,4 +56,93 @@ typedef void (^RDIWDaemonConnectionCallback)(id reply, RDIWConnectionError error
                      withPayload: (NSString *)payload
                completionHandler: (RDIWDaemonConnectionCallback)callback;
 
+/**
+ * @abstract
+ * Asynchronously asks the privileged injector helper to inject the same payload
+ * into a number of targets concurrently.
+ *
+ * @discussion
+ * The helper's reply contains a "results" array with an rd_inject_library() result for
+ * every target (in the same order) and a "stats" dictionary with aggregate statistics
+ * ("succeeded", "failed", "concurrency", "elapsed", "throughput", "mean_latency", "max_latency").
+ * Every target is queued on its own, so the fan-out waits for any other request the
+ * helper is running for the same target.
+ *
+ * @param targets     an array of target process identifiers (NSNumbers)
+ * @param payload     a payload library filename
+ * @param concurrency a maximum number of injections in flight (0 means as many as the helper
+ *                    has workers, which is also the upper bound)
+ * @param callback    a block to be called upon error or when helper's reply received
+ */
+- (void)tellDeamonToInjectTargets: (NSArray *)targets
+                      withPayload: (NSString *)payload
+                      concurrency: (NSUInteger)concurrency
+                completionHandler: (RDIWDaemonConnectionCallback)callback;
+
+/**
+ * @abstract
+ * Asynchronously sends a batch of injection requests to the privileged injector helper
+ * in a single binary frame (see rd_injector_protocol.h).
+ *
+ * @discussion
+ * Any number of batches may be in flight at once; batches for different targets are
+ * processed in parallel. The reply passed to the callback is not an XPC object but an
+ * NSArray with a result dictionary for every injection (in the same order): "target",
+ * "error" (an rd_inject_library() result), "error_class" (one of "none", "request",
+ * "target", "payload", "timeout", "aborted" and "internal"), "handle" (the payload's
+ * dlopen() handle inside the target) and "timings" (phase name -> nanoseconds).
+ * Injections the helper never answers (e.g. because it has crashed) are reported with
+ * the "aborted" error class. The reply is nil if the batch could not be sent (with
+ * kCouldNotEstabilishXPCConnection) or taken in at all (with kTooManyRequestsInFlight,
+ * e.g. when it's too large or there's no memory for it).
+ *
+ * @param injections  an array of dictionaries with a "target" (NSNumber) and a "payload" (NSString)
+ * @param callback    a block to be called upon error or when helper's reply received
+ */
+- (void)tellDeamonToPerformInjections: (NSArray *)injections
+                    completionHandler: (RDIWDaemonConnectionCallback)callback;
+
+/**
+ * @abstract
+ * Asynchronously makes sure the privileged injector helper is up and running.
+ *
+ * @discussion
+ * launchd only launches the helper once a message comes in, and the helper exits once
+ * it has been idle for a while, so the first injection of a burst may pay for the whole
+ * launch. Call this method when you know a burst is coming to pay for it upfront.
+ *
+ * @param callback    a block to be called upon error or when helper's reply received
+ */
+- (void)prelaunchDeamonWithCompletionHandler: (RDIWDaemonConnectionCallback)callback;
+
+/**
+ * @abstract
+ * Asynchronously asks the privileged injector helper for its injection latency statistics.
+ *
+ * @discussion
+ * The helper's reply contains a "histograms" dictionary keyed by an injection phase name
+ * ("attach", "resolve", "allocate", "write", "thread", "dlopen", "teardown", "total"
+ * and, on Linux, "stopped"); each value is a dictionary of "count", "mean", "p50", "p90", "p99" and "max"
+ * (all latencies are in nanoseconds). Note that replies to injection requests also carry
+ * a "timings" dictionary with this injection's phases. There's also a "startup" dictionary
+ * with the helper's launch metrics: "startup" (launch to listening), "first_injection"
+ * (launch to the first successful injection), "warm", "idle_timeout" and "rate".
+ *
+ * @param callback    a block to be called upon error or when helper's reply received
+ */
+- (void)fetchDeamonStatisticsWithCompletionHandler: (RDIWDaemonConnectionCallback)callback;
+
+/**
+ * @abstract
+ * Returns the master's own request statistics.
+ *
+ * @discussion
+ * "in_flight" is the number of injections sent and not answered yet, "waiting" is the
+ * number of injections blocked on the window (the depth of the master's queue);
+ * "peak_in_flight" and "peak_waiting" are their maximums so far. There're also the
+ * total numbers of "submitted" and "rejected" injections and "connects", the number
+ * of connections opened.
+ */
+- (NSDictionary *)clientStatistics;
+
 @end
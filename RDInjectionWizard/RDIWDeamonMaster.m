@@ -11,8 +11,11 @@
 #import <xpc/xpc.h>
 #import <pthread.h>
 #import "RDIWDeamonMaster.h"
+#import "rd_injector_client.h"
 
 #define kRDIWDeamonMasterCallbackQueueLabel "me.rodionovd.RDIWDeamonMaster.callbackqueue"
+#define kRDIWDefaultConnections (1)
+#define kRDIWDefaultWindow (64)
 
 static NSString *kRDIWDeamonIdentifer = @"me.rodionovd.RDInjectionWizard.injector";
 
@@ -21,18 +24,30 @@ static pthread_mutex_t fileIOLock = PTHREAD_MUTEX_INITIALIZER;
 
 @interface RDIWDeamonMaster()
 {
-    // A connection handle for our priveleged helper
-    xpc_connection_t _connection;
+    // XPC connections to our priveleged helper and the in-flight window
+    rd_injector_client_t *_client;
+    // Whether the helper is in place already (guarded by fileIOLock)
+    BOOL _helperInstalled;
     AuthorizationRef _authorization;
     // A dispatch queue to perform user's callbacks in
     dispatch_queue_t _callbackQueue;
 }
-- (BOOL)_initializeXPCConnection;
+- (BOOL)_installHelper;
+- (void)_sendRequest: (xpc_object_t)request
+              weight: (size_t)weight
+   completionHandler: (RDIWDaemonConnectionCallback)callback;
++ (NSArray *)_arrayFromResults: (const rd_injector_result_t *)results count: (size_t)count;
 - (BOOL)_copyHelperIntoHostAppBundle;
 - (BOOL)_registerDeamonWithLaunchd;
 - (BOOL)_removeHelperFromHostAppBundle;
 @end
 
+static void *xpc_transport_open(void *context);
+static void xpc_transport_close(void *connection);
+static bool xpc_transport_send(void *connection, const void *frame, size_t length,
+                               rd_injector_submission_t *submission);
+static void batch_completion(const rd_injector_result_t results[], size_t count, void *context);
+
 @implementation RDIWDeamonMaster
 
 + (instancetype)sharedMaster
@@ -47,79 +62,221 @@ static pthread_mutex_t fileIOLock = PTHREAD_MUTEX_INITIALIZER;
 }
 
 - (instancetype)init
+{
+    return [self initWithConnections: kRDIWDefaultConnections
+                              window: kRDIWDefaultWindow
+                   rejectingOverflow: NO];
+}
+
+- (instancetype)initWithConnections: (NSUInteger)connections
+                             window: (NSUInteger)window
+                  rejectingOverflow: (BOOL)reject
 {
     if ((self = [super init])) {
         _callbackQueue = dispatch_queue_create(kRDIWDeamonMasterCallbackQueueLabel,
                                                 DISPATCH_QUEUE_CONCURRENT);
+        /* Connections are only opened (and the helper installed) on the first request */
+        rd_injector_transport_t transport = {
+            .open = xpc_transport_open,
+            .close = xpc_transport_close,
+            .send = xpc_transport_send,
+            .context = (__bridge void *)self
+        };
+        rd_injector_client_options_t options = {
+            .connections = connections,
+            .window = window,
+            .overflow = reject ? RD_INJECTOR_CLIENT_REJECT : RD_INJECTOR_CLIENT_WAIT
+        };
+        _client = rd_injector_client_create(&transport, &options);
+        if (!_client) {
+            return nil;
+        }
     }
 
     return (self);
 }
 
+- (void)dealloc
+{
+    rd_injector_client_destroy(_client);
+}
+
 - (void)tellDeamonToInjectTarget: (pid_t)target
                      withPayload: (NSString *)payload
                completionHandler: (RDIWDaemonConnectionCallback)callback
 {
-    if (![self _initializeXPCConnection]) {
-        dispatch_async(_callbackQueue, ^{
-            if (callback) callback(nil, kCouldNotEstabilishXPCConnection);
-        });
-        return;
-    }
-
     /* Configure a request message */
     xpc_object_t injection_request = xpc_dictionary_create(NULL, NULL, 0);
     xpc_dictionary_set_int64(injection_request, "target", target);
     xpc_dictionary_set_string(injection_request, "payload", [payload UTF8String]);
 
-    if (callback) {
-        xpc_connection_send_message_with_reply(_connection, injection_request,
-                                               _callbackQueue,
-                                               ^(xpc_object_t object) {
-                                                   callback(object, kSuccess);
-                                               });
-    } else {
-        xpc_connection_send_message(_connection, injection_request);
-    }
+    [self _sendRequest: injection_request weight: 1 completionHandler: callback];
 }
 
+- (void)tellDeamonToInjectTargets: (NSArray *)targets
+                      withPayload: (NSString *)payload
+                      concurrency: (NSUInteger)concurrency
+                completionHandler: (RDIWDaemonConnectionCallback)callback
+{
+    /* Configure a fan-out request message */
+    xpc_object_t targets_array = xpc_array_create(NULL, 0);
+    for (NSNumber *target in targets) {
+        xpc_array_set_int64(targets_array, XPC_ARRAY_APPEND, [target intValue]);
+    }
+    xpc_object_t injection_request = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_value(injection_request, "targets", targets_array);
+    xpc_dictionary_set_string(injection_request, "payload", [payload UTF8String]);
+    xpc_dictionary_set_uint64(injection_request, "concurrency", concurrency);
 
-- (BOOL)_initializeXPCConnection
+    [self _sendRequest: injection_request weight: targets.count completionHandler: callback];
+}
+
+- (void)tellDeamonToPerformInjections: (NSArray *)injections
+                    completionHandler: (RDIWDaemonConnectionCallback)callback
 {
-    if (_connection) {
-        return YES;
+    size_t count = injections.count;
+    rd_injector_request_t *requests = calloc(count ? count : 1, sizeof(*requests));
+    if (!requests) {
+        /* The batch can't be taken in, same as if the window were full */
+        dispatch_async(_callbackQueue, ^{
+            if (callback) callback(nil, kTooManyRequestsInFlight);
+        });
+        return;
     }
-    pthread_mutex_lock(&fileIOLock);
-    if (NO == [self _copyHelperIntoHostAppBundle]) {
-        pthread_mutex_unlock(&fileIOLock);
-        return NO;
+    for (size_t i = 0; i < count; i++) {
+        NSDictionary *injection = injections[i];
+        requests[i].target = [injection[@"target"] intValue];
+        requests[i].payload_path = [injection[@"payload"] fileSystemRepresentation];
     }
-    if (NO == [self _registerDeamonWithLaunchd]) {
-        pthread_mutex_unlock(&fileIOLock);
-        return NO;
+    dispatch_queue_t callback_queue = _callbackQueue;
+    void (^completion)(NSArray *) = ^(NSArray *results) {
+        dispatch_async(callback_queue, ^{
+            if (callback) callback(results, kSuccess);
+        });
+    };
+    void *context = (__bridge_retained void *)[completion copy];
+    int err = rd_injector_client_submit(_client, requests, count, batch_completion, context);
+    free(requests);
+    if (err != KERN_SUCCESS) {
+        /* The completion is never going to be called, so let it go */
+        (void)(__bridge_transfer id)context;
+        RDIWConnectionError error = kTooManyRequestsInFlight;
+        if (err == KERN_FAILURE) {
+            error = kCouldNotEstabilishXPCConnection;
+        } else if (err != KERN_RESOURCE_SHORTAGE) {
+            NSLog(@"%s: Too many injections for a single batch", __PRETTY_FUNCTION__);
+        }
+        dispatch_async(_callbackQueue, ^{
+            if (callback) callback(nil, error);
+        });
     }
-    if (NO == [self _removeHelperFromHostAppBundle]) {
-        pthread_mutex_unlock(&fileIOLock);
-        return NO;
+}
+
+/**
+ * Turns the results of a binary batch into an array of result dictionaries.
+ */
++ (NSArray *)_arrayFromResults: (const rd_injector_result_t *)results count: (size_t)count
+{
+    NSMutableArray *array = [NSMutableArray arrayWithCapacity: count];
+    for (size_t i = 0; i < count; i++) {
+        NSMutableDictionary *timings = [NSMutableDictionary dictionary];
+        for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+            if (results[i].timings.phase_ns[phase] == 0) continue;
+            timings[@(rd_inject_phase_name(phase))] = @(results[i].timings.phase_ns[phase]);
+        }
+        [array addObject: @{
+            @"target": @(results[i].target),
+            @"error": @(results[i].error),
+            @"error_class": @(rd_injector_error_class_name(results[i].error_class)),
+            @"handle": @(results[i].handle),
+            @"timings": timings
+        }];
     }
 
-    _connection = xpc_connection_create_mach_service([kRDIWDeamonIdentifer UTF8String],
-                                                     NULL,
-                                                     XPC_CONNECTION_MACH_SERVICE_PRIVILEGED);
-    if (!_connection) {
-        NSLog(@"%s: Unable to create XPC connection", __PRETTY_FUNCTION__);
-        pthread_mutex_unlock(&fileIOLock);
-        return NO;
+    return array;
+}
+
+- (void)prelaunchDeamonWithCompletionHandler: (RDIWDaemonConnectionCallback)callback
+{
+    xpc_object_t prelaunch_request = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_bool(prelaunch_request, "prelaunch", true);
+
+    [self _sendRequest: prelaunch_request weight: 0 completionHandler: callback];
+}
+
+- (void)fetchDeamonStatisticsWithCompletionHandler: (RDIWDaemonConnectionCallback)callback
+{
+    xpc_object_t stats_request = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_bool(stats_request, "stats", true);
+
+    [self _sendRequest: stats_request weight: 0 completionHandler: callback];
+}
+
+- (NSDictionary *)clientStatistics
+{
+    rd_injector_client_stats_t stats;
+    rd_injector_client_get_stats(_client, &stats);
+
+    return @{
+        @"in_flight": @(stats.in_flight),
+        @"waiting": @(stats.waiting),
+        @"peak_in_flight": @(stats.peak_in_flight),
+        @"peak_waiting": @(stats.peak_waiting),
+        @"submitted": @(stats.submitted),
+        @"rejected": @(stats.rejected),
+        @"connects": @(stats.connects)
+    };
+}
+
+/**
+ * Sends a request over one of our connections once there's a room for its
+ * `weight` injections in the window (requests that inject nothing weigh 0).
+ */
+- (void)_sendRequest: (xpc_object_t)request
+              weight: (size_t)weight
+   completionHandler: (RDIWDaemonConnectionCallback)callback
+{
+    if (weight > 0 && rd_injector_client_acquire(_client, weight) != KERN_SUCCESS) {
+        dispatch_async(_callbackQueue, ^{
+            if (callback) callback(nil, kTooManyRequestsInFlight);
+        });
+        return;
+    }
+    xpc_connection_t connection = (__bridge xpc_connection_t)rd_injector_client_connection(_client);
+    if (!connection) {
+        rd_injector_client_release(_client, weight);
+        dispatch_async(_callbackQueue, ^{
+            if (callback) callback(nil, kCouldNotEstabilishXPCConnection);
+        });
+        return;
     }
-    pthread_mutex_unlock(&fileIOLock);
 
-    /* Every connection has to have an event handler set */
-    xpc_connection_set_event_handler(_connection, ^(xpc_object_t __unused event) {
-        /* no-op */
-    });
-    xpc_connection_resume(_connection);
+    /* We need a reply either way to know when the request leaves the window */
+    rd_injector_client_t *client = _client;
+    xpc_connection_send_message_with_reply(connection, request,
+                                           _callbackQueue,
+                                           ^(xpc_object_t object) {
+                                               rd_injector_client_release(client, weight);
+                                               if (callback) callback(object, kSuccess);
+                                           });
+}
 
-    return YES;
+/**
+ * Makes sure the helper is installed and registered with launchd before
+ * the first connection is opened.
+ */
+- (BOOL)_installHelper
+{
+    pthread_mutex_lock(&fileIOLock);
+    if (!_helperInstalled) {
+        _helperInstalled = ([self _copyHelperIntoHostAppBundle] &&
+                            [self _registerDeamonWithLaunchd] &&
+                            [self _removeHelperFromHostAppBundle]);
+    }
+    BOOL installed = _helperInstalled;
+    pthread_mutex_unlock(&fileIOLock);
+
+    return installed;
 }
 
 /**
@@ -269,3 +426,64 @@ static pthread_mutex_t fileIOLock = PTHREAD_MUTEX_INITIALIZER;
 }
 
 @end
+
+#pragma mark - The XPC transport
+
+static void *xpc_transport_open(void *context)
+{
+    RDIWDeamonMaster *master = (__bridge RDIWDeamonMaster *)context;
+    if (![master _installHelper]) {
+        return NULL;
+    }
+    xpc_connection_t connection = xpc_connection_create_mach_service([kRDIWDeamonIdentifer UTF8String],
+                                                                     NULL,
+                                                                     XPC_CONNECTION_MACH_SERVICE_PRIVILEGED);
+    if (!connection) {
+        NSLog(@"%s: Unable to create XPC connection", __PRETTY_FUNCTION__);
+        return NULL;
+    }
+    /* Every connection has to have an event handler set */
+    xpc_connection_set_event_handler(connection, ^(xpc_object_t __unused event) {
+        /* no-op */
+    });
+    xpc_connection_resume(connection);
+
+    return (__bridge_retained void *)connection;
+}
+
+static void xpc_transport_close(void *connection)
+{
+    xpc_connection_cancel((__bridge_transfer xpc_connection_t)connection);
+}
+
+static bool xpc_transport_send(void *connection, const void *frame, size_t length,
+                               rd_injector_submission_t *submission)
+{
+    xpc_object_t injection_request = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_data(injection_request, "frame", frame, length);
+    /* An XPC error reply (e.g. the helper has crashed) has no frame, so it aborts the batch */
+    xpc_connection_send_message_with_reply((__bridge xpc_connection_t)connection, injection_request,
+                                           dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                                           ^(xpc_object_t reply) {
+        size_t reply_length = 0;
+        const void *reply_frame = NULL;
+        rd_injector_result_t *results = NULL;
+        size_t count = 0;
+        if (xpc_get_type(reply) == XPC_TYPE_DICTIONARY) {
+            reply_frame = xpc_dictionary_get_data(reply, "frame", &reply_length);
+        }
+        if (!reply_frame || !rd_injector_decode_results(reply_frame, reply_length, &results, &count)) {
+            results = NULL;
+        }
+        rd_injector_client_complete(submission, results, count);
+        free(results);
+    });
+
+    return true;
+}
+
+static void batch_completion(const rd_injector_result_t results[], size_t count, void *context)
+{
+    void (^completion)(NSArray *) = (__bridge_transfer void (^)(NSArray *))context;
+    completion([RDIWDeamonMaster _arrayFromResults: results count: count]);
+}
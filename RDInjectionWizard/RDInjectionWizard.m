@@ -8,6 +8,7 @@
 #import <sys/param.h>
 #import "RDIWDeamonMaster.h"
 #import "RDInjectionWizard.h"
+#import "rd_payload_cache.h"
 
 #define kRDFallbackSandboxContainer ([@"~/Library/Fonts" stringByExpandingTildeInPath])
 #define kRDInjectionWizardCallbackQueueLabel "me.rodionovd.RDInjectionWizard.callbackqueue"
@@ -63,20 +64,23 @@
         return;
     }
 
-    BOOL payload_was_copied = NO;
+    /* Stage the payload into the target's container. Staged copies are shared
+     * between injections of the same payload, see rd_payload_cache_stage() */
+    char *staged_payload = NULL;
     if (NO == [sandbox_friendly_payload isEqualToString: _payload]) {
-        payload_was_copied = YES;
-        NSError *error = nil;
-        BOOL copied = [[NSFileManager defaultManager] copyItemAtPath: _payload
-                                                              toPath: sandbox_friendly_payload
-                                                               error: &error];
-        if (!copied) {
-            NSLog(@"%s: %@", __PRETTY_FUNCTION__, error);
+        NSString *staging_directory = [sandbox_friendly_payload stringByDeletingLastPathComponent];
+        staged_payload = rd_payload_cache_stage([_payload fileSystemRepresentation],
+                                                [staging_directory fileSystemRepresentation]);
+        if (!staged_payload) {
+            NSLog(@"%s: could not stage %@ into %@", __PRETTY_FUNCTION__, _payload, staging_directory);
             dispatch_async(_callbackQueue, ^{
                 if (failure) failure(kInvalidPayload);
             });
             return;
         }
+        sandbox_friendly_payload = [[NSFileManager defaultManager]
+                                    stringWithFileSystemRepresentation: staged_payload
+                                                                length: strlen(staged_payload)];
     }
 
     RDIWDeamonMaster *master = [RDIWDeamonMaster sharedMaster];
@@ -84,10 +88,10 @@
                          withPayload: sandbox_friendly_payload
                    completionHandler:
      ^(xpc_object_t reply, RDIWConnectionError error) {
-         /* Remove a payload copy if any */
-         if (payload_was_copied) {
-             [[NSFileManager defaultManager] removeItemAtPath: sandbox_friendly_payload
-                                                        error: nil];
+         /* Let go of the staged payload copy if any */
+         if (staged_payload) {
+             rd_payload_cache_release(staged_payload);
+             free(staged_payload);
          }
          /* Check the xpc reply for an injection error */
          if (!reply) {
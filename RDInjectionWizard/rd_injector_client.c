@@ -0,0 +1,525 @@
+//
+//  rd_injector_client.c
+//  RDInjectionWizard
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+
+#include "rd_injector_client.h"
+
+#if defined(MSG_NOSIGNAL)
+#define kRDSocketSendFlags (MSG_NOSIGNAL)
+#else
+/* There's SO_NOSIGPIPE instead */
+#define kRDSocketSendFlags (0)
+#endif
+
+#pragma mark - Private Interface
+
+struct rd_injector_client {
+    rd_injector_transport_t transport;
+    /* The socket transport's path, if it's ours */
+    char *socket_path;
+    /* The pool; a slot is only written under connections_lock */
+    size_t connections_count;
+    _Atomic(void *) *connections;
+    atomic_size_t next_slot;
+    pthread_mutex_t connections_lock;
+    /* Broken connections we've replaced (other threads may still be using them) */
+    void **retired;
+    size_t retired_count;
+    /* The in-flight window; waiters sleep on window_open under window_lock */
+    size_t window;
+    rd_injector_client_overflow_t overflow;
+    atomic_size_t in_flight;
+    atomic_size_t waiting;
+    pthread_mutex_t window_lock;
+    pthread_cond_t window_open;
+    atomic_uint_fast64_t next_id;
+    /* Stats */
+    atomic_size_t peak_in_flight;
+    atomic_size_t peak_waiting;
+    atomic_uint_fast64_t submitted;
+    atomic_uint_fast64_t rejected;
+    atomic_uint_fast64_t connects;
+};
+
+struct rd_injector_submission {
+    rd_injector_client_t *client;
+    rd_injector_client_callback_t callback;
+    void *context;
+    uint64_t first_id;
+    size_t count;
+    /* What the requests get if there're no results for them */
+    rd_injector_result_t aborted[];
+};
+
+/* A submission sent over a socket and not answered yet */
+typedef struct rd_socket_pending {
+    rd_injector_submission_t *submission;
+    uint64_t first_id;
+    struct rd_socket_pending *next;
+} rd_socket_pending_t;
+
+typedef struct {
+    int fd;
+    /* Guards writes, the pending list and `broken` being set */
+    pthread_mutex_t lock;
+    rd_socket_pending_t *pending;
+    atomic_bool broken;
+    pthread_t reader;
+} rd_socket_connection_t;
+
+static bool try_acquire(rd_injector_client_t *client, size_t count);
+static void update_peak(atomic_size_t *peak, size_t value);
+static void *open_connection(rd_injector_client_t *client, size_t slot);
+static void *socket_open(void *context);
+static void socket_close(void *connection);
+static bool socket_is_broken(void *connection);
+static bool socket_send(void *connection, const void *frame, size_t length,
+                        rd_injector_submission_t *submission);
+static void *socket_reader(void *context);
+static bool recv_all(int fd, void *bytes, size_t length);
+
+#pragma mark - Implementation
+
+rd_injector_client_t *rd_injector_client_create(const rd_injector_transport_t *transport,
+                                                const rd_injector_client_options_t *options)
+{
+    rd_injector_client_t *client = calloc(1, sizeof(*client));
+    if (!client) {
+        return NULL;
+    }
+    client->transport = *transport;
+    client->connections_count = (options && options->connections) ? options->connections : 1;
+    client->connections = calloc(client->connections_count, sizeof(*client->connections));
+    if (!client->connections) {
+        free(client);
+        return NULL;
+    }
+    client->window = options ? options->window : 0;
+    client->overflow = options ? options->overflow : RD_INJECTOR_CLIENT_WAIT;
+    pthread_mutex_init(&client->connections_lock, NULL);
+    pthread_mutex_init(&client->window_lock, NULL);
+    pthread_cond_init(&client->window_open, NULL);
+
+    return client;
+}
+
+rd_injector_client_t *rd_injector_client_create_socket(const char *socket_path,
+                                                       const rd_injector_client_options_t *options)
+{
+    char *path = strdup(socket_path);
+    if (!path) {
+        return NULL;
+    }
+    rd_injector_transport_t transport = {
+        .open = socket_open,
+        .close = socket_close,
+        .is_broken = socket_is_broken,
+        .send = socket_send,
+        .context = path
+    };
+    rd_injector_client_t *client = rd_injector_client_create(&transport, options);
+    if (!client) {
+        free(path);
+        return NULL;
+    }
+    client->socket_path = path;
+
+    return client;
+}
+
+void rd_injector_client_destroy(rd_injector_client_t *client)
+{
+    if (!client) {
+        return;
+    }
+    for (size_t slot = 0; slot < client->connections_count; slot++) {
+        void *connection = atomic_load(&client->connections[slot]);
+        if (connection) client->transport.close(connection);
+    }
+    for (size_t i = 0; i < client->retired_count; i++) {
+        client->transport.close(client->retired[i]);
+    }
+    pthread_mutex_destroy(&client->connections_lock);
+    pthread_mutex_destroy(&client->window_lock);
+    pthread_cond_destroy(&client->window_open);
+    free(client->retired);
+    free(client->connections);
+    free(client->socket_path);
+    free(client);
+}
+
+int rd_injector_client_acquire(rd_injector_client_t *client, size_t count)
+{
+    if (try_acquire(client, count)) {
+        return KERN_SUCCESS;
+    }
+    if (client->overflow == RD_INJECTOR_CLIENT_REJECT) {
+        atomic_fetch_add(&client->rejected, count);
+        return KERN_RESOURCE_SHORTAGE;
+    }
+    pthread_mutex_lock(&client->window_lock);
+    /* Releasers check `waiting` after giving the room back, so we can't miss a wakeup */
+    update_peak(&client->peak_waiting, atomic_fetch_add(&client->waiting, count) + count);
+    while (!try_acquire(client, count)) {
+        pthread_cond_wait(&client->window_open, &client->window_lock);
+    }
+    atomic_fetch_sub(&client->waiting, count);
+    pthread_mutex_unlock(&client->window_lock);
+
+    return KERN_SUCCESS;
+}
+
+void rd_injector_client_release(rd_injector_client_t *client, size_t count)
+{
+    atomic_fetch_sub(&client->in_flight, count);
+    if (atomic_load(&client->waiting) > 0) {
+        pthread_mutex_lock(&client->window_lock);
+        pthread_cond_broadcast(&client->window_open);
+        pthread_mutex_unlock(&client->window_lock);
+    }
+}
+
+void *rd_injector_client_connection(rd_injector_client_t *client)
+{
+    size_t slot = atomic_fetch_add_explicit(&client->next_slot, 1, memory_order_relaxed) %
+                  client->connections_count;
+    void *connection = atomic_load_explicit(&client->connections[slot], memory_order_acquire);
+    if (connection && !(client->transport.is_broken && client->transport.is_broken(connection))) {
+        return connection;
+    }
+    return open_connection(client, slot);
+}
+
+int rd_injector_client_submit(rd_injector_client_t *client,
+                              const rd_injector_request_t requests[], size_t count,
+                              rd_injector_client_callback_t callback, void *context)
+{
+    if (!client->transport.send || count == 0 || count > kRDInjectorMaxBatchCount) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    rd_injector_submission_t *submission = calloc(1, sizeof(*submission) +
+                                                  count * sizeof(*submission->aborted));
+    rd_injector_request_t *numbered = malloc(count * sizeof(*numbered));
+    if (!submission || !numbered) {
+        free(submission);
+        free(numbered);
+        return KERN_FAILURE;
+    }
+    submission->client = client;
+    submission->callback = callback;
+    submission->context = context;
+    submission->count = count;
+    submission->first_id = atomic_fetch_add(&client->next_id, count) + 1;
+    for (size_t i = 0; i < count; i++) {
+        numbered[i] = requests[i];
+        numbered[i].id = submission->first_id + i;
+        submission->aborted[i] = (rd_injector_result_t){
+            .id = numbered[i].id,
+            .target = numbered[i].target,
+            .error = KERN_ABORTED,
+            .error_class = RD_INJECTOR_ERROR_ABORTED
+        };
+    }
+    size_t capacity = rd_injector_requests_frame_length(numbered, count);
+    void *frame = malloc(capacity);
+    size_t length = frame ? rd_injector_encode_requests(numbered, count, frame, capacity) : 0;
+    free(numbered);
+    if (length == 0) {
+        free(frame);
+        free(submission);
+        return KERN_INVALID_ARGUMENT;
+    }
+
+    int err = rd_injector_client_acquire(client, count);
+    if (err != KERN_SUCCESS) {
+        free(frame);
+        free(submission);
+        return err;
+    }
+    /* The submission is not ours anymore once it's sent */
+    void *connection = rd_injector_client_connection(client);
+    if (!connection || !client->transport.send(connection, frame, length, submission)) {
+        rd_injector_client_release(client, count);
+        free(submission);
+        err = KERN_FAILURE;
+    }
+    free(frame);
+
+    return err;
+}
+
+void rd_injector_client_complete(rd_injector_submission_t *submission,
+                                 const rd_injector_result_t results[], size_t count)
+{
+    /* A results frame that doesn't match the requests is as good as none */
+    if (!results || count != submission->count || results[0].id != submission->first_id) {
+        results = submission->aborted;
+        count = submission->count;
+    }
+    rd_injector_client_release(submission->client, submission->count);
+    if (submission->callback) {
+        submission->callback(results, count, submission->context);
+    }
+    free(submission);
+}
+
+uint64_t rd_injector_submission_first_id(const rd_injector_submission_t *submission)
+{
+    return submission->first_id;
+}
+
+void rd_injector_client_get_stats(rd_injector_client_t *client, rd_injector_client_stats_t *stats)
+{
+    stats->in_flight = atomic_load(&client->in_flight);
+    stats->waiting = atomic_load(&client->waiting);
+    stats->peak_in_flight = atomic_load(&client->peak_in_flight);
+    stats->peak_waiting = atomic_load(&client->peak_waiting);
+    stats->submitted = atomic_load(&client->submitted);
+    stats->rejected = atomic_load(&client->rejected);
+    stats->connects = atomic_load(&client->connects);
+}
+
+static
+bool try_acquire(rd_injector_client_t *client, size_t count)
+{
+    size_t in_flight = atomic_load(&client->in_flight);
+    do {
+        if (client->window && in_flight > 0 && in_flight + count > client->window) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&client->in_flight, &in_flight, in_flight + count));
+    update_peak(&client->peak_in_flight, in_flight + count);
+    atomic_fetch_add(&client->submitted, count);
+
+    return true;
+}
+
+static
+void update_peak(atomic_size_t *peak, size_t value)
+{
+    size_t current = atomic_load_explicit(peak, memory_order_relaxed);
+    while (value > current &&
+           !atomic_compare_exchange_weak_explicit(peak, &current, value,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+/**
+ * Opens a connection for the slot unless someone else has already done that,
+ * replacing a broken one.
+ */
+static
+void *open_connection(rd_injector_client_t *client, size_t slot)
+{
+    pthread_mutex_lock(&client->connections_lock);
+    void *connection = atomic_load_explicit(&client->connections[slot], memory_order_relaxed);
+    if (connection && client->transport.is_broken && client->transport.is_broken(connection)) {
+        void **retired = realloc(client->retired, (client->retired_count + 1) * sizeof(*retired));
+        if (!retired) {
+            pthread_mutex_unlock(&client->connections_lock);
+            return NULL;
+        }
+        client->retired = retired;
+        client->retired[client->retired_count++] = connection;
+        atomic_store_explicit(&client->connections[slot], NULL, memory_order_relaxed);
+        connection = NULL;
+    }
+    if (!connection) {
+        connection = client->transport.open(client->transport.context);
+        if (connection) {
+            atomic_fetch_add(&client->connects, 1);
+            atomic_store_explicit(&client->connections[slot], connection, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&client->connections_lock);
+
+    return connection;
+}
+
+static
+void *socket_open(void *context)
+{
+    const char *socket_path = context;
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+    rd_socket_connection_t *connection = calloc(1, sizeof(*connection));
+    if (!connection) {
+        return NULL;
+    }
+    connection->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection->fd < 0) {
+        free(connection);
+        return NULL;
+    }
+    fcntl(connection->fd, F_SETFD, FD_CLOEXEC);
+#if defined(SO_NOSIGPIPE)
+    int enabled = 1;
+    setsockopt(connection->fd, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+#endif
+    pthread_mutex_init(&connection->lock, NULL);
+    if (connect(connection->fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        pthread_create(&connection->reader, NULL, socket_reader, connection) != 0) {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->lock);
+        free(connection);
+        return NULL;
+    }
+
+    return connection;
+}
+
+/**
+ * Closes the socket; the reader gives up on everything that's still pending.
+ */
+static
+void socket_close(void *context)
+{
+    rd_socket_connection_t *connection = context;
+    shutdown(connection->fd, SHUT_RDWR);
+    pthread_join(connection->reader, NULL);
+    close(connection->fd);
+    pthread_mutex_destroy(&connection->lock);
+    free(connection);
+}
+
+static
+bool socket_is_broken(void *context)
+{
+    rd_socket_connection_t *connection = context;
+    return atomic_load_explicit(&connection->broken, memory_order_relaxed);
+}
+
+static
+bool socket_send(void *context, const void *frame, size_t length, rd_injector_submission_t *submission)
+{
+    rd_socket_connection_t *connection = context;
+    rd_socket_pending_t *pending = malloc(sizeof(*pending));
+    if (!pending) {
+        return false;
+    }
+    pending->submission = submission;
+    pending->first_id = rd_injector_submission_first_id(submission);
+
+    pthread_mutex_lock(&connection->lock);
+    if (atomic_load(&connection->broken)) {
+        pthread_mutex_unlock(&connection->lock);
+        free(pending);
+        return false;
+    }
+    /* It's pending before it's sent, so the reader can't miss the reply */
+    pending->next = connection->pending;
+    connection->pending = pending;
+    const char *bytes = frame;
+    while (length > 0) {
+        ssize_t sent = send(connection->fd, bytes, length, kRDSocketSendFlags);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) break;
+        bytes += sent;
+        length -= (size_t)sent;
+    }
+    if (length > 0) {
+        /* The reader finds out soon enough and gives up on everything else */
+        shutdown(connection->fd, SHUT_RDWR);
+        for (rd_socket_pending_t **link = &connection->pending; *link; link = &(*link)->next) {
+            if (*link == pending) {
+                *link = pending->next;
+                free(pending);
+                pending = NULL;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&connection->lock);
+
+    /* If the reader has already taken it, it's the reader's to complete */
+    return (length == 0 || pending != NULL);
+}
+
+/**
+ * Receives results frames and completes their submissions until the connection breaks.
+ */
+static
+void *socket_reader(void *context)
+{
+    rd_socket_connection_t *connection = context;
+    unsigned char header[kRDInjectorFrameHeaderSize];
+    while (recv_all(connection->fd, header, sizeof(header))) {
+        ssize_t length = rd_injector_frame_length(header, sizeof(header));
+        if (length <= 0 || rd_injector_frame_type(header) != RD_INJECTOR_FRAME_RESULTS) {
+            break;
+        }
+        unsigned char *frame = malloc((size_t)length);
+        rd_injector_result_t *results = NULL;
+        size_t count = 0;
+        if (!frame) {
+            break;
+        }
+        memcpy(frame, header, sizeof(header));
+        if (!recv_all(connection->fd, frame + sizeof(header), (size_t)length - sizeof(header)) ||
+            !rd_injector_decode_results(frame, (size_t)length, &results, &count)) {
+            free(frame);
+            break;
+        }
+        free(frame);
+        rd_socket_pending_t *pending = NULL;
+        pthread_mutex_lock(&connection->lock);
+        for (rd_socket_pending_t **link = &connection->pending; count > 0 && *link; link = &(*link)->next) {
+            if ((*link)->first_id == results[0].id) {
+                pending = *link;
+                *link = pending->next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&connection->lock);
+        /* Results nobody waits for are dropped */
+        if (pending) {
+            rd_injector_client_complete(pending->submission, results, count);
+            free(pending);
+        }
+        free(results);
+    }
+
+    pthread_mutex_lock(&connection->lock);
+    atomic_store(&connection->broken, true);
+    rd_socket_pending_t *pending = connection->pending;
+    connection->pending = NULL;
+    pthread_mutex_unlock(&connection->lock);
+    while (pending) {
+        rd_socket_pending_t *next = pending->next;
+        rd_injector_client_complete(pending->submission, NULL, 0);
+        free(pending);
+        pending = next;
+    }
+
+    return NULL;
+}
+
+static
+bool recv_all(int fd, void *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t received = recv(fd, bytes, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes = (char *)bytes + received;
+        length -= (size_t)received;
+    }
+    return true;
+}
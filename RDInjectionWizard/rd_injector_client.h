@@ -0,0 +1,183 @@
+//
+//  rd_injector_client.h
+//  RDInjectionWizard
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "rd_injector_protocol.h"
+
+typedef struct rd_injector_client rd_injector_client_t;
+/* A submission waiting for its results, see rd_injector_client_complete() */
+typedef struct rd_injector_submission rd_injector_submission_t;
+
+/* What to do with a request that doesn't fit into the in-flight window */
+typedef enum {
+    /* Block the caller until enough requests in flight are done */
+    RD_INJECTOR_CLIENT_WAIT = 0,
+    /* Turn the request down with KERN_RESOURCE_SHORTAGE right away */
+    RD_INJECTOR_CLIENT_REJECT
+} rd_injector_client_overflow_t;
+
+typedef struct {
+    /* How many connections to spread the requests over (0 means 1) */
+    size_t connections;
+    /* How many requests may be in flight at once (0 means no limit) */
+    size_t window;
+    rd_injector_client_overflow_t overflow;
+} rd_injector_client_options_t;
+
+/* Delivers the results of a submission, in the same order as its requests */
+typedef void (*rd_injector_client_callback_t)(const rd_injector_result_t results[], size_t count,
+                                              void *context);
+
+/**
+ * @abstract
+ * The way a client talks to the daemon.
+ *
+ * @discussion
+ * `open` and `close` are required; `open` returns a new connection or NULL. A transport
+ * without `send` can't carry rd_injector_client_submit(), so its users send whatever
+ * they like over rd_injector_client_connection(). A transport with `is_broken` gets
+ * its broken connections replaced; the old ones are only closed along with the client,
+ * as other threads may still be using them.
+ *
+ * `send` sends a requests frame and eventually passes the decoded results (or NULL if
+ * they will never come) to rd_injector_client_complete() along with the submission.
+ * It returns false if the frame couldn't be sent; the submission isn't completed then.
+ */
+typedef struct {
+    void *(*open)(void *context);
+    void (*close)(void *connection);
+    bool (*is_broken)(void *connection);
+    bool (*send)(void *connection, const void *frame, size_t length,
+                 rd_injector_submission_t *submission);
+    void *context;
+} rd_injector_transport_t;
+
+typedef struct {
+    /* Requests sent and not answered yet */
+    size_t in_flight;
+    /* Requests waiting for a room in the window: the depth of our own queue */
+    size_t waiting;
+    size_t peak_in_flight;
+    size_t peak_waiting;
+    uint64_t submitted;
+    uint64_t rejected;
+    /* Connections opened so far, including the replacements of broken ones */
+    uint64_t connects;
+} rd_injector_client_stats_t;
+
+/**
+ * @abstract
+ * Creates a client of the injector daemon.
+ *
+ * @discussion
+ * Connections are only opened once they're needed. Getting a connection that is already
+ * open, taking a room in the window and giving it back take no locks; only a caller that
+ * has to wait for the window (or to open a connection) does.
+ *
+ * @param options
+ * NULL means a single connection and no window
+ *
+ * @return
+ * A new client or NULL if there's no memory
+ */
+rd_injector_client_t *rd_injector_client_create(const rd_injector_transport_t *transport,
+                                                const rd_injector_client_options_t *options);
+
+/**
+ * @abstract
+ * Creates a client talking the binary protocol over the daemon's Unix domain socket
+ * (see main_linux.c).
+ *
+ * @discussion
+ * Every connection has a thread reading its results frames; submission callbacks are
+ * called on it, so they must not wait for the window themselves.
+ */
+rd_injector_client_t *rd_injector_client_create_socket(const char *socket_path,
+                                                       const rd_injector_client_options_t *options);
+
+/**
+ * @abstract
+ * Closes every connection of the client and frees it.
+ *
+ * @discussion
+ * Submissions still in flight are completed with KERN_ABORTED results, provided their
+ * transport lets them go on close (the socket one does).
+ */
+void rd_injector_client_destroy(rd_injector_client_t *client);
+
+/**
+ * @abstract
+ * Takes a room for `count` requests in the client's window.
+ *
+ * @discussion
+ * A request larger than the whole window only goes when there's nothing else in flight.
+ *
+ * @return
+ * KERN_SUCCESS or KERN_RESOURCE_SHORTAGE if the window is full and the client rejects
+ * the overflow
+ */
+int rd_injector_client_acquire(rd_injector_client_t *client, size_t count);
+
+/**
+ * @abstract
+ * Gives back a room taken with rd_injector_client_acquire().
+ */
+void rd_injector_client_release(rd_injector_client_t *client, size_t count);
+
+/**
+ * @abstract
+ * Returns one of the client's connections (they take turns), opening it if needed.
+ *
+ * @return
+ * A connection of the transport or NULL if it couldn't be opened
+ */
+void *rd_injector_client_connection(rd_injector_client_t *client);
+
+/**
+ * @abstract
+ * Sends a batch of requests to the daemon in a single frame.
+ *
+ * @discussion
+ * The request ids are assigned by the client (the ones given are ignored), and the
+ * results passed to the callback carry them. Requests the daemon never answers (e.g.
+ * because the connection broke) get KERN_ABORTED results.
+ *
+ * @return
+ * KERN_SUCCESS if the callback is going to be called, KERN_RESOURCE_SHORTAGE if the
+ * window is full, KERN_INVALID_ARGUMENT for an empty or too large batch, KERN_FAILURE
+ * if the daemon can't be reached
+ */
+int rd_injector_client_submit(rd_injector_client_t *client,
+                              const rd_injector_request_t requests[], size_t count,
+                              rd_injector_client_callback_t callback, void *context);
+
+/**
+ * @abstract
+ * Completes a submission with the results the transport has received for it.
+ *
+ * @param results
+ * The decoded results frame or NULL if the transport has given up on the submission
+ */
+void rd_injector_client_complete(rd_injector_submission_t *submission,
+                                 const rd_injector_result_t results[], size_t count);
+
+/**
+ * @abstract
+ * Returns the id of the first request of a submission (the rest follow in order).
+ */
+uint64_t rd_injector_submission_first_id(const rd_injector_submission_t *submission);
+
+/**
+ * @abstract
+ * Takes a snapshot of the client's counters.
+ */
+void rd_injector_client_get_stats(rd_injector_client_t *client, rd_injector_client_stats_t *stats);
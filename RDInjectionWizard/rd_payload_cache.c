@@ -0,0 +1,630 @@
+//
+//  rd_payload_cache.c
+//  RDInjectionWizard
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <sys/clonefile.h>
+#elif defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#include "rd_payload_cache.h"
+
+/* How long unused copies stay around */
+#define kRDPayloadCacheMaxAge   (5 * 60)
+/* How often a directory is swept for copies nobody has used for a while */
+#define kRDSweepInterval        (60)
+#define kRDCopyBufferSize       (1024 * 1024)
+/* A staged copy is named "<payload name>.<16 hex digits of its hash>" */
+#define kRDHashSuffixLength     (17)
+
+#pragma mark - Private Interface
+
+/* A version of a file: it changes whenever the file's content may have changed */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+    time_t ctime_sec;
+    long ctime_nsec;
+    uint64_t hash;
+} rd_payload_identity_t;
+
+/* A staged copy of a payload */
+typedef struct {
+    char *path;
+    size_t references;
+    time_t last_used;
+    /* The version of the copy we've last seen to match its payload byte for byte */
+    rd_payload_identity_t verified;
+} rd_staged_payload_t;
+
+/* A payload we've hashed, by its path */
+typedef struct {
+    char *path;
+    rd_payload_identity_t identity;
+} rd_known_payload_t;
+
+/* A directory we've staged copies into */
+typedef struct {
+    char *path;
+    time_t last_swept;
+} rd_staging_directory_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_staged_payload_t *staged_payloads = NULL;
+static size_t staged_payloads_count = 0;
+static rd_known_payload_t *known_payloads = NULL;
+static size_t known_payloads_count = 0;
+static time_t known_payloads_checked = 0;
+static rd_staging_directory_t *staging_directories = NULL;
+static size_t staging_directories_count = 0;
+
+static rd_payload_identity_t file_identity(const struct stat *info, uint64_t hash);
+static bool is_same_version(const rd_payload_identity_t *identity, const struct stat *info);
+static bool known_payload_hash(const char *path, const struct stat *info, uint64_t *hash);
+static bool payload_content_hash(const char *path, const struct stat *info, uint64_t *hash);
+static void remember_payload_hash(const char *path, const struct stat *info, uint64_t hash);
+static void forget_changed_payloads(void);
+static bool is_staged_copy_of(const char *staged_path, const char *payload_path, off_t size);
+static bool stage_payload_copy(const char *payload_path, const char *staged_path);
+static void prefetch_staged_copy(const char *staged_path);
+static void touch_staged_copy(const char *staged_path);
+static time_t last_use_on_disk(const struct stat *info);
+static size_t evict_unused_payloads(double max_age);
+static void note_staging_directory(const char *directory);
+static size_t sweep_staging_directory(rd_staging_directory_t *directory, double max_age);
+
+#pragma mark - Implementation
+
+char *rd_payload_cache_stage(const char *payload_path, const char *directory)
+{
+    if (!payload_path || !directory) {
+        return NULL;
+    }
+    struct stat info;
+    if (stat(payload_path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    uint64_t hash = 0;
+    bool is_known = known_payload_hash(payload_path, &info, &hash);
+    pthread_mutex_unlock(&cache_lock);
+    /* Reading a large payload takes a while: don't hold up the other payloads meanwhile */
+    if (!is_known) {
+        if (!payload_content_hash(payload_path, &info, &hash)) {
+            return NULL;
+        }
+        pthread_mutex_lock(&cache_lock);
+        remember_payload_hash(payload_path, &info, hash);
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    char *name_buffer = strdup(payload_path);
+    char *staged_path = NULL;
+    if (!name_buffer || asprintf(&staged_path, "%s/%s.%016llx", directory, basename(name_buffer),
+                                 (unsigned long long)hash) < 0) {
+        free(name_buffer);
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    free(name_buffer);
+
+    rd_staged_payload_t *entry = NULL;
+    for (size_t i = 0; i < staged_payloads_count; i++) {
+        if (strcmp(staged_payloads[i].path, staged_path) == 0) {
+            entry = &staged_payloads[i];
+            break;
+        }
+    }
+    /* Someone might have removed or replaced the copy behind our back, and the hash
+     * doesn't rule out a different payload of the same name: a copy is only reused if
+     * it's the version we've compared with the payload before, or if it compares equal */
+    struct stat staged_info;
+    bool is_staged = (stat(staged_path, &staged_info) == 0 && S_ISREG(staged_info.st_mode) &&
+                      staged_info.st_size == info.st_size);
+    if (is_staged && !(entry && entry->verified.hash == hash &&
+                       is_same_version(&entry->verified, &staged_info))) {
+        is_staged = is_staged_copy_of(staged_path, payload_path, info.st_size);
+    }
+    if (!is_staged && !stage_payload_copy(payload_path, staged_path)) {
+        free(staged_path);
+        pthread_mutex_unlock(&cache_lock);
+        return NULL;
+    }
+    if (!is_staged) {
+        prefetch_staged_copy(staged_path);
+    }
+    /* Tell other processes sweeping the directory that the copy is in use */
+    touch_staged_copy(staged_path);
+    if (!entry) {
+        rd_staged_payload_t *payloads = realloc(staged_payloads,
+                                                (staged_payloads_count + 1) * sizeof(*payloads));
+        char *entry_path = strdup(staged_path);
+        if (!payloads || !entry_path) {
+            if (payloads) staged_payloads = payloads;
+            free(entry_path);
+            free(staged_path);
+            pthread_mutex_unlock(&cache_lock);
+            return NULL;
+        }
+        staged_payloads = payloads;
+        entry = &staged_payloads[staged_payloads_count++];
+        *entry = (rd_staged_payload_t){.path = entry_path};
+    }
+    if (stat(staged_path, &staged_info) == 0) {
+        entry->verified = file_identity(&staged_info, hash);
+    }
+    entry->references++;
+    entry->last_used = time(NULL);
+    if (difftime(time(NULL), known_payloads_checked) >= kRDSweepInterval) {
+        forget_changed_payloads();
+    }
+    evict_unused_payloads(kRDPayloadCacheMaxAge);
+    note_staging_directory(directory);
+    pthread_mutex_unlock(&cache_lock);
+
+    return staged_path;
+}
+
+void rd_payload_cache_release(const char *staged_path)
+{
+    if (!staged_path) return;
+
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < staged_payloads_count; i++) {
+        if (strcmp(staged_payloads[i].path, staged_path) == 0) {
+            if (staged_payloads[i].references > 0) {
+                staged_payloads[i].references--;
+            }
+            staged_payloads[i].last_used = time(NULL);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+size_t rd_payload_cache_evict(double max_age)
+{
+    pthread_mutex_lock(&cache_lock);
+    forget_changed_payloads();
+    size_t evicted = evict_unused_payloads(max_age);
+    for (size_t i = 0; i < staging_directories_count; i++) {
+        evicted += sweep_staging_directory(&staging_directories[i], max_age);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return evicted;
+}
+
+/**
+ * Must be called with the cache lock held.
+ */
+static
+size_t evict_unused_payloads(double max_age)
+{
+    size_t evicted = 0;
+    time_t now = time(NULL);
+    for (size_t i = 0; i < staged_payloads_count;) {
+        rd_staged_payload_t *entry = &staged_payloads[i];
+        if (entry->references > 0 || difftime(now, entry->last_used) < max_age) {
+            i++;
+            continue;
+        }
+        /* Another process may have staged the same copy since, then it's theirs to remove */
+        struct stat info;
+        if (lstat(entry->path, &info) == 0 && difftime(now, last_use_on_disk(&info)) >= max_age) {
+            unlink(entry->path);
+        }
+        free(entry->path);
+        *entry = staged_payloads[--staged_payloads_count];
+        evicted++;
+    }
+    return evicted;
+}
+
+/**
+ * @abstract
+ * Remembers a directory we've staged a copy into, and sweeps it every once in a while.
+ *
+ * @discussion
+ * Must be called with the cache lock held.
+ */
+static
+void note_staging_directory(const char *directory)
+{
+    rd_staging_directory_t *known = NULL;
+    for (size_t i = 0; i < staging_directories_count; i++) {
+        if (strcmp(staging_directories[i].path, directory) == 0) {
+            known = &staging_directories[i];
+            break;
+        }
+    }
+    if (!known) {
+        rd_staging_directory_t *directories = realloc(staging_directories,
+                                                      (staging_directories_count + 1) *
+                                                      sizeof(*directories));
+        char *path = strdup(directory);
+        if (!directories || !path) {
+            if (directories) staging_directories = directories;
+            free(path);
+            return;
+        }
+        staging_directories = directories;
+        known = &staging_directories[staging_directories_count++];
+        /* It's swept right away: whoever staged into it before may have exited since */
+        *known = (rd_staging_directory_t){.path = path};
+    }
+    if (difftime(time(NULL), known->last_swept) >= kRDSweepInterval) {
+        sweep_staging_directory(known, kRDPayloadCacheMaxAge);
+    }
+}
+
+/**
+ * @abstract
+ * Removes staged copies nobody has staged for `max_age` seconds from a directory.
+ *
+ * @discussion
+ * Unlike evict_unused_payloads() this goes by the files themselves, so it also picks up
+ * the copies left behind by processes that have exited (and their interrupted temporary
+ * copies). Every stage of a copy touches its access time, so a copy another process is
+ * using isn't old. Copies we're using ourselves are kept anyway. Must be called with
+ * the cache lock held.
+ */
+static
+size_t sweep_staging_directory(rd_staging_directory_t *directory, double max_age)
+{
+    directory->last_swept = time(NULL);
+    DIR *listing = opendir(directory->path);
+    if (!listing) {
+        return 0;
+    }
+    size_t swept = 0;
+    struct dirent *item = NULL;
+    while ((item = readdir(listing))) {
+        /* Only "<name>.<hash>" and "<name>.<hash>.tmp.<pid>.<counter>" are ours */
+        const char *suffix = strstr(item->d_name, ".tmp.");
+        size_t length = suffix ? (size_t)(suffix - item->d_name) : strlen(item->d_name);
+        if (length <= kRDHashSuffixLength || item->d_name[length - kRDHashSuffixLength] != '.' ||
+            strspn(item->d_name + length - kRDHashSuffixLength + 1, "0123456789abcdef") !=
+            kRDHashSuffixLength - 1) {
+            continue;
+        }
+        char *path = NULL;
+        if (asprintf(&path, "%s/%s", directory->path, item->d_name) < 0) {
+            continue;
+        }
+        bool is_used = false;
+        for (size_t i = 0; i < staged_payloads_count && !is_used; i++) {
+            is_used = (staged_payloads[i].references > 0 &&
+                       strcmp(staged_payloads[i].path, path) == 0);
+        }
+        struct stat info;
+        if (!is_used && lstat(path, &info) == 0 && S_ISREG(info.st_mode) &&
+            difftime(directory->last_swept, last_use_on_disk(&info)) >= max_age &&
+            unlink(path) == 0) {
+            swept++;
+        }
+        free(path);
+    }
+    closedir(listing);
+
+    return swept;
+}
+
+static
+rd_payload_identity_t file_identity(const struct stat *info, uint64_t hash)
+{
+    return (rd_payload_identity_t){
+        .device = info->st_dev,
+        .inode = info->st_ino,
+        .size = info->st_size,
+        .mtime_sec = info->st_mtime,
+        .ctime_sec = info->st_ctime,
+#if defined(__APPLE__)
+        .mtime_nsec = info->st_mtimespec.tv_nsec,
+        .ctime_nsec = info->st_ctimespec.tv_nsec,
+#else
+        .mtime_nsec = info->st_mtim.tv_nsec,
+        .ctime_nsec = info->st_ctim.tv_nsec,
+#endif
+        .hash = hash
+    };
+}
+
+/**
+ * @abstract
+ * Tells whether the file is still the same version.
+ *
+ * @discussion
+ * The change time is checked too: unlike mtime, nobody can set it back after
+ * modifying the file.
+ */
+static
+bool is_same_version(const rd_payload_identity_t *identity, const struct stat *info)
+{
+    rd_payload_identity_t current = file_identity(info, identity->hash);
+    return (identity->device == current.device && identity->inode == current.inode &&
+            identity->size == current.size &&
+            identity->mtime_sec == current.mtime_sec && identity->mtime_nsec == current.mtime_nsec &&
+            identity->ctime_sec == current.ctime_sec && identity->ctime_nsec == current.ctime_nsec);
+}
+
+/**
+ * @abstract
+ * Looks up the content hash we've computed for this version of the payload.
+ *
+ * @discussion
+ * Must be called with the cache lock held.
+ */
+static
+bool known_payload_hash(const char *path, const struct stat *info, uint64_t *hash)
+{
+    for (size_t i = 0; i < known_payloads_count; i++) {
+        if (strcmp(known_payloads[i].path, path) == 0) {
+            if (!is_same_version(&known_payloads[i].identity, info)) {
+                return false;
+            }
+            *hash = known_payloads[i].identity.hash;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @abstract
+ * Returns a content hash (64-bit FNV-1a) of the payload.
+ *
+ * @discussion
+ * Reads the whole payload, so it's called without the cache lock; see
+ * remember_payload_hash() for the caching.
+ */
+static
+bool payload_content_hash(const char *path, const struct stat *info, uint64_t *hash)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t size = (size_t)info->st_size;
+    uint64_t result = 0xcbf29ce484222325ULL;
+    if (size > 0) {
+        const uint8_t *content = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (content == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+        for (size_t i = 0; i < size; i++) {
+            result = (result ^ content[i]) * 0x100000001b3ULL;
+        }
+        munmap((void *)content, size);
+    }
+    close(fd);
+    /* Mix the size in as well */
+    result = (result ^ (uint64_t)size) * 0x100000001b3ULL;
+    *hash = result;
+
+    return true;
+}
+
+/**
+ * @abstract
+ * Remembers the payload's hash by its path and version, so we only read the file once
+ * per version of it.
+ *
+ * @discussion
+ * The payload may have changed while we were hashing it, then the hash isn't
+ * remembered at all. Must be called with the cache lock held.
+ */
+static
+void remember_payload_hash(const char *path, const struct stat *info, uint64_t hash)
+{
+    rd_payload_identity_t identity = file_identity(info, hash);
+    struct stat current;
+    if (stat(path, &current) != 0 || !is_same_version(&identity, &current)) {
+        return;
+    }
+    for (size_t i = 0; i < known_payloads_count; i++) {
+        if (strcmp(known_payloads[i].path, path) == 0) {
+            known_payloads[i].identity = identity;
+            return;
+        }
+    }
+    rd_known_payload_t *payloads = realloc(known_payloads,
+                                           (known_payloads_count + 1) * sizeof(*payloads));
+    char *known_path = strdup(path);
+    if (!payloads || !known_path) {
+        if (payloads) known_payloads = payloads;
+        free(known_path);
+        return;
+    }
+    known_payloads = payloads;
+    known_payloads[known_payloads_count++] = (rd_known_payload_t){
+        .path = known_path,
+        .identity = identity
+    };
+}
+
+/**
+ * @abstract
+ * Drops the hashes of payloads that are gone or have changed since we've hashed them.
+ *
+ * @discussion
+ * Must be called with the cache lock held.
+ */
+static
+void forget_changed_payloads(void)
+{
+    for (size_t i = 0; i < known_payloads_count;) {
+        struct stat info;
+        if (stat(known_payloads[i].path, &info) == 0 &&
+            is_same_version(&known_payloads[i].identity, &info)) {
+            i++;
+            continue;
+        }
+        free(known_payloads[i].path);
+        known_payloads[i] = known_payloads[--known_payloads_count];
+    }
+    known_payloads_checked = time(NULL);
+}
+
+/**
+ * @abstract
+ * Compares a staged copy with the payload byte for byte.
+ *
+ * @discussion
+ * A 64-bit hash isn't collision resistant, and anyone who can write into the directory
+ * can put a file under the name of a copy, so a copy we haven't made or checked before
+ * is only reused if it's the very same content. Both files are of `size` bytes.
+ */
+static
+bool is_staged_copy_of(const char *staged_path, const char *payload_path, off_t size)
+{
+    int staged = open(staged_path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    int payload = open(payload_path, O_RDONLY | O_CLOEXEC);
+    bool is_same = (staged >= 0 && payload >= 0);
+    if (is_same && size > 0) {
+        void *staged_content = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, staged, 0);
+        void *payload_content = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, payload, 0);
+        is_same = (staged_content != MAP_FAILED && payload_content != MAP_FAILED &&
+                   memcmp(staged_content, payload_content, (size_t)size) == 0);
+        if (staged_content != MAP_FAILED) munmap(staged_content, (size_t)size);
+        if (payload_content != MAP_FAILED) munmap(payload_content, (size_t)size);
+    }
+    if (staged >= 0) close(staged);
+    if (payload >= 0) close(payload);
+
+    return is_same;
+}
+
+/**
+ * @abstract
+ * Bumps the access time of a staged copy, so sweep_staging_directory() sees it's in use.
+ */
+static
+void touch_staged_copy(const char *staged_path)
+{
+    struct timespec times[2] = {{.tv_nsec = UTIME_NOW}, {.tv_nsec = UTIME_OMIT}};
+    utimensat(AT_FDCWD, staged_path, times, 0);
+}
+
+static
+time_t last_use_on_disk(const struct stat *info)
+{
+    return (info->st_atime > info->st_mtime) ? info->st_atime : info->st_mtime;
+}
+
+/**
+ * @abstract
+ * Starts reading a new copy into the page cache.
+ *
+ * @discussion
+ * A clone shares the original's blocks on the disk but not its cached pages, so the
+ * first dlopen() of it would read the whole payload again. The reads don't block us.
+ */
+static
+void prefetch_staged_copy(const char *staged_path)
+{
+    int fd = open(staged_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+#if defined(__APPLE__)
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+        struct radvisory advice = {
+            .ra_offset = 0,
+            .ra_count = (info.st_size < INT_MAX) ? (int)info.st_size : INT_MAX
+        };
+        fcntl(fd, F_RDADVISE, &advice);
+    }
+#else
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+}
+
+/**
+ * @abstract
+ * Makes a copy of the payload at the given path.
+ *
+ * @discussion
+ * We prefer clones (copy-on-write, so the copy is independent from the original
+ * and costs no I/O) over plain copies. There're no hard links: a link would change
+ * along with the original, and it would let whoever can write into the directory
+ * change the original through it. The copy is made under a temporary name and then
+ * renamed, so nobody ever sees a partial copy.
+ */
+static
+bool stage_payload_copy(const char *payload_path, const char *staged_path)
+{
+    static unsigned long counter = 0;
+    char *temporary_path = NULL;
+    if (asprintf(&temporary_path, "%s.tmp.%d.%lu", staged_path, getpid(), counter++) < 0) {
+        return false;
+    }
+
+    bool copied = false;
+#if defined(__APPLE__)
+    copied = (clonefile(payload_path, temporary_path, 0) == 0);
+#elif defined(__linux__)
+    int source = open(payload_path, O_RDONLY | O_CLOEXEC);
+    int destination = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0755);
+    if (source >= 0 && destination >= 0) {
+        copied = (ioctl(destination, FICLONE, source) == 0);
+    }
+    if (source >= 0) close(source);
+    if (destination >= 0) close(destination);
+    if (!copied) unlink(temporary_path);
+#endif
+    if (!copied) {
+        int source = open(payload_path, O_RDONLY | O_CLOEXEC);
+        int destination = open(temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+        char *buffer = malloc(kRDCopyBufferSize);
+        if (source >= 0 && destination >= 0 && buffer) {
+            ssize_t length = 0;
+            copied = true;
+            while (copied && (length = read(source, buffer, kRDCopyBufferSize)) > 0) {
+                copied = (write(destination, buffer, (size_t)length) == length);
+            }
+            copied = copied && (length == 0);
+        }
+        free(buffer);
+        if (source >= 0) close(source);
+        if (destination >= 0) close(destination);
+    }
+    if (copied) {
+        copied = (rename(temporary_path, staged_path) == 0);
+    }
+    if (!copied) {
+        unlink(temporary_path);
+    }
+    free(temporary_path);
+
+    return copied;
+}
@@ -0,0 +1,63 @@
+//
+//  rd_payload_cache.h
+//  RDInjectionWizard
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * @abstract
+ * Stages a payload into a directory (e.g. the target's sandbox container).
+ *
+ * @discussion
+ * Staged copies are content-addressed: a copy is named after the payload's content
+ * hash, so the same payload is staged into the same directory only once and then
+ * reused by every injection. The content hash itself is cached by the payload's path
+ * and its device, inode, size, mtime and ctime, so a warm stage costs a couple of stat()
+ * calls; a cold one hashes the payload without blocking stages of other payloads. The
+ * hashes of payloads that are gone or have changed are dropped as the cache is evicted.
+ * The hash only names the copy: a copy is compared with the payload byte for byte
+ * before it's reused for the first time (and whenever it changes on the disk).
+ *
+ * A copy is made with a reflink/clone when the file system supports it, and otherwise
+ * by actually copying the file; never with a hard link, which would share the payload's
+ * inode with the directory. A new copy is prefetched into the page cache right away,
+ * so the first injection of it doesn't read it in.
+ *
+ * Every successful call must be balanced with rd_payload_cache_release(). Copies
+ * that are not used by anyone are removed once they're older than a few minutes;
+ * the directories are swept by the copies' access times, so copies left behind by
+ * processes that have exited are removed too.
+ *
+ * @param payload_path
+ * The full path of the payload
+ * @param directory
+ * A directory to stage the payload into
+ *
+ * @return
+ * The full path of the staged copy (free() it when done), or NULL on error
+ */
+char *rd_payload_cache_stage(const char *payload_path, const char *directory);
+
+/**
+ * @abstract
+ * Lets go of a staged copy returned by rd_payload_cache_stage().
+ */
+void rd_payload_cache_release(const char *staged_path);
+
+/**
+ * @abstract
+ * Removes staged copies that are no longer used and haven't been used for `max_age` seconds.
+ *
+ * @discussion
+ * Every directory the payloads have been staged into is swept, including the copies
+ * other processes have staged but haven't touched for `max_age` seconds.
+ *
+ * @return
+ * The number of removed copies
+ */
+size_t rd_payload_cache_evict(double max_age);
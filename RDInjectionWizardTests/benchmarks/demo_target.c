@@ -0,0 +1,17 @@
+//
+//  demo_target.c
+//  benchmarks
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A Linux counterpart of demoTarget64: an idle process waiting to be injected.
+//
+#include <unistd.h>
+
+int main(void)
+{
+    while (1) {
+        pause();
+    }
+    return 0;
+}
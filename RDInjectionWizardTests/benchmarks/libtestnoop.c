@@ -0,0 +1,14 @@
+//
+//  libtestnoop.c
+//  benchmarks
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A Linux counterpart of libtestnoop64: a payload that does nothing on load.
+//
+
+__attribute__((constructor))
+static void libtestnoop_load(void)
+{
+    /* no-op */
+}
@@ -0,0 +1,33 @@
+//
+//  libtestswap.c
+//  benchmarks
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A hot-swappable payload for the swap benchmark. Build it with -DRD_SWAP_BLOB=\"<file>\"
+//  to pad it with the file's content, so we can see how the payload size affects a swap.
+//
+
+#if defined(RD_SWAP_BLOB)
+__asm__(".section .rodata\n"
+        ".globl libtestswap_blob\n"
+        "libtestswap_blob:\n"
+        ".incbin \"" RD_SWAP_BLOB "\"\n"
+        ".previous\n");
+#endif
+
+static void *previous_version = 0;
+
+__attribute__((constructor))
+static void libtestswap_load(void)
+{
+    /* no-op */
+}
+
+/* The handoff routine: take over from the previous version */
+__attribute__((visibility("default")))
+int libtestswap_handoff(void *previous)
+{
+    previous_version = previous;
+    return 0;
+}
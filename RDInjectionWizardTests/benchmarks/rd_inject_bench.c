@@ -0,0 +1,2932 @@
+//
+//  rd_inject_bench.c
+//  benchmarks
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  Injection benchmarks for the Linux backend of rd_inject_library().
+//  Use run_benchmarks.sh to build and run them.
+//
+//  Every benchmark reports a single line of "<benchmark>: <key>=<value> ..."
+//  or, with -j, a JSON object per line, so results can be compared across runs.
+//
+#define _GNU_SOURCE
+#include <elf.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/sendfile.h>
+
+#include "rd_inject_library.h"
+#include "rd_inject_async.h"
+#include "rd_remote_symbols.h"
+#include "rd_inject_preflight.h"
+#include "rd_remote_arena.h"
+#include "rd_remote_handles.h"
+#include "rd_payload_cache.h"
+#include "rd_injector_protocol.h"
+#include "rd_injector_client.h"
+#include "rd_agent.h"
+#include "rd_watcher.h"
+#include "rd_inject_log.h"
+
+#define kRDBenchDefaultIterations  (20)
+#define kRDBenchDefaultLibraries   (8)
+#define kRDBenchDefaultTargets     (64)
+#define kRDBenchDefaultClients     (16)
+#define kRDBenchStagedPayloadSize  (16 * 1024 * 1024)
+#define kRDBenchStressInjections   (5000)
+/* Enough for two targets' handles to go over the registry's sweep threshold */
+#define kRDBenchHandlesPerTarget   (1500)
+#define kRDBenchMaxReplyLength     (1024)
+#define kRDBenchBurstRequests      (4)
+#define kRDBenchBurstGapMs         (300)
+#define kRDBenchDuplicates         (8)
+/* Records logged between flushes, well within a thread's ring */
+#define kRDBenchLogBurst           (512)
+#define kRDBenchLogThreads         (4)
+
+typedef struct {
+    /* The noop payload (libtestnoop.so) */
+    const char *payload;
+    /* The idle target executable (demo_target) */
+    const char *target;
+    /* The Linux injector daemon executable (optional) */
+    const char *daemon;
+    /* Its socket activator executable (optional) */
+    const char *activator;
+    /* The resident agent library (optional) */
+    const char *agent;
+    /* The log decoder executable (optional) */
+    const char *decoder;
+    /* A scratch directory for payload copies */
+    const char *workdir;
+    int iterations;
+    int libraries;
+    int targets;
+    /* Fan-out concurrency, 0 means the number of CPUs */
+    unsigned int concurrency;
+    /* The number of concurrent daemon clients */
+    int clients;
+} rd_bench_config_t;
+
+typedef enum {
+    /* One library per target */
+    RD_BENCH_MODE_SINGLE,
+    /* All the libraries per target at once */
+    RD_BENCH_MODE_BATCHED,
+    /* One library per target, all the targets at once */
+    RD_BENCH_MODE_CONCURRENT,
+    RD_BENCH_MODE_COUNT
+} rd_bench_mode_t;
+
+typedef struct {
+    const char *name;
+    const char *description;
+    int (*run)(const rd_bench_config_t *config);
+} rd_benchmark_t;
+
+/* Print reports as JSON lines instead of plain text */
+static bool report_as_json = false;
+
+#pragma mark - Reports
+
+static void report_begin(const char *benchmark)
+{
+    if (report_as_json) {
+        printf("{\"benchmark\":\"%s\"", benchmark);
+    } else {
+        printf("%s:", benchmark);
+    }
+}
+
+static void report_int(const char *key, long long value)
+{
+    printf(report_as_json ? ",\"%s\":%lld" : " %s=%lld", key, value);
+}
+
+static void report_double(const char *key, int precision, double value)
+{
+    printf(report_as_json ? ",\"%s\":%.*f" : " %s=%.*f", key, precision, value);
+}
+
+/**
+ * Reports p50, p99 and max of a histogram in microseconds as "<prefix>_p50_us" etc.
+ */
+static void report_histogram(const char *prefix, const rd_inject_histogram_t *histogram)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "%s_p50_us", prefix);
+    report_double(key, 1, rd_inject_histogram_percentile(histogram, 50) / 1000.0);
+    snprintf(key, sizeof(key), "%s_p99_us", prefix);
+    report_double(key, 1, rd_inject_histogram_percentile(histogram, 99) / 1000.0);
+    snprintf(key, sizeof(key), "%s_max_us", prefix);
+    report_double(key, 1, histogram->max_ns / 1000.0);
+}
+
+static void report_end(void)
+{
+    printf(report_as_json ? "}\n" : "\n");
+    fflush(stdout);
+}
+
+#pragma mark - Helpers
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Waits until the target has finished exec'ing and is blocked in pause().
+ */
+static bool wait_for_target_to_settle(pid_t target)
+{
+    char stat_path[64];
+    snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", target);
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        FILE *stat = fopen(stat_path, "re");
+        if (!stat) return false;
+        char state = 0;
+        int matched = fscanf(stat, "%*d (%*[^)]) %c", &state);
+        fclose(stat);
+        if (matched == 1 && state == 'S') {
+            return true;
+        }
+        usleep(1000);
+    }
+    return false;
+}
+
+static pid_t spawn_target(const rd_bench_config_t *config)
+{
+    pid_t target = fork();
+    if (target == 0) {
+        execl(config->target, config->target, (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    if (target < 0 || !wait_for_target_to_settle(target)) {
+        fprintf(stderr, "Could not launch %s\n", config->target);
+        return -1;
+    }
+    return target;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void terminate_target(pid_t target)
+{
+    kill(target, SIGKILL);
+    waitpid(target, NULL, 0);
+}
+
+static bool copy_file(const char *source_path, const char *destination_path)
+{
+    int source = open(source_path, O_RDONLY | O_CLOEXEC);
+    int destination = open(destination_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+    struct stat info;
+    off_t offset = 0;
+    bool copied = (source >= 0 && destination >= 0 && fstat(source, &info) == 0 &&
+                   sendfile(destination, source, &offset, (size_t)info.st_size) == info.st_size);
+    if (source >= 0) close(source);
+    if (destination >= 0) close(destination);
+    return copied;
+}
+
+/**
+ * Makes `count` distinct copies of the payload, so every dlopen() actually
+ * loads a new image instead of bumping a reference count of the loaded one.
+ */
+static char **make_payload_copies(const rd_bench_config_t *config, const char *tag, int count)
+{
+    char **copies = calloc((size_t)count, sizeof(*copies));
+    if (!copies) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+        if (asprintf(&copies[i], "%s/libtestnoop.%s.%d.so", config->workdir, tag, i) < 0) {
+            exit(EXIT_FAILURE);
+        }
+        if (!copy_file(config->payload, copies[i])) {
+            fprintf(stderr, "Could not copy %s\n", config->payload);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return copies;
+}
+
+static void remove_payload_copies(char **copies, int count)
+{
+    for (int i = 0; i < count; i++) {
+        unlink(copies[i]);
+        free(copies[i]);
+    }
+    free(copies);
+}
+
+/**
+ * Reads the whole /proc/<pid>/<name> file into a malloc()ed string.
+ */
+static char *read_proc_file(pid_t target, const char *name)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", target, name);
+    FILE *file = fopen(path, "re");
+    if (!file) return NULL;
+    char *contents = NULL;
+    size_t size = 0, length = 0;
+    char chunk[4096];
+    size_t read_size;
+    while ((read_size = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        char *grown = realloc(contents, size = length + read_size + 1);
+        if (!grown) break;
+        contents = grown;
+        memcpy(contents + length, chunk, read_size);
+        length += read_size;
+        contents[length] = '\0';
+    }
+    fclose(file);
+    return contents;
+}
+
+/**
+ * Reads the code at the target's entry point (AT_ENTRY).
+ */
+static bool read_entry_code(pid_t target, unsigned char *code, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/auxv", target);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    Elf64_auxv_t auxv[64];
+    ssize_t length = read(fd, auxv, sizeof(auxv));
+    close(fd);
+    uint64_t entry = 0;
+    for (ssize_t i = 0; length > 0 && i < length / (ssize_t)sizeof(*auxv); i++) {
+        if (auxv[i].a_type == AT_ENTRY) entry = auxv[i].a_un.a_val;
+    }
+    snprintf(path, sizeof(path), "/proc/%d/mem", target);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    bool read_all = (entry != 0 && pread(fd, code, size, (off_t)entry) == (ssize_t)size);
+    close(fd);
+    return read_all;
+}
+
+#pragma mark - Benchmarks
+
+/**
+ * N rd_inject_library() calls vs. a single rd_inject_libraries() call with N libraries.
+ * Every iteration uses fresh targets and fresh payload copies.
+ */
+static int bench_batch(const rd_bench_config_t *config)
+{
+    uint64_t single_ns = 0, batch_ns = 0;
+    int failures = 0;
+
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        char **copies = make_payload_copies(config, "batch", config->libraries * 2);
+
+        pid_t target = spawn_target(config);
+        if (target < 0) return EXIT_FAILURE;
+        uint64_t start = now_ns();
+        for (int i = 0; i < config->libraries; i++) {
+            failures += (rd_inject_library(target, copies[i]) != KERN_SUCCESS);
+        }
+        single_ns += now_ns() - start;
+        terminate_target(target);
+
+        target = spawn_target(config);
+        if (target < 0) return EXIT_FAILURE;
+        start = now_ns();
+        failures += (rd_inject_libraries(target, (const char **)copies + config->libraries,
+                                         (size_t)config->libraries, NULL) != KERN_SUCCESS);
+        batch_ns += now_ns() - start;
+        terminate_target(target);
+
+        remove_payload_copies(copies, config->libraries * 2);
+    }
+
+    double single_us = single_ns / 1000.0 / config->iterations;
+    double batch_us = batch_ns / 1000.0 / config->iterations;
+    report_begin("batch");
+    report_int("libraries", config->libraries);
+    report_int("iterations", config->iterations);
+    report_double("single_us", 1, single_us);
+    report_double("batch_us", 1, batch_us);
+    report_double("speedup", 2, single_us / batch_us);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static pid_t *spawn_targets(const rd_bench_config_t *config)
+{
+    pid_t *targets = calloc((size_t)config->targets, sizeof(*targets));
+    for (int i = 0; targets && i < config->targets; i++) {
+        if ((targets[i] = spawn_target(config)) < 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    return targets;
+}
+
+static void terminate_targets(pid_t *targets, int count)
+{
+    for (int i = 0; i < count; i++) {
+        terminate_target(targets[i]);
+    }
+    free(targets);
+}
+
+/**
+ * Injecting the payload into T targets one by one vs. rd_inject_library_into_processes().
+ */
+static int bench_fanout(const rd_bench_config_t *config)
+{
+    uint64_t sequential_ns = 0;
+    int failures = 0;
+    rd_fanout_stats_t stats, total = {0};
+
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        uint64_t start = now_ns();
+        for (int i = 0; i < config->targets; i++) {
+            failures += (rd_inject_library(targets[i], config->payload) != KERN_SUCCESS);
+        }
+        sequential_ns += now_ns() - start;
+        terminate_targets(targets, config->targets);
+
+        targets = spawn_targets(config);
+        rd_inject_library_into_processes(targets, (size_t)config->targets, config->payload,
+                                         config->concurrency, NULL, &stats);
+        terminate_targets(targets, config->targets);
+        failures += (int)stats.failed;
+        total.elapsed_sec += stats.elapsed_sec;
+        total.mean_latency_sec += stats.mean_latency_sec;
+        if (stats.max_latency_sec > total.max_latency_sec) {
+            total.max_latency_sec = stats.max_latency_sec;
+        }
+        total.concurrency = stats.concurrency;
+    }
+
+    double sequential_rate = config->targets * config->iterations / (sequential_ns / 1e9);
+    double fanout_rate = config->targets * config->iterations / total.elapsed_sec;
+    report_begin("fanout");
+    report_int("targets", config->targets);
+    report_int("iterations", config->iterations);
+    report_int("concurrency", total.concurrency);
+    report_double("sequential_per_sec", 0, sequential_rate);
+    report_double("fanout_per_sec", 0, fanout_rate);
+    report_double("speedup", 2, fanout_rate / sequential_rate);
+    report_double("mean_us", 1, total.mean_latency_sec * 1e6 / config->iterations);
+    report_double("max_us", 1, total.max_latency_sec * 1e6);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Injecting the payload into T targets one by one vs. driving T asynchronous injections
+ * at once from a single poll() loop; then cancelling T injections right after starting them.
+ */
+static int bench_async(const rd_bench_config_t *config)
+{
+    uint64_t sequential_ns = 0, async_ns = 0;
+    int failures = 0, cancelled = 0;
+    size_t count = (size_t)config->targets;
+    rd_injection_t **injections = calloc(count, sizeof(*injections));
+    struct pollfd *fds = calloc(count, sizeof(*fds));
+    if (!injections || !fds) {
+        return EXIT_FAILURE;
+    }
+
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            failures += (rd_inject_library(targets[i], config->payload) != KERN_SUCCESS);
+        }
+        sequential_ns += now_ns() - start;
+        terminate_targets(targets, config->targets);
+
+        targets = spawn_targets(config);
+        start = now_ns();
+        size_t pending = count;
+        for (size_t i = 0; i < count; i++) {
+            injections[i] = rd_inject_library_async(targets[i], config->payload, 10);
+            fds[i] = (struct pollfd){.fd = rd_injection_fd(injections[i]), .events = POLLIN};
+            if (!injections[i]) {
+                failures++;
+                pending--;
+            }
+        }
+        while (pending > 0) {
+            if (poll(fds, count, -1) <= 0) continue;
+            for (size_t i = 0; i < count; i++) {
+                int result = KERN_FAILURE;
+                if (fds[i].fd < 0 || !(fds[i].revents & POLLIN)) continue;
+                if (!rd_injection_result(injections[i], &result, NULL, NULL)) continue;
+                failures += (result != KERN_SUCCESS);
+                rd_injection_release(injections[i]);
+                fds[i].fd = -1;
+                pending--;
+            }
+        }
+        async_ns += now_ns() - start;
+        terminate_targets(targets, config->targets);
+
+        targets = spawn_targets(config);
+        for (size_t i = 0; i < count; i++) {
+            injections[i] = rd_inject_library_async(targets[i], config->payload, 0);
+            rd_injection_cancel(injections[i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            int result = KERN_FAILURE;
+            if (rd_injection_result(injections[i], &result, NULL, NULL) && result == KERN_ABORTED) {
+                cancelled++;
+            }
+            rd_injection_release(injections[i]);
+        }
+        /* Cancelled injections must leave their targets alone */
+        for (size_t i = 0; i < count; i++) {
+            failures += (kill(targets[i], 0) != 0);
+        }
+        terminate_targets(targets, config->targets);
+    }
+    free(injections);
+    free(fds);
+
+    double sequential_rate = config->targets * config->iterations / (sequential_ns / 1e9);
+    double async_rate = config->targets * config->iterations / (async_ns / 1e9);
+    report_begin("async");
+    report_int("targets", config->targets);
+    report_int("iterations", config->iterations);
+    report_double("sequential_per_sec", 0, sequential_rate);
+    report_double("async_per_sec", 0, async_rate);
+    report_double("speedup", 2, async_rate / sequential_rate);
+    report_int("cancelled", cancelled);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0 && cancelled == config->targets * config->iterations)
+           ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Latency (p50/p99/max of a single rd_inject_*() call), throughput and the time every
+ * target was stopped for, for T fresh targets in each of the rd_bench_mode_t modes.
+ * Numbers come from the injector's own histograms, so they're within ~20% of the real
+ * values (maximums are exact).
+ */
+static int bench_latency(const rd_bench_config_t *config)
+{
+    static const char *mode_names[RD_BENCH_MODE_COUNT] = {
+        [RD_BENCH_MODE_SINGLE] = "latency.single",
+        [RD_BENCH_MODE_BATCHED] = "latency.batched",
+        [RD_BENCH_MODE_CONCURRENT] = "latency.concurrent"
+    };
+    char **copies = make_payload_copies(config, "latency", config->libraries);
+    int status = EXIT_SUCCESS;
+
+    for (int mode = 0; mode < RD_BENCH_MODE_COUNT; mode++) {
+        int failures = 0;
+        long long injections = 0;
+        uint64_t elapsed_ns = 0;
+        rd_fanout_stats_t stats = {0};
+        rd_inject_stats_reset();
+        for (int iteration = 0; iteration < config->iterations; iteration++) {
+            pid_t *targets = spawn_targets(config);
+            uint64_t start = now_ns();
+            switch (mode) {
+                case RD_BENCH_MODE_SINGLE:
+                    for (int i = 0; i < config->targets; i++) {
+                        failures += (rd_inject_library(targets[i], config->payload) != KERN_SUCCESS);
+                    }
+                    injections += config->targets;
+                    break;
+                case RD_BENCH_MODE_BATCHED:
+                    for (int i = 0; i < config->targets; i++) {
+                        failures += (rd_inject_libraries(targets[i], (const char **)copies,
+                                                         (size_t)config->libraries, NULL) != KERN_SUCCESS);
+                    }
+                    injections += (long long)config->targets * config->libraries;
+                    break;
+                case RD_BENCH_MODE_CONCURRENT:
+                    rd_inject_library_into_processes(targets, (size_t)config->targets,
+                                                     config->payload, config->concurrency,
+                                                     NULL, &stats);
+                    failures += (int)stats.failed;
+                    injections += config->targets;
+                    break;
+            }
+            elapsed_ns += now_ns() - start;
+            terminate_targets(targets, config->targets);
+        }
+        rd_inject_histogram_t histograms[RD_PHASE_COUNT];
+        rd_inject_stats_snapshot(histograms);
+
+        report_begin(mode_names[mode]);
+        report_int("targets", config->targets);
+        report_int("libraries", (mode == RD_BENCH_MODE_BATCHED) ? config->libraries : 1);
+        report_int("iterations", config->iterations);
+        if (mode == RD_BENCH_MODE_CONCURRENT) {
+            report_int("concurrency", stats.concurrency);
+        }
+        report_int("injections", injections);
+        report_double("throughput_per_sec", 0, injections / (elapsed_ns / 1e9));
+        report_histogram("latency", &histograms[RD_PHASE_TOTAL]);
+        report_histogram("stopped", &histograms[RD_PHASE_STOPPED]);
+        report_int("failures", failures);
+        report_end();
+        if (failures > 0) {
+            status = EXIT_FAILURE;
+        }
+    }
+    remove_payload_copies(copies, config->libraries);
+
+    return status;
+}
+
+/**
+ * Cold (empty cache) vs. warm remote dlopen() lookups.
+ */
+static int bench_resolve(const rd_bench_config_t *config)
+{
+    pid_t target = spawn_target(config);
+    if (target < 0) return EXIT_FAILURE;
+
+    int failures = 0;
+    int lookups = config->iterations * 10;
+    uint64_t cold_ns = 0, warm_ns = 0;
+    for (int i = 0; i < lookups; i++) {
+        rd_remote_symbols_flush_cache();
+        uint64_t start = now_ns();
+        failures += (rd_remote_symbol_address(target, "dlopen") == 0);
+        cold_ns += now_ns() - start;
+    }
+    for (int i = 0; i < lookups; i++) {
+        uint64_t start = now_ns();
+        failures += (rd_remote_symbol_address(target, "dlopen") == 0);
+        warm_ns += now_ns() - start;
+    }
+    terminate_target(target);
+
+    report_begin("resolve");
+    report_int("lookups", lookups);
+    report_double("cold_us", 1, cold_ns / 1000.0 / lookups);
+    report_double("warm_us", 1, warm_ns / 1000.0 / lookups);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Copying a (large) payload into a container and removing it afterwards, which
+ * is what we used to do for every injection, vs. staging it with the payload cache.
+ */
+static int bench_stage(const rd_bench_config_t *config)
+{
+    char *payload = NULL, *container = NULL, *copy = NULL;
+    if (asprintf(&payload, "%s/libtestlarge.so", config->workdir) < 0 ||
+        asprintf(&container, "%s/container", config->workdir) < 0 ||
+        asprintf(&copy, "%s/libtestlarge.so", container) < 0 ||
+        mkdir(container, 0755) != 0) {
+        return EXIT_FAILURE;
+    }
+    /* Pad the payload, so it's as large as a real-world one */
+    char **copies = make_payload_copies(config, "stage", 1);
+    if (rename(copies[0], payload) != 0 || truncate(payload, kRDBenchStagedPayloadSize) != 0) {
+        fprintf(stderr, "Could not create %s\n", payload);
+        return EXIT_FAILURE;
+    }
+    free(copies[0]);
+    free(copies);
+
+    int failures = 0;
+    int rounds = config->iterations * 5;
+    uint64_t copy_ns = 0, stage_ns = 0;
+    for (int i = 0; i < rounds; i++) {
+        uint64_t start = now_ns();
+        int source = open(payload, O_RDONLY | O_CLOEXEC);
+        int destination = open(copy, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+        off_t offset = 0;
+        failures += (source < 0 || destination < 0 ||
+                     sendfile(destination, source, &offset, kRDBenchStagedPayloadSize) !=
+                     kRDBenchStagedPayloadSize);
+        close(source);
+        close(destination);
+        unlink(copy);
+        copy_ns += now_ns() - start;
+    }
+    for (int i = 0; i < rounds; i++) {
+        uint64_t start = now_ns();
+        char *staged = rd_payload_cache_stage(payload, container);
+        failures += (staged == NULL);
+        rd_payload_cache_release(staged);
+        free(staged);
+        stage_ns += now_ns() - start;
+    }
+
+    /* A copy changed behind the cache's back is staged again rather than reused */
+    char *staged = rd_payload_cache_stage(payload, container);
+    int fd = staged ? open(staged, O_RDWR | O_CLOEXEC) : -1;
+    unsigned char original = 0, tampered = 0;
+    bool is_restaged = false;
+    if (fd >= 0 && pread(fd, &original, 1, 0) == 1) {
+        tampered = (unsigned char)~original;
+        failures += (pwrite(fd, &tampered, 1, 0) != 1);
+    }
+    if (fd >= 0) close(fd);
+    rd_payload_cache_release(staged);
+    free(staged);
+    staged = rd_payload_cache_stage(payload, container);
+    fd = staged ? open(staged, O_RDONLY | O_CLOEXEC) : -1;
+    is_restaged = (fd >= 0 && pread(fd, &tampered, 1, 0) == 1 && tampered == original);
+    failures += !is_restaged;
+    if (fd >= 0) close(fd);
+    rd_payload_cache_release(staged);
+    free(staged);
+
+    /* Copies (and partial copies) left behind by someone else are swept by their age */
+    const char *orphans[] = {"liborphan.so.0123456789abcdef", "liborphan.so.0123456789abcdef.tmp.1.0"};
+    size_t swept = 0;
+    for (size_t i = 0; i < sizeof(orphans) / sizeof(*orphans); i++) {
+        char orphan[PATH_MAX];
+        snprintf(orphan, sizeof(orphan), "%s/%s", container, orphans[i]);
+        struct timespec long_ago[2] = {{.tv_sec = time(NULL) - 3600}, {.tv_sec = time(NULL) - 3600}};
+        close(open(orphan, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+        utimensat(AT_FDCWD, orphan, long_ago, 0);
+    }
+    rd_payload_cache_evict(60);
+    for (size_t i = 0; i < sizeof(orphans) / sizeof(*orphans); i++) {
+        char orphan[PATH_MAX];
+        snprintf(orphan, sizeof(orphan), "%s/%s", container, orphans[i]);
+        swept += (access(orphan, F_OK) != 0);
+    }
+    failures += (swept != sizeof(orphans) / sizeof(*orphans));
+    rd_payload_cache_evict(0);
+    unlink(payload);
+    rmdir(container);
+    free(payload);
+    free(container);
+    free(copy);
+
+    report_begin("stage");
+    report_int("size_mb", kRDBenchStagedPayloadSize / (1024 * 1024));
+    report_int("rounds", rounds);
+    report_double("copy_us", 1, copy_ns / 1000.0 / rounds);
+    report_double("stage_us", 1, stage_ns / 1000.0 / rounds);
+    report_double("speedup", 2, (double)copy_ns / stage_ns);
+    report_int("restaged_tampered", is_restaged);
+    report_int("swept_orphans", (int)swept);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Per-phase latencies of single-library injections, and the cost of timing them.
+ */
+static int bench_phases(const rd_bench_config_t *config)
+{
+    int failures = 0;
+    rd_inject_stats_reset();
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        char **copies = make_payload_copies(config, "phases", config->libraries);
+        pid_t target = spawn_target(config);
+        if (target < 0) return EXIT_FAILURE;
+        for (int i = 0; i < config->libraries; i++) {
+            failures += (rd_inject_library(target, copies[i]) != KERN_SUCCESS);
+        }
+        terminate_target(target);
+        remove_payload_copies(copies, config->libraries);
+    }
+    rd_inject_histogram_t histograms[RD_PHASE_COUNT];
+    rd_inject_stats_snapshot(histograms);
+
+    /* Time an injection's worth of timer calls (one mark per phase) */
+    int rounds = 100000;
+    uint64_t start = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        rd_inject_timer_t timer;
+        rd_inject_timer_start(&timer);
+        for (int phase = 0; phase < RD_PHASE_TOTAL; phase++) {
+            rd_inject_timer_mark(&timer, phase);
+        }
+        rd_inject_timer_finish(&timer, NULL);
+    }
+    double overhead_ns = (double)(now_ns() - start) / rounds;
+    rd_inject_stats_reset();
+
+    report_begin("phases");
+    report_int("injections", (long long)histograms[RD_PHASE_TOTAL].count);
+    report_double("overhead_ns", 0, overhead_ns);
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        if (histograms[phase].count == 0) continue;
+        report_histogram(rd_inject_phase_name(phase), &histograms[phase]);
+    }
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* A thread logging bursts of records */
+typedef struct {
+    pthread_t thread;
+    int bursts;
+    uint64_t logging_ns;
+} rd_bench_logger_t;
+
+static void *log_bursts(void *context)
+{
+    rd_bench_logger_t *logger = context;
+    pid_t self = getpid();
+    for (int burst = 0; burst < logger->bursts; burst++) {
+        uint64_t start = now_ns();
+        for (int i = 0; i < kRDBenchLogBurst; i++) {
+            RDLogNotice(self, RD_PHASE_ATTACH, "the bench is logging");
+        }
+        logger->logging_ns += now_ns() - start;
+        /* Draining is the background thread's job, it's not what the callers pay for */
+        rd_log_flush();
+    }
+    return NULL;
+}
+
+/**
+ * Logs with a single thread and several threads at once and counts the nanoseconds per
+ * record, against formatting a line and writing it out synchronously (and syslog(),
+ * if there's a syslog daemon). The log file is then decoded back to make sure every
+ * record is there.
+ */
+static int bench_log(const rd_bench_config_t *config)
+{
+    int bursts = config->iterations * 8;
+    char log_path[PATH_MAX], text_path[PATH_MAX];
+    snprintf(log_path, sizeof(log_path), "%s/bench.rdlog", config->workdir);
+    snprintf(text_path, sizeof(text_path), "%s/bench.log", config->workdir);
+    /* Whatever the other benchmarks have logged isn't ours to count */
+    rd_log_flush();
+    if (!rd_log_open(log_path)) {
+        perror("rd_log_open");
+        return EXIT_FAILURE;
+    }
+    rd_bench_logger_t single = {.bursts = bursts};
+    log_bursts(&single);
+    rd_bench_logger_t threads[kRDBenchLogThreads];
+    for (int i = 0; i < kRDBenchLogThreads; i++) {
+        threads[i] = (rd_bench_logger_t){.bursts = bursts};
+        if (pthread_create(&threads[i].thread, NULL, log_bursts, &threads[i]) != 0) return EXIT_FAILURE;
+    }
+    uint64_t threaded_ns = 0;
+    for (int i = 0; i < kRDBenchLogThreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+        threaded_ns += threads[i].logging_ns;
+    }
+    rd_log_flush();
+    rd_log_open(NULL);
+    long long logged = (long long)bursts * kRDBenchLogBurst * (kRDBenchLogThreads + 1);
+
+    /* What logging costs when every record is a write() of its own */
+    int text_fd = open(text_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (text_fd < 0) return EXIT_FAILURE;
+    int rounds = bursts * kRDBenchLogBurst;
+    pid_t self = getpid();
+    uint64_t start = now_ns();
+    for (int i = 0; i < rounds; i++) {
+        char line[256];
+        int length = snprintf(line, sizeof(line), "[%d] (%d) notice: %s {attach} @%d\n",
+                              (int)self, (int)self, "the bench is logging", __LINE__);
+        if (write(text_fd, line, (size_t)length) != length) break;
+    }
+    double write_ns = (double)(now_ns() - start) / rounds;
+    close(text_fd);
+    unlink(text_path);
+    double syslog_ns = -1;
+    if (access("/dev/log", W_OK) == 0) {
+        openlog("rd_inject_bench", LOG_NDELAY, LOG_USER);
+        start = now_ns();
+        for (int i = 0; i < rounds; i++) {
+            syslog(LOG_DEBUG, "[%d] (%d) notice: %s {attach} @%d", (int)self, (int)self,
+                   "the bench is logging", __LINE__);
+        }
+        syslog_ns = (double)(now_ns() - start) / rounds;
+        closelog();
+    }
+
+    int failures = 0;
+    long long decoded = -1, dropped = 0;
+    if (config->decoder) {
+        char command[2 * PATH_MAX + 16];
+        snprintf(command, sizeof(command), "'%s' '%s'", config->decoder, log_path);
+        FILE *output = popen(command, "r");
+        if (!output) return EXIT_FAILURE;
+        char line[512];
+        decoded = 0;
+        while (fgets(line, sizeof(line), output)) {
+            long long count = 0;
+            const char *drop = strstr(line, " dropped ");
+            if (drop && sscanf(drop, " dropped %lld records", &count) == 1) {
+                dropped += count;
+            } else {
+                decoded += (strstr(line, "notice: the bench is logging {attach}") != NULL);
+            }
+        }
+        failures += (pclose(output) != 0);
+        /* A dropped record is a lost one, but it must be accounted for */
+        failures += (decoded + dropped != logged);
+    } else {
+        fprintf(stderr, "log: not decoding (no decoder given, use -l)\n");
+    }
+    unlink(log_path);
+
+    report_begin("log");
+    report_int("records", logged);
+    report_double("ns_per_record", 1, (double)single.logging_ns / (bursts * kRDBenchLogBurst));
+    report_double("threaded_ns_per_record", 1,
+                  (double)threaded_ns / ((double)bursts * kRDBenchLogBurst * kRDBenchLogThreads));
+    report_double("write_ns", 1, write_ns);
+    report_double("syslog_ns", 1, syslog_ns);
+    report_int("decoded", decoded);
+    report_int("dropped", dropped);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Pause time of rd_swap_library() for payloads of different sizes: a payload is injected
+ * into a fresh target, then swapped with a copy of itself and back (calling the handoff
+ * routine every time) and finally unloaded. The payload is mapped rather than read, so
+ * the pause is expected to stay flat as the payload grows.
+ */
+static int bench_swap(const rd_bench_config_t *config)
+{
+    static const int sizes[] = {0, 1, 16, 64};
+    int status = EXIT_SUCCESS;
+    char *directory = strdup(config->payload);
+    if (!directory) {
+        return EXIT_FAILURE;
+    }
+    *strrchr(directory, '/') = '\0';
+    uint64_t *pauses = calloc((size_t)config->iterations * 2, sizeof(*pauses));
+    uint64_t *latencies = calloc((size_t)config->iterations * 2, sizeof(*latencies));
+    if (!pauses || !latencies) {
+        return EXIT_FAILURE;
+    }
+
+    for (size_t size = 0; size < sizeof(sizes) / sizeof(*sizes); size++) {
+        char *payload = NULL, *versions[2] = {NULL, NULL};
+        if (asprintf(&payload, "%s/libtestswap_%dM.so", directory, sizes[size]) < 0 ||
+            asprintf(&versions[0], "%s/libtestswap_%dM.v1.so", config->workdir, sizes[size]) < 0 ||
+            asprintf(&versions[1], "%s/libtestswap_%dM.v2.so", config->workdir, sizes[size]) < 0 ||
+            !copy_file(payload, versions[0]) || !copy_file(payload, versions[1])) {
+            fprintf(stderr, "Could not copy %s\n", payload ? payload : "the swap payload");
+            return EXIT_FAILURE;
+        }
+        struct stat info;
+        stat(payload, &info);
+
+        int failures = 0, handoffs = 0, swaps = 0;
+        pid_t target = spawn_target(config);
+        failures += (rd_inject_library(target, versions[0]) != KERN_SUCCESS);
+        for (int i = 0; i < config->iterations * 2 && failures == 0; i++) {
+            const char *from = versions[i % 2], *to = versions[(i + 1) % 2];
+            rd_swap_stats_t stats;
+            uint64_t start = now_ns();
+            int err = rd_swap_library(target, from, to, "libtestswap_handoff", &stats);
+            latencies[swaps] = now_ns() - start;
+            pauses[swaps++] = stats.pause_ns;
+            failures += (err != KERN_SUCCESS);
+            handoffs += stats.handoff_called;
+            /* The engine must have followed the swap */
+            failures += (rd_injected_library_handle(target, to) == 0 ||
+                         rd_injected_library_handle(target, from) != 0);
+        }
+        const char *current = versions[swaps % 2];
+        failures += (rd_unload_library(target, current) != KERN_SUCCESS);
+        failures += (rd_injected_library_handle(target, current) != 0);
+        terminate_target(target);
+
+        qsort(pauses, (size_t)swaps, sizeof(*pauses), compare_u64);
+        qsort(latencies, (size_t)swaps, sizeof(*latencies), compare_u64);
+        char name[32];
+        snprintf(name, sizeof(name), "swap.%dM", sizes[size]);
+        report_begin(name);
+        report_int("payload_bytes", (long long)info.st_size);
+        report_int("swaps", swaps);
+        report_int("handoffs", handoffs);
+        if (swaps > 0) {
+            report_double("pause_p50_us", 1, pauses[swaps / 2] / 1e3);
+            report_double("pause_max_us", 1, pauses[swaps - 1] / 1e3);
+            report_double("swap_p50_us", 1, latencies[swaps / 2] / 1e3);
+        }
+        report_int("failures", failures);
+        report_end();
+
+        unlink(versions[0]);
+        unlink(versions[1]);
+        free(versions[0]);
+        free(versions[1]);
+        free(payload);
+        if (failures > 0 || handoffs != swaps) {
+            status = EXIT_FAILURE;
+        }
+    }
+    free(pauses);
+    free(latencies);
+    free(directory);
+
+    return status;
+}
+
+/**
+ * What a bad request costs: injecting a file that's not a library at all and a library
+ * with a missing dependency (libtestneedy.so), cold (right after the preflight cache has
+ * been flushed) and warm, vs. the preflight share and the total latency of good injections.
+ * Rejected injections must never stop the target.
+ */
+static int bench_preflight(const rd_bench_config_t *config)
+{
+    char *garbage = NULL, *needy = NULL;
+    char *directory = strdup(config->payload);
+    if (!directory) {
+        return EXIT_FAILURE;
+    }
+    *strrchr(directory, '/') = '\0';
+    FILE *file = NULL;
+    if (asprintf(&garbage, "%s/libtestgarbage.so", config->workdir) < 0 ||
+        asprintf(&needy, "%s/libtestneedy.so", directory) < 0 ||
+        !(file = fopen(garbage, "we")) || fputs("This is not a library\n", file) < 0) {
+        fprintf(stderr, "Could not set up the bad payloads\n");
+        return EXIT_FAILURE;
+    }
+    fclose(file);
+    pid_t target = spawn_target(config);
+    if (target < 0) return EXIT_FAILURE;
+
+    int failures = 0;
+    int rejections = config->iterations * 10;
+    const char *bad_payloads[] = {garbage, needy};
+    uint64_t cold_ns[2] = {0, 0}, warm_ns[2] = {0, 0};
+    for (int payload = 0; payload < 2; payload++) {
+        for (int i = 0; i < rejections * 2; i++) {
+            bool cold = (i < rejections);
+            if (cold) rd_inject_preflight_flush_cache();
+            rd_inject_timings_t timings;
+            uint64_t start = now_ns();
+            int err = rd_inject_libraries_with_timings(target, &bad_payloads[payload], 1, NULL, &timings);
+            uint64_t elapsed = now_ns() - start;
+            *(cold ? &cold_ns[payload] : &warm_ns[payload]) += elapsed;
+            failures += (err != KERN_INVALID_OBJECT || timings.phase_ns[RD_PHASE_STOPPED] != 0);
+        }
+    }
+
+    char **copies = make_payload_copies(config, "preflight", config->iterations);
+    uint64_t *preflights = calloc((size_t)config->iterations, sizeof(*preflights));
+    uint64_t *latencies = calloc((size_t)config->iterations, sizeof(*latencies));
+    if (!preflights || !latencies) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < config->iterations; i++) {
+        rd_inject_timings_t timings;
+        failures += (rd_inject_libraries_with_timings(target, (const char **)&copies[i], 1, NULL,
+                                                      &timings) != KERN_SUCCESS);
+        preflights[i] = timings.phase_ns[RD_PHASE_PREFLIGHT];
+        latencies[i] = timings.phase_ns[RD_PHASE_TOTAL];
+    }
+    terminate_target(target);
+    remove_payload_copies(copies, config->iterations);
+    qsort(preflights, (size_t)config->iterations, sizeof(*preflights), compare_u64);
+    qsort(latencies, (size_t)config->iterations, sizeof(*latencies), compare_u64);
+
+    report_begin("preflight");
+    report_int("rejections", rejections * 4);
+    report_double("garbage_cold_us", 1, cold_ns[0] / 1000.0 / rejections);
+    report_double("garbage_warm_us", 1, warm_ns[0] / 1000.0 / rejections);
+    report_double("missing_dep_cold_us", 1, cold_ns[1] / 1000.0 / rejections);
+    report_double("missing_dep_warm_us", 1, warm_ns[1] / 1000.0 / rejections);
+    report_double("good_preflight_p50_us", 1, preflights[config->iterations / 2] / 1e3);
+    report_double("good_injection_p50_us", 1, latencies[config->iterations / 2] / 1e3);
+    report_int("failures", failures);
+    report_end();
+
+    unlink(garbage);
+    free(garbage);
+    free(needy);
+    free(directory);
+    free(preflights);
+    free(latencies);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* How the prefetch benchmark injects */
+typedef enum {
+    /* Payload files just dropped from the page cache, not prefetched */
+    RD_BENCH_PREFETCH_COLD,
+    /* Dropped from the page cache, then prefetched by the injection */
+    RD_BENCH_PREFETCH_COLD_PREFETCHED,
+    /* Still in the page cache */
+    RD_BENCH_PREFETCH_WARM,
+    RD_BENCH_PREFETCH_COUNT
+} rd_bench_prefetch_mode_t;
+
+/**
+ * Writes the file out and drops it from the page cache.
+ *
+ * @return the share of its pages still cached afterwards
+ */
+static double evict_file(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0 || info.st_size == 0) {
+        if (fd >= 0) close(fd);
+        return 1.0;
+    }
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    double resident = 1.0;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = ((size_t)info.st_size + page_size - 1) / page_size;
+    unsigned char *vector = malloc(pages);
+    void *mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (vector && mapping != MAP_FAILED && mincore(mapping, (size_t)info.st_size, vector) == 0) {
+        size_t cached = 0;
+        for (size_t i = 0; i < pages; i++) cached += (vector[i] & 1);
+        resident = (double)cached / pages;
+    }
+    if (mapping != MAP_FAILED) munmap(mapping, (size_t)info.st_size);
+    free(vector);
+    close(fd);
+    return resident;
+}
+
+/**
+ * Cold vs. warm remote dlopen() of a payload with a dependency of its own (libtestroot.so
+ * needs libtestleaf.so next to it): cold payloads are dropped from the page cache right
+ * before the injection, with and without prefetching them. Every injection gets fresh
+ * copies of both in a directory of their own, and a fresh target.
+ */
+static int bench_prefetch(const rd_bench_config_t *config)
+{
+    static const char *names[RD_BENCH_PREFETCH_COUNT] = {"cold", "cold_prefetched", "warm"};
+    static const char *files[] = {"libtestroot.so", "libtestleaf.so"};
+    char *directory = strdup(config->payload);
+    if (!directory) {
+        return EXIT_FAILURE;
+    }
+    *strrchr(directory, '/') = '\0';
+    int samples = config->iterations * config->libraries;
+    uint64_t *dlopens[RD_BENCH_PREFETCH_COUNT], *stops[RD_BENCH_PREFETCH_COUNT];
+    for (int mode = 0; mode < RD_BENCH_PREFETCH_COUNT; mode++) {
+        dlopens[mode] = calloc((size_t)samples, sizeof(uint64_t));
+        stops[mode] = calloc((size_t)samples, sizeof(uint64_t));
+        if (!dlopens[mode] || !stops[mode]) return EXIT_FAILURE;
+    }
+    int failures = 0;
+    double resident = 0;
+    int evictions = 0;
+    for (int sample = 0; sample < samples; sample++) {
+        /* Take turns, so they all see the same disk */
+        for (int mode = 0; mode < RD_BENCH_PREFETCH_COUNT; mode++) {
+            char copy_directory[PATH_MAX - 64], copies[2][PATH_MAX];
+            snprintf(copy_directory, sizeof(copy_directory), "%s/prefetch.%d.%d", config->workdir,
+                     mode, sample);
+            if (mkdir(copy_directory, 0755) != 0) return EXIT_FAILURE;
+            for (int i = 0; i < 2; i++) {
+                char source[PATH_MAX];
+                snprintf(source, sizeof(source), "%s/%s", directory, files[i]);
+                snprintf(copies[i], sizeof(copies[i]), "%s/%s", copy_directory, files[i]);
+                if (!copy_file(source, copies[i])) {
+                    fprintf(stderr, "Could not copy %s\n", source);
+                    return EXIT_FAILURE;
+                }
+            }
+            pid_t target = spawn_target(config);
+            if (target < 0) return EXIT_FAILURE;
+            if (mode != RD_BENCH_PREFETCH_WARM) {
+                for (int i = 0; i < 2; i++) {
+                    resident += evict_file(copies[i]);
+                    evictions++;
+                }
+            }
+            rd_inject_prefetch_enable(mode != RD_BENCH_PREFETCH_COLD);
+            rd_inject_timings_t timings;
+            const char *payload = copies[0];
+            failures += (rd_inject_libraries_with_timings(target, &payload, 1, NULL, &timings) !=
+                         KERN_SUCCESS);
+            dlopens[mode][sample] = timings.phase_ns[RD_PHASE_DLOPEN];
+            stops[mode][sample] = timings.phase_ns[RD_PHASE_STOPPED];
+            terminate_target(target);
+            for (int i = 0; i < 2; i++) unlink(copies[i]);
+            rmdir(copy_directory);
+        }
+    }
+    rd_inject_prefetch_enable(true);
+
+    report_begin("prefetch");
+    report_int("injections", samples);
+    /* Eviction is up to the kernel, so make sure it's happened */
+    report_double("cold_resident_pct", 1, evictions ? 100.0 * resident / evictions : 0);
+    for (int mode = 0; mode < RD_BENCH_PREFETCH_COUNT; mode++) {
+        qsort(dlopens[mode], (size_t)samples, sizeof(uint64_t), compare_u64);
+        qsort(stops[mode], (size_t)samples, sizeof(uint64_t), compare_u64);
+        char key[64];
+        snprintf(key, sizeof(key), "%s_dlopen_p50_us", names[mode]);
+        report_double(key, 1, dlopens[mode][samples / 2] / 1e3);
+        snprintf(key, sizeof(key), "%s_dlopen_p99_us", names[mode]);
+        report_double(key, 1, dlopens[mode][(samples - 1) * 99 / 100] / 1e3);
+        snprintf(key, sizeof(key), "%s_stopped_p50_us", names[mode]);
+        report_double(key, 1, stops[mode][samples / 2] / 1e3);
+        free(dlopens[mode]);
+        free(stops[mode]);
+    }
+    report_int("failures", failures);
+    report_end();
+    free(directory);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Recording and looking up remote handles with the registry holding thousands of them,
+ * and the handles of targets that have exited being swept as the registry grows.
+ */
+static int bench_handles(const rd_bench_config_t *config)
+{
+    const int count = kRDBenchHandlesPerTarget;
+    pid_t target = spawn_target(config);
+    if (target < 0) return EXIT_FAILURE;
+    char path[64];
+    size_t initial = rd_remote_handles_count();
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/bench/handles/%d.so", i);
+        rd_remote_handles_record(target, path, (uint64_t)i + 1);
+    }
+    int failures = (rd_remote_handles_lookup(target, path) != (uint64_t)count);
+    terminate_target(target);
+
+    /* Handles of a live process (ourselves) push the registry over its sweep threshold */
+    uint64_t record_ns = 0, lookup_ns = 0;
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/bench/handles/self/%d.so", i);
+        uint64_t start = now_ns();
+        rd_remote_handles_record(getpid(), path, (uint64_t)i + 1);
+        record_ns += now_ns() - start;
+    }
+    size_t live = rd_remote_handles_count();
+    for (int i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/bench/handles/self/%d.so", i);
+        uint64_t start = now_ns();
+        failures += (rd_remote_handles_lookup(getpid(), path) != (uint64_t)i + 1);
+        lookup_ns += now_ns() - start;
+        rd_remote_handles_forget(getpid(), path);
+    }
+    /* The dead target's handles must be gone by now */
+    failures += (live > initial + (size_t)count);
+
+    report_begin("handles");
+    report_int("handles", count * 2);
+    report_int("left_after_sweep", (long long)live);
+    report_double("record_ns", 0, (double)record_ns / count);
+    report_double("lookup_ns", 0, (double)lookup_ns / count);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * A leak check rather than a benchmark: 5000 * iterations (100k by default) injections
+ * of the same payload into a single target must leave its mappings and its entry point
+ * exactly as they were after the first one.
+ *
+ * The mappings are what proves nothing has leaked into the target: on Linux the remote
+ * arena maps nothing (see rd_remote_arena.h), so no live bytes only proves every borrowed
+ * stack region has been handed back.
+ */
+static int bench_stress(const rd_bench_config_t *config)
+{
+    pid_t target = spawn_target(config);
+    if (target < 0) return EXIT_FAILURE;
+
+    int failures = (rd_inject_library(target, config->payload) != KERN_SUCCESS);
+    char *maps_before = read_proc_file(target, "maps");
+    unsigned char entry_before[128], entry_after[128];
+    bool entry_read = read_entry_code(target, entry_before, sizeof(entry_before));
+    int injections = config->iterations * kRDBenchStressInjections;
+    uint64_t *latencies = calloc((size_t)injections, sizeof(*latencies));
+    if (!maps_before || !entry_read || !latencies) {
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < injections; i++) {
+        uint64_t start = now_ns();
+        failures += (rd_inject_library(target, config->payload) != KERN_SUCCESS);
+        latencies[i] = now_ns() - start;
+    }
+    char *maps_after = read_proc_file(target, "maps");
+    bool maps_changed = (!maps_after || strcmp(maps_before, maps_after) != 0);
+    int mappings_before = 0, mappings_after = 0;
+    for (const char *c = maps_before; *c; c++) mappings_before += (*c == '\n');
+    for (const char *c = maps_after ? maps_after : ""; *c; c++) mappings_after += (*c == '\n');
+    uint64_t live_bytes = rd_remote_arena_live_bytes(target);
+    size_t targets_with_live_bytes = rd_remote_arena_usage(NULL, 0);
+    /* The stub goes over the entry point, so compare the code there too */
+    bool entry_changed = (!read_entry_code(target, entry_after, sizeof(entry_after)) ||
+                          memcmp(entry_before, entry_after, sizeof(entry_before)) != 0);
+    terminate_target(target);
+    failures += maps_changed + entry_changed + (live_bytes != 0) + (targets_with_live_bytes != 0);
+    qsort(latencies, (size_t)injections, sizeof(*latencies), compare_u64);
+
+    report_begin("stress");
+    report_int("injections", injections);
+    report_int("mappings_before", mappings_before);
+    report_int("mappings_after", mappings_after);
+    report_int("maps_changed", maps_changed);
+    report_int("entry_changed", entry_changed);
+    report_int("live_bytes", (long long)live_bytes);
+    report_double("latency_p50_us", 1, latencies[injections / 2] / 1e3);
+    report_double("latency_p99_us", 1, latencies[(size_t)injections * 99 / 100] / 1e3);
+    report_int("failures", failures);
+    report_end();
+
+    free(maps_before);
+    free(maps_after);
+    free(latencies);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int connect_to_daemon(const char *socket_path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static pid_t spawn_daemon(const rd_bench_config_t *config, const char *socket_path)
+{
+    pid_t daemon = fork();
+    if (daemon == 0) {
+        execl(config->daemon, config->daemon, socket_path, (char *)NULL);
+        _exit(EXIT_FAILURE);
+    }
+    for (int attempt = 0; daemon > 0 && attempt < 1000; attempt++) {
+        int fd = connect_to_daemon(socket_path);
+        if (fd >= 0) {
+            close(fd);
+            return daemon;
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "Could not launch %s\n", config->daemon);
+    return -1;
+}
+
+typedef struct {
+    const char *socket_path;
+    const pid_t *targets;
+    int count;
+    int failures;
+} rd_daemon_client_t;
+
+/**
+ * Sends all the client's requests at once, then waits for the replies.
+ */
+static void *daemon_client(void *context)
+{
+    rd_daemon_client_t *client = context;
+    int fd = connect_to_daemon(client->socket_path);
+    if (fd < 0) {
+        client->failures = client->count;
+        return NULL;
+    }
+    FILE *requests = fdopen(dup(fd), "w");
+    for (int i = 0; requests && i < client->count; i++) {
+        fprintf(requests, "%d %s\n", client->targets[i], getenv("RD_BENCH_PAYLOAD"));
+    }
+    if (requests) fclose(requests);
+
+    FILE *replies = fdopen(fd, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    int replied = 0, target = 0, status = 0;
+    while (replied < client->count && getline(&line, &line_size, replies) > 0) {
+        /* Replies also carry phases timings which we don't care about here */
+        if (sscanf(line, "%d %d", &target, &status) != 2) break;
+        client->failures += (status != 1);
+        replied++;
+    }
+    client->failures += client->count - replied;
+    free(line);
+    fclose(replies);
+    return NULL;
+}
+
+/**
+ * Sends all the client's targets as a single fan-out request and waits for its reply.
+ */
+static void *daemon_fanout_client(void *context)
+{
+    rd_daemon_client_t *client = context;
+    int fd = connect_to_daemon(client->socket_path);
+    FILE *request = (fd >= 0) ? fdopen(dup(fd), "w") : NULL;
+    if (!request) {
+        if (fd >= 0) close(fd);
+        client->failures = client->count;
+        return NULL;
+    }
+    fprintf(request, "fanout ");
+    for (int i = 0; i < client->count; i++) {
+        fprintf(request, (i > 0) ? ",%d" : "%d", client->targets[i]);
+    }
+    fprintf(request, " %s\n", getenv("RD_BENCH_PAYLOAD"));
+    fclose(request);
+
+    FILE *reply = fdopen(fd, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    int succeeded = 0, count = 0;
+    if (getline(&line, &line_size, reply) <= 0 ||
+        sscanf(line, "fanout %d/%d", &succeeded, &count) != 2 || count != client->count) {
+        succeeded = 0;
+    }
+    client->failures = client->count - succeeded;
+    free(line);
+    fclose(reply);
+    return NULL;
+}
+
+/**
+ * C concurrent clients of the Linux injector daemon sharing T targets; then a single
+ * fan-out request for T targets, alone and racing single requests for the same targets.
+ */
+static int bench_daemon(const rd_bench_config_t *config)
+{
+    if (!config->daemon) {
+        fprintf(stderr, "daemon: skipped (no injector daemon given, use -d)\n");
+        return EXIT_SUCCESS;
+    }
+    char socket_path[256];
+    snprintf(socket_path, sizeof(socket_path), "%s/injector.sock", config->workdir);
+    setenv("RD_BENCH_PAYLOAD", config->payload, 1);
+    pid_t daemon = spawn_daemon(config, socket_path);
+    if (daemon < 0) return EXIT_FAILURE;
+
+    int clients_count = (config->clients < config->targets) ? config->clients : config->targets;
+    rd_daemon_client_t *clients = calloc((size_t)clients_count, sizeof(*clients));
+    pthread_t *threads = calloc((size_t)clients_count, sizeof(*threads));
+    uint64_t elapsed_ns = 0;
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        int per_client = config->targets / clients_count;
+        uint64_t start = now_ns();
+        for (int i = 0; i < clients_count; i++) {
+            clients[i] = (rd_daemon_client_t){
+                .socket_path = socket_path,
+                .targets = targets + i * per_client,
+                .count = (i == clients_count - 1) ? config->targets - i * per_client : per_client
+            };
+            pthread_create(&threads[i], NULL, daemon_client, &clients[i]);
+        }
+        for (int i = 0; i < clients_count; i++) {
+            pthread_join(threads[i], NULL);
+            failures += clients[i].failures;
+        }
+        elapsed_ns += now_ns() - start;
+        terminate_targets(targets, config->targets);
+    }
+
+    uint64_t fanout_ns = 0;
+    int fanout_failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        rd_daemon_client_t fanout = {
+            .socket_path = socket_path, .targets = targets, .count = config->targets
+        };
+        uint64_t start = now_ns();
+        daemon_fanout_client(&fanout);
+        fanout_ns += now_ns() - start;
+        fanout_failures += fanout.failures;
+        terminate_targets(targets, config->targets);
+
+        /* The fan-out's targets go through the same lanes as the single requests */
+        targets = spawn_targets(config);
+        rd_daemon_client_t single = {
+            .socket_path = socket_path, .targets = targets, .count = config->targets
+        };
+        fanout.targets = targets;
+        pthread_create(&threads[0], NULL, daemon_client, &single);
+        daemon_fanout_client(&fanout);
+        pthread_join(threads[0], NULL);
+        fanout_failures += fanout.failures + single.failures;
+        terminate_targets(targets, config->targets);
+    }
+    terminate_target(daemon);
+    unlink(socket_path);
+    free(clients);
+    free(threads);
+
+    report_begin("daemon");
+    report_int("targets", config->targets);
+    report_int("clients", clients_count);
+    report_int("iterations", config->iterations);
+    report_double("throughput_per_sec", 0, config->targets * config->iterations / (elapsed_ns / 1e9));
+    report_double("fanout_per_sec", 0, config->targets * config->iterations / (fanout_ns / 1e9));
+    report_int("failures", failures);
+    report_int("fanout_failures", fanout_failures);
+    report_end();
+
+    return (failures == 0 && fanout_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static bool send_all(int fd, const void *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (sent <= 0) return false;
+        bytes = (const char *)bytes + sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void *bytes, size_t length)
+{
+    while (length > 0) {
+        ssize_t received = recv(fd, bytes, length, 0);
+        if (received <= 0) return false;
+        bytes = (char *)bytes + received;
+        length -= (size_t)received;
+    }
+    return true;
+}
+
+/**
+ * Receives a results frame from the daemon and checks every result in it.
+ *
+ * @param first_id
+ * Receives the id of the first result; ids of a batch are expected to be consecutive
+ * @param count
+ * Receives the number of results
+ *
+ * @return the number of failed (or missing) results, or -1 if the connection is broken
+ */
+static int recv_results(int fd, uint64_t *first_id, size_t *count)
+{
+    unsigned char header[kRDInjectorFrameHeaderSize];
+    if (!recv_all(fd, header, sizeof(header))) return -1;
+    ssize_t length = rd_injector_frame_length(header, sizeof(header));
+    unsigned char *frame = (length > 0) ? malloc((size_t)length) : NULL;
+    if (!frame) return -1;
+    memcpy(frame, header, sizeof(header));
+    rd_injector_result_t *results = NULL;
+    if (!recv_all(fd, frame + sizeof(header), (size_t)length - sizeof(header)) ||
+        !rd_injector_decode_results(frame, (size_t)length, &results, count)) {
+        free(frame);
+        return -1;
+    }
+    int failures = 0;
+    *first_id = (*count > 0) ? results[0].id : 0;
+    for (size_t i = 0; i < *count; i++) {
+        failures += (results[i].id != *first_id + i || results[i].error != KERN_SUCCESS ||
+                     results[i].error_class != RD_INJECTOR_ERROR_NONE || results[i].handle == 0 ||
+                     results[i].timings.phase_ns[RD_PHASE_TOTAL] == 0);
+    }
+    free(results);
+    free(frame);
+    return failures;
+}
+
+/**
+ * Sends the requests in frames of `batch` requests each (all at once), then waits
+ * for every results frame.
+ *
+ * @return the number of failures
+ */
+static int send_pipelined(int fd, rd_injector_request_t *requests, int count, int batch)
+{
+    int frames = (count + batch - 1) / batch;
+    size_t capacity = rd_injector_requests_frame_length(requests, (size_t)count) +
+                      (size_t)frames * kRDInjectorFrameHeaderSize;
+    unsigned char *buffer = malloc(capacity);
+    size_t length = 0;
+    for (int i = 0; buffer && i < count; i += batch) {
+        size_t entries = (size_t)((count - i < batch) ? count - i : batch);
+        length += rd_injector_encode_requests(requests + i, entries, buffer + length, capacity - length);
+    }
+    bool sent = buffer && send_all(fd, buffer, length);
+    free(buffer);
+    if (!sent) return count;
+
+    int failures = 0, replied = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        uint64_t first_id = 0;
+        size_t entries = 0;
+        int failed = recv_results(fd, &first_id, &entries);
+        if (failed < 0) break;
+        failures += failed;
+        replied += (int)entries;
+    }
+    return failures + (count - replied);
+}
+
+/**
+ * T targets over a single connection to the Linux injector daemon: text requests
+ * one round trip at a time vs. pipelined binary requests (a frame per request) vs.
+ * a single frame with all of them, plus the client's cost of encoding and decoding.
+ */
+static int bench_protocol(const rd_bench_config_t *config)
+{
+    if (!config->daemon) {
+        fprintf(stderr, "protocol: skipped (no injector daemon given, use -d)\n");
+        return EXIT_SUCCESS;
+    }
+    char socket_path[256];
+    snprintf(socket_path, sizeof(socket_path), "%s/injector.sock", config->workdir);
+    pid_t daemon = spawn_daemon(config, socket_path);
+    if (daemon < 0) return EXIT_FAILURE;
+    int fd = connect_to_daemon(socket_path);
+    int text_fd = connect_to_daemon(socket_path);
+    rd_injector_request_t *requests = calloc((size_t)config->targets, sizeof(*requests));
+    /* Every mode injects a copy of its own: the daemon answers repeated requests from its cache */
+    char **copies = make_payload_copies(config, "protocol", 3);
+    if (fd < 0 || text_fd < 0 || !requests || !copies) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t next_id = 1;
+    uint64_t lockstep_ns = 0, pipelined_ns = 0, batched_ns = 0;
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+
+        uint64_t start = now_ns();
+        for (int i = 0; i < config->targets; i++) {
+            char line[kRDBenchMaxReplyLength];
+            int length = snprintf(line, sizeof(line), "%d %s\n", targets[i], copies[0]);
+            ssize_t received = 0;
+            if (send_all(text_fd, line, (size_t)length)) {
+                /* There's only one reply in flight, so it's all we can get */
+                received = recv(text_fd, line, sizeof(line) - 1, 0);
+            }
+            int target = 0, status = 0;
+            if (received <= 0 || line[received - 1] != '\n') {
+                failures++;
+                continue;
+            }
+            line[received] = '\0';
+            failures += (sscanf(line, "%d %d", &target, &status) != 2 || status != 1 ||
+                         target != targets[i]);
+        }
+        lockstep_ns += now_ns() - start;
+
+        for (int i = 0; i < config->targets; i++) {
+            requests[i] = (rd_injector_request_t){next_id++, targets[i], copies[1]};
+        }
+        start = now_ns();
+        failures += send_pipelined(fd, requests, config->targets, 1);
+        pipelined_ns += now_ns() - start;
+
+        for (int i = 0; i < config->targets; i++) {
+            requests[i] = (rd_injector_request_t){next_id++, targets[i], copies[2]};
+        }
+        start = now_ns();
+        failures += send_pipelined(fd, requests, config->targets, config->targets);
+        batched_ns += now_ns() - start;
+
+        terminate_targets(targets, config->targets);
+    }
+    close(fd);
+    close(text_fd);
+    terminate_target(daemon);
+    unlink(socket_path);
+    remove_payload_copies(copies, 3);
+
+    /* The client side of a full batch: encoding the requests and decoding as many results */
+    size_t count = kRDInjectorMaxBatchCount;
+    rd_injector_request_t *codec_requests = calloc(count, sizeof(*codec_requests));
+    rd_injector_result_t *codec_results = calloc(count, sizeof(*codec_results));
+    size_t requests_length = 0, results_length = rd_injector_results_frame_length(count);
+    for (size_t i = 0; codec_requests && i < count; i++) {
+        codec_requests[i] = (rd_injector_request_t){i, (pid_t)i + 1, config->payload};
+    }
+    if (codec_requests) requests_length = rd_injector_requests_frame_length(codec_requests, count);
+    void *requests_frame = malloc(requests_length), *results_frame = malloc(results_length);
+    if (!codec_requests || !codec_results || !requests_frame || !results_frame) {
+        return EXIT_FAILURE;
+    }
+    int rounds = config->iterations * 10;
+    uint64_t start = now_ns();
+    for (int round = 0; round < rounds; round++) {
+        rd_injector_request_t *decoded_requests = NULL;
+        rd_injector_result_t *decoded_results = NULL;
+        size_t decoded = 0;
+        failures += (rd_injector_encode_requests(codec_requests, count, requests_frame,
+                                                 requests_length) != requests_length);
+        failures += !rd_injector_decode_requests(requests_frame, requests_length,
+                                                 &decoded_requests, &decoded);
+        failures += (rd_injector_encode_results(codec_results, count, results_frame,
+                                                results_length) != results_length);
+        failures += !rd_injector_decode_results(results_frame, results_length,
+                                                &decoded_results, &decoded);
+        free(decoded_requests);
+        free(decoded_results);
+    }
+    uint64_t codec_ns = now_ns() - start;
+    free(codec_requests);
+    free(codec_results);
+    free(requests_frame);
+    free(results_frame);
+    free(requests);
+
+    double injections = (double)config->targets * config->iterations;
+    report_begin("protocol");
+    report_int("targets", config->targets);
+    report_int("iterations", config->iterations);
+    report_double("lockstep_per_sec", 0, injections / (lockstep_ns / 1e9));
+    report_double("pipelined_per_sec", 0, injections / (pipelined_ns / 1e9));
+    report_double("batched_per_sec", 0, injections / (batched_ns / 1e9));
+    report_int("request_bytes", (long long)(requests_length / count));
+    report_int("result_bytes", (long long)(results_length / count));
+    report_double("codec_ns_per_request", 1, (double)codec_ns / rounds / count);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Launches the socket activator, which launches the daemon once a client comes in
+ * (or right away if `prelaunch` is set).
+ */
+static pid_t spawn_activator(const rd_bench_config_t *config, const char *socket_path,
+                             const char *state_path, bool prelaunch, int min_idle_ms, int max_idle_ms)
+{
+    char min_idle[16], max_idle[16];
+    snprintf(min_idle, sizeof(min_idle), "%d", min_idle_ms);
+    snprintf(max_idle, sizeof(max_idle), "%d", max_idle_ms);
+    pid_t activator = fork();
+    if (activator == 0) {
+        if (prelaunch) {
+            execl(config->activator, config->activator, "-p", socket_path, config->daemon,
+                  "-s", state_path, "-i", min_idle, "-I", max_idle, (char *)NULL);
+        } else {
+            execl(config->activator, config->activator, socket_path, config->daemon,
+                  "-s", state_path, "-i", min_idle, "-I", max_idle, (char *)NULL);
+        }
+        _exit(EXIT_FAILURE);
+    }
+    /* Don't connect to see if it's there: that'd launch the daemon */
+    struct stat info;
+    for (int attempt = 0; activator > 0 && attempt < 1000; attempt++) {
+        if (stat(socket_path, &info) == 0) {
+            return activator;
+        }
+        usleep(1000);
+    }
+    fprintf(stderr, "Could not launch %s\n", config->activator);
+    return -1;
+}
+
+static void stop_activator(pid_t activator)
+{
+    /* It stops the daemon too, and the daemon saves its warm state */
+    kill(activator, SIGTERM);
+    waitpid(activator, NULL, 0);
+}
+
+/**
+ * Sends a line to the daemon over a new connection and waits for a reply line.
+ *
+ * @return the time it took or 0 on failure
+ */
+static uint64_t daemon_round_trip(const char *socket_path, const char *request, char *reply)
+{
+    uint64_t start = now_ns();
+    int fd = -1;
+    /* The activator may be in between bind() and listen() */
+    for (int attempt = 0; fd < 0 && attempt < 100; attempt++) {
+        fd = connect_to_daemon(socket_path);
+        if (fd < 0) usleep(100);
+    }
+    if (fd < 0 || !send_all(fd, request, strlen(request))) {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+    size_t received = 0;
+    while (received < kRDBenchMaxReplyLength - 1) {
+        ssize_t chunk = recv(fd, reply + received, kRDBenchMaxReplyLength - 1 - received, 0);
+        if (chunk <= 0) break;
+        received += (size_t)chunk;
+        if (reply[received - 1] == '\n') break;
+    }
+    uint64_t elapsed = now_ns() - start;
+    close(fd);
+    reply[received] = '\0';
+    return (received > 0 && reply[received - 1] == '\n') ? elapsed : 0;
+}
+
+/**
+ * Injects the payload into the target through the daemon.
+ *
+ * @return the round trip time or 0 on failure
+ */
+static uint64_t daemon_injection(const rd_bench_config_t *config, const char *socket_path, pid_t target)
+{
+    char request[kRDBenchMaxReplyLength], reply[kRDBenchMaxReplyLength];
+    snprintf(request, sizeof(request), "%d %s\n", target, config->payload);
+    uint64_t elapsed = daemon_round_trip(socket_path, request, reply);
+    int replied_target = 0, status = 0;
+    if (sscanf(reply, "%d %d", &replied_target, &status) != 2 || status != 1) {
+        return 0;
+    }
+    return elapsed;
+}
+
+/**
+ * Reads a "<key>=<number>" value from a stats reply.
+ */
+static unsigned long long stats_value(const char *stats, const char *key)
+{
+    char pattern[64];
+    snprintf(pattern, sizeof(pattern), " %s=", key);
+    const char *value = strstr(stats, pattern);
+    return value ? strtoull(value + strlen(pattern), NULL, 10) : 0;
+}
+
+/**
+ * The first request's round trip when the daemon has to be launched for it (cold and
+ * with a warm state saved by the previous launch), when it has been prelaunched and
+ * when it's already up; then bursts of requests under a fixed and an adaptive idle
+ * policy, counting how many times the daemon had to be launched.
+ */
+static int bench_coldstart(const rd_bench_config_t *config)
+{
+    if (!config->daemon || !config->activator) {
+        fprintf(stderr, "coldstart: skipped (no injector daemon or activator given, use -d and -a)\n");
+        return EXIT_SUCCESS;
+    }
+    char socket_path[256], state_path[256], stats[kRDBenchMaxReplyLength];
+    snprintf(socket_path, sizeof(socket_path), "%s/activated.sock", config->workdir);
+    snprintf(state_path, sizeof(state_path), "%s/injector.state", config->workdir);
+    pid_t target = spawn_target(config);
+    if (target < 0) return EXIT_FAILURE;
+
+    enum {kCold, kWarmState, kPrelaunched, kResident, kModes};
+    uint64_t *latencies[kModes], *cold_startups = NULL, *cold_first_injections = NULL;
+    for (int mode = 0; mode < kModes; mode++) {
+        latencies[mode] = calloc((size_t)config->iterations, sizeof(uint64_t));
+    }
+    cold_startups = calloc((size_t)config->iterations, sizeof(uint64_t));
+    cold_first_injections = calloc((size_t)config->iterations, sizeof(uint64_t));
+    int failures = 0, warm_starts = 0;
+    for (int i = 0; i < config->iterations; i++) {
+        unlink(state_path);
+        for (int mode = kCold; mode <= kPrelaunched; mode++) {
+            pid_t activator = spawn_activator(config, socket_path, state_path, mode == kPrelaunched,
+                                              60000, 60000);
+            if (activator < 0) return EXIT_FAILURE;
+            if (mode == kPrelaunched) {
+                /* Only a stats request can tell the daemon is up without injecting anything */
+                failures += (daemon_round_trip(socket_path, "stats\n", stats) == 0);
+            }
+            latencies[mode][i] = daemon_injection(config, socket_path, target);
+            failures += (latencies[mode][i] == 0);
+            if (mode == kCold) {
+                latencies[kResident][i] = daemon_injection(config, socket_path, target);
+                failures += (latencies[kResident][i] == 0);
+            }
+            failures += (daemon_round_trip(socket_path, "stats\n", stats) == 0);
+            if (mode == kCold) {
+                cold_startups[i] = stats_value(stats, "startup");
+                cold_first_injections[i] = stats_value(stats, "first_injection");
+                failures += (stats_value(stats, "warm") != 0);
+            } else {
+                warm_starts += (stats_value(stats, "warm") != 0);
+            }
+            stop_activator(activator);
+        }
+    }
+
+    /* Bursts a bit further apart than the minimum idle timeout */
+    const char *policies[] = {"fixed", "adaptive"};
+    int launches[2] = {0, 0};
+    uint64_t *first_requests[2];
+    for (int policy = 0; policy < 2; policy++) {
+        unlink(state_path);
+        first_requests[policy] = calloc((size_t)config->iterations, sizeof(uint64_t));
+        pid_t activator = spawn_activator(config, socket_path, state_path, false, kRDBenchBurstGapMs / 3,
+                                          policy == 0 ? kRDBenchBurstGapMs / 3 : kRDBenchBurstGapMs * 10);
+        if (activator < 0 || !first_requests[policy]) return EXIT_FAILURE;
+        unsigned long long last_daemon = 0;
+        for (int burst = 0; burst < config->iterations; burst++) {
+            for (int request = 0; request < kRDBenchBurstRequests; request++) {
+                uint64_t elapsed = daemon_injection(config, socket_path, target);
+                failures += (elapsed == 0);
+                if (request == 0) first_requests[policy][burst] = elapsed;
+            }
+            failures += (daemon_round_trip(socket_path, "stats\n", stats) == 0);
+            unsigned long long daemon = stats_value(stats, "pid");
+            launches[policy] += (daemon != last_daemon);
+            last_daemon = daemon;
+            usleep(kRDBenchBurstGapMs * 1000);
+        }
+        stop_activator(activator);
+        qsort(first_requests[policy], (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    }
+    terminate_target(target);
+    unlink(state_path);
+
+    for (int mode = 0; mode < kModes; mode++) {
+        qsort(latencies[mode], (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    }
+    qsort(cold_startups, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    qsort(cold_first_injections, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    int median = config->iterations / 2;
+    report_begin("coldstart");
+    report_int("iterations", config->iterations);
+    report_double("cold_first_request_p50_us", 1, latencies[kCold][median] / 1e3);
+    report_double("warm_state_first_request_p50_us", 1, latencies[kWarmState][median] / 1e3);
+    report_double("prelaunched_first_request_p50_us", 1, latencies[kPrelaunched][median] / 1e3);
+    report_double("resident_request_p50_us", 1, latencies[kResident][median] / 1e3);
+    report_double("cold_startup_p50_us", 1, cold_startups[median] / 1e3);
+    report_double("cold_first_injection_p50_us", 1, cold_first_injections[median] / 1e3);
+    report_int("warm_starts", warm_starts);
+    for (int policy = 0; policy < 2; policy++) {
+        char key[64];
+        snprintf(key, sizeof(key), "%s_launches", policies[policy]);
+        report_int(key, launches[policy]);
+        snprintf(key, sizeof(key), "%s_first_request_p50_us", policies[policy]);
+        report_double(key, 1, first_requests[policy][median] / 1e3);
+        free(first_requests[policy]);
+    }
+    report_int("failures", failures);
+    report_end();
+
+    for (int mode = 0; mode < kModes; mode++) {
+        free(latencies[mode]);
+    }
+    free(cold_startups);
+    free(cold_first_injections);
+
+    /* Every mode but the cold one has to start warm, and the adaptive policy has to
+     * keep the daemon around once it has seen a couple of bursts */
+    bool adapted = (launches[1] < launches[0]);
+    return (failures == 0 && warm_starts == 2 * config->iterations && adapted) ? EXIT_SUCCESS
+                                                                            : EXIT_FAILURE;
+}
+
+/* Requests of a client benchmark run that haven't been answered yet */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t answered;
+    int outstanding;
+    int failures;
+    int rejected;
+    uint64_t *latencies;
+    size_t latencies_count;
+} rd_client_run_t;
+
+typedef struct {
+    rd_client_run_t *run;
+    uint64_t submitted_at;
+} rd_client_request_t;
+
+typedef struct {
+    rd_injector_client_t *client;
+    rd_client_run_t *run;
+    const pid_t *targets;
+    int count;
+    int rounds;
+    const char *payload;
+} rd_client_submitter_t;
+
+static void client_request_done(const rd_injector_result_t results[], size_t count, void *context)
+{
+    rd_client_request_t *request = context;
+    rd_client_run_t *run = request->run;
+    uint64_t latency = now_ns() - request->submitted_at;
+    pthread_mutex_lock(&run->lock);
+    run->latencies[run->latencies_count++] = latency;
+    for (size_t i = 0; i < count; i++) {
+        run->failures += (results[i].error != KERN_SUCCESS);
+    }
+    if (--run->outstanding == 0) pthread_cond_signal(&run->answered);
+    pthread_mutex_unlock(&run->lock);
+    free(request);
+}
+
+/**
+ * Submits a request per target for every round as fast as the client lets it.
+ */
+static void *client_submitter(void *context)
+{
+    rd_client_submitter_t *submitter = context;
+    rd_client_run_t *run = submitter->run;
+    for (int round = 0; round < submitter->rounds; round++) {
+        for (int i = 0; i < submitter->count; i++) {
+            rd_client_request_t *request = malloc(sizeof(*request));
+            rd_injector_request_t injection = {0, submitter->targets[i], submitter->payload};
+            pthread_mutex_lock(&run->lock);
+            run->outstanding++;
+            pthread_mutex_unlock(&run->lock);
+            int err = KERN_FAILURE;
+            if (request) {
+                request->run = run;
+                request->submitted_at = now_ns();
+                err = rd_injector_client_submit(submitter->client, &injection, 1,
+                                                client_request_done, request);
+            }
+            if (err != KERN_SUCCESS) {
+                pthread_mutex_lock(&run->lock);
+                run->rejected += (err == KERN_RESOURCE_SHORTAGE);
+                run->failures += (err != KERN_RESOURCE_SHORTAGE);
+                if (--run->outstanding == 0) pthread_cond_signal(&run->answered);
+                pthread_mutex_unlock(&run->lock);
+                free(request);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * C threads bursting requests for T targets through a client of the Linux injector
+ * daemon: a single connection without a window vs. a pool of connections with
+ * a window that blocks or rejects the overflow, plus the cost of the client's
+ * fast path (an established connection, a room in the window).
+ */
+static int bench_client(const rd_bench_config_t *config)
+{
+    if (!config->daemon) {
+        fprintf(stderr, "client: skipped (no injector daemon given, use -d)\n");
+        return EXIT_SUCCESS;
+    }
+    enum { kUnbounded, kPooled, kRejecting, kModes };
+    static const char *modes[kModes] = {"unbounded", "pooled", "rejecting"};
+    const rd_injector_client_options_t options[kModes] = {
+        [kUnbounded] = {.connections = 1},
+        [kPooled] = {.connections = 4, .window = 16, .overflow = RD_INJECTOR_CLIENT_WAIT},
+        [kRejecting] = {.connections = 4, .window = 16, .overflow = RD_INJECTOR_CLIENT_REJECT}
+    };
+    const int rounds = 4;
+    char socket_path[256];
+    snprintf(socket_path, sizeof(socket_path), "%s/injector.sock", config->workdir);
+    pid_t daemon = spawn_daemon(config, socket_path);
+    if (daemon < 0) return EXIT_FAILURE;
+
+    int clients_count = (config->clients < config->targets) ? config->clients : config->targets;
+    size_t per_iteration = (size_t)config->targets * rounds;
+    rd_client_submitter_t *submitters = calloc((size_t)clients_count, sizeof(*submitters));
+    pthread_t *threads = calloc((size_t)clients_count, sizeof(*threads));
+    uint64_t *latencies[kModes] = {NULL};
+    size_t latencies_count[kModes] = {0};
+    uint64_t elapsed_ns[kModes] = {0};
+    rd_injector_client_stats_t stats[kModes];
+    int failures = 0, rejected = 0;
+    for (int mode = 0; mode < kModes; mode++) {
+        latencies[mode] = calloc(per_iteration * (size_t)config->iterations, sizeof(uint64_t));
+        if (!latencies[mode]) return EXIT_FAILURE;
+    }
+    if (!submitters || !threads) return EXIT_FAILURE;
+
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        for (int mode = 0; mode < kModes; mode++) {
+            rd_injector_client_t *client = rd_injector_client_create_socket(socket_path, &options[mode]);
+            rd_client_run_t run = {
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .answered = PTHREAD_COND_INITIALIZER,
+                .latencies = latencies[mode] + latencies_count[mode]
+            };
+            int per_client = config->targets / clients_count;
+            /* The first mode also loads the payload into the new targets, so all of them re-inject it */
+            rd_client_submitter_t warmup = {client, &run, targets, config->targets, 1, config->payload};
+            if (mode == kUnbounded) {
+                client_submitter(&warmup);
+                pthread_mutex_lock(&run.lock);
+                while (run.outstanding > 0) pthread_cond_wait(&run.answered, &run.lock);
+                pthread_mutex_unlock(&run.lock);
+                failures += run.failures;
+                run.failures = 0;
+                run.latencies_count = 0;
+            }
+            uint64_t start = now_ns();
+            for (int i = 0; i < clients_count; i++) {
+                submitters[i] = (rd_client_submitter_t){
+                    .client = client,
+                    .run = &run,
+                    .targets = targets + i * per_client,
+                    .count = (i == clients_count - 1) ? config->targets - i * per_client : per_client,
+                    .rounds = rounds,
+                    .payload = config->payload
+                };
+                pthread_create(&threads[i], NULL, client_submitter, &submitters[i]);
+            }
+            for (int i = 0; i < clients_count; i++) {
+                pthread_join(threads[i], NULL);
+            }
+            pthread_mutex_lock(&run.lock);
+            while (run.outstanding > 0) pthread_cond_wait(&run.answered, &run.lock);
+            pthread_mutex_unlock(&run.lock);
+            elapsed_ns[mode] += now_ns() - start;
+            latencies_count[mode] += run.latencies_count;
+            failures += run.failures;
+            if (mode == kRejecting) rejected += run.rejected;
+            else failures += run.rejected;
+            rd_injector_client_get_stats(client, &stats[mode]);
+            rd_injector_client_destroy(client);
+        }
+        terminate_targets(targets, config->targets);
+    }
+
+    /* The fast path: an established connection and a room in the window */
+    const int calls = 1000000;
+    rd_injector_client_t *client = rd_injector_client_create_socket(socket_path, &options[kPooled]);
+    pthread_mutex_t connection_lock = PTHREAD_MUTEX_INITIALIZER;
+    void *volatile connection = NULL;
+    for (size_t slot = 0; client && slot < options[kPooled].connections; slot++) {
+        failures += (rd_injector_client_connection(client) == NULL);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; client && i < calls; i++) {
+        connection = rd_injector_client_connection(client);
+    }
+    uint64_t connection_ns = now_ns() - start;
+    /* What checking for the connection under a lock costs */
+    start = now_ns();
+    for (int i = 0; i < calls; i++) {
+        pthread_mutex_lock(&connection_lock);
+        if (!connection) connection = &connection_lock;
+        pthread_mutex_unlock(&connection_lock);
+    }
+    uint64_t locked_connection_ns = now_ns() - start;
+    start = now_ns();
+    for (int i = 0; client && i < calls; i++) {
+        failures += (rd_injector_client_acquire(client, 1) != KERN_SUCCESS);
+        rd_injector_client_release(client, 1);
+    }
+    uint64_t window_ns = now_ns() - start;
+    failures += (client == NULL);
+    rd_injector_client_destroy(client);
+    terminate_target(daemon);
+    unlink(socket_path);
+    free(submitters);
+    free(threads);
+
+    report_begin("client");
+    report_int("targets", config->targets);
+    report_int("clients", clients_count);
+    report_int("iterations", config->iterations);
+    for (int mode = 0; mode < kModes; mode++) {
+        char key[64];
+        qsort(latencies[mode], latencies_count[mode], sizeof(uint64_t), compare_u64);
+        size_t p99 = latencies_count[mode] ? (latencies_count[mode] * 99) / 100 : 0;
+        snprintf(key, sizeof(key), "%s_per_sec", modes[mode]);
+        report_double(key, 0, latencies_count[mode] / (elapsed_ns[mode] / 1e9));
+        snprintf(key, sizeof(key), "%s_p99_us", modes[mode]);
+        report_double(key, 1, latencies_count[mode] ? latencies[mode][p99] / 1e3 : 0);
+        snprintf(key, sizeof(key), "%s_peak_in_flight", modes[mode]);
+        report_int(key, (long long)stats[mode].peak_in_flight);
+        snprintf(key, sizeof(key), "%s_peak_waiting", modes[mode]);
+        report_int(key, (long long)stats[mode].peak_waiting);
+        free(latencies[mode]);
+    }
+    report_int("rejected", rejected);
+    report_double("connection_ns", 1, (double)connection_ns / calls);
+    report_double("locked_connection_ns", 1, (double)locked_connection_ns / calls);
+    report_double("window_ns", 1, (double)window_ns / calls);
+    report_int("failures", failures);
+    report_end();
+
+    /* The window has to hold */
+    bool bounded = (stats[kPooled].peak_in_flight <= options[kPooled].window &&
+                    stats[kRejecting].peak_in_flight <= options[kRejecting].window);
+    return (failures == 0 && bounded) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Sends a requests frame to the daemon and waits for its results frame.
+ *
+ * @return false if the connection is broken
+ */
+static bool exchange_frame(int fd, const rd_injector_request_t requests[], size_t count,
+                           rd_injector_result_t **results, size_t *results_count)
+{
+    size_t length = rd_injector_requests_frame_length(requests, count);
+    unsigned char *frame = malloc(length);
+    bool sent = (frame && rd_injector_encode_requests(requests, count, frame, length) == length &&
+                 send_all(fd, frame, length));
+    free(frame);
+    unsigned char header[kRDInjectorFrameHeaderSize];
+    if (!sent || !recv_all(fd, header, sizeof(header))) return false;
+    ssize_t reply_length = rd_injector_frame_length(header, sizeof(header));
+    frame = (reply_length > 0) ? malloc((size_t)reply_length) : NULL;
+    if (!frame) return false;
+    memcpy(frame, header, sizeof(header));
+    bool received = (recv_all(fd, frame + sizeof(header), (size_t)reply_length - sizeof(header)) &&
+                     rd_injector_decode_results(frame, (size_t)reply_length, results, results_count));
+    free(frame);
+    return received;
+}
+
+/**
+ * D identical requests for each of T targets sent to the Linux injector daemon in a
+ * single frame (interleaved, as if they came from D components at once) and coalesced
+ * into an injection per target, vs. making every one of them an injection of its own,
+ * the way the daemon used to; then repeated requests answered from the daemon's cache.
+ */
+static int bench_coalesce(const rd_bench_config_t *config)
+{
+    if (!config->daemon) {
+        fprintf(stderr, "coalesce: skipped (no injector daemon given, use -d)\n");
+        return EXIT_SUCCESS;
+    }
+    char socket_path[256], stats[kRDBenchMaxReplyLength];
+    snprintf(socket_path, sizeof(socket_path), "%s/injector.sock", config->workdir);
+    pid_t daemon = spawn_daemon(config, socket_path);
+    if (daemon < 0) return EXIT_FAILURE;
+    int fd = connect_to_daemon(socket_path);
+    size_t count = (size_t)config->targets * kRDBenchDuplicates;
+    rd_injector_request_t *requests = calloc(count, sizeof(*requests));
+    if (fd < 0 || !requests) {
+        return EXIT_FAILURE;
+    }
+
+    uint64_t next_id = 1, coalesced_ns = 0, uncoalesced_ns = 0, cached_ns = 0;
+    unsigned long long joined = 0, cached = 0;
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        pid_t *targets = spawn_targets(config);
+        for (size_t i = 0; i < count; i++) {
+            requests[i] = (rd_injector_request_t){next_id++, targets[i % (size_t)config->targets],
+                                                  config->payload};
+        }
+        failures += (daemon_round_trip(socket_path, "stats\n", stats) == 0);
+        unsigned long long joined_before = stats_value(stats, "joined");
+        unsigned long long cached_before = stats_value(stats, "cached");
+
+        rd_injector_result_t *results = NULL;
+        size_t results_count = 0;
+        uint64_t start = now_ns();
+        bool exchanged = exchange_frame(fd, requests, count, &results, &results_count);
+        coalesced_ns += now_ns() - start;
+        if (!exchanged || results_count != count) {
+            failures += (int)count;
+        }
+        /* Everyone gets the same handle of the same injection */
+        for (size_t i = 0; exchanged && i < results_count; i++) {
+            const rd_injector_result_t *first = &results[i % (size_t)config->targets];
+            failures += (results[i].id != requests[i].id || results[i].error != KERN_SUCCESS ||
+                         results[i].handle == 0 || results[i].handle != first->handle);
+        }
+        free(results);
+
+        /* Repeated requests are answered without touching the targets */
+        for (int i = 0; i < config->targets; i++) {
+            uint64_t elapsed = daemon_injection(config, socket_path, targets[i]);
+            failures += (elapsed == 0);
+            cached_ns += elapsed;
+        }
+        failures += (daemon_round_trip(socket_path, "stats\n", stats) == 0);
+        joined += stats_value(stats, "joined") - joined_before;
+        cached += stats_value(stats, "cached") - cached_before;
+        terminate_targets(targets, config->targets);
+
+        /* Every request an injection of its own, one target after another */
+        targets = spawn_targets(config);
+        start = now_ns();
+        for (size_t i = 0; i < count; i++) {
+            failures += (rd_inject_library(targets[i % (size_t)config->targets], config->payload) !=
+                         KERN_SUCCESS);
+        }
+        uncoalesced_ns += now_ns() - start;
+        terminate_targets(targets, config->targets);
+    }
+    /* Every duplicate has either joined its injection or come in after it was done */
+    size_t duplicates = (count - (size_t)config->targets) * (size_t)config->iterations;
+    failures += (joined + cached != duplicates + (size_t)config->targets * config->iterations);
+    close(fd);
+    terminate_target(daemon);
+    unlink(socket_path);
+    free(requests);
+
+    report_begin("coalesce");
+    report_int("targets", config->targets);
+    report_int("duplicates", kRDBenchDuplicates);
+    report_int("iterations", config->iterations);
+    report_double("coalesced_ms", 2, coalesced_ns / 1e6 / config->iterations);
+    report_double("uncoalesced_ms", 2, uncoalesced_ns / 1e6 / config->iterations);
+    report_double("speedup", 1, (double)uncoalesced_ns / coalesced_ns);
+    report_double("cached_round_trip_us", 1, cached_ns / 1e3 / config->targets / config->iterations);
+    report_int("joined", (long long)joined);
+    report_int("cached", (long long)cached);
+    report_int("failures", failures);
+    report_end();
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Copies the target and the payload into a world-readable directory, with the target
+ * setuid to nobody, so the loader runs it in the secure-execution mode and ignores its
+ * preload list.
+ *
+ * @return the directory (free() it) or NULL
+ */
+static char *make_setuid_target(const rd_bench_config_t *config, char **target, char **payload)
+{
+    char *directory = strdup("/tmp/rd_inject_bench_setuid.XXXXXX");
+    if (!directory || !mkdtemp(directory) || chmod(directory, 0755) != 0 ||
+        asprintf(target, "%s/demo_target", directory) < 0 ||
+        asprintf(payload, "%s/libtestnoop.so", directory) < 0 ||
+        !copy_file(config->target, *target) || !copy_file(config->payload, *payload) ||
+        chmod(*payload, 0755) != 0 || chown(*target, 65534, 65534) != 0 ||
+        chmod(*target, 04755) != 0) {
+        fprintf(stderr, "Could not make a setuid target\n");
+        free(directory);
+        return NULL;
+    }
+    return directory;
+}
+
+/**
+ * Launching a target and then injecting into it vs. launching it with the payload
+ * already in the loader's preload list; then launching a setuid target the loader
+ * won't preload anything into, so the payload is injected while it's still held
+ * at its entry point.
+ */
+static int bench_spawn(const rd_bench_config_t *config)
+{
+    uint64_t *attached = calloc((size_t)config->iterations, sizeof(uint64_t));
+    uint64_t *spawned = calloc((size_t)config->iterations, sizeof(uint64_t));
+    uint64_t *loaded = calloc((size_t)config->iterations, sizeof(uint64_t));
+    uint64_t *injected = calloc((size_t)config->iterations, sizeof(uint64_t));
+    if (!attached || !spawned || !loaded || !injected) return EXIT_FAILURE;
+    char *argv[] = {(char *)config->target, NULL};
+    char *setuid_target = NULL, *setuid_payload = NULL;
+    char *setuid_directory = make_setuid_target(config, &setuid_target, &setuid_payload);
+    char *setuid_argv[] = {setuid_target, NULL};
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        uint64_t start = now_ns();
+        pid_t target = spawn_target(config);
+        failures += (target < 0 || rd_inject_library(target, config->payload) != KERN_SUCCESS);
+        attached[iteration] = now_ns() - start;
+        if (target > 0) terminate_target(target);
+
+        rd_spawn_stats_t stats;
+        start = now_ns();
+        int err = rd_spawn_with_library(config->target, argv, NULL, config->payload, &target, &stats);
+        spawned[iteration] = now_ns() - start;
+        loaded[iteration] = stats.loaded_ns;
+        failures += (err != KERN_SUCCESS || stats.mode != RD_SPAWN_PRELOADED);
+        /* The payload has to be there, and the target has to be running on its own */
+        failures += (target > 0 && !wait_for_target_to_settle(target));
+        char *maps = (target > 0) ? read_proc_file(target, "maps") : NULL;
+        failures += (!maps || !strstr(maps, config->payload));
+        free(maps);
+        if (target > 0) terminate_target(target);
+
+        if (!setuid_directory) {
+            failures++;
+            continue;
+        }
+        start = now_ns();
+        err = rd_spawn_with_library(setuid_target, setuid_argv, NULL, setuid_payload, &target, &stats);
+        injected[iteration] = now_ns() - start;
+        failures += (err != KERN_SUCCESS || stats.mode != RD_SPAWN_INJECTED);
+        failures += (target > 0 && !wait_for_target_to_settle(target));
+        maps = (target > 0) ? read_proc_file(target, "maps") : NULL;
+        failures += (!maps || !strstr(maps, setuid_payload));
+        free(maps);
+        if (target > 0) terminate_target(target);
+    }
+    if (setuid_directory) {
+        unlink(setuid_target);
+        unlink(setuid_payload);
+        rmdir(setuid_directory);
+    }
+    free(setuid_directory);
+    free(setuid_target);
+    free(setuid_payload);
+    qsort(attached, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    qsort(spawned, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    qsort(loaded, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    qsort(injected, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    int median = config->iterations / 2;
+
+    report_begin("spawn");
+    report_int("iterations", config->iterations);
+    report_double("spawn_then_inject_p50_us", 1, attached[median] / 1e3);
+    report_double("spawn_preloaded_p50_us", 1, spawned[median] / 1e3);
+    report_double("preloaded_constructor_p50_us", 1, loaded[median] / 1e3);
+    report_double("spawn_held_inject_p50_us", 1, injected[median] / 1e3);
+    report_int("failures", failures);
+    report_end();
+    free(attached);
+    free(spawned);
+    free(loaded);
+    free(injected);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Injecting an in-memory payload by writing it into a file first vs. through a sealed memfd.
+ */
+static int bench_memfd(const rd_bench_config_t *config)
+{
+    /* The payload is "built in memory": padded, so it's as large as a real-world one */
+    char *image = calloc(1, kRDBenchStagedPayloadSize);
+    int source = open(config->payload, O_RDONLY | O_CLOEXEC);
+    ssize_t image_size = (source >= 0) ? read(source, image, kRDBenchStagedPayloadSize) : -1;
+    if (source >= 0) close(source);
+    if (!image || image_size <= 0) {
+        fprintf(stderr, "Could not read %s\n", config->payload);
+        return EXIT_FAILURE;
+    }
+    uint64_t *written = calloc((size_t)config->iterations, sizeof(uint64_t));
+    uint64_t *shared = calloc((size_t)config->iterations, sizeof(uint64_t));
+    if (!written || !shared) return EXIT_FAILURE;
+    int failures = 0;
+    long long filesystem_bytes = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        /* Write the image out, inject it into every target and clean it up */
+        pid_t *targets = spawn_targets(config);
+        char *path = NULL;
+        if (!targets || asprintf(&path, "%s/libtestmemory.%d.so", config->workdir, iteration) < 0) {
+            return EXIT_FAILURE;
+        }
+        uint64_t start = now_ns();
+        int file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0755);
+        failures += (file < 0 || write(file, image, kRDBenchStagedPayloadSize) != kRDBenchStagedPayloadSize);
+        if (file >= 0) close(file);
+        for (int i = 0; i < config->targets; i++) {
+            failures += (rd_inject_library(targets[i], path) != KERN_SUCCESS);
+        }
+        unlink(path);
+        written[iteration] = now_ns() - start;
+        filesystem_bytes += kRDBenchStagedPayloadSize;
+        free(path);
+        terminate_targets(targets, config->targets);
+
+        /* The same through a single sealed memfd */
+        targets = spawn_targets(config);
+        if (!targets) return EXIT_FAILURE;
+        start = now_ns();
+        rd_payload_t *payload = rd_payload_create(image, kRDBenchStagedPayloadSize, "libtestmemory");
+        failures += (payload == NULL);
+        for (int i = 0; payload && i < config->targets; i++) {
+            failures += (rd_inject_payload(targets[i], payload, NULL) != KERN_SUCCESS);
+        }
+        shared[iteration] = now_ns() - start;
+        /* The targets have to map the memfd itself, and it has to be unloadable by its path */
+        char *maps = read_proc_file(targets[0], "maps");
+        failures += (!maps || !strstr(maps, "/memfd:libtestmemory"));
+        free(maps);
+        /* Another payload of the same name is remembered apart from the first one */
+        rd_payload_t *namesake = rd_payload_create(image, kRDBenchStagedPayloadSize, "libtestmemory");
+        failures += (!namesake || !payload ||
+                     strcmp(rd_payload_path(namesake), rd_payload_path(payload)) == 0 ||
+                     rd_inject_payload(targets[0], namesake, NULL) != KERN_SUCCESS ||
+                     rd_injected_library_handle(targets[0], rd_payload_path(namesake)) ==
+                     rd_injected_library_handle(targets[0], rd_payload_path(payload)));
+        failures += (namesake && rd_unload_library(targets[0], rd_payload_path(namesake)) != KERN_SUCCESS);
+        rd_payload_release(namesake);
+        failures += (payload && rd_unload_library(targets[0], rd_payload_path(payload)) != KERN_SUCCESS);
+        rd_payload_release(payload);
+        terminate_targets(targets, config->targets);
+    }
+    qsort(written, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    qsort(shared, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+    int median = config->iterations / 2;
+
+    report_begin("memfd");
+    report_int("size_mb", kRDBenchStagedPayloadSize / (1024 * 1024));
+    report_int("targets", config->targets);
+    report_double("file_p50_us", 1, written[median] / 1e3);
+    report_double("memfd_p50_us", 1, shared[median] / 1e3);
+    report_int("file_bytes_written", filesystem_bytes);
+    report_int("memfd_bytes_written", 0);
+    report_int("failures", failures);
+    report_end();
+    free(written);
+    free(shared);
+    free(image);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#define kRDBenchAgentRivalCalls 200
+
+typedef struct {
+    rd_agent_t *agent;
+    pid_t target;
+    int failures;
+} rd_bench_agent_rival_t;
+
+static void *agent_rival_calls(void *context)
+{
+    rd_bench_agent_rival_t *rival = context;
+    for (int i = 0; i < kRDBenchAgentRivalCalls; i++) {
+        uint64_t result = 0;
+        rival->failures += (rd_agent_call(rival->agent, NULL, "getpid", 0, &result) != KERN_SUCCESS ||
+                            result != (uint64_t)rival->target);
+    }
+    return NULL;
+}
+
+/**
+ * Full injections vs. loads through the resident agent, and a call through the agent.
+ */
+static int bench_agent(const rd_bench_config_t *config)
+{
+    if (!config->agent) {
+        fprintf(stderr, "agent: skipped (no agent library given, use -g)\n");
+        return EXIT_SUCCESS;
+    }
+    int per_iteration = config->libraries;
+    int samples = config->iterations * per_iteration;
+    uint64_t *injected = calloc((size_t)samples, sizeof(uint64_t));
+    uint64_t *loaded = calloc((size_t)samples, sizeof(uint64_t));
+    uint64_t *called = calloc((size_t)samples, sizeof(uint64_t));
+    if (!injected || !loaded || !called) return EXIT_FAILURE;
+    uint64_t attach_ns = 0, reattach_ns = 0, batch_ns = 0;
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        /* Distinct copies, so every load is a real one */
+        char **copies = make_payload_copies(config, "agent", per_iteration * 3);
+        pid_t target = spawn_target(config);
+        if (target < 0) return EXIT_FAILURE;
+        for (int i = 0; i < per_iteration; i++) {
+            uint64_t start = now_ns();
+            failures += (rd_inject_library(target, copies[i]) != KERN_SUCCESS);
+            injected[iteration * per_iteration + i] = now_ns() - start;
+        }
+
+        rd_agent_t *agent = NULL;
+        uint64_t start = now_ns();
+        failures += (rd_agent_attach(target, config->agent, &agent) != KERN_SUCCESS);
+        attach_ns += now_ns() - start;
+        if (!agent) {
+            remove_payload_copies(copies, per_iteration * 3);
+            terminate_target(target);
+            continue;
+        }
+        /* The agent is there already now */
+        rd_agent_detach(agent);
+        start = now_ns();
+        failures += (rd_agent_attach(target, config->agent, &agent) != KERN_SUCCESS);
+        reattach_ns += now_ns() - start;
+        if (!agent) {
+            remove_payload_copies(copies, per_iteration * 3);
+            terminate_target(target);
+            continue;
+        }
+        for (int i = 0; i < per_iteration; i++) {
+            const char *path = copies[per_iteration + i];
+            start = now_ns();
+            failures += (rd_agent_load_libraries(agent, &path, 1, NULL) != KERN_SUCCESS);
+            loaded[iteration * per_iteration + i] = now_ns() - start;
+            uint64_t result = 0;
+            start = now_ns();
+            failures += (rd_agent_call(agent, NULL, "getpid", 0, &result) != KERN_SUCCESS ||
+                         result != (uint64_t)target);
+            called[iteration * per_iteration + i] = now_ns() - start;
+        }
+        start = now_ns();
+        failures += (rd_agent_load_libraries(agent, (const char **)copies + 2 * per_iteration,
+                                             (size_t)per_iteration, NULL) != KERN_SUCCESS);
+        batch_ns += now_ns() - start;
+        /* Whatever the agent loads can be unloaded either way */
+        failures += (rd_agent_unload_library(agent, copies[per_iteration]) != KERN_SUCCESS);
+        failures += (rd_unload_library(target, copies[2 * per_iteration]) != KERN_SUCCESS);
+        failures += (rd_agent_call(agent, NULL, "rd_no_such_routine", 0, NULL) != KERN_INVALID_OBJECT);
+        /* Two connections to the same agent must take turns on its ring */
+        rd_bench_agent_rival_t rivals[2] = {{.target = target}, {.target = target}};
+        pthread_t threads[2];
+        int started = 0;
+        for (int i = 0; i < 2; i++) {
+            if (rd_agent_attach(target, config->agent, &rivals[i].agent) != KERN_SUCCESS) {
+                failures++;
+                continue;
+            }
+            failures += (pthread_create(&threads[started], NULL, agent_rival_calls, &rivals[i]) != 0);
+            started++;
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < 2; i++) {
+            failures += rivals[i].failures;
+            rd_agent_detach(rivals[i].agent);
+        }
+        rd_agent_detach(agent);
+        /* The target must still be running on its own */
+        failures += !wait_for_target_to_settle(target);
+        terminate_target(target);
+        remove_payload_copies(copies, per_iteration * 3);
+    }
+    qsort(injected, (size_t)samples, sizeof(uint64_t), compare_u64);
+    qsort(loaded, (size_t)samples, sizeof(uint64_t), compare_u64);
+    qsort(called, (size_t)samples, sizeof(uint64_t), compare_u64);
+    int median = samples / 2;
+
+    report_begin("agent");
+    report_int("iterations", config->iterations);
+    report_int("libraries", per_iteration);
+    report_double("inject_p50_us", 1, injected[median] / 1e3);
+    report_double("agent_load_p50_us", 1, loaded[median] / 1e3);
+    report_double("agent_batch_per_library_us", 1, batch_ns / 1e3 / samples);
+    report_double("agent_call_p50_us", 1, called[median] / 1e3);
+    report_double("attach_us", 1, attach_ns / 1e3 / config->iterations);
+    report_double("reattach_us", 1, reattach_ns / 1e3 / config->iterations);
+    report_double("speedup", 1, (double)injected[median] / loaded[median]);
+    report_int("failures", failures);
+    report_end();
+    free(injected);
+    free(loaded);
+    free(called);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int bench_call(const rd_bench_config_t *config)
+{
+    int per_iteration = config->libraries;
+    int samples = config->iterations * per_iteration;
+    uint64_t *injected = calloc((size_t)samples, sizeof(uint64_t));
+    uint64_t *called = calloc((size_t)samples, sizeof(uint64_t));
+    rd_remote_call_t *calls = calloc((size_t)per_iteration, sizeof(rd_remote_call_t));
+    if (!injected || !called || !calls) return EXIT_FAILURE;
+    static const char setting[] = "log_level=debug";
+    rd_remote_argument_t string = {.bytes = setting, .size = sizeof(setting)};
+    uint64_t batch_ns = 0, batch_stopped_ns = 0;
+    int failures = 0;
+    for (int iteration = 0; iteration < config->iterations; iteration++) {
+        /* Today's way to configure a payload: inject yet another library for each step */
+        char **copies = make_payload_copies(config, "call", per_iteration);
+        pid_t target = spawn_target(config);
+        if (target < 0) return EXIT_FAILURE;
+        for (int i = 0; i < per_iteration; i++) {
+            uint64_t start = now_ns();
+            failures += (rd_inject_library(target, copies[i]) != KERN_SUCCESS);
+            injected[iteration * per_iteration + i] = now_ns() - start;
+        }
+        for (int i = 0; i < per_iteration; i++) {
+            uint64_t result = 0;
+            uint64_t start = now_ns();
+            failures += (rd_remote_call(target, "getpid", 0, NULL, 0, &result) != KERN_SUCCESS ||
+                         result != (uint64_t)target);
+            called[iteration * per_iteration + i] = now_ns() - start;
+        }
+        /* The same steps in a single stop, alternating by-address and by-symbol calls
+         * (strlen() is an IFUNC, only dlsym() can tell its address) */
+        uint64_t getpid_address = rd_remote_symbol_address(target, "getpid");
+        for (int i = 0; i < per_iteration; i++) {
+            calls[i] = (rd_remote_call_t){.address = getpid_address};
+            if (i % 2) {
+                calls[i] = (rd_remote_call_t){.symbol = "strlen", .arguments = &string,
+                                              .arguments_count = 1};
+            }
+        }
+        rd_inject_timings_t timings;
+        uint64_t start = now_ns();
+        failures += (rd_remote_calls(target, calls, (size_t)per_iteration, &timings) != KERN_SUCCESS);
+        batch_ns += now_ns() - start;
+        batch_stopped_ns += timings.phase_ns[RD_PHASE_STOPPED];
+        for (int i = 0; i < per_iteration; i++) {
+            uint64_t expected = (i % 2) ? strlen(setting) : (uint64_t)target;
+            failures += (calls[i].err != KERN_SUCCESS || calls[i].result != expected);
+        }
+        /* A missing routine fails on its own, the rest of the batch still runs */
+        rd_remote_call_t mixed[] = {
+            {.symbol = "getpid"}, {.symbol = "rd_no_such_routine"}, {.symbol = "getpid"}
+        };
+        failures += (rd_remote_calls(target, mixed, 3, NULL) != KERN_INVALID_OBJECT ||
+                     mixed[0].err != KERN_SUCCESS || mixed[1].err != KERN_INVALID_OBJECT ||
+                     mixed[2].err != KERN_SUCCESS || mixed[2].result != (uint64_t)target);
+        /* Bad calls never get to the target */
+        rd_remote_argument_t arguments[kRDRemoteCallMaxArguments + 1] = {{0}};
+        failures += (rd_remote_call(target, "getpid", 0, arguments, kRDRemoteCallMaxArguments + 1,
+                                    NULL) != KERN_INVALID_ARGUMENT);
+        rd_remote_call_t elsewhere = {.symbol = "getpid", .library_path = "/never/injected.so"};
+        failures += (rd_remote_calls(target, &elsewhere, 1, NULL) != KERN_INVALID_ARGUMENT);
+        failures += !wait_for_target_to_settle(target);
+        terminate_target(target);
+        remove_payload_copies(copies, per_iteration);
+    }
+    qsort(injected, (size_t)samples, sizeof(uint64_t), compare_u64);
+    qsort(called, (size_t)samples, sizeof(uint64_t), compare_u64);
+    int median = samples / 2;
+
+    report_begin("call");
+    report_int("iterations", config->iterations);
+    report_int("calls", per_iteration);
+    report_double("inject_p50_us", 1, injected[median] / 1e3);
+    report_double("call_p50_us", 1, called[median] / 1e3);
+    report_double("batch_us", 1, batch_ns / 1e3 / config->iterations);
+    report_double("batch_stopped_us", 1, batch_stopped_ns / 1e3 / config->iterations);
+    report_double("batch_per_call_us", 1, batch_ns / 1e3 / samples);
+    report_double("speedup", 1, (double)injected[median] * per_iteration /
+                                ((double)batch_ns / config->iterations));
+    report_int("failures", failures);
+    report_end();
+    free(injected);
+    free(called);
+    free(calls);
+
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* What the watcher has done with the target we're waiting for */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pid_t target;
+    bool finished;
+    int err;
+    uint64_t finished_ns;
+} rd_watch_waiter_t;
+
+static void watcher_handler(pid_t target, size_t rule, int err, void *context)
+{
+    (void)rule;
+    rd_watch_waiter_t *waiter = context;
+    pthread_mutex_lock(&waiter->lock);
+    if (target == waiter->target) {
+        waiter->finished = true;
+        waiter->err = err;
+        waiter->finished_ns = now_ns();
+        pthread_cond_signal(&waiter->done);
+    }
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+/**
+ * Launches `count` short-lived processes as fast as it can from a child of ours (so that
+ * we never wait for them), every tenth of them matching the watcher's cmdline rule.
+ */
+static pid_t spawn_storm(int count)
+{
+    pid_t spawner = fork();
+    if (spawner != 0) {
+        return spawner;
+    }
+    int in_flight = 0;
+    for (int i = 0; i < count; i++) {
+        pid_t child = fork();
+        if (child == 0) {
+            execl("/bin/true", "true", (i % 10 == 0) ? "rd_watch_match" : "", (char *)NULL);
+            _exit(EXIT_FAILURE);
+        }
+        if (child > 0 && ++in_flight >= 16) {
+            in_flight -= (wait(NULL) > 0);
+        }
+    }
+    while (wait(NULL) > 0);
+    _exit(EXIT_SUCCESS);
+}
+
+static uint64_t process_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int bench_watch(const rd_bench_config_t *config)
+{
+    char target_path[PATH_MAX];
+    if (!realpath(config->target, target_path)) {
+        return EXIT_FAILURE;
+    }
+    const char *payload_name = strrchr(config->payload, '/') ? strrchr(config->payload, '/') + 1
+                                                             : config->payload;
+    rd_watch_rule_t rules[] = {
+        {RD_WATCH_EXECUTABLE, target_path, config->payload},
+        {RD_WATCH_CMDLINE, "true rd_watch_match", config->payload}
+    };
+    int storm_size = 1000 * config->iterations;
+    uint64_t *latencies = calloc((size_t)config->iterations, sizeof(uint64_t));
+    if (!latencies) return EXIT_FAILURE;
+    int status = EXIT_SUCCESS;
+
+    /* The proc connector first, then /proc scans */
+    for (int scan_only = 0; scan_only <= 1; scan_only++) {
+        rd_watch_waiter_t waiter = {
+            .lock = PTHREAD_MUTEX_INITIALIZER, .done = PTHREAD_COND_INITIALIZER, .target = -1
+        };
+        rd_watcher_t *watcher = NULL;
+        if (rd_watcher_start(rules, 2, scan_only, watcher_handler, &waiter, &watcher) != KERN_SUCCESS) {
+            fprintf(stderr, "watch: could not start a watcher\n");
+            return EXIT_FAILURE;
+        }
+        int failures = 0;
+        /* From fork() to the payload's being loaded */
+        for (int iteration = 0; iteration < config->iterations; iteration++) {
+            pthread_mutex_lock(&waiter.lock);
+            waiter.finished = false;
+            uint64_t start = now_ns();
+            pid_t target = waiter.target = fork();
+            if (target == 0) {
+                execl(config->target, config->target, (char *)NULL);
+                _exit(EXIT_FAILURE);
+            }
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 5;
+            while (!waiter.finished &&
+                   pthread_cond_timedwait(&waiter.done, &waiter.lock, &deadline) == 0);
+            bool injected = (waiter.finished && waiter.err == KERN_SUCCESS);
+            latencies[iteration] = waiter.finished_ns - start;
+            pthread_mutex_unlock(&waiter.lock);
+            char *maps = injected ? read_proc_file(target, "maps") : NULL;
+            /* Loaded, and the target has gone on as if nothing happened */
+            failures += !(maps && strstr(maps, payload_name) && wait_for_target_to_settle(target));
+            free(maps);
+            if (!injected) latencies[iteration] = 0;
+            terminate_target(target);
+        }
+        qsort(latencies, (size_t)config->iterations, sizeof(uint64_t), compare_u64);
+
+        /* Short-lived processes, thousands of them */
+        rd_watcher_stats_t before, after;
+        rd_watcher_statistics(watcher, &before);
+        uint64_t cpu_start = process_cpu_ns(), start = now_ns();
+        pid_t spawner = spawn_storm(storm_size);
+        waitpid(spawner, NULL, 0);
+        uint64_t storm_ns = now_ns() - start;
+        /* Let the last injections finish */
+        for (int attempt = 0; attempt < 5000; attempt++) {
+            rd_watcher_statistics(watcher, &after);
+            if (after.matched == after.injected + after.failed) break;
+            usleep(1000);
+        }
+        uint64_t cpu_ns = process_cpu_ns() - cpu_start;
+        rd_watcher_statistics(watcher, &after);
+        rd_watcher_stop(watcher);
+        uint64_t events = after.events - before.events;
+        uint64_t matched = after.matched - before.matched;
+        /* The proc connector must see every exec; a scan can't. Whether a `true` lives
+         * long enough to be matched and injected is up to the scheduler, so that's reported only */
+        if (after.netlink) failures += (events < (uint64_t)storm_size);
+
+        report_begin("watch");
+        report_int("netlink", after.netlink);
+        report_int("iterations", config->iterations);
+        report_double("exec_to_loaded_p50_us", 1, latencies[config->iterations / 2] / 1e3);
+        report_double("exec_to_loaded_max_us", 1, latencies[config->iterations - 1] / 1e3);
+        report_int("held", (long long)before.held);
+        report_int("spawned", storm_size);
+        report_double("spawns_per_sec", 0, storm_size / (storm_ns / 1e9));
+        report_int("seen", (long long)events);
+        report_int("matched", (long long)matched);
+        report_int("injected", (long long)(after.injected - before.injected));
+        report_int("overruns", (long long)after.overruns);
+        report_double("cpu_us_per_spawn", 2, cpu_ns / 1e3 / storm_size);
+        report_int("failures", failures);
+        report_end();
+        if (failures) status = EXIT_FAILURE;
+    }
+    free(latencies);
+
+    return status;
+}
+
+static const rd_benchmark_t benchmarks[] = {
+    {"latency", "single, batched and concurrent injection latency and stop time", bench_latency},
+    {"batch", "N single injections vs. one batched injection", bench_batch},
+    {"fanout", "T sequential injections vs. a concurrent fan-out", bench_fanout},
+    {"async", "T sequential injections vs. T asynchronous ones from a single thread", bench_async},
+    {"daemon", "C concurrent clients of the injector daemon, and a fan-out request", bench_daemon},
+    {"protocol", "text round trips vs. pipelined and batched binary requests to the daemon", bench_protocol},
+    {"coalesce", "D identical requests per target coalesced by the daemon vs. an injection each, and cached repeats", bench_coalesce},
+    {"client", "a single client connection vs. a pool with a blocking or rejecting window", bench_client},
+    {"coldstart", "the daemon's first request cold, warm and prelaunched; fixed vs. adaptive idle exit", bench_coldstart},
+    {"resolve", "cold vs. warm remote symbol lookups", bench_resolve},
+    {"stage", "copying a payload into a container vs. staging it", bench_stage},
+    {"phases", "per-phase injection latencies and the cost of measuring them", bench_phases},
+    {"log", "ns per record of the ring logger vs. a synchronous write() and syslog(), decoded back", bench_log},
+    {"swap", "hot-swap pause time for payloads of different sizes", bench_swap},
+    {"preflight", "rejecting bad payloads before touching the target, cold vs. warm", bench_preflight},
+    {"prefetch", "cold (with and without prefetching) vs. warm remote dlopen() of a payload and its dependency", bench_prefetch},
+    {"memfd", "injecting an in-memory payload through a file vs. a sealed memfd", bench_memfd},
+    {"agent", "full injections vs. loads and calls through the resident agent", bench_agent},
+    {"call", "configuring a payload by injecting libraries vs. single and batched remote calls", bench_call},
+    {"watch", "injecting new processes as they exec: latency and a spawn storm, proc connector vs. /proc scans", bench_watch},
+    {"spawn", "launching a target and injecting into it vs. launching it preloaded", bench_spawn},
+    {"handles", "recording and looking up remote handles, and sweeping the ones of exited targets", bench_handles},
+    {"stress", "100k injections into one target must not leak anything", bench_stress},
+};
+
+#pragma mark - main
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s <payload.so> <target> [-i iterations] [-n libraries] [-t targets] "
+            "[-c concurrency] [-C clients] [-d injector] [-a activator] [-g agent] [-l decoder] [-j] "
+            "[benchmark ...]\n", name);
+    fprintf(stderr, "benchmarks:\n");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        fprintf(stderr, "  %-10s %s\n", benchmarks[i].name, benchmarks[i].description);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    char workdir[] = "/tmp/rd_inject_bench.XXXXXX";
+    if (!mkdtemp(workdir)) {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    rd_bench_config_t config = {
+        .payload = argv[1],
+        .target = argv[2],
+        .workdir = workdir,
+        .iterations = kRDBenchDefaultIterations,
+        .libraries = kRDBenchDefaultLibraries,
+        .targets = kRDBenchDefaultTargets,
+        .concurrency = 0,
+        .clients = kRDBenchDefaultClients
+    };
+
+    int opt;
+    optind = 3;
+    while ((opt = getopt(argc, argv, "i:n:t:c:C:d:a:g:l:j")) != -1) {
+        switch (opt) {
+            case 'i': config.iterations = atoi(optarg); break;
+            case 'n': config.libraries = atoi(optarg); break;
+            case 't': config.targets = atoi(optarg); break;
+            case 'c': config.concurrency = (unsigned int)atoi(optarg); break;
+            case 'C': config.clients = atoi(optarg); break;
+            case 'd': config.daemon = optarg; break;
+            case 'a': config.activator = optarg; break;
+            case 'g': config.agent = optarg; break;
+            case 'l': config.decoder = optarg; break;
+            case 'j': report_as_json = true; break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (config.iterations <= 0 || config.libraries <= 0 || config.targets <= 0 ||
+        config.clients <= 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(*benchmarks); i++) {
+        bool selected = (optind == argc);
+        for (int arg = optind; arg < argc; arg++) {
+            selected |= (strcmp(argv[arg], benchmarks[i].name) == 0);
+        }
+        if (selected && benchmarks[i].run(&config) != EXIT_SUCCESS) {
+            status = EXIT_FAILURE;
+        }
+    }
+    rmdir(workdir);
+
+    return status;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Builds and runs the injection benchmarks for the Linux backend.
+# Usage: ./run_benchmarks.sh [rd_inject_bench options] [benchmark ...]
+# Pass -j to get one JSON object per benchmark instead of plain text.
+# Note that injecting requires ptrace() permissions (run as root or relax ptrace_scope).
+set -e
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+INJECTOR="$HERE/../../injector"
+LIBRARY="$INJECTOR/rd_inject_library"
+FRAMEWORK="$HERE/../../RDInjectionWizard"
+LIBRARY_SOURCES="$LIBRARY/rd_inject_library_linux.c $LIBRARY/rd_inject_fanout.c \
+    $LIBRARY/rd_remote_symbols.c $LIBRARY/rd_inject_stats.c $LIBRARY/rd_inject_stub.c \
+    $LIBRARY/rd_inject_async.c $LIBRARY/rd_inject_swap.c $LIBRARY/rd_remote_handles.c \
+    $LIBRARY/rd_inject_preflight.c $LIBRARY/rd_remote_arena.c $LIBRARY/rd_inject_spawn.c \
+    $LIBRARY/rd_inject_payload.c $LIBRARY/rd_agent.c $LIBRARY/rd_remote_call.c \
+    $LIBRARY/rd_watcher.c $LIBRARY/rd_inject_log.c"
+BUILD="${BUILD_DIR:-$HERE/build}"
+CC="${CC:-cc}"
+CFLAGS="${CFLAGS:--O2 -Wall -Wno-unknown-pragmas}"
+
+mkdir -p "$BUILD"
+echo "Building benchmarks in $BUILD..."
+$CC $CFLAGS -o "$BUILD/demo_target" "$HERE/demo_target.c"
+$CC $CFLAGS -shared -fPIC -o "$BUILD/libtestnoop.so" "$HERE/libtestnoop.c"
+# Swappable payloads of different sizes for the swap benchmark
+for SIZE in 0 1 16 64; do
+    head -c $((SIZE * 1024 * 1024)) /dev/urandom > "$BUILD/libtestswap.$SIZE.blob"
+    $CC $CFLAGS -shared -fPIC -DRD_SWAP_BLOB="\"$BUILD/libtestswap.$SIZE.blob\"" \
+        -o "$BUILD/libtestswap_${SIZE}M.so" "$HERE/libtestswap.c"
+    rm -f "$BUILD/libtestswap.$SIZE.blob"
+done
+# A payload whose dependency is gone, for the preflight benchmark
+$CC $CFLAGS -shared -fPIC -o "$BUILD/libtestgone.so" "$HERE/libtestnoop.c"
+$CC $CFLAGS -shared -fPIC -o "$BUILD/libtestneedy.so" "$HERE/libtestnoop.c" \
+    -L"$BUILD" -Wl,--no-as-needed -ltestgone
+rm -f "$BUILD/libtestgone.so"
+# A payload with a (1MB) dependency of its own next to it, for the prefetch benchmark
+head -c $((1024 * 1024)) /dev/urandom > "$BUILD/libtestleaf.blob"
+$CC $CFLAGS -shared -fPIC -DRD_SWAP_BLOB="\"$BUILD/libtestleaf.blob\"" \
+    -o "$BUILD/libtestleaf.so" "$HERE/libtestswap.c"
+rm -f "$BUILD/libtestleaf.blob"
+$CC $CFLAGS -shared -fPIC -o "$BUILD/libtestroot.so" "$HERE/libtestnoop.c" \
+    -L"$BUILD" -Wl,--no-as-needed -ltestleaf -Wl,-rpath,'$ORIGIN'
+$CC $CFLAGS -I"$LIBRARY" -I"$FRAMEWORK" -I"$INJECTOR" -o "$BUILD/rd_inject_bench" "$HERE/rd_inject_bench.c" \
+    $LIBRARY_SOURCES "$FRAMEWORK/rd_payload_cache.c" "$FRAMEWORK/rd_injector_client.c" \
+    "$INJECTOR/rd_injector_protocol.c" -ldl -lpthread
+$CC $CFLAGS -I"$LIBRARY" -o "$BUILD/injector" "$INJECTOR/main_linux.c" "$INJECTOR/rd_request_queue.c" \
+    "$INJECTOR/rd_injector_protocol.c" "$INJECTOR/rd_idle_policy.c" "$INJECTOR/rd_request_coalescer.c" \
+    $LIBRARY_SOURCES -ldl -lpthread -lm
+$CC $CFLAGS -o "$BUILD/activator" "$INJECTOR/activator_linux.c"
+$CC $CFLAGS -I"$LIBRARY" -o "$BUILD/rd_log_decode" "$INJECTOR/rd_log_decode.c" \
+    "$LIBRARY/rd_inject_log.c" "$LIBRARY/rd_inject_stats.c" -lpthread
+$CC $CFLAGS -I"$INJECTOR" -shared -fPIC -Wl,-z,nodelete -o "$BUILD/librd_agent.so" \
+    "$INJECTOR/rd_agent_linux.c" -ldl -lpthread
+
+"$BUILD/rd_inject_bench" "$BUILD/libtestnoop.so" "$BUILD/demo_target" -d "$BUILD/injector" \
+    -a "$BUILD/activator" -g "$BUILD/librd_agent.so" -l "$BUILD/rd_log_decode" "$@"
@@ -0,0 +1,171 @@
+//
+//  activator_linux.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A Linux stand-in for launchd launching the injector daemon on demand: the activator
+//  owns the daemon's listening socket, so clients can connect at any time, and launches
+//  the daemon whenever a connection comes in while there's no daemon running. The socket
+//  is handed over the systemd way (as descriptor 3, with LISTEN_PID and LISTEN_FDS) along
+//  with RD_ACTIVATED_AT_NS, the moment the activator has noticed the connection, so the
+//  daemon can tell how long its cold start has taken.
+//
+//  Usage: activator [-p] <socket path> <daemon> [daemon options ...]
+//
+//  With -p the daemon is prelaunched right away instead of waiting for the first client.
+//
+#if defined(__linux__)
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+
+/* The first descriptor passed to an activated daemon */
+#define kActivatedListenerFd (3)
+/* A daemon that fails sooner than this is not launched again right away */
+#define kRelaunchBackoffSec (1)
+
+static volatile sig_atomic_t is_terminating = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static int create_listener(const char *socket_path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+/**
+ * Launches the daemon with the listener as its descriptor 3.
+ *
+ * @return the daemon's pid or (-1)
+ */
+static pid_t launch_daemon(int listener, char *daemon_argv[])
+{
+    char activated_at[32];
+    snprintf(activated_at, sizeof(activated_at), "%llu", (unsigned long long)now_ns());
+    pid_t daemon = fork();
+    if (daemon != 0) {
+        return daemon;
+    }
+    if (listener == kActivatedListenerFd) {
+        /* dup2() is a no-op then, so it'd keep its close-on-exec flag */
+        int flags = fcntl(listener, F_GETFD);
+        fcntl(listener, F_SETFD, flags & ~FD_CLOEXEC);
+    } else if (dup2(listener, kActivatedListenerFd) < 0) {
+        _exit(EXIT_FAILURE);
+    }
+    char listen_pid[16];
+    snprintf(listen_pid, sizeof(listen_pid), "%d", getpid());
+    setenv("LISTEN_PID", listen_pid, 1);
+    setenv("LISTEN_FDS", "1", 1);
+    setenv("RD_ACTIVATED_AT_NS", activated_at, 1);
+    execv(daemon_argv[0], daemon_argv);
+    _exit(EXIT_FAILURE);
+}
+
+static void termination_handler(__attribute__((unused)) int signal)
+{
+    is_terminating = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    bool prelaunch = (argc > 1 && strcmp(argv[1], "-p") == 0);
+    int first_argument = prelaunch ? 2 : 1;
+    if (argc - first_argument < 2) {
+        fprintf(stderr, "usage: %s [-p] <socket path> <daemon> [daemon options ...]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    const char *socket_path = argv[first_argument];
+    /* The daemon gets its options followed by the socket path (which it only uses for logs) */
+    int daemon_argc = argc - first_argument;
+    char **daemon_argv = calloc((size_t)daemon_argc + 1, sizeof(*daemon_argv));
+    if (!daemon_argv) {
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < daemon_argc - 1; i++) {
+        daemon_argv[i] = argv[first_argument + 1 + i];
+    }
+    daemon_argv[daemon_argc - 1] = (char *)socket_path;
+
+    int listener = create_listener(socket_path);
+    if (listener < 0) {
+        syslog(LOG_NOTICE, "Failed to listen on %s: %s", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction termination = {.sa_handler = termination_handler};
+    sigaction(SIGTERM, &termination, NULL);
+    sigaction(SIGINT, &termination, NULL);
+
+    uint64_t launched_at = now_ns();
+    pid_t daemon = prelaunch ? launch_daemon(listener, daemon_argv) : -1;
+    while (!is_terminating) {
+        if (daemon > 0) {
+            int status = 0;
+            if (waitpid(daemon, &status, 0) < 0) {
+                continue;
+            }
+            daemon = -1;
+            bool failed = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+            if (failed && now_ns() - launched_at < kRelaunchBackoffSec * 1000000000ULL) {
+                syslog(LOG_NOTICE, "The daemon has failed right away, backing off");
+                sleep(kRelaunchBackoffSec);
+            }
+            continue;
+        }
+        /* Nobody is listening now: wait for a client and launch the daemon for it */
+        struct pollfd pending = {.fd = listener, .events = POLLIN};
+        if (poll(&pending, 1, -1) > 0 && (pending.revents & POLLIN)) {
+            launched_at = now_ns();
+            daemon = launch_daemon(listener, daemon_argv);
+            if (daemon < 0) {
+                syslog(LOG_NOTICE, "Failed to launch %s: %s", daemon_argv[0], strerror(errno));
+                sleep(kRelaunchBackoffSec);
+            }
+        }
+    }
+
+    if (daemon > 0) {
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+    }
+    unlink(socket_path);
+    free(daemon_argv);
+    return EXIT_SUCCESS;
+}
+
+#endif // defined(__linux__)
@@ -6,46 +6,645 @@
 //  Copyright (c) 2014 rodionovd. All rights reserved.
 //
 
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/sysctl.h>
 #include <xpc/xpc.h>
 #include "rd_inject_library.h"
+#include "rd_request_queue.h"
+#include "rd_remote_arena.h"
+#include "rd_injector_protocol.h"
+#include "rd_idle_policy.h"
+#include "rd_request_coalescer.h"
+#include "rd_inject_log.h"
 
 #define kIdleExitTimeoutSec (10)
-#define kDefaultIdleTime (dispatch_time(DISPATCH_TIME_NOW, kIdleExitTimeoutSec * NSEC_PER_SEC))
+#define kMaxIdleExitTimeoutSec (300)
 #define kDeamonIdentifer "me.rodionovd.RDInjectionWizard.injector"
+#define kDeamonStatePath "/var/db/me.rodionovd.RDInjectionWizard.injector.state"
 
 static dispatch_source_t idle_exit_timer = NULL;
+static rd_request_queue_t *request_queue = NULL;
+static rd_coalescer_t *coalescer = NULL;
+static rd_idle_policy_t idle_policy;
+/* Startup metrics, CLOCK_REALTIME nanoseconds */
+static uint64_t launched_at = 0;
+static uint64_t listening_at = 0;
+static _Atomic uint64_t first_injection_at = 0;
+static bool is_warm_start = false;
 
-static bool main_routine(xpc_object_t dictionary)
+/* A request waiting for (or being processed by) one of the request queue workers */
+typedef struct {
+    xpc_connection_t remote;
+    xpc_object_t event;
+    /* The injection it runs for itself and everyone identical */
+    rd_coalesced_injection_t *injection;
+} rd_xpc_request_t;
+
+/* A "frame" of binary requests (see rd_injector_protocol.h): it's answered with
+ * a results frame once its last request is done */
+typedef struct {
+    xpc_connection_t remote;
+    xpc_object_t event;
+    atomic_size_t remaining;
+    size_t count;
+    rd_injector_result_t results[];
+} rd_xpc_batch_t;
+
+/* A single request of a batch; its payload path points into the batch's frame */
+typedef struct {
+    rd_xpc_batch_t *batch;
+    size_t index;
+    const char *payload_path;
+    rd_coalesced_injection_t *injection;
+} rd_xpc_batch_request_t;
+
+/* A fan-out request: every target goes through its own lane of the request queue, like
+ * a single request for it would, and the fan-out is answered once its last target is done */
+typedef struct {
+    xpc_connection_t remote;
+    xpc_object_t event;
+    atomic_size_t remaining;
+    size_t count;
+    unsigned int concurrency;
+    /* An index of the next target to submit */
+    atomic_size_t next;
+    /* Slots freed by finished targets that are yet to be filled with the next ones */
+    atomic_size_t free_slots;
+    uint64_t started_at;
+    int *results;
+    /* Per-target injection latency in nanoseconds */
+    uint64_t *latencies;
+} rd_xpc_fanout_t;
+
+/* A single target of a fan-out; its payload path points into the fan-out's event */
+typedef struct {
+    rd_xpc_fanout_t *fanout;
+    size_t index;
+    pid_t target;
+    const char *payload_path;
+    rd_coalesced_injection_t *injection;
+} rd_xpc_fanout_request_t;
+
+/**
+ * Remembers when the first injection of this launch has succeeded.
+ */
+static void note_injection(int err)
+{
+    uint64_t not_yet = 0;
+    if (err == KERN_SUCCESS) {
+        atomic_compare_exchange_strong(&first_injection_at, &not_yet, rd_idle_policy_now());
+    }
+}
+
+/**
+ * Puts the phases' timings of an injection into the reply as a "timings" dictionary
+ * of phase name -> nanoseconds. Phases the injection didn't go through are omitted.
+ */
+static void set_timings(xpc_object_t reply, const rd_inject_timings_t *timings)
+{
+    xpc_object_t timings_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        if (timings->phase_ns[phase] > 0) {
+            xpc_dictionary_set_uint64(timings_dictionary, rd_inject_phase_name(phase),
+                                      timings->phase_ns[phase]);
+        }
+    }
+    xpc_dictionary_set_value(reply, "timings", timings_dictionary);
+    xpc_release(timings_dictionary);
+}
+
+/**
+ * Handles a stats request: puts a "histograms" dictionary of phase name ->
+ * {"count", "mean", "p50", "p90", "p99", "max"} (nanoseconds) into the reply,
+ * a "live_bytes" dictionary of pid -> bytes of remote memory the target still holds,
+ * a "startup" dictionary: "startup" and "first_injection" (nanoseconds since launchd
+ * has launched us), "warm" (whether we've started with a saved idle history),
+ * "idle_timeout" (nanoseconds) and "rate" (recent requests per second), and
+ * a "coalescer" dictionary: "joined" and "cached" (requests answered by an identical
+ * injection in flight and by one that has succeeded before).
+ */
+static void stats_routine(xpc_object_t reply)
+{
+    rd_inject_histogram_t histograms[RD_PHASE_COUNT];
+    rd_inject_stats_snapshot(histograms);
+
+    xpc_object_t histograms_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        const rd_inject_histogram_t *histogram = &histograms[phase];
+        if (histogram->count == 0) continue;
+        xpc_object_t phase_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+        xpc_dictionary_set_uint64(phase_dictionary, "count", histogram->count);
+        xpc_dictionary_set_uint64(phase_dictionary, "mean", histogram->total_ns / histogram->count);
+        xpc_dictionary_set_uint64(phase_dictionary, "p50",
+                                  rd_inject_histogram_percentile(histogram, 50));
+        xpc_dictionary_set_uint64(phase_dictionary, "p90",
+                                  rd_inject_histogram_percentile(histogram, 90));
+        xpc_dictionary_set_uint64(phase_dictionary, "p99",
+                                  rd_inject_histogram_percentile(histogram, 99));
+        xpc_dictionary_set_uint64(phase_dictionary, "max", histogram->max_ns);
+        xpc_dictionary_set_value(histograms_dictionary, rd_inject_phase_name(phase),
+                                 phase_dictionary);
+        xpc_release(phase_dictionary);
+    }
+    xpc_dictionary_set_value(reply, "histograms", histograms_dictionary);
+    xpc_release(histograms_dictionary);
+
+    rd_remote_arena_usage_t usage[64];
+    size_t count = rd_remote_arena_usage(usage, sizeof(usage) / sizeof(*usage));
+    xpc_object_t live_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    for (size_t i = 0; i < count && i < sizeof(usage) / sizeof(*usage); i++) {
+        char target[16];
+        snprintf(target, sizeof(target), "%d", usage[i].target);
+        xpc_dictionary_set_uint64(live_dictionary, target, usage[i].live_bytes);
+    }
+    xpc_dictionary_set_value(reply, "live_bytes", live_dictionary);
+    xpc_release(live_dictionary);
+
+    uint64_t now = rd_idle_policy_now();
+    uint64_t first_injection = atomic_load(&first_injection_at);
+    xpc_object_t startup_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(startup_dictionary, "startup", listening_at - launched_at);
+    xpc_dictionary_set_uint64(startup_dictionary, "first_injection",
+                              first_injection ? first_injection - launched_at : 0);
+    xpc_dictionary_set_bool(startup_dictionary, "warm", is_warm_start);
+    xpc_dictionary_set_uint64(startup_dictionary, "idle_timeout",
+                              rd_idle_policy_timeout(&idle_policy, now));
+    xpc_dictionary_set_double(startup_dictionary, "rate",
+                              rd_idle_policy_request_rate(&idle_policy, now));
+    xpc_dictionary_set_value(reply, "startup", startup_dictionary);
+    xpc_release(startup_dictionary);
+
+    rd_coalescer_stats_t coalescer_stats;
+    rd_coalescer_statistics(coalescer, &coalescer_stats);
+    xpc_object_t coalescer_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(coalescer_dictionary, "joined", coalescer_stats.joined);
+    xpc_dictionary_set_uint64(coalescer_dictionary, "cached", coalescer_stats.cached);
+    xpc_dictionary_set_value(reply, "coalescer", coalescer_dictionary);
+    xpc_release(coalescer_dictionary);
+}
+
+static bool is_fanout_request(xpc_object_t dictionary)
+{
+    xpc_object_t targets = xpc_dictionary_get_value(dictionary, "targets");
+    return (targets && xpc_get_type(targets) == XPC_TYPE_ARRAY);
+}
+
+static int main_routine(pid_t target, const char *payload_path, rd_inject_timings_t *timings)
 {
-    pid_t target = (pid_t)xpc_dictionary_get_int64(dictionary, "target");
     if (target <= 0) {
-        return false;
+        return KERN_INVALID_ARGUMENT;
     }
-    const char *payload_path = xpc_dictionary_get_string(dictionary, "payload");
-    syslog(LOG_NOTICE, "Inject (%d) <- [%s] ", target, payload_path);
+    RDLogRequest(target, payload_path);
     if (!payload_path) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    int err = rd_inject_libraries_with_timings(target, &payload_path, 1, NULL, timings);
+    note_injection(err);
+    return err;
+}
+
+/**
+ * Answers a single-target request with its own result or the one of an identical injection.
+ */
+static void answer_request(const rd_coalesced_result_t *result, void *context)
+{
+    rd_xpc_request_t *request = context;
+    xpc_object_t reply = xpc_dictionary_create_reply(request->event);
+    set_timings(reply, &result->timings);
+    xpc_dictionary_set_bool(reply, "status", result->err == KERN_SUCCESS);
+    xpc_connection_send_message(request->remote, reply);
+    xpc_release(reply);
+
+    xpc_release(request->event);
+    xpc_release(request->remote);
+    free(request);
+}
+
+/**
+ * Runs a single-target request on one of the request queue workers.
+ */
+static void process_request(void *context)
+{
+    rd_xpc_request_t *request = context;
+    rd_inject_timings_t timings = {{0}};
+    int err = main_routine((pid_t)xpc_dictionary_get_int64(request->event, "target"),
+                           xpc_dictionary_get_string(request->event, "payload"), &timings);
+    /* Answers this request too */
+    rd_coalescer_complete(coalescer, request->injection, err, &timings);
+}
+
+/**
+ * Lets go of a batch request; the last one replies with the results frame.
+ */
+static void batch_release(rd_xpc_batch_t *batch)
+{
+    if (atomic_fetch_sub(&batch->remaining, 1) != 1) {
+        return;
+    }
+    xpc_object_t reply = xpc_dictionary_create_reply(batch->event);
+    size_t length = rd_injector_results_frame_length(batch->count);
+    void *frame = malloc(length);
+    bool success = (frame &&
+                    rd_injector_encode_results(batch->results, batch->count, frame, length) == length);
+    if (success) {
+        xpc_dictionary_set_data(reply, "frame", frame, length);
+    }
+    xpc_dictionary_set_bool(reply, "status", success);
+    xpc_connection_send_message(batch->remote, reply);
+    xpc_release(reply);
+    free(frame);
+
+    xpc_release(batch->event);
+    xpc_release(batch->remote);
+    free(batch);
+}
+
+/**
+ * Answers a single request of a batch with its own result or the one of an identical injection.
+ */
+static void answer_batch_request(const rd_coalesced_result_t *coalesced, void *context)
+{
+    rd_xpc_batch_request_t *request = context;
+    rd_injector_result_t *result = &request->batch->results[request->index];
+    result->error = coalesced->err;
+    result->error_class = rd_injector_error_class(coalesced->err);
+    result->timings = coalesced->timings;
+    result->handle = coalesced->handle;
+    batch_release(request->batch);
+    free(request);
+}
+
+/**
+ * Runs a single request of a batch on one of the request queue workers.
+ */
+static void process_batch_request(void *context)
+{
+    rd_xpc_batch_request_t *request = context;
+    rd_inject_timings_t timings = {{0}};
+    int err = main_routine(request->batch->results[request->index].target, request->payload_path,
+                           &timings);
+    /* Answers this request too */
+    rd_coalescer_complete(coalescer, request->injection, err, &timings);
+}
+
+/**
+ * Lets go of a fan-out target; the last one replies with per-target "results" and
+ * aggregate "stats" (see rd_fanout_stats_t).
+ */
+static void fanout_release(rd_xpc_fanout_t *fanout)
+{
+    if (atomic_fetch_sub(&fanout->remaining, 1) != 1) {
+        return;
+    }
+    uint64_t elapsed = rd_idle_policy_now() - fanout->started_at;
+    rd_fanout_stats_t stats;
+    bool success = (KERN_SUCCESS == rd_fanout_stats_compute(fanout->results, fanout->latencies,
+                                                            fanout->count, elapsed,
+                                                            fanout->concurrency, &stats));
+    xpc_object_t reply = xpc_dictionary_create_reply(fanout->event);
+    xpc_object_t results_array = xpc_array_create(NULL, 0);
+    for (size_t i = 0; i < fanout->count; i++) {
+        xpc_array_set_int64(results_array, XPC_ARRAY_APPEND, fanout->results[i]);
+    }
+    xpc_dictionary_set_value(reply, "results", results_array);
+    xpc_release(results_array);
+
+    xpc_object_t stats_dictionary = xpc_dictionary_create(NULL, NULL, 0);
+    xpc_dictionary_set_uint64(stats_dictionary, "succeeded", stats.succeeded);
+    xpc_dictionary_set_uint64(stats_dictionary, "failed", stats.failed);
+    xpc_dictionary_set_uint64(stats_dictionary, "concurrency", stats.concurrency);
+    xpc_dictionary_set_double(stats_dictionary, "elapsed", stats.elapsed_sec);
+    xpc_dictionary_set_double(stats_dictionary, "throughput", stats.throughput);
+    xpc_dictionary_set_double(stats_dictionary, "mean_latency", stats.mean_latency_sec);
+    xpc_dictionary_set_double(stats_dictionary, "max_latency", stats.max_latency_sec);
+    xpc_dictionary_set_value(reply, "stats", stats_dictionary);
+    xpc_release(stats_dictionary);
+
+    xpc_dictionary_set_bool(reply, "status", success);
+    xpc_connection_send_message(fanout->remote, reply);
+    xpc_release(reply);
+
+    xpc_release(fanout->event);
+    xpc_release(fanout->remote);
+    free(fanout->results);
+    free(fanout->latencies);
+    free(fanout);
+}
+
+static void fanout_fill_slot(rd_xpc_fanout_t *fanout);
+
+/**
+ * Answers a single target of a fan-out with its own result or the one of an identical
+ * injection, and hands its slot over to the next target.
+ */
+static void answer_fanout_request(const rd_coalesced_result_t *coalesced, void *context)
+{
+    rd_xpc_fanout_request_t *request = context;
+    rd_xpc_fanout_t *fanout = request->fanout;
+    fanout->results[request->index] = coalesced->err;
+    fanout->latencies[request->index] = coalesced->timings.phase_ns[RD_PHASE_TOTAL];
+    free(request);
+    /* This target still holds the fan-out, so it outlives the slot filling */
+    fanout_fill_slot(fanout);
+    fanout_release(fanout);
+}
+
+/**
+ * Runs a single target of a fan-out on one of the request queue workers.
+ */
+static void process_fanout_request(void *context)
+{
+    rd_xpc_fanout_request_t *request = context;
+    rd_inject_timings_t timings = {{0}};
+    int err = main_routine(request->target, request->payload_path, &timings);
+    /* Answers this request too */
+    rd_coalescer_complete(coalescer, request->injection, err, &timings);
+}
+
+/**
+ * Submits the next target of a fan-out that doesn't fail right away.
+ */
+static void fanout_submit_next(rd_xpc_fanout_t *fanout)
+{
+    xpc_object_t targets = xpc_dictionary_get_value(fanout->event, "targets");
+    const char *payload_path = xpc_dictionary_get_string(fanout->event, "payload");
+    size_t i = 0;
+    while ((i = atomic_fetch_add(&fanout->next, 1)) < fanout->count) {
+        pid_t target = (pid_t)xpc_array_get_int64(targets, i);
+        rd_xpc_fanout_request_t *request = calloc(1, sizeof(*request));
+        if (!request) {
+            syslog(LOG_NOTICE, "Failed to queue a request for (%d)", target);
+            fanout->results[i] = KERN_FAILURE;
+            fanout_release(fanout);
+            continue;
+        }
+        *request = (rd_xpc_fanout_request_t){fanout, i, target, payload_path, NULL};
+        /* An identical injection may answer it instead */
+        if (rd_coalescer_join(coalescer, target, payload_path, answer_fanout_request, request,
+                              &request->injection) &&
+            !rd_request_queue_submit(request_queue, target, process_fanout_request, request)) {
+            syslog(LOG_NOTICE, "Failed to queue a request for (%d)", target);
+            rd_coalescer_complete(coalescer, request->injection, KERN_FAILURE, NULL);
+        }
+        return;
+    }
+}
+
+/**
+ * Fills a free slot of the fan-out with its next target.
+ *
+ * A target may be answered right away (e.g. by a cached injection), which frees its slot
+ * while we're still filling this one; whoever is filling slots at the moment fills that
+ * one too, so a fan-out of cached targets doesn't recurse all the way down.
+ */
+static void fanout_fill_slot(rd_xpc_fanout_t *fanout)
+{
+    if (atomic_fetch_add(&fanout->free_slots, 1) != 0) {
+        return;
+    }
+    do {
+        fanout_submit_next(fanout);
+    } while (atomic_fetch_sub(&fanout->free_slots, 1) != 1);
+}
+
+/**
+ * Submits every pid from the "targets" array of a fan-out request into the request queue
+ * on its own, so the fan-out is serialized with any other request for the same target.
+ * Up to "concurrency" targets (bounded by the request queue's workers) are in flight at once.
+ *
+ * @return false if the request is malformed
+ */
+static bool handle_fanout(xpc_connection_t remote, xpc_object_t event)
+{
+    const char *payload_path = xpc_dictionary_get_string(event, "payload");
+    xpc_object_t targets = xpc_dictionary_get_value(event, "targets");
+    size_t count = xpc_array_get_count(targets);
+    if (!payload_path || count == 0) {
+        return false;
+    }
+    rd_xpc_fanout_t *fanout = calloc(1, sizeof(*fanout));
+    if (fanout) {
+        fanout->results = calloc(count, sizeof(*fanout->results));
+        fanout->latencies = calloc(count, sizeof(*fanout->latencies));
+    }
+    if (!fanout || !fanout->results || !fanout->latencies) {
+        if (fanout) {
+            free(fanout->results);
+            free(fanout->latencies);
+        }
+        free(fanout);
         return false;
     }
-    return (KERN_SUCCESS == rd_inject_library(target, payload_path));
+    syslog(LOG_NOTICE, "Inject (%zu targets) <- [%s] ", count, payload_path);
+    unsigned int workers = rd_request_queue_workers(request_queue);
+    unsigned int concurrency = (unsigned int)xpc_dictionary_get_uint64(event, "concurrency");
+    if (concurrency == 0 || concurrency > workers) {
+        concurrency = workers;
+    }
+    if (concurrency > count) {
+        concurrency = (unsigned int)count;
+    }
+    fanout->remote = xpc_retain(remote);
+    fanout->event = xpc_retain(event);
+    fanout->count = count;
+    fanout->concurrency = concurrency;
+    fanout->started_at = rd_idle_policy_now();
+    /* We hold the fan-out too, so it's not answered before all of its slots are filled */
+    atomic_init(&fanout->remaining, count + 1);
+    for (unsigned int i = 0; i < concurrency; i++) {
+        fanout_fill_slot(fanout);
+    }
+    fanout_release(fanout);
+
+    return true;
+}
+
+/**
+ * Submits every request of a "frame" message into the request queue.
+ *
+ * @return false if the frame is malformed
+ */
+static bool handle_frame(xpc_connection_t remote, xpc_object_t event)
+{
+    size_t length = 0;
+    const void *frame = xpc_dictionary_get_data(event, "frame", &length);
+    rd_injector_request_t *requests = NULL;
+    size_t count = 0;
+    if (!frame || !rd_injector_decode_requests(frame, length, &requests, &count)) {
+        return false;
+    }
+    rd_xpc_batch_t *batch = calloc(1, sizeof(*batch) + count * sizeof(*batch->results));
+    if (!batch) {
+        free(requests);
+        return false;
+    }
+    batch->remote = xpc_retain(remote);
+    batch->event = xpc_retain(event);
+    batch->count = count;
+    /* We hold the batch too, so it's not answered before all of it is queued */
+    atomic_init(&batch->remaining, count + 1);
+    for (size_t i = 0; i < count; i++) {
+        batch->results[i].id = requests[i].id;
+        batch->results[i].target = requests[i].target;
+        rd_xpc_batch_request_t *request = calloc(1, sizeof(*request));
+        if (!request) {
+            syslog(LOG_NOTICE, "Failed to queue a request for (%d)", requests[i].target);
+            batch->results[i].error = KERN_FAILURE;
+            batch->results[i].error_class = RD_INJECTOR_ERROR_INTERNAL;
+            batch_release(batch);
+            continue;
+        }
+        *request = (rd_xpc_batch_request_t){batch, i, requests[i].payload_path, NULL};
+        /* An identical injection may answer it instead */
+        if (rd_coalescer_join(coalescer, requests[i].target, request->payload_path,
+                              answer_batch_request, request, &request->injection) &&
+            !rd_request_queue_submit(request_queue, requests[i].target, process_batch_request,
+                                     request)) {
+            syslog(LOG_NOTICE, "Failed to queue a request for (%d)", requests[i].target);
+            rd_coalescer_complete(coalescer, request->injection, KERN_FAILURE, NULL);
+        }
+    }
+    free(requests);
+    batch_release(batch);
+
+    return true;
+}
+
+/**
+ * Pauses the idle-exit timer while there're requests in flight, and restarts it
+ * with the idle policy's timeout once the last one has completed.
+ */
+static void request_queue_activity_handler(bool busy, __unused void *context)
+{
+    if (busy) {
+        dispatch_source_set_timer(idle_exit_timer, DISPATCH_TIME_FOREVER, 0, 0);
+    } else {
+        uint64_t now = rd_idle_policy_now();
+        rd_idle_policy_idle(&idle_policy, now);
+        uint64_t timeout = rd_idle_policy_timeout(&idle_policy, now);
+        dispatch_source_set_timer(idle_exit_timer, dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout),
+                                  0, 0);
+    }
+}
+
+/**
+ * Returns when launchd has launched us (CLOCK_REALTIME nanoseconds).
+ */
+static uint64_t launch_time(void)
+{
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    int name[] = {CTL_KERN, KERN_PROC, KERN_PROC_PID, getpid()};
+    if (sysctl(name, 4, &info, &size, NULL, 0) != 0 || size == 0) {
+        return rd_idle_policy_now();
+    }
+    struct timeval started = info.kp_proc.p_starttime;
+    return (uint64_t)started.tv_sec * NSEC_PER_SEC + (uint64_t)started.tv_usec * NSEC_PER_USEC;
+}
+
+static void load_warm_state(void)
+{
+    FILE *state = fopen(kDeamonStatePath, "rb");
+    if (!state) {
+        return;
+    }
+    is_warm_start = rd_idle_policy_load(&idle_policy, state);
+    fclose(state);
+}
+
+/**
+ * Saves the idle history for the next launch. There's nothing else worth saving on OS X:
+ * dlopen() and friends come from the shared cache, and staged payloads stay on disk anyway.
+ */
+static void save_warm_state(void)
+{
+    char temporary_path[PATH_MAX];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", kDeamonStatePath, getpid());
+    FILE *state = fopen(temporary_path, "wb");
+    if (!state) {
+        return;
+    }
+    bool saved = rd_idle_policy_save(&idle_policy, state, rd_idle_policy_now());
+    if (fclose(state) != 0 || !saved || rename(temporary_path, kDeamonStatePath) != 0) {
+        syslog(LOG_NOTICE, "Failed to save the warm state");
+        unlink(temporary_path);
+    }
+}
+
+static void idle_exit_handler(__unused void *context)
+{
+    /* The timer might have fired right before a new request was queued */
+    if (rd_request_queue_in_flight(request_queue) > 0) {
+        return;
+    }
+    save_warm_state();
+    rd_log_flush();
+    exit(EXIT_SUCCESS);
 }
 
 static void __XPC_Connection_Handler(xpc_connection_t connection)  {
 	xpc_connection_set_event_handler(connection, ^(xpc_object_t event) {
         if (xpc_get_type(event) != XPC_TYPE_ERROR) {
-
-            /* Pause an idle-exit timer */
-            dispatch_source_set_timer(idle_exit_timer, DISPATCH_TIME_FOREVER, 0, 0);
-            {
-                bool success = main_routine(event);
-                xpc_connection_t remote = xpc_dictionary_get_remote_connection(event);
+            /* A prelaunch request has already done its job by getting us launched */
+            if (xpc_dictionary_get_bool(event, "prelaunch")) {
+                xpc_object_t reply = xpc_dictionary_create_reply(event);
+                xpc_dictionary_set_bool(reply, "status", true);
+                xpc_connection_send_message(xpc_dictionary_get_remote_connection(event), reply);
+                xpc_release(reply);
+                return;
+            }
+            /* Stats requests are cheap, so they don't go through the request queue */
+            if (xpc_dictionary_get_bool(event, "stats")) {
                 xpc_object_t reply = xpc_dictionary_create_reply(event);
-                xpc_dictionary_set_bool(reply, "status", success);
-                xpc_connection_send_message(remote, reply);
+                stats_routine(reply);
+                xpc_dictionary_set_bool(reply, "status", true);
+                xpc_connection_send_message(xpc_dictionary_get_remote_connection(event), reply);
                 xpc_release(reply);
+                return;
+            }
+            rd_idle_policy_request(&idle_policy, rd_idle_policy_now());
+            /* Binary frames carry their own batches of requests */
+            if (xpc_dictionary_get_value(event, "frame")) {
+                xpc_connection_t remote = xpc_dictionary_get_remote_connection(event);
+                if (!handle_frame(remote, event)) {
+                    xpc_object_t reply = xpc_dictionary_create_reply(event);
+                    xpc_dictionary_set_bool(reply, "status", false);
+                    xpc_connection_send_message(remote, reply);
+                    xpc_release(reply);
+                }
+                return;
+            }
+            /* So do fan-out requests, a request per target */
+            if (is_fanout_request(event)) {
+                xpc_connection_t remote = xpc_dictionary_get_remote_connection(event);
+                if (!handle_fanout(remote, event)) {
+                    xpc_object_t reply = xpc_dictionary_create_reply(event);
+                    xpc_dictionary_set_bool(reply, "status", false);
+                    xpc_connection_send_message(remote, reply);
+                    xpc_release(reply);
+                }
+                return;
+            }
+            rd_xpc_request_t *request = calloc(1, sizeof(*request));
+            if (!request) {
+                return;
+            }
+            request->remote = xpc_retain(xpc_dictionary_get_remote_connection(event));
+            request->event = xpc_retain(event);
+            /* Requests for the same target are serialized, others run in parallel */
+            pid_t target = (pid_t)xpc_dictionary_get_int64(event, "target");
+            /* An identical injection may answer it instead */
+            if (rd_coalescer_join(coalescer, target, xpc_dictionary_get_string(event, "payload"),
+                                  answer_request, request, &request->injection) &&
+                !rd_request_queue_submit(request_queue, target, process_request, request)) {
+                syslog(LOG_NOTICE, "Failed to queue a request for (%d)", target);
+                rd_coalescer_complete(coalescer, request->injection, KERN_FAILURE, NULL);
             }
-            /* Reset the timer */
-            dispatch_source_set_timer(idle_exit_timer, kDefaultIdleTime, 0, 0);
         } else {
             // error handling?
         }
@@ -55,6 +654,11 @@ static void __XPC_Connection_Handler(xpc_connection_t connection)  {
 }
 
 int main(__unused int argc, __unused const char *argv[]) {
+    launched_at = launch_time();
+    rd_idle_policy_init(&idle_policy, kIdleExitTimeoutSec * NSEC_PER_SEC,
+                        kMaxIdleExitTimeoutSec * NSEC_PER_SEC, launched_at);
+    load_warm_state();
+
     xpc_connection_t service = xpc_connection_create_mach_service(kDeamonIdentifer,
                                                                   dispatch_get_main_queue(),
                                                                   XPC_CONNECTION_MACH_SERVICE_LISTENER);
@@ -76,11 +680,24 @@ int main(__unused int argc, __unused const char *argv[]) {
         exit(EXIT_FAILURE);
     }
     dispatch_set_context(idle_exit_timer, NULL);
-    dispatch_source_set_event_handler_f(idle_exit_timer, (void (*)(void *))exit);
-    dispatch_source_set_timer(idle_exit_timer, kDefaultIdleTime, 0, 0);
+    dispatch_source_set_event_handler_f(idle_exit_timer, idle_exit_handler);
+    dispatch_source_set_timer(idle_exit_timer,
+                              dispatch_time(DISPATCH_TIME_NOW,
+                                            (int64_t)rd_idle_policy_timeout(&idle_policy, launched_at)),
+                              0, 0);
     dispatch_resume(idle_exit_timer);
 
+    /* Identical requests share a single injection */
+    coalescer = rd_coalescer_create();
+    /* Requests are processed by a pool of workers, so a slow target won't block others */
+    request_queue = rd_request_queue_create(0, request_queue_activity_handler, NULL);
+    if (!coalescer || !request_queue) {
+        syslog(LOG_NOTICE, "Failed to create a request queue.");
+        exit(EXIT_FAILURE);
+    }
+
     xpc_connection_resume(service);
+    listening_at = rd_idle_policy_now();
     dispatch_main();
     xpc_release(service);
 
@@ -0,0 +1,848 @@
+//
+//  main_linux.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A Linux stand-in for the XPC injector daemon: the same request queue served
+//  over a Unix-domain socket. Every request is a line of "<pid> <payload path>",
+//  every reply is a line of "<pid> <status> [<phase>=<ns> ...]" (status is 1 on
+//  success, 0 otherwise), followed by the injection's phases timings. Replies
+//  for different targets may come in any order.
+//
+//  A "stats" line requests the daemon's latency histograms; the reply is a line of
+//  "stats [<phase>=<count>/<mean>/<p50>/<p90>/<p99>/<max> ...] [live=<pid>:<bytes> ...]
+//  startup=<ns> first_injection=<ns> warm=<0|1> idle_timeout=<ns> rate=<requests/sec>
+//  pid=<pid>" (nanoseconds), where "live" lists the targets still holding our remote
+//  memory, "startup" and "first_injection" are measured from the launch (or the
+//  activation) of the daemon and "warm" tells whether it has started with a warm state.
+//  It ends with "joined=<count> cached=<count>": the requests answered by an identical
+//  injection in flight and by one that has succeeded before (see rd_request_coalescer.h).
+//
+//  A "fanout <pid>,<pid>,... <payload path>" line injects the payload into every listed
+//  target concurrently; the reply is a single line of "fanout <succeeded>/<count>
+//  [<pid>=<status> ...] concurrency=<workers> elapsed=<ns> throughput=<injections/sec>
+//  mean_latency=<ns> max_latency=<ns>" once every target is done. Each target is queued
+//  on its own, so it's serialized with any other request for the same pid.
+//
+//  A client that starts with a frame header speaks the binary protocol instead (see
+//  rd_injector_protocol.h) for the rest of the connection: it sends batches of
+//  requests with their ids and gets a results frame for every batch.
+//
+//  Usage: injector [-s <warm state file>] [-i <min idle ms>] [-I <max idle ms>] [-l <log file>]
+//                  [<socket path>]
+//
+//  The injection path logs into syslog, or into a binary log file given with -l
+//  (see rd_inject_log.h; rd_log_decode turns it into text).
+//
+//  The daemon exits once it has been idle for a while (see rd_idle_policy.h) and
+//  saves its warm state (the idle history and the resolved symbols) for the next
+//  launch. It may be socket-activated the systemd way (LISTEN_PID/LISTEN_FDS, see
+//  activator_linux.c), in which case the listener outlives the daemon and
+//  a connection that comes in after it has exited launches it again.
+//
+#if defined(__linux__)
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+
+#include "rd_inject_library.h"
+#include "rd_request_queue.h"
+#include "rd_remote_arena.h"
+#include "rd_injector_protocol.h"
+#include "rd_idle_policy.h"
+#include "rd_remote_symbols.h"
+#include "rd_request_coalescer.h"
+#include "rd_inject_log.h"
+
+#define kIdleExitTimeoutSec (10)
+#define kMaxIdleExitTimeoutSec (300)
+#define kDeamonSocketPath "/var/run/me.rodionovd.RDInjectionWizard.injector.sock"
+#define kDeamonStatePath "/var/cache/me.rodionovd.RDInjectionWizard.injector.state"
+/* The first descriptor passed by a socket activator */
+#define kActivatedListenerFd (3)
+#define kMaxClients (1024)
+/* How long to stop accepting connections for once accept4() has run out of something */
+#define kAcceptBackoffMs (10)
+#define kMaxRequestLength (4096 + 32)
+#define kMaxReplyLength (1024)
+
+/* A client connection. It's shared by the event loop and every request
+ * the client has in flight, and closed once the last of them lets it go. */
+typedef struct {
+    int fd;
+    atomic_int references;
+    pthread_mutex_t write_lock;
+    /* Whether the client speaks the binary protocol (once we've seen its first bytes) */
+    bool negotiated;
+    bool binary;
+    /* It only grows past kMaxRequestLength for large frames */
+    char *buffer;
+    size_t capacity;
+    size_t buffered;
+} rd_client_t;
+
+/* A frame of binary requests: it's answered once its last request is done */
+typedef struct {
+    rd_client_t *client;
+    atomic_size_t remaining;
+    size_t count;
+    rd_injector_result_t results[];
+} rd_socket_batch_t;
+
+/* A fan-out request: every target goes through its own lane like any single request
+ * would, and the fan-out is answered once its last target is done */
+typedef struct {
+    rd_client_t *client;
+    atomic_size_t remaining;
+    size_t count;
+    uint64_t started_at;
+    pid_t *targets;
+    int *results;
+    /* Per-target injection latency in nanoseconds */
+    uint64_t *latencies;
+} rd_socket_fanout_t;
+
+typedef struct {
+    rd_client_t *client;
+    pid_t target;
+    char *payload_path;
+    /* Binary and fan-out requests only: where the result goes */
+    rd_socket_batch_t *batch;
+    rd_socket_fanout_t *fanout;
+    size_t index;
+    /* The injection this request runs for itself and everyone identical */
+    rd_coalesced_injection_t *injection;
+} rd_socket_request_t;
+
+static rd_request_queue_t *request_queue = NULL;
+static rd_coalescer_t *coalescer = NULL;
+/* Wakes up the event loop when the daemon becomes idle */
+static int activity_event = -1;
+static atomic_bool is_busy = false;
+static volatile sig_atomic_t is_terminating = 0;
+static rd_idle_policy_t idle_policy;
+/* Startup metrics, CLOCK_REALTIME nanoseconds */
+static uint64_t launched_at = 0;
+static uint64_t listening_at = 0;
+static _Atomic uint64_t first_injection_at = 0;
+static bool is_warm_start = false;
+
+static void client_release(rd_client_t *client)
+{
+    if (atomic_fetch_sub(&client->references, 1) == 1) {
+        close(client->fd);
+        pthread_mutex_destroy(&client->write_lock);
+        free(client->buffer);
+        free(client);
+    }
+}
+
+static int main_routine(pid_t target, const char *payload_path, rd_inject_timings_t *timings)
+{
+    if (target <= 0) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    RDLogRequest(target, payload_path);
+    if (!payload_path) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    return rd_inject_libraries_with_timings(target, &payload_path, 1, NULL, timings);
+}
+
+static void client_send(rd_client_t *client, const char *reply, size_t length)
+{
+    pthread_mutex_lock(&client->write_lock);
+    /* The client may have gone away already, that's fine */
+    if (send(client->fd, reply, length, MSG_NOSIGNAL) != (ssize_t)length) {
+        syslog(LOG_NOTICE, "Failed to send a reply");
+    }
+    pthread_mutex_unlock(&client->write_lock);
+}
+
+/**
+ * Appends " <phase>=<value>" to the reply, unless it doesn't fit.
+ */
+static size_t append_phase(char *reply, size_t length, rd_inject_phase_t phase, const char *value)
+{
+    int appended = snprintf(reply + length, kMaxReplyLength - length, " %s=%s",
+                            rd_inject_phase_name(phase), value);
+    if (appended < 0 || (size_t)appended >= kMaxReplyLength - length) {
+        reply[length] = '\0';
+        return length;
+    }
+    return length + (size_t)appended;
+}
+
+/**
+ * Replies to a stats request, see the top of this file for the format.
+ */
+static void send_stats(rd_client_t *client)
+{
+    rd_inject_histogram_t histograms[RD_PHASE_COUNT];
+    rd_inject_stats_snapshot(histograms);
+
+    char reply[kMaxReplyLength] = "stats";
+    size_t length = strlen(reply);
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        const rd_inject_histogram_t *histogram = &histograms[phase];
+        if (histogram->count == 0) continue;
+        char value[128];
+        snprintf(value, sizeof(value), "%llu/%llu/%llu/%llu/%llu/%llu",
+                 (unsigned long long)histogram->count,
+                 (unsigned long long)(histogram->total_ns / histogram->count),
+                 (unsigned long long)rd_inject_histogram_percentile(histogram, 50),
+                 (unsigned long long)rd_inject_histogram_percentile(histogram, 90),
+                 (unsigned long long)rd_inject_histogram_percentile(histogram, 99),
+                 (unsigned long long)histogram->max_ns);
+        length = append_phase(reply, length, phase, value);
+    }
+    rd_remote_arena_usage_t usage[16];
+    size_t count = rd_remote_arena_usage(usage, sizeof(usage) / sizeof(*usage));
+    for (size_t i = 0; i < count && i < sizeof(usage) / sizeof(*usage); i++) {
+        int appended = snprintf(reply + length, kMaxReplyLength - length, " live=%d:%llu",
+                                usage[i].target, (unsigned long long)usage[i].live_bytes);
+        if (appended < 0 || (size_t)appended >= kMaxReplyLength - length) {
+            reply[length] = '\0';
+            break;
+        }
+        length += (size_t)appended;
+    }
+    uint64_t now = rd_idle_policy_now();
+    uint64_t first_injection = atomic_load(&first_injection_at);
+    rd_coalescer_stats_t coalescer_stats;
+    rd_coalescer_statistics(coalescer, &coalescer_stats);
+    int appended = snprintf(reply + length, kMaxReplyLength - length,
+                            " startup=%llu first_injection=%llu warm=%d idle_timeout=%llu"
+                            " rate=%.2f pid=%d joined=%llu cached=%llu",
+                            (unsigned long long)(listening_at - launched_at),
+                            (unsigned long long)(first_injection ? first_injection - launched_at : 0),
+                            is_warm_start,
+                            (unsigned long long)rd_idle_policy_timeout(&idle_policy, now),
+                            rd_idle_policy_request_rate(&idle_policy, now), getpid(),
+                            (unsigned long long)coalescer_stats.joined,
+                            (unsigned long long)coalescer_stats.cached);
+    if (appended > 0 && (size_t)appended < kMaxReplyLength - length) {
+        length += (size_t)appended;
+    }
+    reply[length++] = '\n';
+    client_send(client, reply, length);
+}
+
+/**
+ * Lets go of a batch request; the last one sends the results frame.
+ */
+static void batch_release(rd_socket_batch_t *batch)
+{
+    if (atomic_fetch_sub(&batch->remaining, 1) != 1) {
+        return;
+    }
+    size_t length = rd_injector_results_frame_length(batch->count);
+    void *frame = malloc(length);
+    if (frame && rd_injector_encode_results(batch->results, batch->count, frame, length) == length) {
+        client_send(batch->client, frame, length);
+    } else {
+        syslog(LOG_NOTICE, "Failed to encode a results frame");
+    }
+    free(frame);
+    client_release(batch->client);
+    free(batch);
+}
+
+/**
+ * Lets go of a fan-out target; the last one sends the fan-out reply, see the top of
+ * this file for the format.
+ */
+static void fanout_release(rd_socket_fanout_t *fanout)
+{
+    if (atomic_fetch_sub(&fanout->remaining, 1) != 1) {
+        return;
+    }
+    uint64_t elapsed = rd_idle_policy_now() - fanout->started_at;
+    unsigned int concurrency = rd_request_queue_workers(request_queue);
+    if (concurrency > fanout->count) {
+        concurrency = (unsigned int)fanout->count;
+    }
+    rd_fanout_stats_t stats;
+    rd_fanout_stats_compute(fanout->results, fanout->latencies, fanout->count, elapsed,
+                            concurrency, &stats);
+    /* A pid takes up to 13 bytes and " <pid>=<0|1>" at most 16 */
+    size_t capacity = kMaxReplyLength + fanout->count * 16;
+    char *reply = malloc(capacity);
+    if (reply) {
+        size_t length = (size_t)snprintf(reply, capacity, "fanout %zu/%zu", stats.succeeded,
+                                         fanout->count);
+        for (size_t i = 0; i < fanout->count; i++) {
+            length += (size_t)snprintf(reply + length, capacity - length, " %d=%d",
+                                       fanout->targets[i], fanout->results[i] == KERN_SUCCESS);
+        }
+        length += (size_t)snprintf(reply + length, capacity - length,
+                                   " concurrency=%u elapsed=%llu throughput=%.2f"
+                                   " mean_latency=%llu max_latency=%llu\n",
+                                   stats.concurrency, (unsigned long long)elapsed, stats.throughput,
+                                   (unsigned long long)(stats.mean_latency_sec * 1e9),
+                                   (unsigned long long)(stats.max_latency_sec * 1e9));
+        client_send(fanout->client, reply, length);
+    } else {
+        syslog(LOG_NOTICE, "Failed to allocate a reply for a fan-out of %zu", fanout->count);
+    }
+    free(reply);
+    client_release(fanout->client);
+    free(fanout->targets);
+    free(fanout->results);
+    free(fanout->latencies);
+    free(fanout);
+}
+
+/**
+ * Answers a request with its own result or the one of an identical injection.
+ */
+static void answer_request(const rd_coalesced_result_t *coalesced, void *context)
+{
+    rd_socket_request_t *request = context;
+    int err = coalesced->err;
+    if (request->batch) {
+        rd_injector_result_t *result = &request->batch->results[request->index];
+        result->error = err;
+        result->error_class = rd_injector_error_class(err);
+        result->timings = coalesced->timings;
+        result->handle = coalesced->handle;
+        batch_release(request->batch);
+    } else if (request->fanout) {
+        request->fanout->results[request->index] = err;
+        request->fanout->latencies[request->index] = coalesced->timings.phase_ns[RD_PHASE_TOTAL];
+        fanout_release(request->fanout);
+    } else {
+        char reply[kMaxReplyLength];
+        size_t length = (size_t)snprintf(reply, sizeof(reply), "%d %d", request->target,
+                                         err == KERN_SUCCESS);
+        for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+            if (coalesced->timings.phase_ns[phase] == 0) continue;
+            char value[32];
+            snprintf(value, sizeof(value), "%llu", (unsigned long long)coalesced->timings.phase_ns[phase]);
+            length = append_phase(reply, length, phase, value);
+        }
+        reply[length++] = '\n';
+        client_send(request->client, reply, length);
+    }
+
+    client_release(request->client);
+    free(request->payload_path);
+    free(request);
+}
+
+/**
+ * Runs on one of the request queue workers.
+ */
+static void process_request(void *context)
+{
+    rd_socket_request_t *request = context;
+    rd_inject_timings_t timings = {{0}};
+    int err = main_routine(request->target, request->payload_path, &timings);
+    uint64_t not_yet = 0;
+    if (err == KERN_SUCCESS) {
+        atomic_compare_exchange_strong(&first_injection_at, &not_yet, rd_idle_policy_now());
+    }
+    /* Answers this request too */
+    rd_coalescer_complete(coalescer, request->injection, err, &timings);
+}
+
+static void request_queue_activity_handler(bool busy, __attribute__((unused)) void *context)
+{
+    atomic_store(&is_busy, busy);
+    if (!busy) {
+        rd_idle_policy_idle(&idle_policy, rd_idle_policy_now());
+        uint64_t one = 1;
+        if (write(activity_event, &one, sizeof(one)) != sizeof(one)) {
+            /* The counter is saturated, so the loop is going to wake up anyway */
+        }
+    }
+}
+
+/**
+ * Submits a request into the request queue, unless an identical injection answers it.
+ *
+ * @return false if it could not be accepted at all
+ */
+static bool submit_request(rd_client_t *client, pid_t target, const char *payload_path,
+                           rd_socket_batch_t *batch, rd_socket_fanout_t *fanout, size_t index)
+{
+    rd_socket_request_t *request = calloc(1, sizeof(*request));
+    if (!request) {
+        return false;
+    }
+    request->client = client;
+    request->target = target;
+    request->payload_path = payload_path ? strdup(payload_path) : NULL;
+    request->batch = batch;
+    request->fanout = fanout;
+    request->index = index;
+    rd_idle_policy_request(&idle_policy, rd_idle_policy_now());
+    atomic_fetch_add(&client->references, 1);
+    if (!rd_coalescer_join(coalescer, target, request->payload_path, answer_request, request,
+                           &request->injection)) {
+        return true;
+    }
+    if (!rd_request_queue_submit(request_queue, target, process_request, request)) {
+        syslog(LOG_NOTICE, "Failed to queue a request for (%d)", target);
+        /* Whoever has joined it meanwhile gets the failure as well */
+        rd_coalescer_complete(coalescer, request->injection, KERN_FAILURE, NULL);
+    }
+    return true;
+}
+
+/**
+ * Submits every target of a "fanout <pid>,<pid>,... <payload path>" line on its own.
+ *
+ * The targets go through their lanes of the request queue (and the coalescer) just like
+ * single requests, so a fan-out never races another request for the same target.
+ */
+static void handle_fanout_line(rd_client_t *client, char *line)
+{
+    size_t count = 1;
+    char *payload_path = strchr(line, ' ');
+    for (char *c = line; *c && c != payload_path; c++) {
+        if (*c == ',') count++;
+    }
+    while (payload_path && *payload_path == ' ') payload_path++;
+    if (!payload_path || *payload_path == '\0') {
+        payload_path = NULL;
+    }
+    rd_socket_fanout_t *fanout = calloc(1, sizeof(*fanout));
+    if (fanout) {
+        fanout->targets = calloc(count, sizeof(*fanout->targets));
+        fanout->results = calloc(count, sizeof(*fanout->results));
+        fanout->latencies = calloc(count, sizeof(*fanout->latencies));
+    }
+    if (!fanout || !fanout->targets || !fanout->results || !fanout->latencies) {
+        syslog(LOG_NOTICE, "Failed to allocate a fan-out of %zu targets", count);
+        if (fanout) {
+            free(fanout->targets);
+            free(fanout->results);
+            free(fanout->latencies);
+        }
+        free(fanout);
+        client_send(client, "fanout 0/0\n", strlen("fanout 0/0\n"));
+        return;
+    }
+    fanout->client = client;
+    fanout->count = count;
+    fanout->started_at = rd_idle_policy_now();
+    /* We hold the fan-out too, so it's not answered before all of it is queued */
+    atomic_init(&fanout->remaining, count + 1);
+    atomic_fetch_add(&client->references, 1);
+    char *pid = line;
+    for (size_t i = 0; i < count; i++) {
+        fanout->targets[i] = (pid_t)strtol(pid, &pid, 10);
+        pid++;
+        if (!submit_request(client, fanout->targets[i], payload_path, NULL, fanout, i)) {
+            fanout->results[i] = KERN_FAILURE;
+            fanout_release(fanout);
+        }
+    }
+    fanout_release(fanout);
+}
+
+/**
+ * Parses a request line and submits it into the request queue.
+ */
+static void handle_request_line(rd_client_t *client, char *line)
+{
+    /* Stats requests are cheap, so they don't go through the request queue */
+    if (strcmp(line, "stats") == 0) {
+        send_stats(client);
+        return;
+    }
+    if (strncmp(line, "fanout ", strlen("fanout ")) == 0) {
+        handle_fanout_line(client, line + strlen("fanout "));
+        return;
+    }
+    char *payload_path = NULL;
+    long target = strtol(line, &payload_path, 10);
+    while (payload_path && *payload_path == ' ') payload_path++;
+    if (!payload_path || *payload_path == '\0') {
+        payload_path = NULL;
+    }
+
+    submit_request(client, (pid_t)target, payload_path, NULL, NULL, 0);
+}
+
+/**
+ * Submits every request of a requests frame into the request queue.
+ *
+ * @return false if the frame is malformed
+ */
+static bool handle_request_frame(rd_client_t *client, const void *frame, size_t length)
+{
+    rd_injector_request_t *requests = NULL;
+    size_t count = 0;
+    if (!rd_injector_decode_requests(frame, length, &requests, &count)) {
+        return false;
+    }
+    rd_socket_batch_t *batch = calloc(1, sizeof(*batch) + count * sizeof(*batch->results));
+    if (!batch) {
+        /* There's no way to tell the client, so it'll see a disconnect instead */
+        syslog(LOG_NOTICE, "Failed to allocate a batch of %zu requests", count);
+        free(requests);
+        return false;
+    }
+    batch->client = client;
+    batch->count = count;
+    /* We hold the batch too, so it's not answered before all of it is queued */
+    atomic_init(&batch->remaining, count + 1);
+    atomic_fetch_add(&client->references, 1);
+    for (size_t i = 0; i < count; i++) {
+        batch->results[i].id = requests[i].id;
+        batch->results[i].target = requests[i].target;
+        if (!submit_request(client, requests[i].target, requests[i].payload_path, batch, NULL, i)) {
+            batch->results[i].error = KERN_FAILURE;
+            batch->results[i].error_class = RD_INJECTOR_ERROR_INTERNAL;
+            batch_release(batch);
+        }
+    }
+    free(requests);
+    batch_release(batch);
+
+    return true;
+}
+
+/**
+ * Handles every complete request line in the client's buffer.
+ *
+ * @return false if the client has to be dropped
+ */
+static bool handle_text_input(rd_client_t *client)
+{
+    char *line = client->buffer;
+    char *end = NULL;
+    while ((end = memchr(line, '\n', client->buffered - (size_t)(line - client->buffer)))) {
+        *end = '\0';
+        handle_request_line(client, line);
+        line = end + 1;
+    }
+    client->buffered -= (size_t)(line - client->buffer);
+    memmove(client->buffer, line, client->buffered);
+    if (client->buffered == client->capacity) {
+        syslog(LOG_NOTICE, "A request is too long, dropping the client");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Handles every complete frame in the client's buffer, and makes room for the next one.
+ *
+ * @return false if the client has to be dropped
+ */
+static bool handle_binary_input(rd_client_t *client)
+{
+    size_t consumed = 0;
+    ssize_t length = 0;
+    while ((length = rd_injector_frame_length(client->buffer + consumed,
+                                              client->buffered - consumed)) > 0) {
+        if ((size_t)length > client->buffered - consumed) {
+            break;
+        }
+        if (rd_injector_frame_type(client->buffer + consumed) != RD_INJECTOR_FRAME_REQUESTS ||
+            !handle_request_frame(client, client->buffer + consumed, (size_t)length)) {
+            length = -1;
+            break;
+        }
+        consumed += (size_t)length;
+    }
+    if (length < 0) {
+        syslog(LOG_NOTICE, "A malformed frame, dropping the client");
+        return false;
+    }
+    client->buffered -= consumed;
+    memmove(client->buffer, client->buffer + consumed, client->buffered);
+    /* A large frame: make room for all of it at once */
+    if (length > 0 && (size_t)length > client->capacity) {
+        char *grown = realloc(client->buffer, (size_t)length);
+        if (!grown) {
+            syslog(LOG_NOTICE, "Failed to allocate %zd bytes for a frame", length);
+            return false;
+        }
+        client->buffer = grown;
+        client->capacity = (size_t)length;
+    }
+
+    return true;
+}
+
+/**
+ * Reads whatever the client has sent so far.
+ *
+ * @return false if the client has disconnected
+ */
+static bool handle_client_input(rd_client_t *client)
+{
+    ssize_t received = recv(client->fd, client->buffer + client->buffered,
+                            client->capacity - client->buffered, 0);
+    if (received <= 0) {
+        return (received < 0 && errno == EINTR);
+    }
+    client->buffered += (size_t)received;
+    /* A text request never starts with the magic, so the first bytes tell which protocol it is */
+    if (!client->negotiated) {
+        if (client->buffered < 4 && !memchr(client->buffer, '\n', client->buffered)) {
+            return true;
+        }
+        client->negotiated = true;
+        client->binary = rd_injector_is_frame(client->buffer, client->buffered);
+    }
+
+    return client->binary ? handle_binary_input(client) : handle_text_input(client);
+}
+
+static int create_listener(const char *socket_path)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+/**
+ * Picks up the listener passed by a socket activator, if any.
+ *
+ * @return the listener or (-1) if we haven't been activated
+ */
+static int activated_listener(void)
+{
+    const char *listen_pid = getenv("LISTEN_PID");
+    const char *listen_fds = getenv("LISTEN_FDS");
+    if (!listen_pid || !listen_fds || atoi(listen_pid) != getpid() || atoi(listen_fds) < 1) {
+        return -1;
+    }
+    /* Don't pass these to anything we might spawn */
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    fcntl(kActivatedListenerFd, F_SETFD, FD_CLOEXEC);
+    return kActivatedListenerFd;
+}
+
+static void load_warm_state(const char *state_path)
+{
+    FILE *state = fopen(state_path, "rbe");
+    if (!state) {
+        return;
+    }
+    if (rd_idle_policy_load(&idle_policy, state)) {
+        is_warm_start = rd_remote_symbols_load_cache(state);
+    }
+    fclose(state);
+}
+
+/**
+ * Saves the warm state for the next launch; a half-written file never replaces a good one.
+ */
+static void save_warm_state(const char *state_path)
+{
+    char temporary_path[PATH_MAX];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", state_path, getpid());
+    FILE *state = fopen(temporary_path, "wbe");
+    if (!state) {
+        syslog(LOG_NOTICE, "Failed to save the warm state: %s", strerror(errno));
+        return;
+    }
+    bool saved = (rd_idle_policy_save(&idle_policy, state, rd_idle_policy_now()) &&
+                  rd_remote_symbols_save_cache(state));
+    if (fclose(state) != 0 || !saved || rename(temporary_path, state_path) != 0) {
+        syslog(LOG_NOTICE, "Failed to save the warm state");
+        unlink(temporary_path);
+    }
+}
+
+static void termination_handler(__attribute__((unused)) int signal)
+{
+    is_terminating = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    /* An activator tells us when it has actually launched us */
+    const char *activated_at = getenv("RD_ACTIVATED_AT_NS");
+    launched_at = activated_at ? strtoull(activated_at, NULL, 10) : rd_idle_policy_now();
+    const char *state_path = kDeamonStatePath;
+    uint64_t min_idle_ms = kIdleExitTimeoutSec * 1000, max_idle_ms = kMaxIdleExitTimeoutSec * 1000;
+    int option;
+    while ((option = getopt(argc, argv, "s:i:I:l:")) != -1) {
+        switch (option) {
+            case 's': state_path = optarg; break;
+            case 'i': min_idle_ms = strtoull(optarg, NULL, 10); break;
+            case 'I': max_idle_ms = strtoull(optarg, NULL, 10); break;
+            case 'l':
+                if (!rd_log_open(optarg)) {
+                    syslog(LOG_NOTICE, "Failed to open the log file %s: %s", optarg, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default: exit(EXIT_FAILURE);
+        }
+    }
+    const char *socket_path = (optind < argc) ? argv[optind] : kDeamonSocketPath;
+    rd_idle_policy_init(&idle_policy, min_idle_ms * 1000000, max_idle_ms * 1000000, launched_at);
+    load_warm_state(state_path);
+
+    /* An activated listener belongs to the activator, so it outlives us */
+    int listener = activated_listener();
+    bool is_activated = (listener >= 0);
+    if (!is_activated) {
+        listener = create_listener(socket_path);
+    }
+    if (listener < 0) {
+        syslog(LOG_NOTICE, "Failed to listen on %s: %s", socket_path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    struct sigaction termination = {.sa_handler = termination_handler};
+    sigaction(SIGTERM, &termination, NULL);
+    sigaction(SIGINT, &termination, NULL);
+    activity_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (activity_event < 0) {
+        syslog(LOG_NOTICE, "Failed to create an activity event.");
+        exit(EXIT_FAILURE);
+    }
+    /* Identical requests share a single injection */
+    coalescer = rd_coalescer_create();
+    /* Requests are processed by a pool of workers, so a slow target won't block others */
+    request_queue = rd_request_queue_create(0, request_queue_activity_handler, NULL);
+    if (!coalescer || !request_queue) {
+        syslog(LOG_NOTICE, "Failed to create a request queue.");
+        exit(EXIT_FAILURE);
+    }
+    listening_at = rd_idle_policy_now();
+
+    static struct pollfd fds[kMaxClients + 2];
+    static rd_client_t *clients[kMaxClients + 2];
+    nfds_t nfds = 2;
+    fds[0] = (struct pollfd){.fd = listener, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = activity_event, .events = POLLIN};
+
+    struct timespec idle_since;
+    clock_gettime(CLOCK_MONOTONIC, &idle_since);
+    bool is_accept_paused = false;
+    while (!is_terminating) {
+        /* The idle-exit timer is paused while there're requests in flight */
+        int timeout = -1;
+        if (!atomic_load(&is_busy)) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long idle_ms = (now.tv_sec - idle_since.tv_sec) * 1000 +
+                           (now.tv_nsec - idle_since.tv_nsec) / 1000000;
+            long idle_timeout_ms = (long)(rd_idle_policy_timeout(&idle_policy, rd_idle_policy_now()) / 1000000);
+            if (idle_ms >= idle_timeout_ms && rd_request_queue_in_flight(request_queue) == 0) {
+                break;
+            }
+            timeout = (int)(idle_timeout_ms - idle_ms);
+        }
+        if (is_accept_paused && (timeout < 0 || timeout > kAcceptBackoffMs)) {
+            timeout = kAcceptBackoffMs;
+        }
+        int ready = poll(fds, nfds, timeout);
+        if (ready < 0 && errno != EINTR) {
+            syslog(LOG_NOTICE, "poll() failed: %s", strerror(errno));
+            break;
+        }
+        if (is_accept_paused) {
+            /* Pending connections are still there, give them another try */
+            fds[0].events = POLLIN;
+            is_accept_paused = false;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[1].revents & POLLIN) {
+            uint64_t counter;
+            if (read(activity_event, &counter, sizeof(counter)) == sizeof(counter)) {
+                /* Reset the timer */
+                clock_gettime(CLOCK_MONOTONIC, &idle_since);
+            }
+        }
+        for (nfds_t i = 2; i < nfds; i++) {
+            if (fds[i].revents == 0) continue;
+            if ((fds[i].revents & POLLIN) && handle_client_input(clients[i])) continue;
+            /* The client is gone: its requests in flight still hold a reference */
+            shutdown(fds[i].fd, SHUT_RD);
+            client_release(clients[i]);
+            nfds--;
+            fds[i] = fds[nfds];
+            clients[i] = clients[nfds];
+            i--;
+        }
+        if (fds[0].revents & POLLIN) {
+            int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED) continue;
+                /* The listener stays readable, so keep poll() from waking us up for it
+                 * until we've (hopefully) got some descriptors or memory back */
+                if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) {
+                    syslog(LOG_NOTICE, "accept4() failed: %s", strerror(errno));
+                }
+                fds[0].events = 0;
+                is_accept_paused = true;
+                continue;
+            }
+            rd_client_t *client = (nfds < kMaxClients + 2) ? calloc(1, sizeof(*client)) : NULL;
+            if (!client) {
+                close(fd);
+                continue;
+            }
+            client->fd = fd;
+            client->capacity = kMaxRequestLength;
+            client->buffer = malloc(client->capacity);
+            if (!client->buffer) {
+                free(client);
+                close(fd);
+                continue;
+            }
+            atomic_init(&client->references, 1);
+            pthread_mutex_init(&client->write_lock, NULL);
+            fds[nfds] = (struct pollfd){.fd = fd, .events = POLLIN};
+            clients[nfds] = client;
+            nfds++;
+            /* A new connection is an activity too */
+            clock_gettime(CLOCK_MONOTONIC, &idle_since);
+        }
+    }
+
+    /* Let the requests in flight finish, so their results make it into the warm state */
+    rd_request_queue_destroy(request_queue);
+    rd_coalescer_destroy(coalescer);
+    save_warm_state(state_path);
+    rd_log_flush();
+    if (!is_activated) {
+        unlink(socket_path);
+    }
+    return EXIT_SUCCESS;
+}
+
+#endif // defined(__linux__)
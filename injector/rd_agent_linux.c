@@ -0,0 +1,149 @@
+//
+//  rd_agent_linux.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  The resident agent: a payload that stays in the target and runs the injector's commands
+//  (dlopen(), dlclose() and calls) off a command ring shared with the injector, see
+//  rd_inject_library/rd_agent.h. It's injected once with rd_inject_library(); from then on
+//  nothing stops the target anymore.
+//
+//  Build it as a shared library that can't be unloaded (its thread never exits):
+//      cc -shared -fPIC -Wl,-z,nodelete -o librd_agent.so rd_agent_linux.c -ldl -lpthread
+//
+#if defined(__linux__)
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "rd_inject_library/rd_agent_ring.h"
+
+static rd_agent_ring_t *ring = NULL;
+static int ring_fd = -1;
+
+static void run_command(rd_agent_slot_t *slot)
+{
+    slot->status = -1;
+    slot->result = 0;
+    switch (slot->command) {
+        case RD_AGENT_DLOPEN: {
+            void *handle = dlopen(slot->string, RTLD_NOW | RTLD_LOCAL);
+            slot->result = (uint64_t)(uintptr_t)handle;
+            slot->status = handle ? 0 : -1;
+            break;
+        }
+        case RD_AGENT_DLCLOSE:
+            slot->status = dlclose((void *)(uintptr_t)slot->handle);
+            break;
+        case RD_AGENT_CALL: {
+            void *handle = slot->handle ? (void *)(uintptr_t)slot->handle : RTLD_DEFAULT;
+            uint64_t (*routine)(uint64_t) = (uint64_t (*)(uint64_t))dlsym(handle, slot->string);
+            if (routine) {
+                slot->result = routine(slot->argument);
+                slot->status = 0;
+            }
+            break;
+        }
+    }
+}
+
+/**
+ * Runs the commands as the injector queues them, sleeping on the head while there's none.
+ */
+static void *serve_ring(void *context)
+{
+    rd_agent_ring_t *served = context;
+    uint32_t tail = atomic_load_explicit(&served->tail, memory_order_relaxed);
+    while (true) {
+        uint32_t head = atomic_load_explicit(&served->head, memory_order_acquire);
+        if (head == tail) {
+            syscall(SYS_futex, &served->head, FUTEX_WAIT, head, NULL, NULL, 0);
+            continue;
+        }
+        run_command(&served->slots[tail % kRDAgentRingSlots]);
+        atomic_store_explicit(&served->tail, ++tail, memory_order_release);
+        /* The injector waits for whole batches, so only wake it up once we've caught up */
+        if (atomic_load_explicit(&served->head, memory_order_acquire) == tail) {
+            syscall(SYS_futex, &served->tail, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+        }
+    }
+    return NULL;
+}
+
+static bool start_agent(void)
+{
+    ring_fd = memfd_create(kRDAgentRingName, MFD_CLOEXEC);
+    if (ring_fd < 0) {
+        return false;
+    }
+    if (ftruncate(ring_fd, sizeof(*ring)) != 0) {
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        close(ring_fd);
+        ring_fd = -1;
+        return false;
+    }
+    ring->version = kRDAgentRingVersion;
+    ring->owner = getpid();
+    ring->slots_count = kRDAgentRingSlots;
+
+    /* Keep the target's signals away from our thread */
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    bool started = (pthread_create(&thread, &attributes, serve_ring, ring) == 0);
+    pthread_attr_destroy(&attributes);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (!started) {
+        return false;
+    }
+    /* The injector only takes a ring with the magic in place */
+    __atomic_store_n(&ring->magic, kRDAgentRingMagic, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * A forked child has the parent's ring but not the thread serving it, so it gets its own.
+ */
+static void restart_in_child(void)
+{
+    if (ring) {
+        munmap(ring, sizeof(*ring));
+        ring = NULL;
+    }
+    if (ring_fd >= 0) {
+        close(ring_fd);
+        ring_fd = -1;
+    }
+    start_agent();
+}
+
+__attribute__((constructor))
+static void rd_agent_load(void)
+{
+    if (start_agent()) {
+        pthread_atfork(NULL, NULL, restart_in_child);
+    }
+}
+
+#endif // defined(__linux__)
@@ -0,0 +1,182 @@
+//
+//  rd_idle_policy.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <math.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rd_idle_policy.h"
+
+#define kRDIdlePolicyMagic          (0x50494452) /* "RDIP" */
+#define kRDIdleHistoryWindowNs      (3600ULL * 1000000000ULL)
+#define kRDIdleRateWindowSec        (60.0)
+/* The timeout has to cover this share of the recent gaps */
+#define kRDIdleCoveragePercent      (75)
+
+#pragma mark - Private Interface
+
+/* What's saved into a warm state file */
+typedef struct {
+    uint32_t magic;
+    uint32_t gaps_count;
+    uint64_t next_gap;
+    uint64_t idle_since_ns;
+    double request_rate;
+    uint64_t rate_updated_ns;
+    uint64_t gaps_ns[kRDIdleGapHistory];
+    uint64_t gaps_ended_ns[kRDIdleGapHistory];
+} rd_idle_policy_record_t;
+
+static void decay_rate(rd_idle_policy_t *policy, uint64_t now);
+static int compare_u64(const void *a, const void *b);
+
+#pragma mark - Implementation
+
+uint64_t rd_idle_policy_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void rd_idle_policy_init(rd_idle_policy_t *policy, uint64_t min_timeout_ns,
+                         uint64_t max_timeout_ns, uint64_t now)
+{
+    memset(policy, 0, sizeof(*policy));
+    pthread_mutex_init(&policy->lock, NULL);
+    policy->min_timeout_ns = min_timeout_ns;
+    policy->max_timeout_ns = (max_timeout_ns > min_timeout_ns) ? max_timeout_ns : min_timeout_ns;
+    policy->idle = true;
+    policy->idle_since_ns = now;
+    policy->rate_updated_ns = now;
+}
+
+void rd_idle_policy_request(rd_idle_policy_t *policy, uint64_t now)
+{
+    pthread_mutex_lock(&policy->lock);
+    decay_rate(policy, now);
+    policy->request_rate += 1.0 / kRDIdleRateWindowSec;
+    if (policy->idle) {
+        policy->idle = false;
+        policy->gaps_ns[policy->next_gap] = (now > policy->idle_since_ns) ? now - policy->idle_since_ns : 0;
+        policy->gaps_ended_ns[policy->next_gap] = now;
+        policy->next_gap = (policy->next_gap + 1) % kRDIdleGapHistory;
+        if (policy->gaps_count < kRDIdleGapHistory) policy->gaps_count++;
+    }
+    pthread_mutex_unlock(&policy->lock);
+}
+
+void rd_idle_policy_idle(rd_idle_policy_t *policy, uint64_t now)
+{
+    pthread_mutex_lock(&policy->lock);
+    policy->idle = true;
+    policy->idle_since_ns = now;
+    pthread_mutex_unlock(&policy->lock);
+}
+
+uint64_t rd_idle_policy_timeout(rd_idle_policy_t *policy, uint64_t now)
+{
+    pthread_mutex_lock(&policy->lock);
+    uint64_t gaps[kRDIdleGapHistory];
+    size_t count = 0;
+    for (size_t i = 0; i < policy->gaps_count; i++) {
+        /* The wall clock may have been set back since the gap ended: we can't tell
+         * how old such a gap is, so it doesn't count */
+        if (now >= policy->gaps_ended_ns[i] &&
+            now - policy->gaps_ended_ns[i] <= kRDIdleHistoryWindowNs) {
+            gaps[count++] = policy->gaps_ns[i];
+        }
+    }
+    uint64_t timeout = policy->min_timeout_ns;
+    if (count >= 2) {
+        qsort(gaps, count, sizeof(*gaps), compare_u64);
+        size_t covering = (count * kRDIdleCoveragePercent + 99) / 100 - 1;
+        /* Leave some room for the gaps to get a bit longer */
+        timeout = gaps[covering] + gaps[covering] / 4;
+    } else {
+        /* No history yet: a steady stream of requests is all we can go by */
+        decay_rate(policy, now);
+        if (policy->request_rate > 0) {
+            /* For a Poisson stream the next request comes within 3/rate with a 95% chance */
+            timeout = (uint64_t)(3.0 / policy->request_rate * 1e9);
+        }
+    }
+    if (timeout > policy->max_timeout_ns) {
+        /* The bursts are too rare to wait for */
+        timeout = policy->min_timeout_ns;
+    } else if (timeout < policy->min_timeout_ns) {
+        timeout = policy->min_timeout_ns;
+    }
+    pthread_mutex_unlock(&policy->lock);
+
+    return timeout;
+}
+
+double rd_idle_policy_request_rate(rd_idle_policy_t *policy, uint64_t now)
+{
+    pthread_mutex_lock(&policy->lock);
+    decay_rate(policy, now);
+    double rate = policy->request_rate;
+    pthread_mutex_unlock(&policy->lock);
+
+    return rate;
+}
+
+bool rd_idle_policy_save(rd_idle_policy_t *policy, FILE *file, uint64_t now)
+{
+    rd_idle_policy_record_t record = {.magic = kRDIdlePolicyMagic};
+    pthread_mutex_lock(&policy->lock);
+    decay_rate(policy, now);
+    record.gaps_count = (uint32_t)policy->gaps_count;
+    record.next_gap = policy->next_gap;
+    record.idle_since_ns = policy->idle ? policy->idle_since_ns : now;
+    record.request_rate = policy->request_rate;
+    record.rate_updated_ns = policy->rate_updated_ns;
+    memcpy(record.gaps_ns, policy->gaps_ns, sizeof(record.gaps_ns));
+    memcpy(record.gaps_ended_ns, policy->gaps_ended_ns, sizeof(record.gaps_ended_ns));
+    pthread_mutex_unlock(&policy->lock);
+
+    return (fwrite(&record, sizeof(record), 1, file) == 1);
+}
+
+bool rd_idle_policy_load(rd_idle_policy_t *policy, FILE *file)
+{
+    rd_idle_policy_record_t record;
+    if (fread(&record, sizeof(record), 1, file) != 1 || record.magic != kRDIdlePolicyMagic ||
+        record.gaps_count > kRDIdleGapHistory || record.next_gap >= kRDIdleGapHistory) {
+        return false;
+    }
+    pthread_mutex_lock(&policy->lock);
+    policy->gaps_count = record.gaps_count;
+    policy->next_gap = (size_t)record.next_gap;
+    memcpy(policy->gaps_ns, record.gaps_ns, sizeof(policy->gaps_ns));
+    memcpy(policy->gaps_ended_ns, record.gaps_ended_ns, sizeof(policy->gaps_ended_ns));
+    /* We've been idle since the previous launch went idle, not since this one started */
+    policy->idle = true;
+    policy->idle_since_ns = record.idle_since_ns;
+    policy->request_rate = record.request_rate;
+    policy->rate_updated_ns = record.rate_updated_ns;
+    pthread_mutex_unlock(&policy->lock);
+
+    return true;
+}
+
+static
+void decay_rate(rd_idle_policy_t *policy, uint64_t now)
+{
+    if (now > policy->rate_updated_ns) {
+        policy->request_rate *= exp(-(double)(now - policy->rate_updated_ns) / 1e9 / kRDIdleRateWindowSec);
+        policy->rate_updated_ns = now;
+    }
+}
+
+static
+int compare_u64(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a, right = *(const uint64_t *)b;
+    return (left > right) - (left < right);
+}
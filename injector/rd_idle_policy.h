@@ -0,0 +1,107 @@
+//
+//  rd_idle_policy.h
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define kRDIdleGapHistory (16)
+
+/**
+ * @abstract
+ * Decides how long the daemon should stay around once it has nothing to do.
+ *
+ * @discussion
+ * Our traffic comes in bursts, and the first request of a burst that finds no daemon
+ * pays for the whole cold start. So the policy remembers the recent idle gaps (how long
+ * the daemon had been idle when the next burst came) and picks a timeout that would
+ * have caught most of them, within [min, max]. Gaps older than an hour don't count,
+ * and if bursts come too rarely for any timeout within the limits to help, the policy
+ * falls back to the minimum one.
+ *
+ * All the times are CLOCK_REALTIME nanoseconds, so the history stays meaningful across
+ * daemon launches (see rd_idle_policy_save()). Gaps that seem to have ended in the
+ * future (the clock has been set back since) are ignored. A policy is safe to use from
+ * any thread.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t min_timeout_ns;
+    uint64_t max_timeout_ns;
+    /* A ring of the recent idle gaps and when they've ended */
+    uint64_t gaps_ns[kRDIdleGapHistory];
+    uint64_t gaps_ended_ns[kRDIdleGapHistory];
+    size_t gaps_count;
+    size_t next_gap;
+    bool idle;
+    uint64_t idle_since_ns;
+    /* Requests per second, exponentially decayed over a minute */
+    double request_rate;
+    uint64_t rate_updated_ns;
+} rd_idle_policy_t;
+
+/**
+ * @abstract
+ * Returns the current CLOCK_REALTIME time in nanoseconds.
+ */
+uint64_t rd_idle_policy_now(void);
+
+/**
+ * @abstract
+ * Sets up an idle policy; the daemon is considered idle since `now`.
+ */
+void rd_idle_policy_init(rd_idle_policy_t *policy, uint64_t min_timeout_ns,
+                         uint64_t max_timeout_ns, uint64_t now);
+
+/**
+ * @abstract
+ * Records a new request.
+ *
+ * @discussion
+ * The first request after an idle period ends that period, which becomes a part of
+ * the history.
+ */
+void rd_idle_policy_request(rd_idle_policy_t *policy, uint64_t now);
+
+/**
+ * @abstract
+ * Records that the last request in flight has completed.
+ */
+void rd_idle_policy_idle(rd_idle_policy_t *policy, uint64_t now);
+
+/**
+ * @abstract
+ * Returns how long the daemon should stay idle before exiting.
+ */
+uint64_t rd_idle_policy_timeout(rd_idle_policy_t *policy, uint64_t now);
+
+/**
+ * @abstract
+ * Returns the recent request rate (requests per second).
+ */
+double rd_idle_policy_request_rate(rd_idle_policy_t *policy, uint64_t now);
+
+/**
+ * @abstract
+ * Writes the policy's history into a file, so the next launch can pick it up.
+ *
+ * @discussion
+ * The daemon is assumed to be idle from now on, so the first request of the next
+ * launch ends this idle period.
+ */
+bool rd_idle_policy_save(rd_idle_policy_t *policy, FILE *file, uint64_t now);
+
+/**
+ * @abstract
+ * Reads the history saved by rd_idle_policy_save() into a freshly initialized policy.
+ *
+ * @return false if the file has no valid history (the policy is left as it was)
+ */
+bool rd_idle_policy_load(rd_idle_policy_t *policy, FILE *file);
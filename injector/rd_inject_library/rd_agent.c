@@ -0,0 +1,419 @@
+//
+//  rd_agent.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#include "rd_agent.h"
+#include "rd_agent_ring.h"
+#include "rd_remote_handles.h"
+
+/* How long the agent may take to run a batch of commands */
+#define kRDAgentTimeoutNs       (5ULL * 1000000000ULL)
+/* How often to check whether the target is still there while waiting */
+#define kRDAgentWaitSliceNs     (100ULL * 1000000ULL)
+
+struct rd_agent {
+    pid_t target;
+    rd_agent_ring_t *ring;
+    /* Our own open of the ring's memfd: the whole ring is write-locked through it while
+     * we're producing, so connections from other threads and processes take turns */
+    int ring_fd;
+    /* We're the single producer of the ring, whatever number of threads we have */
+    pthread_mutex_t lock;
+};
+
+#pragma mark - Private Interface
+
+#if defined(__linux__)
+static rd_agent_ring_t *map_ring(pid_t target, int *ring_fd);
+static int lock_ring(rd_agent_t *agent, short type);
+static int run_commands(rd_agent_t *agent, rd_agent_slot_t commands[], size_t count);
+static int wait_for_commands(rd_agent_t *agent, uint32_t head);
+#endif
+
+#pragma mark - Implementation
+
+#if defined(__APPLE__)
+
+int rd_agent_attach(pid_t target, const char *agent_path, rd_agent_t **agent)
+{
+    (void)target;
+    (void)agent_path;
+    if (agent) *agent = NULL;
+    syslog(LOG_NOTICE, "Resident agents are only supported on Linux");
+    return KERN_FAILURE;
+}
+
+void rd_agent_detach(rd_agent_t *agent)
+{
+    (void)agent;
+}
+
+int rd_agent_load_libraries(rd_agent_t *agent, const char *library_paths[], size_t count,
+                            int results[])
+{
+    (void)agent;
+    (void)library_paths;
+    for (size_t i = 0; results && i < count; i++) {
+        results[i] = KERN_FAILURE;
+    }
+    return KERN_FAILURE;
+}
+
+int rd_agent_unload_library(rd_agent_t *agent, const char *library_path)
+{
+    (void)agent;
+    (void)library_path;
+    return KERN_FAILURE;
+}
+
+int rd_agent_call(rd_agent_t *agent, const char *library_path, const char *symbol,
+                  uint64_t argument, uint64_t *result)
+{
+    (void)agent;
+    (void)library_path;
+    (void)symbol;
+    (void)argument;
+    (void)result;
+    return KERN_FAILURE;
+}
+
+#else
+
+int rd_agent_attach(pid_t target, const char *agent_path, rd_agent_t **agent)
+{
+    if (!agent) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    *agent = NULL;
+    if (target <= 0 || !agent_path) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    int ring_fd = -1;
+    rd_agent_ring_t *ring = map_ring(target, &ring_fd);
+    if (!ring) {
+        int err = rd_inject_library(target, agent_path);
+        if (err != KERN_SUCCESS) {
+            return err;
+        }
+        /* The agent's constructor has set the ring up by the time dlopen() returns */
+        ring = map_ring(target, &ring_fd);
+        if (!ring) {
+            syslog(LOG_NOTICE, "The agent in %d hasn't set up its command ring", target);
+            return KERN_FAILURE;
+        }
+    }
+    rd_agent_t *connection = calloc(1, sizeof(*connection));
+    if (!connection) {
+        munmap(ring, sizeof(*ring));
+        close(ring_fd);
+        return KERN_FAILURE;
+    }
+    connection->target = target;
+    connection->ring = ring;
+    connection->ring_fd = ring_fd;
+    pthread_mutex_init(&connection->lock, NULL);
+    *agent = connection;
+
+    return KERN_SUCCESS;
+}
+
+void rd_agent_detach(rd_agent_t *agent)
+{
+    if (!agent) return;
+    munmap(agent->ring, sizeof(*agent->ring));
+    close(agent->ring_fd);
+    pthread_mutex_destroy(&agent->lock);
+    free(agent);
+}
+
+int rd_agent_load_libraries(rd_agent_t *agent, const char *library_paths[], size_t count,
+                            int results[])
+{
+    if (!agent || !library_paths || count == 0) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    rd_agent_slot_t *commands = calloc(count, sizeof(*commands));
+    if (!commands) {
+        return KERN_FAILURE;
+    }
+    int err = KERN_SUCCESS;
+    for (size_t i = 0; i < count && err == KERN_SUCCESS; i++) {
+        commands[i].command = RD_AGENT_DLOPEN;
+        if (!library_paths[i] || strlen(library_paths[i]) >= sizeof(commands[i].string)) {
+            err = KERN_INVALID_ARGUMENT;
+            break;
+        }
+        strcpy(commands[i].string, library_paths[i]);
+    }
+    if (err == KERN_SUCCESS) {
+        err = run_commands(agent, commands, count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        int result = err;
+        if (err == KERN_SUCCESS) {
+            if (commands[i].status != 0 || commands[i].result == 0) {
+                syslog(LOG_NOTICE, "Remote dlopen() failed for %s", library_paths[i]);
+                result = KERN_INVALID_OBJECT;
+            } else {
+                rd_remote_handles_record(agent->target, library_paths[i], commands[i].result);
+            }
+        }
+        if (results) results[i] = result;
+        if (result != KERN_SUCCESS && err == KERN_SUCCESS) {
+            err = result;
+        }
+    }
+    free(commands);
+
+    return err;
+}
+
+int rd_agent_unload_library(rd_agent_t *agent, const char *library_path)
+{
+    if (!agent || !library_path) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    uint64_t handle = rd_remote_handles_lookup(agent->target, library_path);
+    if (handle == 0) {
+        syslog(LOG_NOTICE, "%s has never been injected into %d", library_path, agent->target);
+        return KERN_INVALID_ARGUMENT;
+    }
+    rd_agent_slot_t command = {.command = RD_AGENT_DLCLOSE, .handle = handle};
+    int err = run_commands(agent, &command, 1);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    if (command.status != 0) {
+        syslog(LOG_NOTICE, "Remote dlclose() failed for %s", library_path);
+        return KERN_FAILURE;
+    }
+    rd_remote_handles_forget(agent->target, library_path);
+
+    return KERN_SUCCESS;
+}
+
+int rd_agent_call(rd_agent_t *agent, const char *library_path, const char *symbol,
+                  uint64_t argument, uint64_t *result)
+{
+    if (!agent || !symbol) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    rd_agent_slot_t command = {.command = RD_AGENT_CALL, .argument = argument};
+    if (library_path) {
+        command.handle = rd_remote_handles_lookup(agent->target, library_path);
+        if (command.handle == 0) {
+            syslog(LOG_NOTICE, "%s has never been injected into %d", library_path, agent->target);
+            return KERN_INVALID_ARGUMENT;
+        }
+    }
+    if (strlen(symbol) >= sizeof(command.string)) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    strcpy(command.string, symbol);
+    int err = run_commands(agent, &command, 1);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    if (command.status != 0) {
+        syslog(LOG_NOTICE, "%s can't be found in %d", symbol, agent->target);
+        return KERN_INVALID_OBJECT;
+    }
+    if (result) *result = command.result;
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Finds the agent's ring among the target's descriptors and maps it.
+ *
+ * @discussion
+ * A child the target has forked (and not exec()ed) inherits the parent's ring, which
+ * its own agent has replaced with a ring of its own, so rings of other owners are skipped.
+ */
+static
+rd_agent_ring_t *map_ring(pid_t target, int *ring_fd)
+{
+    char directory_path[64];
+    snprintf(directory_path, sizeof(directory_path), "/proc/%d/fd", target);
+    DIR *directory = opendir(directory_path);
+    if (!directory) {
+        return NULL;
+    }
+    const char *ring_link = "/memfd:" kRDAgentRingName " (deleted)";
+    rd_agent_ring_t *ring = NULL;
+    struct dirent *entry;
+    while (!ring && (entry = readdir(directory)) != NULL) {
+        char path[PATH_MAX], link[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", directory_path, entry->d_name);
+        ssize_t length = readlink(path, link, sizeof(link) - 1);
+        if (length < 0) continue;
+        link[length] = '\0';
+        if (strcmp(link, ring_link) != 0) continue;
+
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat info;
+        if (fd < 0) continue;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(*ring)) {
+            close(fd);
+            continue;
+        }
+        ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (ring == MAP_FAILED) {
+            close(fd);
+            ring = NULL;
+            continue;
+        }
+        /* The agent publishes the magic last */
+        if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != kRDAgentRingMagic ||
+            ring->version != kRDAgentRingVersion || ring->owner != target ||
+            ring->slots_count != kRDAgentRingSlots) {
+            munmap(ring, sizeof(*ring));
+            close(fd);
+            ring = NULL;
+            continue;
+        }
+        *ring_fd = fd;
+    }
+    closedir(directory);
+
+    return ring;
+}
+
+/**
+ * @abstract
+ * Takes (F_WRLCK) or drops (F_UNLCK) the producer's lock on the ring.
+ *
+ * @discussion
+ * An open file description lock: every connection opens the memfd on its own, so two
+ * connections to the same target exclude each other even within a single process,
+ * and a producer that dies has its lock dropped by the kernel.
+ */
+static
+int lock_ring(rd_agent_t *agent, short type)
+{
+    struct flock lock = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = 0,
+        .l_len = 0
+    };
+    while (fcntl(agent->ring_fd, F_OFD_SETLKW, &lock) != 0) {
+        if (errno != EINTR) {
+            syslog(LOG_NOTICE, "Couldn't lock the command ring of %d: %s", agent->target,
+                   strerror(errno));
+            return KERN_FAILURE;
+        }
+    }
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Queues the commands on the ring and waits for the agent to run them all.
+ *
+ * @discussion
+ * A batch larger than the ring goes in as many rounds as it takes. The commands get
+ * their results back in place.
+ */
+static
+int run_commands(rd_agent_t *agent, rd_agent_slot_t commands[], size_t count)
+{
+    rd_agent_ring_t *ring = agent->ring;
+    pthread_mutex_lock(&agent->lock);
+    int err = lock_ring(agent, F_WRLCK);
+    if (err != KERN_SUCCESS) {
+        pthread_mutex_unlock(&agent->lock);
+        return err;
+    }
+    /* Nobody else moves the head, not until we unlock the ring */
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t done = 0;
+    while (done < count && err == KERN_SUCCESS) {
+        /* Commands left over from a batch that has timed out may still be in the ring */
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        uint32_t first = head;
+        size_t queued = done;
+        while (queued < count && head - tail < kRDAgentRingSlots) {
+            rd_agent_slot_t *slot = &ring->slots[head % kRDAgentRingSlots];
+            /* Only copy as much of the string as there is */
+            memcpy(slot, &commands[queued], offsetof(rd_agent_slot_t, string));
+            strcpy(slot->string, commands[queued].string);
+            head++;
+            queued++;
+        }
+        if (queued > done) {
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+            syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+        err = wait_for_commands(agent, head);
+        for (uint32_t index = first; err == KERN_SUCCESS && index != head; index++) {
+            rd_agent_slot_t *slot = &ring->slots[index % kRDAgentRingSlots];
+            commands[done].status = slot->status;
+            commands[done].result = slot->result;
+            done++;
+        }
+    }
+    lock_ring(agent, F_UNLCK);
+    pthread_mutex_unlock(&agent->lock);
+
+    return err;
+}
+
+/**
+ * @abstract
+ * Sleeps on the ring's tail until the agent has caught up with the head.
+ */
+static
+int wait_for_commands(rd_agent_t *agent, uint32_t head)
+{
+    rd_agent_ring_t *ring = agent->ring;
+    uint64_t deadline = rd_inject_clock_ns() + kRDAgentTimeoutNs;
+    while (true) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (tail == head) {
+            return KERN_SUCCESS;
+        }
+        uint64_t now = rd_inject_clock_ns();
+        if (now >= deadline) {
+            syslog(LOG_NOTICE, "The agent in %d hasn't answered in time", agent->target);
+            return KERN_OPERATION_TIMED_OUT;
+        }
+        if (kill(agent->target, 0) != 0 && errno == ESRCH) {
+            syslog(LOG_NOTICE, "%d is gone along with its agent", agent->target);
+            return KERN_FAILURE;
+        }
+        uint64_t slice = (deadline - now < kRDAgentWaitSliceNs) ? deadline - now : kRDAgentWaitSliceNs;
+        struct timespec timeout = {
+            .tv_sec = (time_t)(slice / 1000000000ULL),
+            .tv_nsec = (long)(slice % 1000000000ULL)
+        };
+        syscall(SYS_futex, &ring->tail, FUTEX_WAIT, tail, &timeout, NULL, 0);
+    }
+}
+
+#endif
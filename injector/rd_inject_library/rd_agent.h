@@ -0,0 +1,101 @@
+//
+//  rd_agent.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "rd_inject_library.h"
+
+/* A resident agent inside a target process */
+typedef struct rd_agent rd_agent_t;
+
+/**
+ * @abstract
+ * Connects to the target's resident agent, injecting the agent first if it isn't there.
+ *
+ * @discussion
+ * The agent (injector/rd_agent_linux.c) is an ordinary payload: it's injected with
+ * rd_inject_library() once and stays loaded. It maps a command ring shared with us
+ * (see rd_agent_ring.h) and serves it on a thread of its own, so later loads, unloads
+ * and calls don't stop the target or touch ptrace() at all. Connecting to an agent that
+ * is already there takes no injection either, so does connecting from another process.
+ * Any number of connections to the same target may exist at once: their batches of
+ * commands are run one after another.
+ *
+ * Linux only: on OS X the function fails with KERN_FAILURE.
+ *
+ * @param target
+ * The identifer of the target process
+ * @param agent_path
+ * The full path of the agent library
+ * @param agent
+ * Receives the agent connection
+ *
+ * @return KERN_SUCCESS
+ * Means the agent is ready for commands
+ * @return
+ * Any other error comes from rd_inject_library() or means the agent hasn't set up its ring
+ */
+int rd_agent_attach(pid_t target, const char *agent_path, rd_agent_t **agent);
+
+/**
+ * @abstract
+ * Disconnects from the agent, which stays in the target for the next time.
+ */
+void rd_agent_detach(rd_agent_t *agent);
+
+/**
+ * @abstract
+ * Has the agent dlopen() a number of libraries, the same way rd_inject_libraries() would.
+ *
+ * @discussion
+ * All the commands are queued at once and the agent runs them in order. The handles are
+ * remembered as if the libraries were injected, so rd_unload_library() and
+ * rd_swap_library() work for them too. Commands to the same agent from several threads
+ * are run one batch after another.
+ *
+ * @param results
+ * An array of `count` results, as rd_inject_libraries() has (optional)
+ *
+ * @return KERN_SUCCESS
+ * Means every library has been loaded
+ * @return KERN_INVALID_OBJECT
+ * Means some library has failed to load
+ * @return KERN_OPERATION_TIMED_OUT
+ * Means the agent hasn't answered in time (e.g. the target is gone or stopped)
+ */
+int rd_agent_load_libraries(rd_agent_t *agent, const char *library_paths[], size_t count,
+                            int results[]);
+
+/**
+ * @abstract
+ * Has the agent dlclose() a library loaded into the target either way.
+ *
+ * @return KERN_INVALID_ARGUMENT
+ * Means the library has never been loaded into the target
+ */
+int rd_agent_unload_library(rd_agent_t *agent, const char *library_path);
+
+/**
+ * @abstract
+ * Has the agent call a routine as `uint64_t routine(uint64_t argument)`.
+ *
+ * @param library_path
+ * The library to look the routine up in, or NULL to look it up in every library
+ * @param result
+ * Receives what the routine has returned (optional)
+ *
+ * @return KERN_INVALID_ARGUMENT
+ * Means the library has never been loaded into the target
+ * @return KERN_INVALID_OBJECT
+ * Means there's no such routine
+ */
+int rd_agent_call(rd_agent_t *agent, const char *library_path, const char *symbol,
+                  uint64_t argument, uint64_t *result);
@@ -0,0 +1,61 @@
+//
+//  rd_agent_ring.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  The command ring shared by the injector and the resident agent (see rd_agent.h).
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+
+#define kRDAgentRingMagic       (0x47415244) /* "RDAG" */
+#define kRDAgentRingVersion     (1)
+/* The agent's memfd shows up as "/memfd:<name> (deleted)" in /proc/<pid>/fd */
+#define kRDAgentRingName        "rd_agent_ring"
+#define kRDAgentRingSlots       (32)
+
+typedef enum {
+    /* dlopen(string, RTLD_NOW | RTLD_LOCAL) */
+    RD_AGENT_DLOPEN = 1,
+    /* dlclose(handle) */
+    RD_AGENT_DLCLOSE,
+    /* dlsym(handle or RTLD_DEFAULT, string)(argument) */
+    RD_AGENT_CALL
+} rd_agent_command_t;
+
+typedef struct {
+    uint32_t command;
+    /* 0 if the command has succeeded, -1 otherwise */
+    int32_t status;
+    uint64_t handle;
+    uint64_t argument;
+    /* The new handle (RD_AGENT_DLOPEN) or what the routine has returned (RD_AGENT_CALL) */
+    uint64_t result;
+    char string[PATH_MAX];
+} rd_agent_slot_t;
+
+/**
+ * @discussion
+ * A single-producer single-consumer ring: only the injector moves `head`, only the agent
+ * moves `tail`. Every connection takes a write lock on the whole memfd (F_OFD_SETLKW)
+ * before touching `head`, so there's a single producer however many threads and
+ * processes are connected to the agent. Both counters only
+ * grow, and both are futex words: the agent sleeps on `head` while the ring is empty,
+ * the injector sleeps on `tail` until its commands are done. The ring lives in a
+ * memfd, so the futexes are shared ones.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    /* The process that has created the ring, i.e. not a forked child of it */
+    int32_t owner;
+    uint32_t slots_count;
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    _Alignas(64) rd_agent_slot_t slots[kRDAgentRingSlots];
+} rd_agent_ring_t;
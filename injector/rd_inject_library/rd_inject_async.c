@@ -0,0 +1,564 @@
+//
+//  rd_inject_async.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#if defined(__APPLE__)
+#include <dispatch/dispatch.h>
+#elif defined(__linux__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include "rd_inject_library_linux.h"
+#endif
+
+#include "rd_inject_async.h"
+
+#if defined(__linux__)
+/* Stops of the targets aren't pollable, so while some remote dlopen()s are in flight
+ * the engine checks for them every so often: right away at first, then backing off */
+#define kRDEngineMinPollInterval    (20 * 1000ull)
+#define kRDEngineMaxPollInterval    (5 * 1000 * 1000ull)
+#endif
+
+#pragma mark - Private Interface
+
+struct rd_injection {
+    pid_t target;
+    char **library_paths;
+    size_t count;
+    /* Monotonic time to give up at, or zero */
+    uint64_t deadline_ns;
+    atomic_uint references;
+    atomic_bool cancelled;
+
+    pthread_mutex_t lock;
+    bool finished;
+    int result;
+    int *results;
+    rd_inject_timings_t timings;
+    /* An eventfd on Linux, a pipe on OS X */
+    int notify_fds[2];
+
+#if defined(__linux__)
+    /* The rest is owned by the engine thread */
+    struct rd_injection *next;
+    bool started;
+    bool abandoned;
+    rd_linux_injection_t machine;
+#endif
+};
+
+static rd_injection_t *injection_create(pid_t target, const char *library_paths[], size_t count,
+                                        double timeout);
+static bool injection_complete(rd_injection_t *injection, int result, const int results[],
+                               const rd_inject_timings_t *timings);
+static bool injection_is_finished(rd_injection_t *injection);
+static bool backend_submit(rd_injection_t *injection);
+static void backend_cancel(rd_injection_t *injection);
+
+#if defined(__linux__)
+/* The only thread that ever traces targets of asynchronous injections */
+static struct {
+    pthread_mutex_t lock;
+    /* New injections the engine hasn't picked up yet */
+    rd_injection_t *submitted;
+    rd_injection_t **submitted_tail;
+    /* An eventfd to wake the engine up with */
+    int wakeup;
+} engine = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .submitted = NULL,
+    .submitted_tail = &engine.submitted,
+    .wakeup = -1
+};
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+static void engine_start(void);
+static void engine_wake_up(void);
+static void *engine_thread(void *unused);
+static bool engine_pass(rd_injection_t **injections, uint64_t *next_deadline, bool *tracing);
+static rd_injection_t *engine_find_tracee(rd_injection_t *injections, pid_t target);
+#endif
+
+#pragma mark - Implementation
+
+rd_injection_t *rd_inject_library_async(pid_t target, const char *library_path, double timeout)
+{
+    return rd_inject_libraries_async(target, &library_path, 1, timeout);
+}
+
+rd_injection_t *rd_inject_libraries_async(pid_t target, const char *library_paths[], size_t count,
+                                          double timeout)
+{
+    if (target <= 0 || !library_paths || count == 0 || timeout < 0) {
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!library_paths[i]) {
+            return NULL;
+        }
+    }
+    rd_injection_t *injection = injection_create(target, library_paths, count, timeout);
+    if (!injection) {
+        return NULL;
+    }
+    /* One reference for the caller and one for the backend */
+    atomic_store(&injection->references, 2);
+    if (!backend_submit(injection)) {
+        atomic_store(&injection->references, 1);
+        rd_injection_release(injection);
+        return NULL;
+    }
+    return injection;
+}
+
+int rd_injection_fd(rd_injection_t *injection)
+{
+    if (!injection) return -1;
+
+    return injection->notify_fds[0];
+}
+
+bool rd_injection_result(rd_injection_t *injection, int *result, int results[],
+                         rd_inject_timings_t *timings)
+{
+    if (!injection) return false;
+
+    pthread_mutex_lock(&injection->lock);
+    bool finished = injection->finished;
+    if (finished) {
+        if (result) *result = injection->result;
+        if (results) memcpy(results, injection->results, injection->count * sizeof(*results));
+        if (timings) *timings = injection->timings;
+    }
+    pthread_mutex_unlock(&injection->lock);
+
+    return finished;
+}
+
+void rd_injection_cancel(rd_injection_t *injection)
+{
+    if (!injection) return;
+
+    atomic_store(&injection->cancelled, true);
+    injection_complete(injection, KERN_ABORTED, NULL, NULL);
+    backend_cancel(injection);
+}
+
+void rd_injection_release(rd_injection_t *injection)
+{
+    if (!injection) return;
+    if (atomic_fetch_sub(&injection->references, 1) != 1) return;
+
+    for (size_t i = 0; i < injection->count; i++) {
+        free(injection->library_paths[i]);
+    }
+    free(injection->library_paths);
+    free(injection->results);
+    if (injection->notify_fds[0] >= 0) close(injection->notify_fds[0]);
+    if (injection->notify_fds[1] >= 0 && injection->notify_fds[1] != injection->notify_fds[0]) {
+        close(injection->notify_fds[1]);
+    }
+    pthread_mutex_destroy(&injection->lock);
+    free(injection);
+}
+
+static
+rd_injection_t *injection_create(pid_t target, const char *library_paths[], size_t count,
+                                 double timeout)
+{
+    rd_injection_t *injection = calloc(1, sizeof(*injection));
+    if (!injection) {
+        return NULL;
+    }
+    injection->target = target;
+    injection->notify_fds[0] = injection->notify_fds[1] = -1;
+    pthread_mutex_init(&injection->lock, NULL);
+    atomic_init(&injection->references, 1);
+    atomic_init(&injection->cancelled, false);
+    if (timeout > 0) {
+        injection->deadline_ns = rd_inject_clock_ns() + (uint64_t)(timeout * 1e9);
+    }
+
+    injection->library_paths = calloc(count, sizeof(*injection->library_paths));
+    injection->results = calloc(count, sizeof(*injection->results));
+    if (!injection->library_paths || !injection->results) {
+        rd_injection_release(injection);
+        return NULL;
+    }
+    /* Let release() know how many paths to free */
+    injection->count = count;
+    for (size_t i = 0; i < count; i++) {
+        injection->results[i] = KERN_FAILURE;
+        if (!(injection->library_paths[i] = strdup(library_paths[i]))) {
+            rd_injection_release(injection);
+            return NULL;
+        }
+    }
+
+#if defined(__linux__)
+    injection->notify_fds[0] = injection->notify_fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (injection->notify_fds[0] < 0) {
+#else
+    if (pipe(injection->notify_fds) != 0) {
+#endif
+        syslog(LOG_NOTICE, "Could not create a notification descriptor: %s", strerror(errno));
+        rd_injection_release(injection);
+        return NULL;
+    }
+#if !defined(__linux__)
+    for (int i = 0; i < 2; i++) {
+        fcntl(injection->notify_fds[i], F_SETFD, FD_CLOEXEC);
+        fcntl(injection->notify_fds[i], F_SETFL, O_NONBLOCK);
+    }
+#endif
+
+    return injection;
+}
+
+/**
+ * @abstract
+ * Finishes the injection (unless it's already finished) and makes its descriptor readable.
+ *
+ * @return
+ * false if the injection had already been finished (i.e. timed out or cancelled)
+ */
+static
+bool injection_complete(rd_injection_t *injection, int result, const int results[],
+                        const rd_inject_timings_t *timings)
+{
+    pthread_mutex_lock(&injection->lock);
+    if (injection->finished) {
+        pthread_mutex_unlock(&injection->lock);
+        return false;
+    }
+    injection->finished = true;
+    injection->result = result;
+    if (results) {
+        memcpy(injection->results, results, injection->count * sizeof(*results));
+    }
+    if (timings) {
+        injection->timings = *timings;
+    }
+    pthread_mutex_unlock(&injection->lock);
+
+#if defined(__linux__)
+    uint64_t value = 1;
+#else
+    char value = 1;
+#endif
+    if (write(injection->notify_fds[1], &value, sizeof(value)) != (ssize_t)sizeof(value)) {
+        syslog(LOG_NOTICE, "Could not signal an injection completion: %s", strerror(errno));
+    }
+    return true;
+}
+
+static
+bool injection_is_finished(rd_injection_t *injection)
+{
+    pthread_mutex_lock(&injection->lock);
+    bool finished = injection->finished;
+    pthread_mutex_unlock(&injection->lock);
+
+    return finished;
+}
+
+#if defined(__APPLE__)
+
+static void injection_worker(void *context);
+static void injection_timeout(void *context);
+
+static
+bool backend_submit(rd_injection_t *injection)
+{
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    if (injection->deadline_ns != 0) {
+        atomic_fetch_add(&injection->references, 1);
+        /* The deadline may have passed already, e.g. while the injection was queued */
+        uint64_t now = rd_inject_clock_ns();
+        uint64_t timeout = (injection->deadline_ns > now) ? injection->deadline_ns - now : 0;
+        dispatch_after_f(dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout), queue,
+                         injection, injection_timeout);
+    }
+    dispatch_async_f(queue, injection, injection_worker);
+    return true;
+}
+
+static
+void backend_cancel(rd_injection_t *injection)
+{
+    /* There's no way to stop a running injection here, the worker will discard its result */
+    (void)injection;
+}
+
+/**
+ * @abstract
+ * Runs the injection on a GCD worker thread.
+ */
+static
+void injection_worker(void *context)
+{
+    rd_injection_t *injection = context;
+    if (!atomic_load(&injection->cancelled) && !injection_is_finished(injection)) {
+        int *results = calloc(injection->count, sizeof(*results));
+        rd_inject_timings_t timings;
+        int result = rd_inject_libraries_with_timings(injection->target,
+                                                      (const char **)injection->library_paths,
+                                                      injection->count, results, &timings);
+        injection_complete(injection, results ? result : KERN_FAILURE, results, &timings);
+        free(results);
+    }
+    rd_injection_release(injection);
+}
+
+static
+void injection_timeout(void *context)
+{
+    rd_injection_t *injection = context;
+    injection_complete(injection, KERN_OPERATION_TIMED_OUT, NULL, NULL);
+    rd_injection_release(injection);
+}
+
+#elif defined(__linux__)
+
+static
+bool backend_submit(rd_injection_t *injection)
+{
+    pthread_once(&engine_once, engine_start);
+    if (engine.wakeup < 0) {
+        return false;
+    }
+    pthread_mutex_lock(&engine.lock);
+    *engine.submitted_tail = injection;
+    engine.submitted_tail = &injection->next;
+    pthread_mutex_unlock(&engine.lock);
+    engine_wake_up();
+
+    return true;
+}
+
+static
+void backend_cancel(rd_injection_t *injection)
+{
+    (void)injection;
+    engine_wake_up();
+}
+
+static
+void engine_start(void)
+{
+    int wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeup < 0) {
+        syslog(LOG_NOTICE, "Could not create the injection engine's eventfd: %s", strerror(errno));
+        return;
+    }
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    /* Don't let the engine take signals meant for the host's own threads */
+    sigset_t signals, old_signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_SETMASK, &signals, &old_signals);
+    pthread_t thread;
+    int err = pthread_create(&thread, &attributes, engine_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    pthread_attr_destroy(&attributes);
+    if (err != 0) {
+        syslog(LOG_NOTICE, "Could not spawn the injection engine: %s", strerror(err));
+        close(wakeup);
+        return;
+    }
+    engine.wakeup = wakeup;
+}
+
+static
+void engine_wake_up(void)
+{
+    uint64_t value = 1;
+    if (engine.wakeup >= 0 && write(engine.wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        syslog(LOG_NOTICE, "Could not wake up the injection engine: %s", strerror(errno));
+    }
+}
+
+/**
+ * @abstract
+ * The engine's event loop.
+ *
+ * @discussion
+ * Being the tracer of every target, the engine thread only collects its own tracees'
+ * stops (__WNOTHREAD), so it never reaps the host's children. Between passes it sleeps
+ * on the wakeup eventfd until the nearest deadline or, if some stubs are running, for
+ * a short while to check on them.
+ */
+static
+void *engine_thread(void *unused)
+{
+    (void)unused;
+    rd_injection_t *injections = NULL;
+    rd_injection_t **injections_tail = &injections;
+    uint64_t poll_interval = kRDEngineMinPollInterval;
+
+    while (1) {
+        pthread_mutex_lock(&engine.lock);
+        if (engine.submitted) {
+            *injections_tail = engine.submitted;
+            engine.submitted = NULL;
+            engine.submitted_tail = &engine.submitted;
+        }
+        pthread_mutex_unlock(&engine.lock);
+
+        bool progress = false;
+        int status = 0;
+        pid_t target = 0;
+        while ((target = waitpid(-1, &status, WNOHANG | __WALL | __WNOTHREAD)) > 0) {
+            rd_injection_t *injection = engine_find_tracee(injections, target);
+            if (injection) {
+                rd_linux_injection_handle_stop(&injection->machine, status);
+            }
+            progress = true;
+        }
+
+        uint64_t next_deadline = UINT64_MAX;
+        bool tracing = false;
+        progress |= engine_pass(&injections, &next_deadline, &tracing);
+        for (injections_tail = &injections; *injections_tail; injections_tail = &(*injections_tail)->next);
+
+        poll_interval = progress ? kRDEngineMinPollInterval : poll_interval * 2;
+        if (poll_interval > kRDEngineMaxPollInterval) {
+            poll_interval = kRDEngineMaxPollInterval;
+        }
+        uint64_t timeout = tracing ? poll_interval : UINT64_MAX;
+        if (next_deadline != UINT64_MAX) {
+            uint64_t now = rd_inject_clock_ns();
+            uint64_t until_deadline = (next_deadline > now) ? next_deadline - now : 0;
+            if (until_deadline < timeout) timeout = until_deadline;
+        }
+        struct timespec interval = {
+            .tv_sec = (time_t)(timeout / 1000000000ull),
+            .tv_nsec = (long)(timeout % 1000000000ull)
+        };
+        struct pollfd wakeup = {.fd = engine.wakeup, .events = POLLIN};
+        if (ppoll(&wakeup, 1, (timeout == UINT64_MAX) ? NULL : &interval, NULL) > 0) {
+            uint64_t value;
+            while (read(engine.wakeup, &value, sizeof(value)) > 0);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @abstract
+ * Starts, times out and retires the engine's injections.
+ *
+ * @discussion
+ * Injections are kept in submission order, so the first one for a target is the one
+ * to run: a target can't have two tracers anyway.
+ *
+ * @return
+ * true if some injection has been started or retired
+ */
+static
+bool engine_pass(rd_injection_t **injections, uint64_t *next_deadline, bool *tracing)
+{
+    bool progress = false;
+    uint64_t now = rd_inject_clock_ns();
+    /* Targets with an earlier injection still around */
+    size_t busy_capacity = 64, busy_count = 0;
+    pid_t *busy = malloc(busy_capacity * sizeof(*busy));
+
+    rd_injection_t **link = injections;
+    while (*link) {
+        rd_injection_t *injection = *link;
+        bool cancelled = atomic_load(&injection->cancelled);
+        bool expired = (injection->deadline_ns != 0 && now >= injection->deadline_ns);
+        if (expired) {
+            injection_complete(injection, KERN_OPERATION_TIMED_OUT, NULL, NULL);
+        }
+
+        if (!injection->started && !cancelled && !expired) {
+            bool is_busy = false;
+            for (size_t i = 0; i < busy_count && !is_busy; i++) {
+                is_busy = (busy[i] == injection->target);
+            }
+            if (!is_busy) {
+                injection->started = true;
+                rd_linux_injection_start(&injection->machine, injection->target,
+                                         (const char **)injection->library_paths, injection->count);
+                progress = true;
+            }
+        } else if (injection->started && (cancelled || expired) && !injection->abandoned) {
+            /* A running stub will finish on its own, but the caller doesn't wait for it */
+            injection->abandoned = true;
+            rd_linux_injection_cancel(&injection->machine);
+        }
+
+        bool retired = !injection->started && (cancelled || expired);
+        if (injection->started && injection->machine.state == RD_INJECTION_FINISHED) {
+            int *results = calloc(injection->count, sizeof(*results));
+            rd_inject_timings_t timings;
+            int result = rd_linux_injection_finish(&injection->machine, results, &timings);
+            injection_complete(injection, results ? result : KERN_FAILURE, results, &timings);
+            free(results);
+            retired = true;
+        }
+        if (retired) {
+            *link = injection->next;
+            injection->next = NULL;
+            rd_injection_release(injection);
+            progress = true;
+            continue;
+        }
+
+        if (injection->started) {
+            *tracing = true;
+        }
+        if (injection->deadline_ns != 0 && !injection_is_finished(injection) &&
+            injection->deadline_ns < *next_deadline) {
+            *next_deadline = injection->deadline_ns;
+        }
+        if (busy_count == busy_capacity) {
+            pid_t *grown = realloc(busy, 2 * busy_capacity * sizeof(*busy));
+            if (grown) {
+                busy = grown;
+                busy_capacity *= 2;
+            }
+        }
+        if (busy && busy_count < busy_capacity) {
+            busy[busy_count++] = injection->target;
+        }
+        link = &injection->next;
+    }
+    free(busy);
+
+    return progress;
+}
+
+static
+rd_injection_t *engine_find_tracee(rd_injection_t *injections, pid_t target)
+{
+    for (rd_injection_t *injection = injections; injection; injection = injection->next) {
+        if (injection->started && injection->target == target &&
+            injection->machine.state != RD_INJECTION_FINISHED) {
+            return injection;
+        }
+    }
+    return NULL;
+}
+
+#endif // defined(__linux__)
@@ -0,0 +1,99 @@
+//
+//  rd_inject_async.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rd_inject_library.h"
+
+/* An injection in flight */
+typedef struct rd_injection rd_injection_t;
+
+/**
+ * @abstract
+ * Starts loading (injecting) a number of dynamic libraries into a target process
+ * without waiting for it to finish.
+ *
+ * @discussion
+ * The injection itself is the same as rd_inject_libraries() does. On Linux every
+ * asynchronous injection is driven by a single background tracer thread that never
+ * blocks on a target, so thousands of them may be in flight at once. On OS X
+ * injections are run on a GCD queue.
+ *
+ * Injections into the same target run one after another in submission order.
+ *
+ * @param target
+ * The identifer of the target process
+ * @param library_paths
+ * The full paths of the libraries to be injected (they're copied)
+ * @param count
+ * The number of libraries
+ * @param timeout
+ * How many seconds to wait for the injection before giving up on it; pass 0 for no timeout
+ *
+ * @return
+ * A new injection (release it with rd_injection_release()) or NULL on error
+ */
+rd_injection_t *rd_inject_libraries_async(pid_t target, const char *library_paths[], size_t count,
+                                          double timeout);
+
+/**
+ * @abstract
+ * Same as rd_inject_libraries_async() for a single library.
+ */
+rd_injection_t *rd_inject_library_async(pid_t target, const char *library_path, double timeout);
+
+/**
+ * @abstract
+ * Returns a file descriptor that becomes readable once the injection is finished.
+ *
+ * @discussion
+ * The descriptor is meant for poll()/epoll()/kqueue() only: don't read from it or
+ * close it, it's owned by the injection.
+ */
+int rd_injection_fd(rd_injection_t *injection);
+
+/**
+ * @abstract
+ * Collects the result of the injection without blocking.
+ *
+ * @param result
+ * An optional pointer to put the rd_inject_libraries() result into, or
+ * KERN_OPERATION_TIMED_OUT if the injection has timed out, or
+ * KERN_ABORTED if it has been cancelled
+ * @param results
+ * An optional array of `count` items to put a per-library result into
+ * @param timings
+ * An optional pointer to put the injection timings into (zeroes if the
+ * injection has timed out or been cancelled)
+ *
+ * @return
+ * false if the injection is still in progress
+ */
+bool rd_injection_result(rd_injection_t *injection, int *result, int results[],
+                         rd_inject_timings_t *timings);
+
+/**
+ * @abstract
+ * Cancels the injection.
+ *
+ * @discussion
+ * The injection is finished with KERN_ABORTED right away (unless it has already
+ * finished). Note that a remote dlopen() can't be interrupted: if it's already
+ * running, it will complete (and the target will be restored) in the background, so
+ * the libraries may still end up loaded. The same applies to timeouts.
+ */
+void rd_injection_cancel(rd_injection_t *injection);
+
+/**
+ * @abstract
+ * Lets go of the injection; the injection itself is not cancelled.
+ */
+void rd_injection_release(rd_injection_t *injection);
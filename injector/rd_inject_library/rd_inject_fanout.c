@@ -0,0 +1,143 @@
+//
+//  rd_inject_fanout.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <time.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "rd_inject_library.h"
+
+#pragma mark - Private Interface
+
+/* A state shared between all workers of a single fan-out */
+typedef struct {
+    const pid_t *targets;
+    size_t count;
+    const char *library_path;
+    /* An index of the next target to pick up */
+    atomic_size_t next;
+    int *results;
+    /* Per-target injection latency in nanoseconds */
+    uint64_t *latencies;
+} rd_fanout_context_t;
+
+static void *fanout_worker(void *context);
+
+#pragma mark - Implementation
+
+int rd_inject_library_into_processes(const pid_t targets[], size_t count, const char *library_path,
+                                     unsigned int concurrency, int results[],
+                                     rd_fanout_stats_t *stats)
+{
+    if (!targets || count == 0 || !library_path) {
+        return KERN_FAILURE;
+    }
+    if (concurrency == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        concurrency = (cpus > 0) ? (unsigned int)cpus : 1;
+    }
+    if (concurrency > count) {
+        concurrency = (unsigned int)count;
+    }
+
+    int *local_results = results ? results : calloc(count, sizeof(*local_results));
+    uint64_t *latencies = calloc(count, sizeof(*latencies));
+    pthread_t *workers = calloc(concurrency, sizeof(*workers));
+    if (!local_results || !latencies || !workers) {
+        if (!results) free(local_results);
+        free(latencies);
+        free(workers);
+        return KERN_FAILURE;
+    }
+    for (size_t i = 0; i < count; i++) {
+        local_results[i] = KERN_FAILURE;
+    }
+    rd_fanout_context_t context = {
+        .targets = targets,
+        .count = count,
+        .library_path = library_path,
+        .results = local_results,
+        .latencies = latencies
+    };
+    atomic_init(&context.next, 0);
+
+    uint64_t start = rd_inject_clock_ns();
+    /* The calling thread is a worker too */
+    unsigned int spawned = 0;
+    for (unsigned int i = 1; i < concurrency; i++) {
+        if (pthread_create(&workers[spawned], NULL, fanout_worker, &context) != 0) {
+            syslog(LOG_NOTICE, "Could only spawn %u fan-out workers out of %u", spawned + 1,
+                   concurrency);
+            break;
+        }
+        spawned++;
+    }
+    fanout_worker(&context);
+    for (unsigned int i = 0; i < spawned; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    uint64_t elapsed = rd_inject_clock_ns() - start;
+
+    int err = rd_fanout_stats_compute(local_results, latencies, count, elapsed, spawned + 1, stats);
+
+    if (!results) free(local_results);
+    free(latencies);
+    free(workers);
+
+    return err;
+}
+
+int rd_fanout_stats_compute(const int results[], const uint64_t latencies_ns[], size_t count,
+                            uint64_t elapsed_ns, unsigned int concurrency, rd_fanout_stats_t *stats)
+{
+    int err = KERN_SUCCESS;
+    size_t succeeded = 0;
+    uint64_t min_latency = UINT64_MAX, max_latency = 0, total_latency = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (results[i] == KERN_SUCCESS) {
+            succeeded++;
+        } else {
+            err = KERN_FAILURE;
+        }
+        if (latencies_ns[i] < min_latency) min_latency = latencies_ns[i];
+        if (latencies_ns[i] > max_latency) max_latency = latencies_ns[i];
+        total_latency += latencies_ns[i];
+    }
+    if (stats) {
+        stats->injections = count;
+        stats->succeeded = succeeded;
+        stats->failed = count - succeeded;
+        stats->concurrency = concurrency;
+        stats->elapsed_sec = elapsed_ns / 1e9;
+        stats->throughput = (elapsed_ns > 0) ? count / (elapsed_ns / 1e9) : 0;
+        stats->min_latency_sec = (count > 0) ? min_latency / 1e9 : 0;
+        stats->max_latency_sec = max_latency / 1e9;
+        stats->mean_latency_sec = (count > 0) ? (total_latency / count) / 1e9 : 0;
+    }
+
+    return err;
+}
+
+static
+void *fanout_worker(void *ctx)
+{
+    rd_fanout_context_t *context = ctx;
+    while (1) {
+        size_t i = atomic_fetch_add(&context->next, 1);
+        if (i >= context->count) {
+            break;
+        }
+        uint64_t start = rd_inject_clock_ns();
+        context->results[i] = rd_inject_library(context->targets[i], context->library_path);
+        context->latencies[i] = rd_inject_clock_ns() - start;
+    }
+    return NULL;
+}
@@ -7,31 +7,45 @@
 //
 #include <dlfcn.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <syslog.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <mach/mach.h>
-#include <sys/param.h>
-#include <sys/sysctl.h>
 #include <mach-o/dyld.h>
 #include <dispatch/dispatch.h>
 #include <mach/machine/thread_status.h>
 
 #include "rd_inject_library.h"
+#include "rd_inject_stub.h"
+#include "rd_remote_handles.h"
+#include "rd_inject_preflight.h"
+#include "rd_remote_arena.h"
+#include "rd_inject_log.h"
 
 #define kRDRemoteStackSize      (25*1024)
-#define kRDShouldJumpToDlopen   0xabad1dea
 
-#define RDFailOnError(function) {if (err != KERN_SUCCESS) {syslog(LOG_NOTICE, "[%d] %s failed with error: %s\n", \
-    __LINE__-1, function, mach_error_string(err)); return (err);}}
+#define RDFailOnError(function) {if (err != KERN_SUCCESS) {RDLogKernFailed(proc, kRDLogNoPhase, \
+    function, err); goto teardown;}}
 
 #pragma mark - Private Interface
 
-static int load_library_into_task(task_t task, const char *library_path, void **return_value);
+/* A state of a single injection shared with our exception handler
+ * (it's attached to the exception port as the port's context) */
+typedef struct {
+    /* Where the remote stub's final trap leaves the instruction pointer */
+    uint64_t trap_address;
+    /* Whether the stub has got to its final trap */
+    bool finished;
+    rd_inject_timer_t *timer;
+} rd_injection_context_t;
+
+static int attach_to_process(pid_t proc, task_t *task, rd_inject_timer_t *timer);
+static int run_stub_in_task(pid_t proc, task_t task, const rd_inject_stub_call_t *call,
+                            void *results, rd_inject_timer_t *timer);
 static mach_port_t
 init_exception_port_for_thread(thread_act_t thread, thread_state_flavor_t thread_flavor);
-static bool process_is_64_bit(pid_t proc);
 
 /* Received from xnu/bsd/uxkern/ux_exception.c
  * (Apple's XNU version 2422.90.20)
@@ -54,87 +68,169 @@ typedef struct {
 #pragma mark - Implementation
 
 int rd_inject_library(pid_t target_proc, const char *library_path)
+{
+    return rd_inject_libraries(target_proc, &library_path, 1, NULL);
+}
+
+int rd_inject_libraries(pid_t target_proc, const char *library_paths[], size_t count, int results[])
+{
+    return rd_inject_libraries_with_timings(target_proc, library_paths, count, results, NULL);
+}
+
+int rd_inject_libraries_with_timings(pid_t target_proc, const char *library_paths[], size_t count,
+                                     int results[], rd_inject_timings_t *timings)
 {
     int err = KERN_FAILURE;
-    if (target_proc <= 0 || !library_path) {
+    if (target_proc <= 0 || !library_paths || count == 0) {
         return (err);
     }
+    for (size_t i = 0; i < count; i++) {
+        if (!library_paths[i]) {
+            return (err);
+        }
+        if (results) results[i] = KERN_FAILURE;
+    }
+
+    /* Don't even create a remote thread if the target is unable to load the libraries anyway */
+    uint64_t *scratch = NULL;
+    rd_inject_timer_t timer;
+    rd_inject_timer_start(&timer);
+    err = rd_inject_preflight_target(target_proc);
+    if (err != KERN_SUCCESS) {
+        goto end;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (rd_inject_preflight_library(target_proc, library_paths[i]) != KERN_SUCCESS) {
+            err = KERN_INVALID_OBJECT;
+            if (results) results[i] = err;
+        }
+    }
+    /* Get the libraries off the disk while we're getting the task port, rather than in dlopen() */
+    for (size_t i = 0; err == KERN_SUCCESS && i < count; i++) {
+        rd_inject_prefetch_library(target_proc, library_paths[i]);
+    }
+    rd_inject_timer_mark(&timer, RD_PHASE_PREFLIGHT);
+    if (err != KERN_SUCCESS) {
+        goto end;
+    }
 
-    /* Yeah, I know, there're lots of i386 apps.
-     * No.
-     * There aren't.
-     * YOLO.
-     */
-    bool proc64bit = process_is_64_bit(target_proc);
-    if (!proc64bit) {
-        syslog(LOG_NOTICE, "[The target task should be a 64 bit process]");
+    /* Lay out the completion word, the results and all the paths one after another */
+    size_t results_size = sizeof(uint64_t) * (count + 1);
+    size_t scratch_size = results_size;
+    for (size_t i = 0; i < count; i++) {
+        scratch_size += strlen(library_paths[i]) + 1;
+    }
+    scratch = calloc(1, scratch_size);
+    if (!scratch) {
+        err = KERN_FAILURE;
         goto end;
     }
+    char *path = (char *)scratch + results_size;
+    for (size_t i = 0; i < count; i++) {
+        size_t path_size = strlen(library_paths[i]) + 1;
+        memcpy(path, library_paths[i], path_size);
+        path += path_size;
+    }
+    rd_inject_stub_call_t call = {
+        .code = rd_inject_stub,
+        .size = kRDInjectStubSize,
+        .trap_offset = kRDInjectStubTrapOffset,
+        .scratch = scratch,
+        .scratch_size = scratch_size,
+        .results_size = results_size,
+        .rbx_offset = results_size,
+        .r12 = count,
+        .completion = count
+    };
 
     task_t task;
-    /* You should be a member of procmod users group in order to
-     * use task_for_pid(). Being root is OK. */
-    err = task_for_pid(mach_task_self(), target_proc, &task);
+    err = attach_to_process(target_proc, &task, &timer);
     if (err != KERN_SUCCESS) {
-        syslog(LOG_NOTICE, "task_for_pid() failed with error: %s [%d]",
-               mach_error_string(err), err);
         goto end;
     }
-    void *remote_dlopen_return_value = NULL;
-    err = load_library_into_task(task, library_path, &remote_dlopen_return_value);
+    /* The results go right over the local scratch area */
+    err = run_stub_in_task(target_proc, task, &call, scratch, &timer);
+    mach_port_deallocate(mach_task_self(), task);
     if (err != KERN_SUCCESS) {
-        syslog(LOG_NOTICE, "load_library_into_task() failed with error: %s [%d]",
-               mach_error_string(err), err);
+        RDLogKernFailed(target_proc, kRDLogNoPhase, "load_libraries_into_task()", err);
         goto end;
     }
-    if (remote_dlopen_return_value == NULL) {
-        err = KERN_INVALID_OBJECT;
-        syslog(LOG_NOTICE, "Remote dlopen() failed");
-        goto end;
+    for (size_t i = 0; i < count; i++) {
+        int result = KERN_SUCCESS;
+        if (scratch[i + 1] == 0) {
+            result = err = KERN_INVALID_OBJECT;
+            RDLogDlopenFailed(target_proc, library_paths[i]);
+        } else {
+            rd_remote_handles_record(target_proc, library_paths[i], scratch[i + 1]);
+        }
+        if (results) results[i] = result;
     }
 
 end:
+    free(scratch);
+    rd_inject_timer_finish(&timer, timings);
+    return (err);
+}
+
+int rd_inject_run_stub(pid_t target_proc, const rd_inject_stub_call_t *call, void *results,
+                       rd_inject_timings_t *timings)
+{
+    if (target_proc <= 0 || !call || !call->code || call->size > vm_page_size ||
+        call->trap_offset > call->size || !call->scratch ||
+        call->results_size > call->scratch_size || call->rbx_offset >= call->scratch_size) {
+        return (KERN_FAILURE);
+    }
+    rd_inject_timer_t timer;
+    rd_inject_timer_start(&timer);
+    int err = rd_inject_preflight_target(target_proc);
+    rd_inject_timer_mark(&timer, RD_PHASE_PREFLIGHT);
+    task_t task;
+    if (err == KERN_SUCCESS) {
+        err = attach_to_process(target_proc, &task, &timer);
+    }
+    if (err == KERN_SUCCESS) {
+        err = run_stub_in_task(target_proc, task, call, results, &timer);
+        mach_port_deallocate(mach_task_self(), task);
+    }
+    rd_inject_timer_finish(&timer, timings);
     return (err);
 }
 
 /**
  * @abstract
- * Check wheither the given task is a 64 bit process.
- *
- * @return YES
- * Means the process' architecture is x86_64 (also ppcp64, but who cares)
- * @return NO
- * Means it's not
+ * Gets the task port of a target that has passed rd_inject_preflight_target().
  */
 static
-bool process_is_64_bit(pid_t proc)
+int attach_to_process(pid_t proc, task_t *task, rd_inject_timer_t *timer)
 {
-    int mib[4] = {
-        CTL_KERN, KERN_PROC, KERN_PROC_PID, proc
-    };
-    struct kinfo_proc info;
-    size_t size = sizeof(info);
-
-    if (sysctl(mib, 4, &info, &size, NULL, 0) == KERN_SUCCESS) {
-        return (info.kp_proc.p_flag & P_LP64);
-    } else {
-        return false;
+    /* You should be a member of procmod users group in order to
+     * use task_for_pid(). Being root is OK. */
+    int err = task_for_pid(mach_task_self(), proc, task);
+    rd_inject_timer_mark(timer, RD_PHASE_ATTACH);
+    if (err != KERN_SUCCESS) {
+        RDLogKernFailed(proc, RD_PHASE_ATTACH, "task_for_pid()", err);
     }
+    return (err);
 }
 
 /**
  * @abstract
- * Load a library into a given task.
+ * Run a stub inside a given task, e.g. to load libraries into it.
  *
  * @discussion
- * This function creates a remote thread inside the task and perform dlopen()
- * on this thread.
+ * This function creates a remote thread inside the task and runs the stub on this thread.
+ *
+ * The stub (see rd_inject_stub.h) first converts the thread (a plain mach thread) into
+ * a UNIX pthread with _pthread_set_self(), then does its job (e.g. calls dlopen() for
+ * every library, storing the results into a remote completion word and a results array:
+ * the stub's scratch area lives right above the remote stack), and finally traps.
+ * So we set up an exception handler for the remote thread, and the only exception
+ * we get is either the stub's final trap or a crash; either way the handler suspends
+ * the thread, and we read the results back and terminate it gracefully.
  *
- * As the created thead is a plain mach thread, we also need to convert it into a UNIX
- * pthead before calling dlopen(). To do that we'll set up an exeption handler for the
- * remote thread, then call _pthread_set_self() with invalid return address on it, catch
- * an EXC_BAD_ACCESS exception, re-configure the thread to call dlopen() and resume it.
- * We'll also gracefully terminate the thread when dlopen() returned.
+ * The stub, the stack and the scratch area all live in a single remote arena, which is
+ * released on every way out of here; the only exception is a remote thread we've failed
+ * to terminate, since it may still be running on that memory.
  *
  * @return
  * KERN_SUCCESS if injection was done without errors
@@ -142,72 +238,87 @@ bool process_is_64_bit(pid_t proc)
  * KERN_FAILRUE if there're some injection errors
  */
 static
-int load_library_into_task(task_t task, const char *library_path, void **return_value)
+int run_stub_in_task(pid_t proc, task_t task, const rd_inject_stub_call_t *call, void *results,
+                     rd_inject_timer_t *timer)
 {
     if (!task) return KERN_INVALID_ARGUMENT;
     int err = KERN_FAILURE;
+    rd_remote_arena_t arena = {0};
+    thread_act_t remote_thread = 0;
+    bool remote_thread_terminated = false;
+    mach_port_t exception_port = 0;
+    rd_injection_context_t context = {0};
+    uint64_t completion = 0;
 
-    /* Copy the library path into target's address space */
-    size_t path_size = strlen(library_path) + 1;
-    mach_vm_address_t rlibrary = 0;
-    err = mach_vm_allocate(task, &rlibrary, path_size, VM_FLAGS_ANYWHERE);
-    RDFailOnError("mach_vm_allocate");
-    err = mach_vm_write(task, rlibrary, (vm_offset_t)library_path,
-                        (mach_msg_type_number_t)path_size);
-    RDFailOnError("mach_vm_write");
-
-    /* Compose a fake backtrace and allocate remote stack. */
-    uint64_t fake_backtrace[] = {
-        kRDShouldJumpToDlopen
-    };
-    mach_vm_address_t stack = 0;
-    err = mach_vm_allocate(task, &stack, (kRDRemoteStackSize + sizeof(fake_backtrace)),
-                           VM_FLAGS_ANYWHERE);
-    RDFailOnError("mach_vm_allocate");
+    /* The stub will jump right into _pthread_set_self() to convert
+     * our mach thread into real POSIX thread */
+    void *pthread_set_self = dlsym(RTLD_DEFAULT, "_pthread_set_self");
+    if (!pthread_set_self) {
+        err = KERN_INVALID_HOST;
+        RDFailOnError("dlsym(\"_pthread_set_self\")");
+    }
+    rd_inject_timer_mark(timer, RD_PHASE_RESOLVE);
+
+    /* A page for the stub itself (the only executable one), then a remote stack with
+     * some place for the stub's scratch area (the completion word, the results and the
+     * libraries paths) right on top of it */
+    err = rd_remote_arena_map(&arena, proc, task,
+                              vm_page_size + kRDRemoteStackSize + call->scratch_size);
+    RDFailOnError("rd_remote_arena_map");
+    mach_vm_address_t stub = rd_remote_arena_allocate(&arena, vm_page_size, vm_page_size);
+    mach_vm_address_t stack = rd_remote_arena_allocate(&arena, kRDRemoteStackSize, 16);
+    mach_vm_address_t rcompletion = rd_remote_arena_allocate(&arena, call->scratch_size, 16);
+    err = (stub && stack && rcompletion == stack + kRDRemoteStackSize) ? KERN_SUCCESS : KERN_FAILURE;
+    RDFailOnError("rd_remote_arena_allocate");
+    rd_inject_timer_mark(timer, RD_PHASE_ALLOCATE);
 
     /* Reserve some place for a pthread struct */
     mach_vm_address_t pthread_struct = stack;
 
-    /* Copy the backtrace to the top of remote stack */
-    err = mach_vm_write(task, (stack + kRDRemoteStackSize), (vm_offset_t)fake_backtrace,
-                        (mach_msg_type_number_t)sizeof(fake_backtrace));
+    /* Copy the scratch area into target's address space */
+    err = mach_vm_write(task, rcompletion, (vm_offset_t)call->scratch,
+                        (mach_msg_type_number_t)call->scratch_size);
+    RDFailOnError("mach_vm_write");
+    /* Copy the stub and make it executable */
+    err = mach_vm_write(task, stub, (vm_offset_t)call->code, (mach_msg_type_number_t)call->size);
     RDFailOnError("mach_vm_write");
+    err = mach_vm_protect(task, stub, vm_page_size, FALSE, VM_PROT_READ | VM_PROT_EXECUTE);
+    RDFailOnError("mach_vm_protect");
+    rd_inject_timer_mark(timer, RD_PHASE_WRITE);
 
-    /* Initialize a remote thread state */
+    /* Initialize a remote thread state, see rd_inject_stub.h for the registers */
     x86_thread_state64_t state;
     memset(&state, 0, sizeof(state));
-    state.__rbp = stack;
-    state.__rsp = stack + kRDRemoteStackSize;
-
-    /* We'll jump right into _pthread_set_self() to convert
-     * our mach thread into real POSIX thread */
-    void *pthread_set_self = dlsym(RTLD_DEFAULT, "_pthread_set_self");
-    if (!pthread_set_self) {
-        err = KERN_INVALID_HOST;
-        RDFailOnError("dlsym(\"_pthread_set_self\")");
-    }
-    state.__rip = (mach_vm_address_t)pthread_set_self;
+    state.__rip = stub;
+    state.__rsp = rcompletion;
     state.__rdi = pthread_struct;
-    /* Store the library path here for dlopen() */
-    state.__rbx = rlibrary;
+    state.__r15 = (mach_vm_address_t)pthread_set_self;
+    state.__rbx = call->rbx_offset ? rcompletion + call->rbx_offset : 0;
+    state.__r12 = call->r12;
+    state.__r13 = rcompletion;
+    state.__r14 = (mach_vm_address_t)&dlopen;
+    state.__rbp = RTLD_NOW | RTLD_LOCAL;
 
     /* Create a remote thread, set up an exception port for it
-     * (so we will be able to handle ECX_BAD_ACCESS exceptions) */
-    thread_act_t remote_thread = 0;
+     * (so we will be able to handle the stub's trap) */
     err = thread_create(task, &remote_thread);
     RDFailOnError("thead_create");
     err = thread_set_state(remote_thread, x86_THREAD_STATE64,
                            (thread_state_t)&state, x86_THREAD_STATE64_COUNT);
     RDFailOnError("thread_set_state");
 
-    mach_port_t exception_port = 0;
     exception_port = init_exception_port_for_thread(remote_thread, x86_THREAD_STATE64);
     if (!exception_port) {
         err = KERN_FAILURE;
         RDFailOnError("init_exception_handler_for_thread");
     }
+    context.trap_address = stub + call->trap_offset;
+    context.timer = timer;
+    err = mach_port_set_context(mach_task_self(), exception_port, (mach_vm_address_t)&context);
+    RDFailOnError("mach_port_set_context");
     err = thread_resume(remote_thread);
     RDFailOnError("thread_resume");
+    rd_inject_timer_mark(timer, RD_PHASE_THREAD);
 
     /* Exception handling loop */
     while (1) {
@@ -224,30 +335,48 @@ int load_library_into_task(task_t task, const char *library_path, void **return_
 
         /* Chech if we've already suspended the thread inside our exception handler */
         if (thread_basic_info.suspend_count > 0) {
-            /* So retrive the dlopen() return value first */
-            if (return_value) {
-                x86_thread_state64_t updated_state;
-                mach_msg_type_number_t state_count = x86_THREAD_STATE64_COUNT;
-                err = thread_get_state(remote_thread, x86_THREAD_STATE64,
-                                       (thread_state_t)&updated_state, &state_count);
-                RDFailOnError("thread_get_state");
-                *return_value = (void *)updated_state.__rax;
-            }
-
-            /* then terminate the remote thread */
+            /* so terminate the remote thread */
             err = thread_terminate(remote_thread);
             RDFailOnError("thead_terminate");
-            /* and do some memory clean-up */
-            err = mach_vm_deallocate(task, rlibrary, path_size);
-            RDFailOnError("mach_vm_deallocate");
-            err = mach_vm_deallocate(task, stack, kRDRemoteStackSize);
-            RDFailOnError("mach_vm_deallocate");
-            err = mach_port_deallocate(mach_task_self(), exception_port);
-            RDFailOnError("mach_port_deallocate");
+            remote_thread_terminated = true;
+            /* collect the results (e.g. the dlopen() return values) */
+            mach_vm_size_t read_size = 0;
+            err = mach_vm_read_overwrite(task, rcompletion, sizeof(completion),
+                                         (mach_vm_address_t)&completion, &read_size);
+            RDFailOnError("mach_vm_read_overwrite");
+            if (results) {
+                err = mach_vm_read_overwrite(task, rcompletion, call->results_size,
+                                             (mach_vm_address_t)results, &read_size);
+                RDFailOnError("mach_vm_read_overwrite");
+            }
             break;
         }
     }
 
+teardown:
+    /* Never pull the memory from under a thread that may still be running on it */
+    if (remote_thread && !remote_thread_terminated &&
+        thread_terminate(remote_thread) != KERN_SUCCESS) {
+        RDLogNotice(proc, RD_PHASE_TEARDOWN, "left the remote thread's memory behind");
+        memset(&arena, 0, sizeof(arena));
+    }
+    if (remote_thread) {
+        mach_port_deallocate(mach_task_self(), remote_thread);
+    }
+    if (exception_port) {
+        mach_port_deallocate(mach_task_self(), exception_port);
+        mach_port_mod_refs(mach_task_self(), exception_port, MACH_PORT_RIGHT_RECEIVE, -1);
+    }
+    if (rd_remote_arena_release(&arena) != KERN_SUCCESS && err == KERN_SUCCESS) {
+        err = KERN_FAILURE;
+    }
+    rd_inject_timer_mark(timer, RD_PHASE_TEARDOWN);
+    /* The thread has crashed before it could finish its job */
+    if (err == KERN_SUCCESS && (!context.finished || completion != call->completion)) {
+        RDLogNotice(proc, RD_PHASE_DLOPEN, "the stub didn't finish properly");
+        err = KERN_FAILURE;
+    }
+
     return err;
 }
 
@@ -287,10 +416,11 @@ mach_port_t init_exception_port_for_thread(thread_act_t thread, thread_state_fla
 #pragma clang diagnostic ignored "-Wmissing-prototypes"
 /**
  * @abstract
- * Custom EXC_BAD_ACCESS exception handler, called by exc_server().
+ * Custom exception handler for the remote thread, called by exc_server().
+ *
+ * @discussion
+ * We only expect a single exception: the remote stub's final trap (or a crash).
  *
- * @return
- * KERN_SUCCESS indicates that we've reset a thread state and it's ready to be run again
  * @return
  * MIG_NO_REPLY indicates that we've terminated or suspended the thread, so the kernel won't
  *              handle it anymore. This one also breaks our exception handling loop, so we
@@ -310,29 +440,29 @@ catch_exception_raise_state_identity(mach_port_t exception_port, mach_port_t thr
                                      thread_state_t out_state,
                                      mach_msg_type_number_t *out_state_count)
 {
-#pragma unused (exception_port, task)
-#pragma unused (exception, code, code_count, in_state_count, out_state, out_state_count)
+#pragma unused (exception, code, code_count, in_state_count)
+#pragma unused (out_state, out_state_count)
 
     if (*flavor != x86_THREAD_STATE64) {
         return KERN_FAILURE;
     }
+    rd_injection_context_t *context = NULL;
+    mach_port_get_context(mach_task_self(), exception_port, (mach_vm_address_t *)&context);
+    if (!context) {
+        return KERN_FAILURE;
+    }
 
-    if (((x86_thread_state64_t *)in_state)->__rip == kRDShouldJumpToDlopen) {
-        /* Prepare the thread to execute dlopen() */
-        ((x86_thread_state64_t *)out_state)->__rip = (uint64_t)&dlopen;
-        ((x86_thread_state64_t *)out_state)->__rsi = RTLD_NOW | RTLD_LOCAL;
-        ((x86_thread_state64_t *)out_state)->__rdi = ((x86_thread_state64_t *)in_state)->__rbx;
-        /* Preserve the stack pointer */
-        uint64_t stack = ((x86_thread_state64_t *)in_state)->__rsp;
-        ((x86_thread_state64_t *)out_state)->__rsp =  stack;
-        /* Indicate that we've updateed this thread state and ready to resume it */
-        *out_state_count = x86_THREAD_STATE64_COUNT;
-
-        return KERN_SUCCESS;
+    x86_thread_state64_t *current_state = (x86_thread_state64_t *)in_state;
+    if (current_state->__rip == context->trap_address) {
+        context->finished = true;
+        rd_inject_timer_mark(context->timer, RD_PHASE_DLOPEN);
     }
-    /* In any other case we want to gracefully terminate the thread, so our
-     * target won't crash. */
+    /* Either the stub is done or the thread has crashed; in any case we want to
+     * gracefully terminate the thread, so our target won't crash. */
     thread_suspend(thread);
+    /* We don't reply, so the rights that came with the message are ours to drop */
+    mach_port_deallocate(mach_task_self(), thread);
+    mach_port_deallocate(mach_task_self(), task);
 
     return MIG_NO_REPLY;
 }
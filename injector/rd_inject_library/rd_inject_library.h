@@ -8,14 +8,36 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "rd_inject_stats.h"
+
+#if defined(__APPLE__)
+#include <mach/kern_return.h>
+#else
+/* The Linux backend reports the same error classes as the Mach one,
+ * so keep the values in sync with <mach/kern_return.h> */
+#define KERN_SUCCESS            0
+#define KERN_INVALID_ARGUMENT   4
+#define KERN_FAILURE            5
+#define KERN_RESOURCE_SHORTAGE  6
+#define KERN_ABORTED            14
+#define KERN_INVALID_HOST       22
+#define KERN_INVALID_OBJECT     29
+#define KERN_OPERATION_TIMED_OUT 49
+#endif
+
 /**
  * @abstract
  * Loads (injects) a dynamic library into a target process.
  *
  * @discussion
- * This function creates new thread in the target process and runs dlopen() on it.
+ * On OS X this function creates new thread in the target process and runs dlopen() on it.
+ * On Linux it hijacks one of the target's threads via ptrace() instead; the thread
+ * is only stopped for the duration of the remote dlopen() call.
  *
- * @see internal load_library_into_task() for details
+ * @see internal load_libraries_into_task() for details
  *
  * @param target
  * The identifer of the target process
@@ -24,9 +46,421 @@
  *
  * @return KERN_SUCCESS
  * Means the completion of injection and library loading
+ * @return KERN_INVALID_HOST
+ * Means that dlopen() could not be located inside the target
  * @return KERN_INVALID_OBJECT
- * Means that the remote dlopen() failed to open the library
+ * Means that the remote dlopen() failed to open the library, or that the library
+ * has failed the preflight checks (see rd_inject_preflight.h) and the target
+ * was never touched
  * @return KERN_FAILURE
  * Means an error occured while injecting into the target
  */
 int rd_inject_library(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Loads (injects) a number of dynamic libraries into a target process at once.
+ *
+ * @discussion
+ * Unlike calling rd_inject_library() for each library, this function attaches to
+ * the target only once and loads all the libraries (in the given order) using a
+ * single remote thread and stack.
+ *
+ * @param target
+ * The identifer of the target process
+ * @param library_paths
+ * The full paths of the libraries to be injected
+ * @param count
+ * The number of libraries
+ * @param results
+ * An optional array of `count` items to put a per-library result into:
+ * KERN_SUCCESS, KERN_INVALID_OBJECT or KERN_FAILURE (if the library was never
+ * reached because of an injection error)
+ *
+ * @return KERN_SUCCESS
+ * Means that all the libraries were loaded
+ * @return KERN_INVALID_OBJECT
+ * Means that the remote dlopen() failed to open some of the libraries, or that some
+ * of them have failed the preflight checks, in which case nothing is loaded at all
+ * @return
+ * Any other error means an error occured while injecting into the target
+ */
+int rd_inject_libraries(pid_t target, const char *library_paths[], size_t count, int results[]);
+
+/**
+ * @abstract
+ * Same as rd_inject_libraries(), but also reports how long each phase of the injection took.
+ *
+ * @discussion
+ * Every injection is timed anyway (see rd_inject_stats_snapshot() for the per-process
+ * histograms), this function just lets the caller have the timings of this one.
+ *
+ * @param timings
+ * An optional pointer to put the injection timings into
+ */
+int rd_inject_libraries_with_timings(pid_t target, const char *library_paths[], size_t count,
+                                     int results[], rd_inject_timings_t *timings);
+
+/* Aggregate statistics of rd_inject_library_into_processes() */
+typedef struct {
+    /* The number of target processes */
+    size_t injections;
+    size_t succeeded;
+    size_t failed;
+    /* The number of workers actually used */
+    unsigned int concurrency;
+    /* Wall clock time of the whole fan-out */
+    double elapsed_sec;
+    /* Injections per second */
+    double throughput;
+    /* Per-target injection latency */
+    double min_latency_sec;
+    double max_latency_sec;
+    double mean_latency_sec;
+} rd_fanout_stats_t;
+
+/**
+ * @abstract
+ * Loads (injects) a dynamic library into a number of target processes concurrently.
+ *
+ * @discussion
+ * Targets are handed out to a pool of worker threads (the calling thread included)
+ * that call rd_inject_library() for them. The function returns once every target
+ * has been processed.
+ *
+ * @param targets
+ * The identifiers of the target processes
+ * @param count
+ * The number of targets
+ * @param library_path
+ * The full path of the library to be injected
+ * @param concurrency
+ * The maximum number of injections in flight; pass 0 to use the number of online CPUs
+ * @param results
+ * An optional array of `count` items to put a per-target rd_inject_library() result into
+ * @param stats
+ * An optional pointer to put aggregate statistics into
+ *
+ * @return KERN_SUCCESS
+ * Means that the library was loaded into every target
+ * @return KERN_FAILURE
+ * Means that some of the injections failed (see `results` for details)
+ */
+int rd_inject_library_into_processes(const pid_t targets[], size_t count, const char *library_path,
+                                     unsigned int concurrency, int results[],
+                                     rd_fanout_stats_t *stats);
+
+/**
+ * @abstract
+ * Aggregates the per-target results and latencies of a fan-out.
+ *
+ * @discussion
+ * It's what rd_inject_library_into_processes() reports, for the daemons that fan out
+ * through their own request queues instead.
+ *
+ * @param concurrency
+ * The number of workers the fan-out has used
+ *
+ * @return
+ * KERN_SUCCESS if every target has succeeded, KERN_FAILURE otherwise
+ */
+int rd_fanout_stats_compute(const int results[], const uint64_t latencies_ns[], size_t count,
+                            uint64_t elapsed_ns, unsigned int concurrency, rd_fanout_stats_t *stats);
+
+/**
+ * @abstract
+ * Returns the handle the remote dlopen() has returned when we injected the library.
+ *
+ * @discussion
+ * Every successful injection is remembered per target process, which is what
+ * rd_swap_library() and rd_unload_library() rely on.
+ *
+ * @return
+ * The handle (only meaningful inside the target) or (0) if we haven't injected the
+ * library into the target
+ */
+uint64_t rd_injected_library_handle(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Unloads (dlclose()s) a library previously injected into the target.
+ *
+ * @return KERN_SUCCESS
+ * Means the remote dlclose() succeeded
+ * @return KERN_INVALID_ARGUMENT
+ * Means we haven't injected this library into the target
+ * @return
+ * Any other error means an error occured while injecting into the target
+ */
+int rd_unload_library(pid_t target, const char *library_path);
+
+/* Statistics of rd_swap_library() */
+typedef struct {
+    /* How long the target's own code was stopped (Linux). On OS X the target is never
+     * stopped, so it's how long the swap routine has run on its own remote thread */
+    uint64_t pause_ns;
+    /* Whether the new library exports the handoff symbol */
+    bool handoff_called;
+    /* What the handoff routine has returned */
+    int handoff_result;
+    rd_inject_timings_t timings;
+} rd_swap_stats_t;
+
+/**
+ * @abstract
+ * Atomically replaces a library previously injected into the target with another one.
+ *
+ * @discussion
+ * Everything happens in a single remote call (so on Linux the target is stopped once):
+ * the new library is dlopen()ed, then its handoff routine (if the caller names one and
+ * the library exports it) is called as `int handoff(void *old_handle)` and finally the
+ * old library is dlclose()d. If the new library fails to load, the old one stays; if the
+ * handoff routine returns non-zero, the new library is dlclose()d instead of the old one.
+ *
+ * The loader treats the same path as the same library, so a new version must come
+ * under a new path (e.g. a staged copy named after its content).
+ *
+ * @param target
+ * The identifer of the target process
+ * @param old_library_path
+ * The full path the old library was injected with
+ * @param new_library_path
+ * The full path of the new library
+ * @param handoff_symbol
+ * An optional name of the new library's handoff routine
+ * @param stats
+ * An optional pointer to put the swap statistics into
+ *
+ * @return KERN_SUCCESS
+ * Means the new library has replaced the old one
+ * @return KERN_INVALID_ARGUMENT
+ * Means we haven't injected the old library into the target
+ * @return KERN_INVALID_OBJECT
+ * Means that the remote dlopen() failed to open the new library, or that it has failed
+ * the preflight checks and the target was never stopped
+ * @return KERN_ABORTED
+ * Means the handoff routine has vetoed the swap
+ * @return
+ * Any other error means an error occured while injecting into the target
+ */
+int rd_swap_library(pid_t target, const char *old_library_path, const char *new_library_path,
+                    const char *handoff_symbol, rd_swap_stats_t *stats);
+
+/* How rd_spawn_with_library() has got the library into the new process */
+typedef enum {
+    /* The loader has loaded it along with the executable's own libraries */
+    RD_SPAWN_PRELOADED = 0,
+    /* The loader wouldn't (e.g. for a setuid executable), so it was injected instead */
+    RD_SPAWN_INJECTED
+} rd_spawn_mode_t;
+
+/* Statistics of rd_spawn_with_library() */
+typedef struct {
+    rd_spawn_mode_t mode;
+    /* From the spawn until the library's constructors have run (see rd_spawn_with_library()) */
+    uint64_t loaded_ns;
+    /* The injection's timings, RD_SPAWN_INJECTED only */
+    rd_inject_timings_t timings;
+} rd_spawn_stats_t;
+
+/**
+ * @abstract
+ * Launches a new process with a library already loaded into it.
+ *
+ * @discussion
+ * The library is handed to the loader (LD_PRELOAD on Linux, DYLD_INSERT_LIBRARIES on OS X),
+ * so it's loaded and initialized along with the executable's own libraries, before
+ * its main() runs, and the process never has to be stopped for an injection. If the loader
+ * ignores it (for setuid executables and, on OS X, restricted ones), the function falls
+ * back to injecting the library into the new process with rd_inject_library().
+ *
+ * On Linux the function returns once the process has reached its entry point, i.e. when
+ * every library's constructors have run. On OS X it returns once dyld has loaded the library,
+ * right before it runs the initializers.
+ *
+ * The loader does not give out handles of the libraries it loads, so a preloaded library
+ * can't be swapped or unloaded with rd_swap_library() and rd_unload_library().
+ *
+ * @param executable_path
+ * The full path of the executable
+ * @param argv
+ * The arguments of the new process, NULL-terminated
+ * @param envp
+ * The environment of the new process, NULL-terminated; NULL means our own environment
+ * @param library_path
+ * The full path of the library to be loaded
+ * @param pid
+ * Receives the identifier of the new process; it's set even if loading the library has
+ * failed, in which case the process is left running
+ * @param stats
+ * An optional pointer to put the spawn statistics into
+ *
+ * @return KERN_SUCCESS
+ * Means the process is running with the library loaded
+ * @return KERN_INVALID_OBJECT
+ * Means the library can't be read, or that the fallback injection has failed to load it
+ * @return KERN_FAILURE
+ * Means the process could not be launched or has died before its entry point
+ * @return
+ * Any other error comes from the fallback injection
+ */
+int rd_spawn_with_library(const char *executable_path, char *const argv[], char *const envp[],
+                          const char *library_path, pid_t *pid, rd_spawn_stats_t *stats);
+
+/* A library image kept in memory rather than in a file, see rd_payload_create() */
+typedef struct rd_payload rd_payload_t;
+
+/**
+ * @abstract
+ * Makes an injectable payload out of a library image in memory.
+ *
+ * @discussion
+ * This is the only time the bytes are copied: on Linux they go into a sealed memfd (it
+ * can't be written, grown or shrunk anymore) and every injection passes the very same
+ * descriptor to its target, so the target maps the same pages. The caller may free the
+ * buffer right away. OS X has no memfd, so the image is written into a read-only file in
+ * the temporary directory once instead, which is removed along with the payload.
+ *
+ * A payload is reference counted and may be injected from any thread.
+ *
+ * @param bytes
+ * The library image
+ * @param size
+ * The size of the image
+ * @param name
+ * A name to tell the payload by, it shows in the target's memory map on Linux
+ *
+ * @return
+ * A payload with a single reference or NULL if it couldn't be created
+ */
+rd_payload_t *rd_payload_create(const void *bytes, size_t size, const char *name);
+
+/**
+ * @abstract
+ * Takes another reference to a payload.
+ */
+rd_payload_t *rd_payload_retain(rd_payload_t *payload);
+
+/**
+ * @abstract
+ * Drops a reference to a payload, destroying it with the last one.
+ *
+ * @discussion
+ * Targets the payload has been injected into keep it loaded.
+ */
+void rd_payload_release(rd_payload_t *payload);
+
+/**
+ * @abstract
+ * Returns the path the payload's injections are remembered under.
+ *
+ * @discussion
+ * Pass it to rd_injected_library_handle(), rd_unload_library() or rd_swap_library() as
+ * the library path. It's "memfd:<name>#<serial>" on Linux (so two payloads of the same
+ * name are remembered apart) and the staged file's path on OS X.
+ */
+const char *rd_payload_path(const rd_payload_t *payload);
+
+/**
+ * @abstract
+ * Loads (injects) a payload into a target process.
+ *
+ * @discussion
+ * On Linux the target receives the payload's descriptor over a one-off Unix domain socket
+ * (an abstract one, so the target has to share our network namespace) and dlopen()s it as
+ * "/proc/self/fd/<number>", all while it's stopped once. The descriptor stays open in the
+ * target for as long as it lives.
+ *
+ * @param target
+ * The identifer of the target process
+ * @param payload
+ * The payload to inject
+ * @param timings
+ * An optional pointer to put the injection's timings into
+ *
+ * @return KERN_SUCCESS
+ * Means the payload has been loaded
+ * @return KERN_INVALID_OBJECT
+ * Means that the remote dlopen() failed to load the payload
+ * @return
+ * Any other error means an error occured while injecting into the target (including
+ * the target being unable to receive the descriptor)
+ */
+int rd_inject_payload(pid_t target, rd_payload_t *payload, rd_inject_timings_t *timings);
+
+/* The most arguments a remote call can take: all of them go in registers */
+#define kRDRemoteCallMaxArguments   (6)
+
+/* An argument of a remote call */
+typedef struct {
+    /* The argument itself, unless there are `bytes` */
+    uint64_t value;
+    /* Bytes to copy into the target for the duration of the call (e.g. a string or
+     * a structure); the routine gets their address inside the target instead of `value` */
+    const void *bytes;
+    size_t size;
+} rd_remote_argument_t;
+
+/* A remote call, see rd_remote_calls() */
+typedef struct {
+    /* The routine's address inside the target, or 0 to look `symbol` up there */
+    uint64_t address;
+    const char *symbol;
+    /* A library injected into the target to look the symbol up in, or NULL to look it
+     * up in every library the target has loaded */
+    const char *library_path;
+    const rd_remote_argument_t *arguments;
+    size_t arguments_count;
+    /* What the routine has returned */
+    uint64_t result;
+    /* KERN_SUCCESS once the routine has returned */
+    int err;
+} rd_remote_call_t;
+
+/**
+ * @abstract
+ * Calls a routine inside the target as `uint64_t routine(arguments ...)`.
+ *
+ * @discussion
+ * Takes the same path as rd_inject_library(), with the call in place of dlopen(): on Linux
+ * the target is stopped once, on OS X the call runs on a new remote thread.
+ *
+ * @param symbol
+ * The routine's name, looked up in every library the target has loaded (or NULL)
+ * @param address
+ * The routine's address inside the target, if there's no symbol
+ * @param result
+ * Receives what the routine has returned (optional)
+ *
+ * @return KERN_INVALID_OBJECT
+ * Means the symbol can't be found inside the target
+ * @return
+ * See rd_remote_calls()
+ */
+int rd_remote_call(pid_t target, const char *symbol, uint64_t address,
+                   const rd_remote_argument_t arguments[], size_t arguments_count, uint64_t *result);
+
+/**
+ * @abstract
+ * Makes a number of calls inside the target in order, all in a single remote call.
+ *
+ * @discussion
+ * Every call gets its own result and error. A symbol that can't be found fails its own
+ * call only, the others are made anyway. Argument bytes of all the calls must fit into
+ * the scratch area (64 KB on Linux).
+ *
+ * @param timings
+ * An optional pointer to put the timings into
+ *
+ * @return KERN_SUCCESS
+ * Means every call has been made
+ * @return KERN_INVALID_ARGUMENT
+ * Means some call names no routine, takes too many arguments or names a library we
+ * haven't injected; the target is not touched then
+ * @return KERN_INVALID_OBJECT
+ * Means some symbol can't be found inside the target
+ * @return
+ * Any other error means an error occured while injecting into the target
+ */
+int rd_remote_calls(pid_t target, rd_remote_call_t calls[], size_t count,
+                    rd_inject_timings_t *timings);
@@ -0,0 +1,607 @@
+//
+//  rd_inject_library_linux.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+
+#include "rd_inject_library.h"
+#include "rd_inject_library_linux.h"
+#include "rd_remote_symbols.h"
+#include "rd_remote_handles.h"
+#include "rd_inject_preflight.h"
+#include "rd_remote_arena.h"
+#include "rd_inject_stub.h"
+#include "rd_inject_log.h"
+
+#if !defined(__x86_64__)
+#error "The only supported target architecture is x86_64"
+#endif
+
+/* The x86_64 ABI allows leaf functions to use 128 bytes below %rsp,
+ * so we have to step over it before borrowing the target's stack */
+#define kRDRedZoneSize          (128)
+/* How much of the target's stack we may borrow for the libraries' paths and results */
+#define kRDRemoteScratchSize    (64*1024)
+
+#define RDFailOnError(function) {if (err != KERN_SUCCESS) {RDLogCallFailed(injection->proc, \
+    kRDLogNoPhase, function, errno); err = KERN_FAILURE; goto detach;}}
+
+#pragma mark - Private Interface
+
+static void initialize_injection(rd_linux_injection_t *injection, pid_t proc);
+static int start_libraries_injection(rd_linux_injection_t *injection, pid_t proc,
+                                     const char *library_paths[], size_t count, bool held);
+static int start_injection(rd_linux_injection_t *injection, const rd_inject_stub_call_t *call);
+static void run_injection(rd_linux_injection_t *injection);
+static bool handle_loading_stop(rd_linux_injection_t *injection, int status, int *err);
+static void detach_from_process(rd_linux_injection_t *injection, int err);
+static void restore_code(rd_linux_injection_t *injection);
+static unsigned long process_entry_point(pid_t proc);
+
+#pragma mark - Implementation
+
+int rd_inject_library(pid_t target_proc, const char *library_path)
+{
+    return rd_inject_libraries(target_proc, &library_path, 1, NULL);
+}
+
+int rd_inject_libraries(pid_t target_proc, const char *library_paths[], size_t count, int results[])
+{
+    return rd_inject_libraries_with_timings(target_proc, library_paths, count, results, NULL);
+}
+
+int rd_inject_libraries_with_timings(pid_t target_proc, const char *library_paths[], size_t count,
+                                     int results[], rd_inject_timings_t *timings)
+{
+    rd_linux_injection_t injection;
+    if (rd_linux_injection_start(&injection, target_proc, library_paths, count) == KERN_SUCCESS) {
+        run_injection(&injection);
+    }
+    return rd_linux_injection_finish(&injection, results, timings);
+}
+
+int rd_inject_run_stub(pid_t target_proc, const rd_inject_stub_call_t *call, void *results,
+                       rd_inject_timings_t *timings)
+{
+    rd_linux_injection_t injection;
+    if (rd_linux_injection_start_stub(&injection, target_proc, call) == KERN_SUCCESS) {
+        run_injection(&injection);
+    }
+    return rd_linux_injection_finish_stub(&injection, results, timings);
+}
+
+int rd_linux_inject_held(pid_t proc, const char *library_paths[], size_t count, int results[],
+                         rd_inject_timings_t *timings)
+{
+    rd_linux_injection_t injection;
+    if (start_libraries_injection(&injection, proc, library_paths, count, true) == KERN_SUCCESS) {
+        run_injection(&injection);
+    }
+    return rd_linux_injection_finish(&injection, results, timings);
+}
+
+int rd_linux_injection_start(rd_linux_injection_t *injection, pid_t proc,
+                             const char *library_paths[], size_t count)
+{
+    return start_libraries_injection(injection, proc, library_paths, count, false);
+}
+
+static
+int start_libraries_injection(rd_linux_injection_t *injection, pid_t proc,
+                              const char *library_paths[], size_t count, bool held)
+{
+    initialize_injection(injection, proc);
+    /* A held target is ours until the injection is finished, whatever happens */
+    injection->is_held = injection->is_seized = injection->is_stopped = held;
+    injection->library_paths = library_paths;
+    injection->count = count;
+    if (proc <= 0 || !library_paths || count == 0) {
+        return injection->err;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!library_paths[i]) {
+            return injection->err;
+        }
+    }
+
+    /* Don't even seize the target if it's unable to load the libraries anyway */
+    rd_inject_timer_start(&injection->timer);
+    if (rd_inject_preflight_target(proc) != KERN_SUCCESS) {
+        return injection->err;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (rd_inject_preflight_library(proc, library_paths[i]) == KERN_SUCCESS) {
+            continue;
+        }
+        if (!injection->rejected && !(injection->rejected = calloc(count, sizeof(bool)))) {
+            return injection->err;
+        }
+        injection->rejected[i] = true;
+        injection->err = KERN_INVALID_OBJECT;
+    }
+    /* Get the libraries off the disk while we're attaching, rather than in dlopen() */
+    for (size_t i = 0; !injection->rejected && i < count; i++) {
+        rd_inject_prefetch_library(proc, library_paths[i]);
+    }
+    rd_inject_timer_mark(&injection->timer, RD_PHASE_PREFLIGHT);
+    if (injection->rejected) {
+        return injection->err;
+    }
+
+    /* Lay out the completion word, the results and all the paths one after another,
+     * so a single write (and a single read of the first two) is enough */
+    size_t results_size = sizeof(uint64_t) * (count + 1);
+    size_t scratch_size = results_size;
+    for (size_t i = 0; i < count; i++) {
+        scratch_size += strlen(library_paths[i]) + 1;
+    }
+    uint64_t *scratch = calloc(1, scratch_size);
+    if (!scratch) {
+        return injection->err;
+    }
+    char *path = (char *)scratch + results_size;
+    for (size_t i = 0; i < count; i++) {
+        size_t path_size = strlen(library_paths[i]) + 1;
+        memcpy(path, library_paths[i], path_size);
+        path += path_size;
+    }
+    rd_inject_stub_call_t call = {
+        .code = rd_inject_stub,
+        .size = kRDInjectStubSize,
+        .trap_offset = kRDInjectStubTrapOffset,
+        .scratch = scratch,
+        .scratch_size = scratch_size,
+        .results_size = results_size,
+        .rbx_offset = results_size,
+        .r12 = count,
+        .completion = count
+    };
+    int err = start_injection(injection, &call);
+    free(scratch);
+
+    return err;
+}
+
+int rd_linux_injection_start_stub(rd_linux_injection_t *injection, pid_t proc,
+                                  const rd_inject_stub_call_t *call)
+{
+    initialize_injection(injection, proc);
+    if (proc <= 0 || !call || !call->code || call->size > kRDInjectStubMaxSize ||
+        call->trap_offset > call->size || !call->scratch ||
+        call->results_size > call->scratch_size || call->rbx_offset >= call->scratch_size) {
+        return injection->err;
+    }
+    rd_inject_timer_start(&injection->timer);
+    int err = rd_inject_preflight_target(proc);
+    rd_inject_timer_mark(&injection->timer, RD_PHASE_PREFLIGHT);
+    if (err != KERN_SUCCESS) {
+        return injection->err;
+    }
+    return start_injection(injection, call);
+}
+
+static
+void initialize_injection(rd_linux_injection_t *injection, pid_t proc)
+{
+    memset(injection, 0, sizeof(*injection));
+    injection->proc = proc;
+    injection->state = RD_INJECTION_FINISHED;
+    injection->err = KERN_FAILURE;
+    injection->memory = -1;
+}
+
+/**
+ * @abstract
+ * Locates everything we need, seizes the target, puts the stub in and interrupts the target.
+ *
+ * @discussion
+ * The caller has started the injection's timer and made sure the target is a 64 bit process.
+ */
+static
+int start_injection(rd_linux_injection_t *injection, const rd_inject_stub_call_t *call)
+{
+    pid_t proc = injection->proc;
+    rd_inject_timer_t *timer = &injection->timer;
+    if (call->scratch_size > kRDRemoteScratchSize) {
+        RDLogNotice(proc, RD_PHASE_ALLOCATE, "the libraries paths don't fit");
+        return injection->err;
+    }
+
+    /* Locate the target's dlopen() before we actually stop anything */
+    injection->remote_dlopen = rd_remote_loader_routine(proc, "dlopen");
+    injection->remote_stub = process_entry_point(proc);
+    rd_inject_timer_mark(timer, RD_PHASE_RESOLVE);
+    if (!injection->remote_dlopen) {
+        RDLogNotice(proc, RD_PHASE_RESOLVE, "no dlopen() inside the target");
+        return (injection->err = KERN_INVALID_HOST);
+    }
+    if (!injection->remote_stub) {
+        RDLogNotice(proc, RD_PHASE_RESOLVE, "no entry point in the target");
+        return injection->err;
+    }
+
+    injection->stub_code = call->code;
+    injection->stub_size = call->size;
+    injection->trap_offset = call->trap_offset;
+    injection->rbx_offset = call->rbx_offset;
+    injection->r12 = call->r12;
+    injection->completion = call->completion;
+    injection->scratch_size = call->scratch_size;
+    injection->results_size = call->results_size;
+    /* Keep the scratch area 8-byte aligned locally as well, the results are read as words */
+    injection->scratch = malloc((call->scratch_size + 7) & ~(size_t)7);
+    if (!injection->scratch) {
+        return injection->err;
+    }
+    memcpy(injection->scratch, call->scratch, call->scratch_size);
+    /* There's no remote allocation here: we only lay out the scratch area locally */
+    rd_inject_timer_mark(timer, RD_PHASE_ALLOCATE);
+
+    if (!injection->is_held && ptrace(PTRACE_SEIZE, proc, NULL, NULL) != 0) {
+        RDLogCallFailed(proc, RD_PHASE_ATTACH, "ptrace(PTRACE_SEIZE)", errno);
+        return injection->err;
+    }
+    injection->is_seized = true;
+    injection->state = RD_INJECTION_STOPPING;
+
+    /* Being the tracer, we're the only one patching this target right now. The entry point
+     * is never executed again, so the stub goes in before the target is even stopped.
+     * Unlike process_vm_writev(), /proc/<pid>/mem lets us write into read-only code pages. */
+    char memory_path[64];
+    snprintf(memory_path, sizeof(memory_path), "/proc/%d/mem", proc);
+    injection->memory = open(memory_path, O_RDWR | O_CLOEXEC);
+    int err = (injection->memory >= 0) ? KERN_SUCCESS : KERN_FAILURE;
+    RDFailOnError("open(/proc/<pid>/mem)");
+    err = (pread(injection->memory, injection->saved_code, injection->stub_size,
+                 (off_t)injection->remote_stub) == (ssize_t)injection->stub_size)
+          ? KERN_SUCCESS : KERN_FAILURE;
+    RDFailOnError("pread(/proc/<pid>/mem)");
+    injection->should_restore_code = true;
+    err = (pwrite(injection->memory, injection->stub_code, injection->stub_size,
+                  (off_t)injection->remote_stub) == (ssize_t)injection->stub_size)
+          ? KERN_SUCCESS : KERN_FAILURE;
+    RDFailOnError("pwrite(/proc/<pid>/mem)");
+    rd_inject_timer_mark(timer, RD_PHASE_WRITE);
+
+    rd_inject_timer_target_stopped(timer);
+    if (injection->is_held) {
+        /* It's stopped already, so there's no stop to wait for */
+        injection->err = KERN_SUCCESS;
+        rd_linux_injection_handle_stop(injection, W_STOPCODE(SIGTRAP));
+        return injection->err;
+    }
+    err = ptrace(PTRACE_INTERRUPT, proc, NULL, NULL);
+    RDFailOnError("ptrace(PTRACE_INTERRUPT)");
+
+    return (injection->err = KERN_SUCCESS);
+
+detach:
+    detach_from_process(injection, err);
+    return injection->err;
+}
+
+bool rd_linux_injection_handle_stop(rd_linux_injection_t *injection, int status)
+{
+    int err = KERN_FAILURE;
+    pid_t proc = injection->proc;
+    rd_inject_timer_t *timer = &injection->timer;
+
+    switch (injection->state) {
+        case RD_INJECTION_STOPPING: {
+            err = WIFSTOPPED(status) ? KERN_SUCCESS : KERN_FAILURE;
+            RDFailOnError("waitpid (the target is gone)");
+            injection->is_stopped = true;
+            /* A signal-delivery stop may beat our interrupt: hold the signal back until
+             * we're done (our own stop is still pending then and passes by later) */
+            if (!injection->is_held && status >> 16 != PTRACE_EVENT_STOP) {
+                injection->pending_signal = WSTOPSIG(status);
+            }
+            if (injection->cancelled) {
+                err = KERN_ABORTED;
+                goto detach;
+            }
+            err = ptrace(PTRACE_GETREGS, proc, NULL, &injection->saved_state);
+            RDFailOnError("ptrace(PTRACE_GETREGS)");
+            injection->should_restore_state = true;
+            rd_inject_timer_mark(timer, RD_PHASE_ATTACH);
+
+            size_t scratch_size = injection->scratch_size;
+            injection->rscratch = (injection->saved_state.rsp - kRDRedZoneSize - scratch_size) & ~0xFUL;
+            rd_remote_arena_borrow(&injection->arena, proc, injection->rscratch, scratch_size);
+            struct iovec local = {injection->scratch, scratch_size};
+            struct iovec remote = {(void *)injection->rscratch, scratch_size};
+            err = (process_vm_writev(proc, &local, 1, &remote, 1, 0) == (ssize_t)scratch_size)
+                  ? KERN_SUCCESS : KERN_FAILURE;
+            RDFailOnError("process_vm_writev");
+            rd_inject_timer_mark(timer, RD_PHASE_WRITE);
+
+            struct user_regs_struct state = injection->saved_state;
+            state.rip = injection->remote_stub;
+            state.rbx = injection->rbx_offset ? injection->rscratch + injection->rbx_offset : 0;
+            state.r12 = injection->r12;
+            state.r13 = injection->rscratch;
+            state.r14 = injection->remote_dlopen;
+            state.r15 = 0;
+            state.rbp = RTLD_NOW | RTLD_LOCAL;
+            /* The stub calls dlopen() itself, so the stack has to be 16-byte aligned */
+            state.rsp = (injection->rscratch - 0x10) & ~0xFUL;
+            /* Don't let the kernel restart an interrupted syscall on top of our call */
+            state.orig_rax = -1;
+            err = ptrace(PTRACE_SETREGS, proc, NULL, &state);
+            RDFailOnError("ptrace(PTRACE_SETREGS)");
+            err = ptrace(PTRACE_CONT, proc, NULL, NULL);
+            RDFailOnError("ptrace(PTRACE_CONT)");
+            injection->state = RD_INJECTION_LOADING;
+            return false;
+        }
+        case RD_INJECTION_LOADING: {
+            if (!handle_loading_stop(injection, status, &err)) {
+                return false;
+            }
+            if (err != KERN_SUCCESS) {
+                RDLogNotice(proc, RD_PHASE_DLOPEN, "the stub didn't finish properly");
+                goto detach;
+            }
+            rd_inject_timer_mark(timer, RD_PHASE_DLOPEN);
+
+            /* Read the completion word and the results back */
+            struct iovec local = {injection->scratch, injection->results_size};
+            struct iovec remote = {(void *)injection->rscratch, injection->results_size};
+            err = (process_vm_readv(proc, &local, 1, &remote, 1, 0) == (ssize_t)injection->results_size)
+                  ? KERN_SUCCESS : KERN_FAILURE;
+            RDFailOnError("process_vm_readv");
+            err = (injection->scratch[0] == injection->completion) ? KERN_SUCCESS : KERN_FAILURE;
+            RDFailOnError("The remote stub (completion word)");
+            goto detach;
+        }
+        case RD_INJECTION_FINISHED:
+            return true;
+    }
+
+detach:
+    detach_from_process(injection, err);
+    return true;
+}
+
+void rd_linux_injection_cancel(rd_linux_injection_t *injection)
+{
+    injection->cancelled = true;
+}
+
+int rd_linux_injection_finish(rd_linux_injection_t *injection, int results[],
+                              rd_inject_timings_t *timings)
+{
+    int err = injection->err;
+    if (injection->state == RD_INJECTION_FINISHED && injection->is_held) {
+        /* A held target we've given up on before running the stub is still stopped */
+        detach_from_process(injection, err);
+    }
+    if (injection->state != RD_INJECTION_FINISHED) {
+        /* Nobody should abandon an injection halfway, but don't leave the target hanging */
+        detach_from_process(injection, KERN_FAILURE);
+        err = injection->err;
+    } else if (err != KERN_SUCCESS && err != KERN_ABORTED && injection->timer.started_ns != 0) {
+        RDLogKernFailed(injection->proc, kRDLogNoPhase, "load_libraries_into_process()", err);
+    }
+    for (size_t i = 0; i < injection->count; i++) {
+        int result = KERN_FAILURE;
+        if (injection->rejected && injection->rejected[i]) {
+            result = KERN_INVALID_OBJECT;
+        } else if (injection->err == KERN_SUCCESS) {
+            result = KERN_SUCCESS;
+            if (injection->scratch[i + 1] == 0) {
+                result = err = KERN_INVALID_OBJECT;
+                RDLogDlopenFailed(injection->proc, injection->library_paths[i]);
+            } else {
+                rd_remote_handles_record(injection->proc, injection->library_paths[i],
+                                         injection->scratch[i + 1]);
+            }
+        }
+        if (results) results[i] = result;
+    }
+
+    free(injection->rejected);
+    injection->rejected = NULL;
+    free(injection->scratch);
+    injection->scratch = NULL;
+    if (injection->timer.started_ns != 0) {
+        rd_inject_timer_finish(&injection->timer, timings);
+    }
+    return (err);
+}
+
+int rd_linux_injection_finish_stub(rd_linux_injection_t *injection, void *results,
+                                   rd_inject_timings_t *timings)
+{
+    if (injection->state != RD_INJECTION_FINISHED) {
+        detach_from_process(injection, KERN_FAILURE);
+    }
+    int err = injection->err;
+    if (err == KERN_SUCCESS && results) {
+        memcpy(results, injection->scratch, injection->results_size);
+    }
+    free(injection->scratch);
+    injection->scratch = NULL;
+    if (injection->timer.started_ns != 0) {
+        rd_inject_timer_finish(&injection->timer, timings);
+    }
+    return (err);
+}
+
+/**
+ * @abstract
+ * Waits for the target's stops until the injection is finished.
+ */
+static
+void run_injection(rd_linux_injection_t *injection)
+{
+    while (injection->state != RD_INJECTION_FINISHED) {
+        int status = 0;
+        if (waitpid(injection->proc, &status, __WALL) != injection->proc) {
+            if (errno == EINTR) continue;
+            status = 0;
+        }
+        rd_linux_injection_handle_stop(injection, status);
+    }
+}
+
+/**
+ * @abstract
+ * Handles a stop of the hijacked thread while it's running the stub.
+ *
+ * @discussion
+ * Any signal the target receives in the meantime is passed through, so its handlers
+ * run on top of the stub's frame as usual.
+ *
+ * @param err
+ * KERN_SUCCESS when the thread has hit the stub's final trap, KERN_FAILURE if the
+ * target died or crashed somewhere
+ *
+ * @return
+ * false if the stub is still running
+ */
+static
+bool handle_loading_stop(rd_linux_injection_t *injection, int status, int *err)
+{
+    *err = KERN_FAILURE;
+    if (!WIFSTOPPED(status)) {
+        return true;
+    }
+    int signal = WSTOPSIG(status);
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+        /* Group-stop or a stray PTRACE_INTERRUPT: there's no signal to deliver */
+        signal = 0;
+    } else if (signal == SIGTRAP) {
+        struct user_regs_struct regs;
+        if (ptrace(PTRACE_GETREGS, injection->proc, NULL, &regs) != 0) {
+            return true;
+        }
+        if (regs.rip == injection->remote_stub + injection->trap_offset) {
+            *err = KERN_SUCCESS;
+            return true;
+        }
+    } else if (signal == SIGSEGV || signal == SIGBUS || signal == SIGILL) {
+        /* A crash inside dlopen() must not kill the target, so we bail out and
+         * let the caller restore the original thread state */
+        return true;
+    }
+    return (ptrace(PTRACE_CONT, injection->proc, NULL, (void *)(long)signal) != 0);
+}
+
+/**
+ * @abstract
+ * Restores the target's thread and code, detaches from it and finishes the injection.
+ */
+static
+void detach_from_process(rd_linux_injection_t *injection, int err)
+{
+    pid_t proc = injection->proc;
+    int status = 0;
+
+    if (injection->is_seized) {
+        if (!injection->is_stopped && ptrace(PTRACE_INTERRUPT, proc, NULL, NULL) == 0) {
+            /* PTRACE_DETACH only works for a stopped tracee */
+            waitpid(proc, &status, __WALL);
+            if (WIFSTOPPED(status) && status >> 16 != PTRACE_EVENT_STOP && !injection->pending_signal) {
+                injection->pending_signal = WSTOPSIG(status);
+            }
+        }
+        if (injection->should_restore_state) {
+            if (ptrace(PTRACE_SETREGS, proc, NULL, &injection->saved_state) != 0) {
+                RDLogCallFailed(proc, RD_PHASE_TEARDOWN, "ptrace(PTRACE_SETREGS)", errno);
+                err = KERN_FAILURE;
+            }
+        }
+        /* The borrowed stack is the target's again once the thread is restored */
+        rd_remote_arena_release(&injection->arena);
+        /* A held target may be about to run its entry point */
+        if (injection->is_held) {
+            restore_code(injection);
+        }
+        /* PTRACE_DETACH also resumes the target, with the signal we've held back */
+        ptrace(PTRACE_DETACH, proc, NULL, (void *)(long)injection->pending_signal);
+        rd_inject_timer_target_resumed(&injection->timer);
+    }
+    restore_code(injection);
+    if (injection->memory >= 0) {
+        close(injection->memory);
+        injection->memory = -1;
+    }
+    if (injection->is_seized) {
+        rd_inject_timer_mark(&injection->timer, RD_PHASE_TEARDOWN);
+    }
+    injection->is_held = injection->is_seized = injection->is_stopped = false;
+    injection->should_restore_state = injection->should_restore_code = false;
+    injection->pending_signal = 0;
+    injection->state = RD_INJECTION_FINISHED;
+    injection->err = err;
+}
+
+/**
+ * @abstract
+ * Puts the target's own code back in place of the stub (once).
+ */
+static
+void restore_code(rd_linux_injection_t *injection)
+{
+    if (!injection->should_restore_code) {
+        return;
+    }
+    if (pwrite(injection->memory, injection->saved_code, injection->stub_size,
+               (off_t)injection->remote_stub) != (ssize_t)injection->stub_size) {
+        RDLogCallFailed(injection->proc, RD_PHASE_TEARDOWN, "restoring the entry point", errno);
+    }
+    injection->should_restore_code = false;
+}
+
+/**
+ * @abstract
+ * Looks up the entry point of the process' main executable in its auxiliary vector.
+ *
+ * @return
+ * The entry point address or (0) on error
+ */
+static
+unsigned long process_entry_point(pid_t proc)
+{
+    char auxv_path[64];
+    snprintf(auxv_path, sizeof(auxv_path), "/proc/%d/auxv", proc);
+    int fd = open(auxv_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    Elf64_auxv_t auxv[64];
+    ssize_t size = read(fd, auxv, sizeof(auxv));
+    close(fd);
+
+    for (ssize_t i = 0; size > 0 && i < size / (ssize_t)sizeof(*auxv); i++) {
+        if (auxv[i].a_type == AT_ENTRY) {
+            return auxv[i].a_un.a_val;
+        }
+        if (auxv[i].a_type == AT_NULL) {
+            break;
+        }
+    }
+    return 0;
+}
+
+#endif // defined(__linux__)
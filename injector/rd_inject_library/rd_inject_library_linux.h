@@ -0,0 +1,176 @@
+//
+//  rd_inject_library_linux.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#if defined(__linux__)
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/user.h>
+
+#include "rd_inject_library.h"
+#include "rd_inject_stub.h"
+#include "rd_remote_arena.h"
+
+typedef enum {
+    /* Waiting for the target to stop after PTRACE_INTERRUPT */
+    RD_INJECTION_STOPPING = 0,
+    /* The stub is running the dlopen() calls */
+    RD_INJECTION_LOADING,
+    /* We've detached from the target; see `err` */
+    RD_INJECTION_FINISHED
+} rd_injection_state_t;
+
+/**
+ * @abstract
+ * A single injection into a single process, driven by the target's ptrace() stops.
+ *
+ * @discussion
+ * There're no remote threads on Linux, so we borrow one of the target's threads instead.
+ * The actual loading is done by a tiny stub (see rd_inject_stub.h) that we temporarily
+ * put over the main executable's entry point: nobody ever jumps there again once the
+ * process has started. The thread is seized with ptrace() and interrupted, then a single
+ * process_vm_writev() call puts the libraries paths and a zeroed completion word with
+ * the results array onto its stack (right below the red zone). The thread is redirected
+ * into the stub which calls dlopen() for every library and traps exactly once, so we
+ * read the results back, restore the thread's original state and detach. The target
+ * only stays stopped for the duration of the dlopen() calls themselves.
+ *
+ * Nothing here ever waits for the target: whoever started the injection collects the
+ * target's stops with waitpid() and feeds them into rd_linux_injection_handle_stop().
+ * Since ptrace() requests are only accepted from the tracer thread, all the calls for
+ * an injection must be made from the same thread.
+ */
+typedef struct {
+    pid_t proc;
+    const char **library_paths;
+    size_t count;
+    /* Which libraries the preflight checks have turned down (NULL if none) */
+    bool *rejected;
+    rd_injection_state_t state;
+    int err;
+    /* Don't run the stub once the target stops, just detach */
+    bool cancelled;
+    rd_inject_timer_t timer;
+    /* The stub to run and its arguments (see rd_inject_stub_call_t) */
+    const unsigned char *stub_code;
+    size_t stub_size;
+    size_t trap_offset;
+    size_t rbx_offset;
+    uint64_t r12;
+    uint64_t completion;
+    /* The stub's scratch area (e.g. the completion word, the results and the paths),
+     * laid out as it goes into the target */
+    uint64_t *scratch;
+    size_t scratch_size;
+    size_t results_size;
+    unsigned long rscratch;
+    /* The part of the thread's stack the scratch area is borrowing */
+    rd_remote_arena_t arena;
+    unsigned long remote_dlopen;
+    unsigned long remote_stub;
+    int memory;
+    /* The caller has handed the target over traced and stopped (see rd_linux_inject_held()) */
+    bool is_held;
+    bool is_seized;
+    /* A signal the target was about to receive when it first stopped for us; it's
+     * delivered when we detach */
+    int pending_signal;
+    bool is_stopped;
+    bool should_restore_state;
+    struct user_regs_struct saved_state;
+    bool should_restore_code;
+    unsigned char saved_code[kRDInjectStubMaxSize];
+} rd_linux_injection_t;
+
+/**
+ * @abstract
+ * Prepares everything, seizes the target and asks it to stop.
+ *
+ * @discussion
+ * The target and the libraries are checked first (see rd_inject_preflight.h), so a hopeless
+ * injection is finished with KERN_FAILURE or KERN_INVALID_OBJECT before the target is seized.
+ *
+ * @param library_paths
+ * The paths must stay valid until rd_linux_injection_finish()
+ *
+ * @return
+ * KERN_SUCCESS if the injection is now waiting for the target's stops; any other error
+ * means the injection is already finished
+ */
+int rd_linux_injection_start(rd_linux_injection_t *injection, pid_t proc,
+                             const char *library_paths[], size_t count);
+
+/**
+ * @abstract
+ * Same as rd_linux_injection_start(), but runs an arbitrary stub instead of loading libraries.
+ *
+ * @discussion
+ * The call's scratch area is copied, so it doesn't have to outlive the injection.
+ */
+int rd_linux_injection_start_stub(rd_linux_injection_t *injection, pid_t proc,
+                                  const rd_inject_stub_call_t *call);
+
+/**
+ * @abstract
+ * Moves the injection forward on a waitpid() status of the target.
+ *
+ * @discussion
+ * Pass a status that's not WIFSTOPPED() (e.g. zero) if waitpid() itself failed.
+ *
+ * @return
+ * true once the injection is finished
+ */
+bool rd_linux_injection_handle_stop(rd_linux_injection_t *injection, int status);
+
+/**
+ * @abstract
+ * Asks the injection to give up as soon as it can.
+ *
+ * @discussion
+ * An injection is only cancelled until the stub starts: interrupting dlopen() halfway
+ * would leave the target's loader locked, so a loading injection always runs to the end.
+ */
+void rd_linux_injection_cancel(rd_linux_injection_t *injection);
+
+/**
+ * @abstract
+ * Collects the results of a finished injection and frees its resources.
+ *
+ * @return
+ * Same as rd_inject_libraries()
+ */
+int rd_linux_injection_finish(rd_linux_injection_t *injection, int results[],
+                              rd_inject_timings_t *timings);
+
+/**
+ * @abstract
+ * Same as rd_linux_injection_finish() for an injection started with rd_linux_injection_start_stub().
+ *
+ * @param results
+ * A buffer of `results_size` bytes to copy the stub's scratch area into
+ *
+ * @return
+ * Same as rd_inject_run_stub()
+ */
+int rd_linux_injection_finish_stub(rd_linux_injection_t *injection, void *results,
+                                   rd_inject_timings_t *timings);
+
+/**
+ * @abstract
+ * Same as rd_inject_libraries(), for a target the calling thread is already tracing and
+ * that's stopped, e.g. held at its entry point.
+ *
+ * @discussion
+ * Such a target may be just about to run its entry point, so the stub is taken out of
+ * there before the target goes on. The target is detached from either way.
+ */
+int rd_linux_inject_held(pid_t proc, const char *library_paths[], size_t count, int results[],
+                         rd_inject_timings_t *timings);
+
+#endif // defined(__linux__)
@@ -0,0 +1,346 @@
+//
+//  rd_inject_log.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <mach/mach_error.h>
+#else
+#include <sys/syscall.h>
+#endif
+
+#include "rd_inject_log.h"
+
+/* Records per thread; a power of two */
+#define kRDLogRingRecords       (1024)
+/* How often the rings are drained: right after some records, less often while it's quiet */
+#define kRDLogMinDrainNs        (2ULL * 1000000ULL)
+#define kRDLogMaxDrainNs        (250ULL * 1000000ULL)
+/* Records written into a file at once */
+#define kRDLogWriteBatch        (256)
+
+#pragma mark - Private Interface
+
+/* A single-producer single-consumer ring. It's owned by a thread until the thread
+ * exits; then it's up for grabs, and it's never freed. */
+typedef struct rd_log_ring {
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    atomic_uint_fast64_t dropped;
+    atomic_bool is_owned;
+    uint32_t thread;
+    struct rd_log_ring *next;
+    rd_log_record_t records[kRDLogRingRecords];
+} rd_log_ring_t;
+
+static _Atomic(rd_log_ring_t *) rings = NULL;
+static __thread rd_log_ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+/* Serializes draining (the drainer vs. rd_log_flush()) and guards the sink */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+/* A binary log file or (-1) for syslog */
+static int sink_fd = -1;
+
+static const char *event_names[RD_LOG_EVENT_COUNT] = {
+    [RD_LOG_REQUEST] = "inject",
+    [RD_LOG_CALL_FAILED] = "failed",
+    [RD_LOG_KERN_FAILED] = "failed",
+    [RD_LOG_DLOPEN_FAILED] = "dlopen() failed for",
+    [RD_LOG_NOTICE] = "notice:",
+    [RD_LOG_DROPPED] = "dropped"
+};
+
+static void initialize_log(void);
+static rd_log_ring_t *claim_ring(void);
+static void release_ring(void *ring);
+static void *drainer(void *context);
+static size_t drain_rings(void);
+static void sink_records(const rd_log_record_t records[], size_t count);
+static uint32_t current_thread_id(void);
+
+#pragma mark - Implementation
+
+void rd_log(rd_log_event_t event, pid_t target, unsigned int phase, int error, unsigned int line,
+            const char *detail)
+{
+    rd_log_ring_t *ring = thread_ring ? thread_ring : claim_ring();
+    if (!ring) {
+        return;
+    }
+    uint_fast64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint_fast64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= kRDLogRingRecords) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    rd_log_record_t *record = &ring->records[head & (kRDLogRingRecords - 1)];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    record->thread = ring->thread;
+    record->target = target;
+    record->error = error;
+    record->line = (uint16_t)line;
+    record->event = (uint8_t)event;
+    record->phase = (uint8_t)phase;
+    size_t length = detail ? strlen(detail) : 0;
+    if (length >= kRDLogDetailSize) {
+        /* The tail of a path tells more than its head */
+        bool is_path = (event == RD_LOG_REQUEST || event == RD_LOG_DLOPEN_FAILED);
+        if (is_path) detail += length - (kRDLogDetailSize - 1);
+        length = kRDLogDetailSize - 1;
+    }
+    memcpy(record->detail, detail ? detail : "", length);
+    record->detail[length] = '\0';
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+bool rd_log_open(const char *path)
+{
+    int fd = -1;
+    if (path) {
+        fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0) {
+            if (fd >= 0) close(fd);
+            return false;
+        }
+        rd_log_file_header_t header = {
+            .magic = kRDLogFileMagic,
+            .version = kRDLogFileVersion,
+            .record_size = sizeof(rd_log_record_t)
+        };
+        if (info.st_size == 0 && write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            return false;
+        }
+    }
+    pthread_mutex_lock(&drain_lock);
+    if (sink_fd >= 0) close(sink_fd);
+    sink_fd = fd;
+    pthread_mutex_unlock(&drain_lock);
+
+    return true;
+}
+
+void rd_log_flush(void)
+{
+    pthread_mutex_lock(&drain_lock);
+    drain_rings();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+int rd_log_format(const rd_log_record_t *record, bool timestamp, char *buffer, size_t size)
+{
+    char time[48] = "";
+    if (timestamp) {
+        time_t seconds = (time_t)(record->timestamp_ns / 1000000000ULL);
+        struct tm local;
+        localtime_r(&seconds, &local);
+        size_t length = strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S", &local);
+        snprintf(time + length, sizeof(time) - length, ".%06llu ",
+                 (unsigned long long)(record->timestamp_ns % 1000000000ULL / 1000));
+    }
+    const char *event = (record->event < RD_LOG_EVENT_COUNT) ? event_names[record->event] : "unknown";
+    char phase[32] = "";
+    if (record->phase < RD_PHASE_COUNT) {
+        snprintf(phase, sizeof(phase), " {%s}", rd_inject_phase_name(record->phase));
+    }
+    /* The detail may come from a file, so don't trust it to be terminated */
+    int detail_length = (int)strnlen(record->detail, kRDLogDetailSize);
+    char error[96] = "";
+    switch (record->event) {
+        case RD_LOG_CALL_FAILED:
+            snprintf(error, sizeof(error), ": %s", strerror(record->error));
+            break;
+        case RD_LOG_KERN_FAILED:
+#if defined(__APPLE__)
+            snprintf(error, sizeof(error), ": %s", mach_error_string(record->error));
+#else
+            snprintf(error, sizeof(error), ": error %d", record->error);
+#endif
+            break;
+        case RD_LOG_DROPPED:
+            snprintf(error, sizeof(error), " %d records", record->error);
+            break;
+        default:
+            break;
+    }
+    return snprintf(buffer, size, "%s[%u] (%d) %s %.*s%s%s @%u", time, record->thread,
+                    record->target, event, detail_length, record->detail, error, phase,
+                    record->line);
+}
+
+static
+void initialize_log(void)
+{
+    pthread_key_create(&ring_key, release_ring);
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attributes, drainer, NULL) != 0) {
+        syslog(LOG_NOTICE, "Failed to start the log drainer, logging is off");
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * @abstract
+ * Gives the calling thread a ring: one left by an exited thread, or a new one.
+ */
+static
+rd_log_ring_t *claim_ring(void)
+{
+    pthread_once(&log_once, initialize_log);
+    rd_log_ring_t *ring = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        bool is_owned = false;
+        if (atomic_compare_exchange_strong(&ring->is_owned, &is_owned, true)) {
+            break;
+        }
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) {
+            return NULL;
+        }
+        atomic_init(&ring->is_owned, true);
+        rd_log_ring_t *first = atomic_load_explicit(&rings, memory_order_relaxed);
+        do {
+            ring->next = first;
+        } while (!atomic_compare_exchange_weak_explicit(&rings, &first, ring, memory_order_release,
+                                                        memory_order_relaxed));
+    }
+    ring->thread = current_thread_id();
+    thread_ring = ring;
+    /* So it's given back once the thread is gone */
+    pthread_setspecific(ring_key, ring);
+
+    return ring;
+}
+
+static
+void release_ring(void *ring)
+{
+    atomic_store(&((rd_log_ring_t *)ring)->is_owned, false);
+}
+
+/**
+ * @abstract
+ * Drains the rings for as long as the process lives, more often while it's busy.
+ */
+static
+void *drainer(__attribute__((unused)) void *context)
+{
+    uint64_t interval = kRDLogMinDrainNs;
+    while (1) {
+        struct timespec nap = {
+            .tv_sec = (time_t)(interval / 1000000000ULL),
+            .tv_nsec = (long)(interval % 1000000000ULL)
+        };
+        nanosleep(&nap, NULL);
+        pthread_mutex_lock(&drain_lock);
+        size_t drained = drain_rings();
+        pthread_mutex_unlock(&drain_lock);
+        interval = drained ? kRDLogMinDrainNs : interval * 2;
+        if (interval > kRDLogMaxDrainNs) interval = kRDLogMaxDrainNs;
+    }
+    return NULL;
+}
+
+/**
+ * @abstract
+ * Moves every record from the rings into the sink (the drain lock must be held).
+ *
+ * @return the number of records drained
+ */
+static
+size_t drain_rings(void)
+{
+    rd_log_record_t batch[kRDLogWriteBatch];
+    size_t batched = 0, drained = 0;
+    rd_log_ring_t *ring = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        uint_fast64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint_fast64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            batch[batched++] = ring->records[tail & (kRDLogRingRecords - 1)];
+            if (batched == kRDLogWriteBatch) {
+                sink_records(batch, batched);
+                drained += batched;
+                batched = 0;
+            }
+        }
+        /* Copied out, so the owner may have the room back */
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        uint_fast64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_REALTIME, &now);
+            batch[batched++] = (rd_log_record_t){
+                .timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec,
+                .thread = ring->thread,
+                .error = (int32_t)dropped,
+                .event = RD_LOG_DROPPED,
+                .phase = kRDLogNoPhase,
+                .line = __LINE__
+            };
+            if (batched == kRDLogWriteBatch) {
+                sink_records(batch, batched);
+                drained += batched;
+                batched = 0;
+            }
+        }
+    }
+    if (batched > 0) {
+        sink_records(batch, batched);
+        drained += batched;
+    }
+    return drained;
+}
+
+static
+void sink_records(const rd_log_record_t records[], size_t count)
+{
+    if (sink_fd >= 0) {
+        size_t length = count * sizeof(*records);
+        if (write(sink_fd, records, length) != (ssize_t)length) {
+            /* There's nobody to tell but syslog itself */
+            syslog(LOG_NOTICE, "Failed to write %zu log records", count);
+        }
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        char line[256];
+        rd_log_format(&records[i], false, line, sizeof(line));
+        syslog(LOG_NOTICE, "%s", line);
+    }
+}
+
+static
+uint32_t current_thread_id(void)
+{
+#if defined(__APPLE__)
+    uint64_t thread = 0;
+    pthread_threadid_np(NULL, &thread);
+    return (uint32_t)thread;
+#else
+    return (uint32_t)syscall(SYS_gettid);
+#endif
+}
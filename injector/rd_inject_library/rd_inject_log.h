@@ -0,0 +1,129 @@
+//
+//  rd_inject_log.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rd_inject_stats.h"
+
+/* What a log record is about */
+typedef enum {
+    /* A request to inject `detail` (the tail of the payload's path) */
+    RD_LOG_REQUEST = 0,
+    /* `detail` (a call) has failed with an errno value */
+    RD_LOG_CALL_FAILED,
+    /* `detail` (a call) has failed with a KERN_* code */
+    RD_LOG_KERN_FAILED,
+    /* The remote dlopen() of `detail` (the tail of the library's path) has failed */
+    RD_LOG_DLOPEN_FAILED,
+    /* Anything else, `detail` says what */
+    RD_LOG_NOTICE,
+    /* The ring of a thread was full, so `error` records of it are lost */
+    RD_LOG_DROPPED,
+    RD_LOG_EVENT_COUNT
+} rd_log_event_t;
+
+/* Longer details are cut (from the start for paths, where the tail tells more) */
+#define kRDLogDetailSize    (40)
+/* The phase of records that don't belong to any */
+#define kRDLogNoPhase       (RD_PHASE_COUNT)
+
+/* A log record, as it's kept in memory and written into a binary log file */
+typedef struct {
+    /* CLOCK_REALTIME */
+    uint64_t timestamp_ns;
+    uint32_t thread;
+    int32_t target;
+    int32_t error;
+    /* The source line of the record */
+    uint16_t line;
+    uint8_t event;
+    uint8_t phase;
+    char detail[kRDLogDetailSize];
+} rd_log_record_t;
+
+/* A binary log file starts with a header, then it's records all the way */
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+} rd_log_file_header_t;
+
+#define kRDLogFileMagic     "RDLG"
+#define kRDLogFileVersion   (1)
+
+/**
+ * @abstract
+ * Logs a record without blocking.
+ *
+ * @discussion
+ * Every thread writes into a ring of its own, so logging takes no locks and makes no
+ * syscalls: it's a timestamp and a 64-byte copy. A background thread drains the rings
+ * every few milliseconds into the sink (syslog unless rd_log_open() says otherwise).
+ * When a thread's ring is full its new records are dropped and counted, and the count
+ * is logged as an RD_LOG_DROPPED record once there's room again.
+ *
+ * Use the RDLog*() macros below rather than calling it directly.
+ *
+ * @param phase
+ * The phase (rd_inject_phase_t) the record belongs to, or kRDLogNoPhase
+ * @param detail
+ * A short text (or NULL); paths are cut from the start, anything else from the end
+ */
+void rd_log(rd_log_event_t event, pid_t target, unsigned int phase, int error, unsigned int line,
+            const char *detail);
+
+#define RDLogRequest(target, payload_path) \
+    rd_log(RD_LOG_REQUEST, (target), kRDLogNoPhase, 0, __LINE__, (payload_path))
+#define RDLogCallFailed(target, phase, function, errno_value) \
+    rd_log(RD_LOG_CALL_FAILED, (target), (phase), (errno_value), __LINE__, (function))
+#define RDLogKernFailed(target, phase, function, err) \
+    rd_log(RD_LOG_KERN_FAILED, (target), (phase), (err), __LINE__, (function))
+#define RDLogDlopenFailed(target, library_path) \
+    rd_log(RD_LOG_DLOPEN_FAILED, (target), RD_PHASE_DLOPEN, 0, __LINE__, (library_path))
+#define RDLogNotice(target, phase, message) \
+    rd_log(RD_LOG_NOTICE, (target), (phase), 0, __LINE__, (message))
+
+/**
+ * @abstract
+ * Sends the log records into a binary file instead of syslog.
+ *
+ * @discussion
+ * The file is appended to (a new one gets a header first); see rd_log_decode.c for
+ * turning it back into text. Records logged before the call go into the file as well,
+ * unless they have been drained already.
+ *
+ * @param path
+ * The file, or NULL to go back to syslog
+ *
+ * @return false if the file can't be opened (the sink stays as it was)
+ */
+bool rd_log_open(const char *path);
+
+/**
+ * @abstract
+ * Drains every ring into the sink right away.
+ *
+ * @discussion
+ * Call it before exiting: records still in the rings are lost otherwise.
+ */
+void rd_log_flush(void);
+
+/**
+ * @abstract
+ * Formats a record as a line of text (without a line break).
+ *
+ * @param timestamp
+ * Whether to start with the record's time (syslog has its own)
+ *
+ * @return the length of the text, as snprintf() would
+ */
+int rd_log_format(const rd_log_record_t *record, bool timestamp, char *buffer, size_t size);
@@ -0,0 +1,437 @@
+//
+//  rd_inject_payload.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#if defined(__linux__)
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+#include "rd_inject_library.h"
+#if defined(__linux__)
+#include "rd_inject_stub.h"
+#include "rd_remote_handles.h"
+#endif
+
+#if defined(__linux__)
+/* Older headers don't know the memfd flag for executable contents */
+#ifndef MFD_EXEC
+#define MFD_EXEC                    (0x0010U)
+#endif
+/* How long the handoff thread waits for a descriptor to free up when it's run out of them */
+#define kRDHandoffBackoffUsec       (10 * 1000)
+#endif
+
+struct rd_payload {
+    atomic_uint references;
+    /* The sealed memfd on Linux, the staged file on OS X */
+    int fd;
+    char *path;
+};
+
+#if defined(__linux__)
+/* A target waiting for a payload's descriptor */
+typedef struct rd_handoff {
+    pid_t target;
+    int fd;
+    struct rd_handoff *next;
+} rd_handoff_t;
+
+/* Every target connects to the same listener, served by a single thread */
+static pthread_once_t handoff_once = PTHREAD_ONCE_INIT;
+static atomic_int handoff_listener = -1;
+static struct sockaddr_un handoff_address;
+static socklen_t handoff_address_length;
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_handoff_t *pending_handoffs = NULL;
+/* Tells payloads of the same name apart */
+static atomic_ulong payloads_created = 0;
+#endif
+
+#pragma mark - Private Interface
+
+static int store_image(rd_payload_t *payload, const void *bytes, size_t size, const char *name);
+#if defined(__linux__)
+static void start_handoff_thread(void);
+static bool expect_target(rd_handoff_t *handoff);
+static void forget_target(rd_handoff_t *handoff);
+static void *hand_descriptors_over(void *context);
+static bool send_descriptor(int connection, int fd);
+#endif
+
+#pragma mark - Implementation
+
+rd_payload_t *rd_payload_create(const void *bytes, size_t size, const char *name)
+{
+    if (!bytes || size == 0 || !name || name[0] == '\0') {
+        return NULL;
+    }
+    rd_payload_t *payload = calloc(1, sizeof(*payload));
+    if (!payload) {
+        return NULL;
+    }
+    atomic_init(&payload->references, 1);
+    payload->fd = -1;
+    if (store_image(payload, bytes, size, name) != KERN_SUCCESS) {
+        rd_payload_release(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+rd_payload_t *rd_payload_retain(rd_payload_t *payload)
+{
+    if (payload) {
+        atomic_fetch_add_explicit(&payload->references, 1, memory_order_relaxed);
+    }
+    return payload;
+}
+
+void rd_payload_release(rd_payload_t *payload)
+{
+    if (!payload || atomic_fetch_sub_explicit(&payload->references, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (payload->fd >= 0) {
+        close(payload->fd);
+    }
+#if defined(__APPLE__)
+    if (payload->path) {
+        unlink(payload->path);
+    }
+#endif
+    free(payload->path);
+    free(payload);
+}
+
+const char *rd_payload_path(const rd_payload_t *payload)
+{
+    return payload ? payload->path : NULL;
+}
+
+#if defined(__APPLE__)
+
+int rd_inject_payload(pid_t target, rd_payload_t *payload, rd_inject_timings_t *timings)
+{
+    if (timings) memset(timings, 0, sizeof(*timings));
+    if (!payload) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    const char *paths[] = {payload->path};
+    int result = KERN_FAILURE;
+    int err = rd_inject_libraries_with_timings(target, paths, 1, &result, timings);
+    return (err == KERN_SUCCESS) ? result : err;
+}
+
+/**
+ * @abstract
+ * Writes the image into a read-only file in the temporary directory.
+ */
+static
+int store_image(rd_payload_t *payload, const void *bytes, size_t size, const char *name)
+{
+    const char *directory = getenv("TMPDIR");
+    if (!directory || directory[0] == '\0') {
+        directory = "/tmp";
+    }
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s.XXXXXX", directory, name) >= (int)sizeof(path)) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        syslog(LOG_NOTICE, "Could not stage %s: %s", name, strerror(errno));
+        return KERN_FAILURE;
+    }
+    payload->path = strdup(path);
+    const char *position = bytes;
+    size_t left = size;
+    while (left > 0) {
+        ssize_t written = write(fd, position, left);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        position += written;
+        left -= (size_t)written;
+    }
+    close(fd);
+    if (!payload->path || left > 0 || chmod(path, 0444) != 0) {
+        syslog(LOG_NOTICE, "Could not stage %s: %s", name, strerror(errno));
+        if (!payload->path) unlink(path);
+        return KERN_FAILURE;
+    }
+    return KERN_SUCCESS;
+}
+
+#else
+
+int rd_inject_payload(pid_t target, rd_payload_t *payload, rd_inject_timings_t *timings)
+{
+    if (timings) memset(timings, 0, sizeof(*timings));
+    if (target <= 0 || !payload) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    pthread_once(&handoff_once, start_handoff_thread);
+    /* The handoff thread may have given up on its listener since */
+    if (atomic_load(&handoff_listener) < 0) {
+        return KERN_FAILURE;
+    }
+    rd_handoff_t handoff = {.target = target, .fd = payload->fd};
+    if (!expect_target(&handoff)) {
+        syslog(LOG_NOTICE, "Someone is handing a payload to %d already", target);
+        return KERN_FAILURE;
+    }
+    rd_memfd_block_t block;
+    memset(&block, 0, sizeof(block));
+    block.fd = -1;
+    memcpy(block.path_prefix, "/proc/self/fd/", strlen("/proc/self/fd/"));
+    block.message.msg_iovlen = 1;
+    block.message.msg_controllen = sizeof(block.control);
+    block.data.iov_len = 1;
+    block.address = handoff_address;
+    block.address_length = handoff_address_length;
+    rd_inject_stub_call_t call = {
+        .code = rd_memfd_stub,
+        .size = kRDMemfdStubSize,
+        .trap_offset = kRDMemfdStubTrapOffset,
+        .scratch = &block,
+        .scratch_size = sizeof(block),
+        .results_size = offsetof(rd_memfd_block_t, address_length),
+        .completion = 1
+    };
+    int err = rd_inject_run_stub(target, &call, &block, timings);
+    forget_target(&handoff);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    if (block.fd < 0) {
+        syslog(LOG_NOTICE, "%d could not receive %s: %s", target, payload->path,
+               (block.error < 0) ? strerror((int)-block.error) : "no descriptor has come");
+        return KERN_FAILURE;
+    }
+    if (block.handle == 0) {
+        syslog(LOG_NOTICE, "Remote dlopen() failed for %s", payload->path);
+        return KERN_INVALID_OBJECT;
+    }
+    rd_remote_handles_record(target, payload->path, block.handle);
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Copies the image into a new memfd and seals it.
+ */
+static
+int store_image(rd_payload_t *payload, const void *bytes, size_t size, const char *name)
+{
+    /* It's what the injections are remembered under, so it has to be unique */
+    unsigned long serial = atomic_fetch_add_explicit(&payloads_created, 1, memory_order_relaxed);
+    if (asprintf(&payload->path, "memfd:%s#%lu", name, serial) < 0) {
+        payload->path = NULL;
+        return KERN_FAILURE;
+    }
+    /* Kernels that may refuse to execute a memfd want to be told it's executable,
+     * older ones don't know the flag at all */
+    payload->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING | MFD_EXEC);
+    if (payload->fd < 0 && errno == EINVAL) {
+        payload->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    }
+    if (payload->fd < 0) {
+        syslog(LOG_NOTICE, "memfd_create() failed with error: %s", strerror(errno));
+        return KERN_FAILURE;
+    }
+    const char *position = bytes;
+    size_t left = size;
+    while (left > 0) {
+        ssize_t written = write(payload->fd, position, left);
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0) break;
+        position += written;
+        left -= (size_t)written;
+    }
+    if (left > 0) {
+        syslog(LOG_NOTICE, "Could not write %s into a memfd: %s", name, strerror(errno));
+        return KERN_FAILURE;
+    }
+    if (fcntl(payload->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        syslog(LOG_NOTICE, "Could not seal %s: %s", name, strerror(errno));
+        return KERN_FAILURE;
+    }
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Starts listening on a fresh abstract socket and the thread accepting its connections.
+ */
+static
+void start_handoff_thread(void)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener < 0) {
+        syslog(LOG_NOTICE, "socket() failed with error: %s", strerror(errno));
+        return;
+    }
+    /* Binding nothing but the family picks a unique abstract name for us */
+    struct sockaddr_un unnamed = {.sun_family = AF_UNIX};
+    handoff_address_length = sizeof(handoff_address);
+    if (bind(listener, (struct sockaddr *)&unnamed, sizeof(sa_family_t)) != 0 ||
+        getsockname(listener, (struct sockaddr *)&handoff_address, &handoff_address_length) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        syslog(LOG_NOTICE, "Could not listen for targets: %s", strerror(errno));
+        close(listener);
+        return;
+    }
+    /* Published first, as the thread resets it if it has to give up */
+    atomic_store(&handoff_listener, listener);
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attributes, hand_descriptors_over, (void *)(intptr_t)listener);
+    pthread_attr_destroy(&attributes);
+    if (err != 0) {
+        syslog(LOG_NOTICE, "pthread_create() failed with error: %s", strerror(err));
+        atomic_store(&handoff_listener, -1);
+        close(listener);
+        return;
+    }
+}
+
+/**
+ * @abstract
+ * Lets the target's connection through to the handoff thread.
+ *
+ * @return
+ * false if the target is expected already, i.e. someone else is injecting into it
+ */
+static
+bool expect_target(rd_handoff_t *handoff)
+{
+    pthread_mutex_lock(&handoff_lock);
+    bool is_expected = false;
+    for (rd_handoff_t *pending = pending_handoffs; pending; pending = pending->next) {
+        is_expected |= (pending->target == handoff->target);
+    }
+    if (!is_expected) {
+        handoff->next = pending_handoffs;
+        pending_handoffs = handoff;
+    }
+    pthread_mutex_unlock(&handoff_lock);
+
+    return !is_expected;
+}
+
+static
+void forget_target(rd_handoff_t *handoff)
+{
+    pthread_mutex_lock(&handoff_lock);
+    for (rd_handoff_t **pending = &pending_handoffs; *pending; pending = &(*pending)->next) {
+        if (*pending == handoff) {
+            *pending = handoff->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&handoff_lock);
+}
+
+/**
+ * @abstract
+ * Sends every expected target its descriptor.
+ *
+ * @discussion
+ * Anyone in our network namespace can connect to an abstract socket, so a connection only
+ * gets a descriptor if it comes from an expected target. The descriptor is sent under
+ * the lock: once the injection has forgotten the target, its payload may be gone.
+ *
+ * Running out of descriptors only makes us wait a bit (the connection waits in the
+ * backlog meanwhile); any other accept4() error means the listener is broken, so we
+ * close it and stop.
+ */
+static
+void *hand_descriptors_over(void *context)
+{
+    int listener = (int)(intptr_t)context;
+    while (true) {
+        int connection = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (connection < 0 && (errno == EINTR || errno == ECONNABORTED)) {
+            continue;
+        }
+        /* The connection stays in the backlog until we've got a descriptor for it */
+        if (connection < 0 && (errno == EMFILE || errno == ENFILE ||
+                               errno == ENOBUFS || errno == ENOMEM)) {
+            usleep(kRDHandoffBackoffUsec);
+            continue;
+        }
+        if (connection < 0) {
+            break;
+        }
+        struct ucred peer;
+        socklen_t peer_size = sizeof(peer);
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_size) == 0) {
+            pthread_mutex_lock(&handoff_lock);
+            for (rd_handoff_t *pending = pending_handoffs; pending; pending = pending->next) {
+                if (pending->target == peer.pid) {
+                    send_descriptor(connection, pending->fd);
+                    break;
+                }
+            }
+            pthread_mutex_unlock(&handoff_lock);
+        }
+        close(connection);
+    }
+    /* Targets can't connect anymore, so their injections fail instead of waiting for us */
+    syslog(LOG_NOTICE, "Stopped handing payloads over: %s", strerror(errno));
+    atomic_store(&handoff_listener, -1);
+    close(listener);
+    return NULL;
+}
+
+static
+bool send_descriptor(int connection, int fd)
+{
+    char byte = 0;
+    struct iovec data = {&byte, 1};
+    union {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr message = {
+        .msg_iov = &data,
+        .msg_iovlen = 1,
+        .msg_control = control.buffer,
+        .msg_controllen = sizeof(control.buffer)
+    };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+    /* A fresh connection has all of its buffer free, so this never waits */
+    ssize_t sent;
+    do {
+        sent = sendmsg(connection, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (sent < 0 && errno == EINTR);
+
+    return (sent == 1);
+}
+
+#endif
@@ -0,0 +1,921 @@
+//
+//  rd_inject_preflight.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__APPLE__)
+#include <sys/sysctl.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <libkern/OSByteOrder.h>
+#else
+#include <elf.h>
+#endif
+
+#include "rd_inject_library.h"
+#include "rd_inject_preflight.h"
+
+#define kRDMaxCachedLibraries   (64)
+#define kRDMaxCachedTargets     (256)
+/* The most files of a library's dependency closure to prefetch */
+#define kRDMaxPrefetchedFiles   (32)
+
+#pragma mark - Private Interface
+
+/* What we've learned about a library file */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    struct timespec mtime;
+    /* KERN_SUCCESS or KERN_INVALID_OBJECT if the library can't be loaded no matter what */
+    int err;
+    /* The libraries it depends on (NUL-separated), followed by its own search path
+     * (colon-separated RUNPATH or RPATH entries, Linux only) */
+    char *strings;
+    size_t strings_size;
+    size_t dependencies_count;
+    size_t search_path_offset;
+} rd_library_summary_t;
+
+/* What we've learned about a target process */
+typedef struct {
+    pid_t target;
+    uint64_t start_time;
+    bool is_64_bit;
+} rd_target_summary_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_library_summary_t cached_libraries[kRDMaxCachedLibraries];
+static size_t cached_libraries_count = 0;
+static rd_target_summary_t cached_targets[kRDMaxCachedTargets];
+static size_t cached_targets_count = 0;
+static atomic_bool is_prefetching = true;
+
+static bool lookup_cached_library(const struct stat *info, rd_library_summary_t *summary);
+static void cache_library(const rd_library_summary_t *summary);
+static void summarize_library(int fd, const struct stat *info, rd_library_summary_t *summary);
+static bool locate_dependency(pid_t target, const char *library_path, const char *search_path,
+                              const char *dependency, char *located, size_t located_size);
+static bool prefetch_file(int fd, const struct stat *info);
+static bool process_is_64_bit(pid_t target);
+#if defined(__linux__)
+static bool search_directories(const char *root, const char *directories, const char *origin,
+                               const char *dependency, char *located, size_t located_size);
+static int lookup_loader_cache(const char *root, const char *dependency, char *located,
+                               size_t located_size);
+static bool target_has_loaded(pid_t target, const char *root, const char *dependency,
+                              char *located, size_t located_size);
+static bool file_exists(const char *root, const char *directory, const char *name,
+                        char *located, size_t located_size);
+#endif
+
+#pragma mark - Implementation
+
+uint64_t rd_process_start_time(pid_t target)
+{
+#if defined(__APPLE__)
+    int mib[4] = {
+        CTL_KERN, KERN_PROC, KERN_PROC_PID, target
+    };
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+    if (sysctl(mib, 4, &info, &size, NULL, 0) != 0 || size == 0) {
+        return 0;
+    }
+    return (uint64_t)info.kp_proc.p_starttime.tv_sec * 1000000ull +
+           (uint64_t)info.kp_proc.p_starttime.tv_usec;
+#else
+    char stat_path[64];
+    snprintf(stat_path, sizeof(stat_path), "/proc/%d/stat", target);
+    int fd = open(stat_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    char buffer[1024];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    buffer[length] = '\0';
+    /* The command name may contain anything, so skip right past its closing paren:
+     * the start time is the 20th field after it */
+    char *field = strrchr(buffer, ')');
+    for (int i = 0; field && i < 20; i++) {
+        field = strchr(field + 1, ' ');
+    }
+    return field ? strtoull(field + 1, NULL, 10) : 0;
+#endif
+}
+
+int rd_inject_preflight_target(pid_t target)
+{
+    uint64_t start_time = rd_process_start_time(target);
+    if (start_time == 0) {
+        syslog(LOG_NOTICE, "[The target process %d is gone]", target);
+        return KERN_FAILURE;
+    }
+
+    bool known = false, is_64_bit = false;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cached_targets_count; i++) {
+        if (cached_targets[i].target == target && cached_targets[i].start_time == start_time) {
+            is_64_bit = cached_targets[i].is_64_bit;
+            known = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (!known) {
+        is_64_bit = process_is_64_bit(target);
+        pthread_mutex_lock(&cache_lock);
+        size_t slot = cached_targets_count;
+        for (size_t i = 0; i < cached_targets_count; i++) {
+            /* A previous process with the same pid is gone for good */
+            if (cached_targets[i].target == target) {
+                slot = i;
+                break;
+            }
+        }
+        if (slot == kRDMaxCachedTargets) {
+            /* Same as the symbols cache: no eviction, just start over */
+            cached_targets_count = slot = 0;
+        }
+        cached_targets[slot] = (rd_target_summary_t){
+            .target = target,
+            .start_time = start_time,
+            .is_64_bit = is_64_bit
+        };
+        if (slot == cached_targets_count) {
+            cached_targets_count++;
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+
+    if (!is_64_bit) {
+        /* Yeah, I know, there're lots of i386 apps.
+         * No.
+         * There aren't.
+         * YOLO.
+         */
+        syslog(LOG_NOTICE, "[The target task should be a 64 bit process]");
+        return KERN_FAILURE;
+    }
+    return KERN_SUCCESS;
+}
+
+int rd_inject_preflight_library(pid_t target, const char *library_path)
+{
+    if (!library_path || library_path[0] == '\0') {
+        return KERN_INVALID_OBJECT;
+    }
+    if (library_path[0] != '/') {
+        /* It's up to the target's loader (and its working directory) then */
+        return KERN_SUCCESS;
+    }
+#if defined(__APPLE__)
+    const char *path = library_path;
+#else
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "/proc/%d/root%s", target, library_path);
+#endif
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+        syslog(LOG_NOTICE, "[%s doesn't exist or is not a file]", library_path);
+        return KERN_INVALID_OBJECT;
+    }
+
+    rd_library_summary_t summary;
+    if (!lookup_cached_library(&info, &summary)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        struct stat opened;
+        if (fd < 0 || fstat(fd, &opened) != 0) {
+            if (fd >= 0) close(fd);
+            syslog(LOG_NOTICE, "[Could not open %s]", library_path);
+            return KERN_INVALID_OBJECT;
+        }
+        /* Key the summary by what we've actually read */
+        summarize_library(fd, &opened, &summary);
+        close(fd);
+        cache_library(&summary);
+    }
+    if (summary.err != KERN_SUCCESS) {
+        syslog(LOG_NOTICE, "[%s is not an x86_64 shared library]", library_path);
+        free(summary.strings);
+        return summary.err;
+    }
+
+    int err = KERN_SUCCESS;
+    const char *dependency = summary.strings;
+    for (size_t i = 0; i < summary.dependencies_count; i++) {
+        char located[PATH_MAX + 64];
+        if (!locate_dependency(target, library_path, summary.strings + summary.search_path_offset,
+                               dependency, located, sizeof(located))) {
+            syslog(LOG_NOTICE, "[%s depends on %s which can't be found]", library_path, dependency);
+            err = KERN_INVALID_OBJECT;
+            break;
+        }
+        dependency += strlen(dependency) + 1;
+    }
+    free(summary.strings);
+
+    return err;
+}
+
+size_t rd_inject_prefetch_library(pid_t target, const char *library_path)
+{
+    if (!atomic_load_explicit(&is_prefetching, memory_order_relaxed) || !library_path ||
+        library_path[0] != '/') {
+        return 0;
+    }
+#if defined(__APPLE__)
+    const char root[] = "";
+#else
+    char root[32];
+    snprintf(root, sizeof(root), "/proc/%d/root", target);
+#endif
+    /* The library and its dependencies as the target sees them, breadth first */
+    char *closure[kRDMaxPrefetchedFiles];
+    size_t count = 0, prefetched = 0;
+    closure[count++] = strdup(library_path);
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX + 64];
+        snprintf(path, sizeof(path), "%s%s", root, closure[i] ? closure[i] : "");
+        int fd = closure[i] ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+        struct stat info;
+        if (fd < 0 || fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+            if (fd >= 0) close(fd);
+            continue;
+        }
+        prefetched += prefetch_file(fd, &info);
+        rd_library_summary_t summary;
+        if (!lookup_cached_library(&info, &summary)) {
+            summarize_library(fd, &info, &summary);
+            cache_library(&summary);
+        }
+        close(fd);
+
+        const char *dependency = summary.strings;
+        for (size_t j = 0; summary.err == KERN_SUCCESS && j < summary.dependencies_count &&
+             count < kRDMaxPrefetchedFiles; j++, dependency += strlen(dependency) + 1) {
+            char located[PATH_MAX + 64];
+            /* Nothing to prefetch for the ones only the target's loader knows about */
+            if (!locate_dependency(target, closure[i], summary.strings + summary.search_path_offset,
+                                   dependency, located, sizeof(located)) || located[0] == '\0') {
+                continue;
+            }
+            const char *seen_path = located + strlen(root);
+            bool is_known = false;
+            for (size_t k = 0; k < count && !is_known; k++) {
+                is_known = (closure[k] && strcmp(closure[k], seen_path) == 0);
+            }
+            if (!is_known) {
+                closure[count++] = strdup(seen_path);
+            }
+        }
+        free(summary.strings);
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(closure[i]);
+    }
+
+    return prefetched;
+}
+
+void rd_inject_prefetch_enable(bool enabled)
+{
+    atomic_store_explicit(&is_prefetching, enabled, memory_order_relaxed);
+}
+
+void rd_inject_preflight_flush_cache(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cached_libraries_count; i++) {
+        free(cached_libraries[i].strings);
+    }
+    cached_libraries_count = 0;
+    cached_targets_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @abstract
+ * Copies a cached summary of the library out.
+ *
+ * @discussion
+ * The caller owns `summary->strings` then.
+ */
+static
+bool lookup_cached_library(const struct stat *info, rd_library_summary_t *summary)
+{
+    bool found = false;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cached_libraries_count; i++) {
+        rd_library_summary_t *entry = &cached_libraries[i];
+#if defined(__APPLE__)
+        const struct timespec *mtime = &info->st_mtimespec;
+#else
+        const struct timespec *mtime = &info->st_mtim;
+#endif
+        if (entry->device != info->st_dev || entry->inode != info->st_ino ||
+            entry->size != info->st_size || entry->mtime.tv_sec != mtime->tv_sec ||
+            entry->mtime.tv_nsec != mtime->tv_nsec) {
+            continue;
+        }
+        *summary = *entry;
+        summary->strings = malloc(entry->strings_size);
+        if (summary->strings) {
+            memcpy(summary->strings, entry->strings, entry->strings_size);
+            found = true;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return found;
+}
+
+static
+void cache_library(const rd_library_summary_t *summary)
+{
+    char *strings = summary->strings ? malloc(summary->strings_size) : NULL;
+    if (!strings) {
+        return;
+    }
+    memcpy(strings, summary->strings, summary->strings_size);
+
+    pthread_mutex_lock(&cache_lock);
+    size_t slot = cached_libraries_count;
+    for (size_t i = 0; i < cached_libraries_count; i++) {
+        /* The file has changed since we've seen it */
+        if (cached_libraries[i].device == summary->device &&
+            cached_libraries[i].inode == summary->inode) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot == kRDMaxCachedLibraries) {
+        for (size_t i = 0; i < cached_libraries_count; i++) {
+            free(cached_libraries[i].strings);
+        }
+        cached_libraries_count = slot = 0;
+    }
+    if (slot < cached_libraries_count) {
+        free(cached_libraries[slot].strings);
+    } else {
+        cached_libraries_count++;
+    }
+    cached_libraries[slot] = *summary;
+    cached_libraries[slot].strings = strings;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @abstract
+ * Asks the kernel to start reading the whole file into the page cache.
+ *
+ * @discussion
+ * It doesn't wait for the reads, so they overlap whatever we do next. Pages that are
+ * already cached cost a lookup each.
+ */
+static
+bool prefetch_file(int fd, const struct stat *info)
+{
+#if defined(__APPLE__)
+    struct radvisory advice = {
+        .ra_offset = 0,
+        .ra_count = (info->st_size < INT_MAX) ? (int)info->st_size : INT_MAX
+    };
+    return (fcntl(fd, F_RDADVISE, &advice) != -1);
+#else
+    (void)info;
+    return (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0);
+#endif
+}
+
+#if defined(__APPLE__)
+
+/**
+ * @abstract
+ * Checks the Mach-O header of a library and collects the libraries it depends on.
+ *
+ * @discussion
+ * A fat library is fine as long as it has an x86_64 slice. Weak dependencies are skipped
+ * since dyld doesn't require them to exist.
+ */
+static
+void summarize_library(int fd, const struct stat *info, rd_library_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    summary->device = info->st_dev;
+    summary->inode = info->st_ino;
+    summary->size = info->st_size;
+    summary->mtime = info->st_mtimespec;
+    summary->err = KERN_INVALID_OBJECT;
+    summary->strings = calloc(1, 1);
+    summary->strings_size = 1;
+
+    size_t size = (size_t)info->st_size;
+    if (!summary->strings || size < sizeof(struct mach_header_64)) {
+        return;
+    }
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        return;
+    }
+#define RDInBounds(offset, length) ((uint64_t)(offset) <= size && (uint64_t)(length) <= size - (uint64_t)(offset))
+
+    uint64_t slice = 0;
+    const struct fat_header *fat = (const struct fat_header *)file;
+    if (OSSwapBigToHostInt32(fat->magic) == FAT_MAGIC) {
+        uint32_t count = OSSwapBigToHostInt32(fat->nfat_arch);
+        const struct fat_arch *archs = (const struct fat_arch *)(fat + 1);
+        if (!RDInBounds(sizeof(*fat), (uint64_t)count * sizeof(*archs))) {
+            goto end;
+        }
+        slice = size;
+        for (uint32_t i = 0; i < count; i++) {
+            if ((cpu_type_t)OSSwapBigToHostInt32(archs[i].cputype) == CPU_TYPE_X86_64) {
+                slice = OSSwapBigToHostInt32(archs[i].offset);
+                break;
+            }
+        }
+        if (!RDInBounds(slice, sizeof(struct mach_header_64))) {
+            goto end;
+        }
+    }
+    const struct mach_header_64 *header = (const struct mach_header_64 *)(file + slice);
+    if (header->magic != MH_MAGIC_64 || header->cputype != CPU_TYPE_X86_64 ||
+        (header->filetype != MH_DYLIB && header->filetype != MH_BUNDLE) ||
+        !RDInBounds(slice + sizeof(*header), header->sizeofcmds)) {
+        goto end;
+    }
+
+    /* The dependencies' names can't be longer than the load commands themselves */
+    char *strings = realloc(summary->strings, header->sizeofcmds + 1);
+    if (!strings) {
+        goto end;
+    }
+    summary->strings = strings;
+    size_t position = 0;
+    const uint8_t *commands = (const uint8_t *)(header + 1);
+    const uint8_t *command = commands;
+    for (uint32_t i = 0; i < header->ncmds; i++) {
+        const struct load_command *load = (const struct load_command *)command;
+        if (command + sizeof(*load) > commands + header->sizeofcmds || load->cmdsize < sizeof(*load) ||
+            command + load->cmdsize > commands + header->sizeofcmds) {
+            goto end;
+        }
+        if ((load->cmd == LC_LOAD_DYLIB || load->cmd == LC_REEXPORT_DYLIB) &&
+            load->cmdsize > sizeof(struct dylib_command)) {
+            const struct dylib_command *dylib = (const struct dylib_command *)command;
+            uint32_t offset = dylib->dylib.name.offset;
+            if (offset < sizeof(*dylib) || offset >= load->cmdsize) {
+                goto end;
+            }
+            const char *name = (const char *)command + offset;
+            size_t length = strnlen(name, load->cmdsize - offset);
+            memcpy(strings + position, name, length);
+            strings[position + length] = '\0';
+            position += length + 1;
+            summary->dependencies_count++;
+        }
+        command += load->cmdsize;
+    }
+    /* There's no search path of our own on OS X */
+    strings[position] = '\0';
+    summary->search_path_offset = position;
+    summary->strings_size = position + 1;
+    summary->err = KERN_SUCCESS;
+#undef RDInBounds
+
+end:
+    munmap((void *)file, size);
+}
+
+/**
+ * @abstract
+ * Checks whether a dependency of the library exists and tells where it is.
+ *
+ * @discussion
+ * System libraries may only live in the dyld shared cache, and we can't know the target's
+ * run path search list (let alone its executable path) from here, so such dependencies
+ * are assumed to exist (and `located` is empty then).
+ */
+static
+bool locate_dependency(pid_t target, const char *library_path, const char *search_path,
+                       const char *dependency, char *located, size_t located_size)
+{
+    (void)target;
+    (void)search_path;
+    struct stat info;
+    located[0] = '\0';
+    if (strncmp(dependency, "@loader_path/", strlen("@loader_path/")) == 0) {
+        const char *slash = strrchr(library_path, '/');
+        snprintf(located, located_size, "%.*s%s", slash ? (int)(slash - library_path) : 0,
+                 library_path, dependency + strlen("@loader_path"));
+        return (stat(located, &info) == 0);
+    }
+    if (dependency[0] != '/' || strncmp(dependency, "/usr/lib/", strlen("/usr/lib/")) == 0 ||
+        strncmp(dependency, "/System/Library/", strlen("/System/Library/")) == 0) {
+        return true;
+    }
+    snprintf(located, located_size, "%s", dependency);
+    return (stat(located, &info) == 0);
+}
+
+/**
+ * @abstract
+ * Check wheither the given task is a 64 bit process.
+ */
+static
+bool process_is_64_bit(pid_t target)
+{
+    int mib[4] = {
+        CTL_KERN, KERN_PROC, KERN_PROC_PID, target
+    };
+    struct kinfo_proc info;
+    size_t size = sizeof(info);
+
+    if (sysctl(mib, 4, &info, &size, NULL, 0) == KERN_SUCCESS) {
+        return (info.kp_proc.p_flag & P_LP64);
+    } else {
+        return false;
+    }
+}
+
+#else
+
+/* Where the loader looks after RPATH/LD_LIBRARY_PATH/RUNPATH and its cache */
+static const char kRDDefaultSearchPath[] =
+    "/lib/x86_64-linux-gnu:/usr/lib/x86_64-linux-gnu:/lib64:/usr/lib64:/lib:/usr/lib";
+
+/* <dl-cache.h> is private to glibc, so here's the bits of its "new" format we need */
+#define kRDLoaderCacheMagic     "glibc-ld.so.cache1.1"
+#define kRDLoaderCacheOldMagic  "ld.so-1.7.0"
+#define kRDLoaderCacheX8664     (0x0303)
+
+typedef struct {
+    char magic[sizeof(kRDLoaderCacheMagic) - 1];
+    uint32_t count;
+    uint32_t strings_size;
+    uint8_t flags;
+    uint8_t padding[3];
+    uint32_t extension_offset;
+    uint32_t unused[3];
+} rd_loader_cache_header_t;
+
+typedef struct {
+    int32_t flags;
+    uint32_t key;
+    uint32_t value;
+    uint32_t os_version;
+    uint64_t hwcap;
+} rd_loader_cache_entry_t;
+
+/**
+ * @abstract
+ * Checks the ELF header of a library and collects the libraries it depends on.
+ *
+ * @discussion
+ * Modern glibc refuses to dlopen() position-independent executables, so they're rejected
+ * here as well.
+ */
+static
+void summarize_library(int fd, const struct stat *info, rd_library_summary_t *summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    summary->device = info->st_dev;
+    summary->inode = info->st_ino;
+    summary->size = info->st_size;
+    summary->mtime = info->st_mtim;
+    summary->err = KERN_INVALID_OBJECT;
+    summary->strings = calloc(1, 1);
+    summary->strings_size = 1;
+
+    size_t size = (size_t)info->st_size;
+    if (!summary->strings || size < sizeof(Elf64_Ehdr)) {
+        return;
+    }
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        return;
+    }
+#define RDInBounds(offset, length) ((uint64_t)(offset) <= size && (uint64_t)(length) <= size - (uint64_t)(offset))
+
+    const Elf64_Ehdr *header = (const Elf64_Ehdr *)file;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        header->e_ident[EI_DATA] != ELFDATA2LSB || header->e_machine != EM_X86_64 ||
+        header->e_type != ET_DYN ||
+        !RDInBounds(header->e_phoff, (uint64_t)header->e_phnum * sizeof(Elf64_Phdr))) {
+        goto end;
+    }
+
+    /* The dynamic section points at its string table by address, so we need the segments
+     * to turn that back into a file offset */
+    const Elf64_Phdr *segments = (const Elf64_Phdr *)(file + header->e_phoff);
+    const Elf64_Phdr *dynamic = NULL;
+    for (Elf64_Half i = 0; i < header->e_phnum; i++) {
+        if (segments[i].p_type == PT_DYNAMIC) dynamic = &segments[i];
+    }
+    if (!dynamic || !RDInBounds(dynamic->p_offset, dynamic->p_filesz)) {
+        goto end;
+    }
+    const Elf64_Dyn *entries = (const Elf64_Dyn *)(file + dynamic->p_offset);
+    size_t entries_count = dynamic->p_filesz / sizeof(Elf64_Dyn);
+    uint64_t strtab = 0, strsz = 0, rpath = ~0ULL, runpath = ~0ULL, flags = 0;
+    for (size_t i = 0; i < entries_count && entries[i].d_tag != DT_NULL; i++) {
+        switch (entries[i].d_tag) {
+            case DT_STRTAB:  strtab = entries[i].d_un.d_ptr; break;
+            case DT_STRSZ:   strsz = entries[i].d_un.d_val; break;
+            case DT_RPATH:   rpath = entries[i].d_un.d_val; break;
+            case DT_RUNPATH: runpath = entries[i].d_un.d_val; break;
+            case DT_FLAGS_1: flags = entries[i].d_un.d_val; break;
+        }
+    }
+    if (flags & DF_1_PIE) {
+        goto end;
+    }
+    uint64_t strings_offset = ~0ULL;
+    for (Elf64_Half i = 0; i < header->e_phnum; i++) {
+        if (segments[i].p_type == PT_LOAD && strtab >= segments[i].p_vaddr &&
+            strtab - segments[i].p_vaddr < segments[i].p_filesz) {
+            strings_offset = segments[i].p_offset + (strtab - segments[i].p_vaddr);
+            break;
+        }
+    }
+    if (strtab == 0 || !RDInBounds(strings_offset, strsz)) {
+        goto end;
+    }
+    const char *dynstr = (const char *)(file + strings_offset);
+
+    /* Every string we keep is a part of .dynstr, so that's the upper bound */
+    char *strings = realloc(summary->strings, strsz * 2 + 1);
+    if (!strings) {
+        goto end;
+    }
+    summary->strings = strings;
+    size_t position = 0;
+    for (size_t i = 0; i < entries_count && entries[i].d_tag != DT_NULL; i++) {
+        if (entries[i].d_tag != DT_NEEDED || entries[i].d_un.d_val >= strsz) {
+            continue;
+        }
+        const char *name = dynstr + entries[i].d_un.d_val;
+        size_t length = strnlen(name, strsz - entries[i].d_un.d_val);
+        memcpy(strings + position, name, length);
+        strings[position + length] = '\0';
+        position += length + 1;
+        summary->dependencies_count++;
+    }
+    /* RUNPATH makes the loader ignore RPATH */
+    summary->search_path_offset = position;
+    uint64_t search_path = (runpath != ~0ULL) ? runpath : rpath;
+    if (search_path < strsz) {
+        size_t length = strnlen(dynstr + search_path, strsz - search_path);
+        memcpy(strings + position, dynstr + search_path, length);
+        position += length;
+    }
+    strings[position] = '\0';
+    summary->strings_size = position + 1;
+    summary->err = KERN_SUCCESS;
+#undef RDInBounds
+
+end:
+    munmap((void *)file, size);
+}
+
+/**
+ * @abstract
+ * Checks whether a dependency of the library exists, roughly the way the loader does,
+ * and tells where it is.
+ *
+ * @discussion
+ * LD_LIBRARY_PATH and ld.so.conf directories missing from ld.so.cache are covered
+ * by looking into the directories the target has already loaded libraries from.
+ *
+ * @param located
+ * Receives the dependency's path through /proc/<pid>/root, or an empty string if
+ * it's assumed to exist or the target has it loaded already
+ */
+static
+bool locate_dependency(pid_t target, const char *library_path, const char *search_path,
+                       const char *dependency, char *located, size_t located_size)
+{
+    char root[32];
+    snprintf(root, sizeof(root), "/proc/%d/root", target);
+    located[0] = '\0';
+    if (strchr(dependency, '/')) {
+        return (dependency[0] != '/' || file_exists(root, "", dependency, located, located_size));
+    }
+
+    char origin[PATH_MAX];
+    const char *slash = strrchr(library_path, '/');
+    snprintf(origin, sizeof(origin), "%.*s", slash ? (int)(slash - library_path) : 0, library_path);
+    if (search_directories(root, search_path, origin, dependency, located, located_size) ||
+        search_directories(root, kRDDefaultSearchPath, NULL, dependency, located, located_size)) {
+        return true;
+    }
+    int cached = lookup_loader_cache(root, dependency, located, located_size);
+    if (cached > 0) {
+        return true;
+    }
+    /* Without ld.so.cache (e.g. on musl) we don't know where else to look */
+    located[0] = '\0';
+    return (cached < 0 || target_has_loaded(target, root, dependency, located, located_size));
+}
+
+static
+bool search_directories(const char *root, const char *directories, const char *origin,
+                        const char *dependency, char *located, size_t located_size)
+{
+    const char *directory = directories;
+    while (directory && *directory) {
+        size_t length = strcspn(directory, ":");
+        char expanded[PATH_MAX];
+        if (origin && strncmp(directory, "$ORIGIN", strlen("$ORIGIN")) == 0) {
+            snprintf(expanded, sizeof(expanded), "%s%.*s", origin,
+                     (int)(length - strlen("$ORIGIN")), directory + strlen("$ORIGIN"));
+        } else if (origin && strncmp(directory, "${ORIGIN}", strlen("${ORIGIN}")) == 0) {
+            snprintf(expanded, sizeof(expanded), "%s%.*s", origin,
+                     (int)(length - strlen("${ORIGIN}")), directory + strlen("${ORIGIN}"));
+        } else {
+            snprintf(expanded, sizeof(expanded), "%.*s", (int)length, directory);
+        }
+        /* Skip $LIB, $PLATFORM and relative entries rather than guessing */
+        if (expanded[0] == '/' && !strchr(expanded, '$') &&
+            file_exists(root, expanded, dependency, located, located_size)) {
+            return true;
+        }
+        directory += length;
+        if (*directory == ':') directory++;
+    }
+    return false;
+}
+
+/**
+ * @abstract
+ * Looks a library up in the target's ld.so.cache.
+ *
+ * @return
+ * 1 if the cache has it (and `located` is where it is, if the cache says), 0 if not,
+ * -1 if there's no cache we could read
+ */
+static
+int lookup_loader_cache(const char *root, const char *dependency, char *located,
+                        size_t located_size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "%s/etc/ld.so.cache", root);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(rd_loader_cache_header_t)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)info.st_size;
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return -1;
+    }
+
+    int found = -1;
+    /* Older glibc versions prepend the new format with the old one (12-byte entries) */
+    size_t start = 0;
+    if (memcmp(file, kRDLoaderCacheOldMagic, strlen(kRDLoaderCacheOldMagic)) == 0) {
+        uint32_t old_count;
+        memcpy(&old_count, file + strlen(kRDLoaderCacheOldMagic) + 1, sizeof(old_count));
+        start = strlen(kRDLoaderCacheOldMagic) + 1 + sizeof(old_count) + (size_t)old_count * 12;
+        start = (start + 7) & ~(size_t)7;
+    }
+    if (start > size || size - start < sizeof(rd_loader_cache_header_t)) {
+        goto end;
+    }
+    const rd_loader_cache_header_t *header = (const rd_loader_cache_header_t *)(file + start);
+    const rd_loader_cache_entry_t *entries = (const rd_loader_cache_entry_t *)(header + 1);
+    if (memcmp(header->magic, kRDLoaderCacheMagic, sizeof(header->magic)) != 0 ||
+        (size - start - sizeof(*header)) / sizeof(*entries) < header->count) {
+        goto end;
+    }
+    /* String offsets are relative to the new header */
+    const char *strings = (const char *)header;
+    size_t strings_limit = size - start;
+    size_t length = strlen(dependency) + 1;
+    found = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        if (entries[i].flags != kRDLoaderCacheX8664 || entries[i].key >= strings_limit ||
+            strings_limit - entries[i].key < length) {
+            continue;
+        }
+        if (memcmp(strings + entries[i].key, dependency, length) == 0) {
+            found = 1;
+            if (entries[i].value < strings_limit) {
+                const char *path = strings + entries[i].value;
+                snprintf(located, located_size, "%s%.*s", root,
+                         (int)strnlen(path, strings_limit - entries[i].value), path);
+            }
+            break;
+        }
+    }
+
+end:
+    munmap((void *)file, size);
+    return found;
+}
+
+/**
+ * @abstract
+ * Looks for a library in the directories of the target's mapped files.
+ */
+static
+bool target_has_loaded(pid_t target, const char *root, const char *dependency,
+                       char *located, size_t located_size)
+{
+    char maps_path[64];
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", target);
+    FILE *maps = fopen(maps_path, "re");
+    if (!maps) {
+        return false;
+    }
+    bool found = false;
+    char line[PATH_MAX + 128];
+    char last_directory[PATH_MAX] = "";
+    while (!found && fgets(line, sizeof(line), maps)) {
+        char *path = strchr(line, '/');
+        if (!path) {
+            continue;
+        }
+        path[strcspn(path, "\n")] = '\0';
+        char *name = strrchr(path, '/');
+        *name++ = '\0';
+        /* Consecutive mappings usually belong to the same file */
+        if (strcmp(path, last_directory) == 0) {
+            continue;
+        }
+        snprintf(last_directory, sizeof(last_directory), "%s", path);
+        found = (strcmp(name, dependency) == 0 ||
+                 file_exists(root, path, dependency, located, located_size));
+    }
+    fclose(maps);
+
+    return found;
+}
+
+static
+bool file_exists(const char *root, const char *directory, const char *name, char *located,
+                 size_t located_size)
+{
+    snprintf(located, located_size, "%s%s/%s", root, directory, name);
+    if (access(located, F_OK) == 0) {
+        return true;
+    }
+    located[0] = '\0';
+    return false;
+}
+
+/**
+ * @abstract
+ * Check wheither the given process is a 64 bit one.
+ *
+ * @discussion
+ * Looks at the ELF class of the process' main executable.
+ */
+static
+bool process_is_64_bit(pid_t target)
+{
+    char exe_path[64];
+    snprintf(exe_path, sizeof(exe_path), "/proc/%d/exe", target);
+    int fd = open(exe_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    unsigned char ident[EI_NIDENT];
+    ssize_t size = pread(fd, ident, sizeof(ident), 0);
+    close(fd);
+
+    return (size == sizeof(ident) && memcmp(ident, ELFMAG, SELFMAG) == 0
+            && ident[EI_CLASS] == ELFCLASS64);
+}
+
+#endif
@@ -0,0 +1,102 @@
+//
+//  rd_inject_preflight.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * @abstract
+ * Returns an opaque start time of the process (or 0 if it's gone).
+ *
+ * @discussion
+ * Together with the pid it identifies a process: a recycled pid gets a new start time.
+ */
+uint64_t rd_process_start_time(pid_t target);
+
+/**
+ * @abstract
+ * Checks whether we're able to inject into the target at all (i.e. it's a 64 bit process).
+ *
+ * @discussion
+ * The answer is cached by the target's pid and start time. Note that exec() keeps both,
+ * so a target that exec()s into a different architecture after its first check is only
+ * caught later, when we fail to locate dlopen() in it.
+ *
+ * @return KERN_SUCCESS
+ * Means the target is a 64 bit process
+ * @return KERN_FAILURE
+ * Means it's not, or it's gone
+ */
+int rd_inject_preflight_target(pid_t target);
+
+/**
+ * @abstract
+ * Checks whether the target would be able to load the library, without touching the target.
+ *
+ * @discussion
+ * The library must be a 64 bit x86_64 shared library (a Mach-O dylib or bundle on OS X,
+ * a non-PIE ELF shared object on Linux) and all the libraries it depends on must exist.
+ * On Linux the library and its dependencies are looked up through /proc/<pid>/root, i.e.
+ * the way the target sees them, using the library's RPATH/RUNPATH, the default search
+ * directories, the target's ld.so.cache and the directories the target has already loaded
+ * anything from. Dependencies we can't see from here (e.g. @rpath ones on OS X, or any
+ * if the target has no ld.so.cache) are given the benefit of the doubt.
+ *
+ * Parsing a library only happens once: the outcome, its dependencies and search paths
+ * are cached by the library's device, inode, size and mtime, so a warm check costs a
+ * stat() plus a stat() per dependency. The cache is shared by all threads.
+ *
+ * @param target
+ * The identifier of the target process
+ * @param library_path
+ * The full path of the library (as the target sees it)
+ *
+ * @return KERN_SUCCESS
+ * Means the library is worth injecting
+ * @return KERN_INVALID_OBJECT
+ * Means the target would fail to load the library
+ */
+int rd_inject_preflight_library(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Starts reading the library and the libraries it depends on into the page cache.
+ *
+ * @discussion
+ * A cold remote dlopen() spends most of its time faulting the library and its
+ * dependencies in from the disk, while the hijacked thread (and on Linux the whole
+ * target) waits. Every injection calls this right after the preflight, so the reads
+ * are under way while we're attaching to the target: the dependencies are located the
+ * way rd_inject_preflight_library() does it (and their summaries come from the same
+ * cache), and every file of the closure is handed to posix_fadvise(POSIX_FADV_WILLNEED)
+ * (F_RDADVISE on OS X), which doesn't wait for the reads. Dependencies the target has
+ * loaded already are mostly cached, so they cost a lookup per page.
+ *
+ * @param target
+ * The identifier of the target process
+ * @param library_path
+ * The full path of the library (as the target sees it)
+ *
+ * @return the number of files prefetched (0 if prefetching is off)
+ */
+size_t rd_inject_prefetch_library(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Turns prefetching on (the default) or off for every injection.
+ */
+void rd_inject_prefetch_enable(bool enabled);
+
+/**
+ * @abstract
+ * Drops all the cached libraries and targets.
+ */
+void rd_inject_preflight_flush_cache(void);
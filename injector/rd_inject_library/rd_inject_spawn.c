@@ -0,0 +1,432 @@
+//
+//  rd_inject_spawn.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/wait.h>
+#if defined(__APPLE__)
+#include <spawn.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <mach-o/dyld_images.h>
+#elif defined(__linux__)
+#include <elf.h>
+#include <sys/user.h>
+#include <sys/ptrace.h>
+#endif
+
+#include "rd_inject_library.h"
+#if defined(__linux__)
+#include "rd_inject_library_linux.h"
+#endif
+
+#if defined(__APPLE__)
+#define kRDPreloadVariable      "DYLD_INSERT_LIBRARIES"
+/* How long dyld may take to get to the initializers */
+#define kRDSpawnLoadTimeoutSec  (5)
+#else
+#define kRDPreloadVariable      "LD_PRELOAD"
+#endif
+
+extern char **environ;
+
+#pragma mark - Private Interface
+
+static char **environment_with_library(char *const envp[], const char *library_path, char **variable);
+static int spawn_preloaded(const char *executable_path, char *const argv[], char *const envp[],
+                           const char *library_path, pid_t *pid, bool *preloaded);
+#if defined(__APPLE__)
+static int wait_for_dyld(task_t task, const char *library_path, bool *preloaded);
+static bool read_remote(task_t task, mach_vm_address_t address, void *buffer, mach_vm_size_t size);
+#elif defined(__linux__)
+static int run_to_entry_point(pid_t proc, bool *secure);
+static bool library_is_mapped(pid_t proc, const char *library_path);
+#endif
+
+#pragma mark - Implementation
+
+int rd_spawn_with_library(const char *executable_path, char *const argv[], char *const envp[],
+                          const char *library_path, pid_t *pid, rd_spawn_stats_t *stats)
+{
+    if (stats) memset(stats, 0, sizeof(*stats));
+    if (!executable_path || !argv || !library_path || !pid) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    *pid = -1;
+    /* The loader won't tell us it has skipped a library it can't read */
+    if (access(library_path, R_OK) != 0) {
+        syslog(LOG_NOTICE, "Can't read %s: %s", library_path, strerror(errno));
+        return KERN_INVALID_OBJECT;
+    }
+    char *variable = NULL;
+    char **environment = environment_with_library(envp ? envp : environ, library_path, &variable);
+    if (!environment) {
+        return KERN_FAILURE;
+    }
+
+    uint64_t started = rd_inject_clock_ns();
+    bool preloaded = false;
+    int err = spawn_preloaded(executable_path, argv, environment, library_path, pid, &preloaded);
+    free(environment);
+    free(variable);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    rd_spawn_mode_t mode = RD_SPAWN_PRELOADED;
+    if (!preloaded) {
+        syslog(LOG_NOTICE, "The loader has skipped %s, injecting it into (%d)", library_path, *pid);
+        mode = RD_SPAWN_INJECTED;
+#if defined(__linux__)
+        /* It's still held at its entry point, so it doesn't run a single instruction of
+         * its own until the library is loaded (and the stub is gone from there) */
+        err = rd_linux_inject_held(*pid, &library_path, 1, NULL, stats ? &stats->timings : NULL);
+#else
+        err = rd_inject_libraries_with_timings(*pid, &library_path, 1, NULL,
+                                               stats ? &stats->timings : NULL);
+#endif
+    }
+#if defined(__linux__)
+    else {
+        ptrace(PTRACE_DETACH, *pid, NULL, NULL);
+    }
+#endif
+    if (stats) {
+        stats->mode = mode;
+        stats->loaded_ns = rd_inject_clock_ns() - started;
+    }
+
+    return err;
+}
+
+/**
+ * @abstract
+ * Copies the environment with the library put in front of the loader's preload list.
+ *
+ * @param variable
+ * Receives the new preload variable, the only string of the copy that needs to be freed
+ *
+ * @return
+ * The copy (free() it) or NULL if there's no memory
+ */
+static
+char **environment_with_library(char *const envp[], const char *library_path, char **variable)
+{
+    const size_t prefix_length = strlen(kRDPreloadVariable "=");
+    size_t count = 0;
+    const char *preloads = NULL;
+    for (; envp[count]; count++) {
+        if (strncmp(envp[count], kRDPreloadVariable "=", prefix_length) == 0) {
+            preloads = envp[count] + prefix_length;
+        }
+    }
+    char **environment = calloc(count + 2, sizeof(*environment));
+    if (!environment) {
+        return NULL;
+    }
+    if (preloads && *preloads) {
+        if (asprintf(variable, "%s=%s:%s", kRDPreloadVariable, library_path, preloads) < 0) *variable = NULL;
+    } else {
+        if (asprintf(variable, "%s=%s", kRDPreloadVariable, library_path) < 0) *variable = NULL;
+    }
+    if (!*variable) {
+        free(environment);
+        return NULL;
+    }
+    size_t copied = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (strncmp(envp[i], kRDPreloadVariable "=", prefix_length) != 0) {
+            environment[copied++] = envp[i];
+        }
+    }
+    environment[copied] = *variable;
+
+    return environment;
+}
+
+#if defined(__APPLE__)
+
+/**
+ * @abstract
+ * Launches the process with the library in its preload list and waits until dyld
+ * has loaded its libraries.
+ *
+ * @param preloaded
+ * Receives whether dyld has loaded the library
+ */
+static
+int spawn_preloaded(const char *executable_path, char *const argv[], char *const envp[],
+                    const char *library_path, pid_t *pid, bool *preloaded)
+{
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    /* Don't let dyld run until we can watch it */
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_START_SUSPENDED);
+    int error = posix_spawn(pid, executable_path, NULL, &attributes, argv, envp);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0) {
+        syslog(LOG_NOTICE, "Failed to launch %s: %s", executable_path, strerror(error));
+        return KERN_FAILURE;
+    }
+    task_t task = MACH_PORT_NULL;
+    int err = task_for_pid(mach_task_self(), *pid, &task);
+    kill(*pid, SIGCONT);
+    if (err != KERN_SUCCESS) {
+        syslog(LOG_NOTICE, "task_for_pid() failed with error: %s [%d]", mach_error_string(err), err);
+        return KERN_FAILURE;
+    }
+    err = wait_for_dyld(task, library_path, preloaded);
+    mach_port_deallocate(mach_task_self(), task);
+
+    return err;
+}
+
+/**
+ * @abstract
+ * Watches dyld's image list until the library shows up in it or libSystem gets initialized.
+ *
+ * @discussion
+ * dyld loads every library (the inserted ones included) before running any initializers,
+ * libSystem's go first, so if the library isn't there by then, dyld has skipped it.
+ */
+static
+int wait_for_dyld(task_t task, const char *library_path, bool *preloaded)
+{
+    *preloaded = false;
+    uint64_t deadline = rd_inject_clock_ns() + kRDSpawnLoadTimeoutSec * 1000000000ULL;
+    while (rd_inject_clock_ns() < deadline) {
+        struct task_dyld_info dyld_info;
+        mach_msg_type_number_t count = TASK_DYLD_INFO_COUNT;
+        struct dyld_all_image_infos infos;
+        int err = task_info(task, TASK_DYLD_INFO, (task_info_t)&dyld_info, &count);
+        if (err != KERN_SUCCESS) {
+            /* The process is gone */
+            return KERN_FAILURE;
+        }
+        /* dyld hasn't registered its image list yet */
+        if (dyld_info.all_image_info_addr == 0 ||
+            !read_remote(task, dyld_info.all_image_info_addr, &infos, sizeof(infos))) {
+            usleep(100);
+            continue;
+        }
+        /* The list is NULL while dyld is updating it */
+        for (uint32_t i = 0; infos.infoArray && i < infos.infoArrayCount; i++) {
+            struct dyld_image_info image;
+            char path[PATH_MAX] = {0};
+            if (!read_remote(task, (mach_vm_address_t)(infos.infoArray + i), &image, sizeof(image)) ||
+                !read_remote(task, (mach_vm_address_t)image.imageFilePath, path, sizeof(path) - 1)) {
+                continue;
+            }
+            if (strcmp(path, library_path) == 0) {
+                *preloaded = true;
+                return KERN_SUCCESS;
+            }
+        }
+        if (infos.libSystemInitialized) {
+            return KERN_SUCCESS;
+        }
+        usleep(100);
+    }
+    syslog(LOG_NOTICE, "dyld has not loaded anything in %d seconds", kRDSpawnLoadTimeoutSec);
+
+    return KERN_OPERATION_TIMED_OUT;
+}
+
+static
+bool read_remote(task_t task, mach_vm_address_t address, void *buffer, mach_vm_size_t size)
+{
+    mach_vm_size_t read = 0;
+    return (mach_vm_read_overwrite(task, address, size, (mach_vm_address_t)buffer, &read) == KERN_SUCCESS &&
+            read == size);
+}
+
+#elif defined(__linux__)
+
+/**
+ * @abstract
+ * Launches the process with the library in its preload list and lets it run until
+ * its entry point, i.e. until the loader has loaded and initialized every library.
+ *
+ * @discussion
+ * The process is traced from the exec on (which costs next to nothing, as nobody has
+ * to attach to it) and stopped at its entry point with a breakpoint.
+ *
+ * @param preloaded
+ * Receives whether the loader has loaded the library
+ *
+ * @return
+ * KERN_SUCCESS with the process still traced and stopped at its entry point: detach
+ * from it, or inject the library with rd_linux_inject_held() if it's not preloaded
+ */
+static
+int spawn_preloaded(const char *executable_path, char *const argv[], char *const envp[],
+                    const char *library_path, pid_t *pid, bool *preloaded)
+{
+    /* The child reports why it couldn't exec through this pipe; it's closed on exec */
+    int report[2];
+    if (pipe2(report, O_CLOEXEC) != 0) {
+        return KERN_FAILURE;
+    }
+    pid_t child = fork();
+    if (child < 0) {
+        close(report[0]);
+        close(report[1]);
+        return KERN_FAILURE;
+    }
+    if (child == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == 0) {
+            execve(executable_path, argv, envp);
+        }
+        int error = errno;
+        if (write(report[1], &error, sizeof(error)) < 0) {
+            /* Nothing to do */
+        }
+        _exit(127);
+    }
+    close(report[1]);
+    int error = 0;
+    ssize_t reported = 0;
+    do {
+        reported = read(report[0], &error, sizeof(error));
+    } while (reported < 0 && errno == EINTR);
+    close(report[0]);
+    if (reported > 0) {
+        waitpid(child, NULL, 0);
+        syslog(LOG_NOTICE, "Failed to launch %s: %s", executable_path, strerror(error));
+        return KERN_FAILURE;
+    }
+    *pid = child;
+
+    bool secure = false;
+    int err = run_to_entry_point(child, &secure);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    /* The loader ignores the preload list of setuid executables altogether, and it
+     * only complains about a library it can't load */
+    *preloaded = !secure && library_is_mapped(child, library_path);
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Takes a process stopped right after the exec to its entry point.
+ *
+ * @param secure
+ * Receives whether the loader runs in the secure-execution mode (e.g. for a setuid
+ * executable)
+ *
+ * @return
+ * KERN_SUCCESS with the process stopped at the entry point, still traced
+ */
+static
+int run_to_entry_point(pid_t proc, bool *secure)
+{
+    int status = 0;
+    /* An exec of a traced process stops it with a SIGTRAP */
+    if (waitpid(proc, &status, __WALL) != proc || !WIFSTOPPED(status)) {
+        return KERN_FAILURE;
+    }
+    char auxv_path[64];
+    snprintf(auxv_path, sizeof(auxv_path), "/proc/%d/auxv", proc);
+    int fd = open(auxv_path, O_RDONLY | O_CLOEXEC);
+    Elf64_auxv_t auxv[64];
+    ssize_t size = (fd >= 0) ? read(fd, auxv, sizeof(auxv)) : -1;
+    if (fd >= 0) close(fd);
+    unsigned long entry = 0;
+    for (ssize_t i = 0; size > 0 && i < size / (ssize_t)sizeof(*auxv); i++) {
+        if (auxv[i].a_type == AT_ENTRY) entry = auxv[i].a_un.a_val;
+        if (auxv[i].a_type == AT_SECURE) *secure = (auxv[i].a_un.a_val != 0);
+        if (auxv[i].a_type == AT_NULL) break;
+    }
+    errno = 0;
+    long original = (entry != 0) ? ptrace(PTRACE_PEEKTEXT, proc, entry, NULL) : -1;
+    if (entry == 0 || errno != 0 ||
+        ptrace(PTRACE_POKETEXT, proc, entry, (original & ~0xffL) | 0xcc) != 0) {
+        syslog(LOG_NOTICE, "Failed to set a breakpoint at the entry point of (%d)", proc);
+        ptrace(PTRACE_DETACH, proc, NULL, NULL);
+        return KERN_FAILURE;
+    }
+
+    struct user_regs_struct regs;
+    int signal = 0;
+    while (true) {
+        if (ptrace(PTRACE_CONT, proc, NULL, signal) != 0 || waitpid(proc, &status, __WALL) != proc) {
+            /* We've lost it with a breakpoint in its code */
+            kill(proc, SIGKILL);
+            return KERN_FAILURE;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            syslog(LOG_NOTICE, "(%d) has died before its entry point", proc);
+            return KERN_FAILURE;
+        }
+        signal = WSTOPSIG(status);
+        if (signal == SIGTRAP && ptrace(PTRACE_GETREGS, proc, NULL, &regs) == 0 &&
+            regs.rip == entry + 1) {
+            break;
+        }
+        /* Signals other than our breakpoint are the process' own business */
+        if (signal == SIGTRAP) signal = 0;
+    }
+    regs.rip = entry;
+    if (ptrace(PTRACE_POKETEXT, proc, entry, original) != 0 ||
+        ptrace(PTRACE_SETREGS, proc, NULL, &regs) != 0) {
+        /* The process can't go on without its first instruction */
+        kill(proc, SIGKILL);
+        waitpid(proc, NULL, __WALL);
+        return KERN_FAILURE;
+    }
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Checks whether the library is mapped into the process.
+ */
+static
+bool library_is_mapped(pid_t proc, const char *library_path)
+{
+    char resolved_path[PATH_MAX];
+    if (!realpath(library_path, resolved_path)) {
+        return false;
+    }
+    char maps_path[64];
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", proc);
+    FILE *maps = fopen(maps_path, "re");
+    if (!maps) {
+        return false;
+    }
+    size_t resolved_length = strlen(resolved_path);
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length = 0;
+    bool mapped = false;
+    while (!mapped && (length = getline(&line, &line_size, maps)) > 0) {
+        if (line[length - 1] == '\n') line[--length] = '\0';
+        mapped = ((size_t)length > resolved_length &&
+                  strcmp(line + length - resolved_length, resolved_path) == 0 &&
+                  line[length - resolved_length - 1] == ' ');
+    }
+    free(line);
+    fclose(maps);
+
+    return mapped;
+}
+
+#endif
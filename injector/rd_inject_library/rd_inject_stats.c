@@ -0,0 +1,196 @@
+//
+//  rd_inject_stats.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <time.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "rd_inject_stats.h"
+
+#pragma mark - Private Interface
+
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t buckets[kRDInjectHistogramBuckets];
+} rd_atomic_histogram_t;
+
+static rd_atomic_histogram_t histograms[RD_PHASE_COUNT];
+
+static const char *phase_names[RD_PHASE_COUNT] = {
+    [RD_PHASE_PREFLIGHT] = "preflight",
+    [RD_PHASE_ATTACH] = "attach",
+    [RD_PHASE_RESOLVE] = "resolve",
+    [RD_PHASE_ALLOCATE] = "allocate",
+    [RD_PHASE_WRITE] = "write",
+    [RD_PHASE_THREAD] = "thread",
+    [RD_PHASE_DLOPEN] = "dlopen",
+    [RD_PHASE_TEARDOWN] = "teardown",
+    [RD_PHASE_TOTAL] = "total",
+    [RD_PHASE_STOPPED] = "stopped"
+};
+
+static void histogram_record(rd_atomic_histogram_t *histogram, uint64_t ns);
+static unsigned int bucket_for_value(uint64_t ns);
+static uint64_t bucket_upper_bound(unsigned int bucket);
+
+#pragma mark - Implementation
+
+uint64_t rd_inject_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+const char *rd_inject_phase_name(rd_inject_phase_t phase)
+{
+    if (phase >= RD_PHASE_COUNT) {
+        return "unknown";
+    }
+    return phase_names[phase];
+}
+
+void rd_inject_stats_snapshot(rd_inject_histogram_t snapshot[RD_PHASE_COUNT])
+{
+    if (!snapshot) return;
+
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        rd_atomic_histogram_t *histogram = &histograms[phase];
+        snapshot[phase].count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+        snapshot[phase].total_ns = atomic_load_explicit(&histogram->total_ns, memory_order_relaxed);
+        snapshot[phase].max_ns = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+        for (unsigned int i = 0; i < kRDInjectHistogramBuckets; i++) {
+            snapshot[phase].buckets[i] = atomic_load_explicit(&histogram->buckets[i],
+                                                              memory_order_relaxed);
+        }
+    }
+}
+
+void rd_inject_stats_reset(void)
+{
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        rd_atomic_histogram_t *histogram = &histograms[phase];
+        atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&histogram->total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&histogram->max_ns, 0, memory_order_relaxed);
+        for (unsigned int i = 0; i < kRDInjectHistogramBuckets; i++) {
+            atomic_store_explicit(&histogram->buckets[i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t rd_inject_histogram_percentile(const rd_inject_histogram_t *histogram, double percentile)
+{
+    if (!histogram || histogram->count == 0) {
+        return 0;
+    }
+    if (percentile < 0) percentile = 0;
+    if (percentile > 100) percentile = 100;
+    /* The snapshot isn't atomic as a whole, so don't trust `count` too much */
+    uint64_t total = 0;
+    for (unsigned int i = 0; i < kRDInjectHistogramBuckets; i++) {
+        total += histogram->buckets[i];
+    }
+    uint64_t rank = (uint64_t)(percentile / 100.0 * total + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < kRDInjectHistogramBuckets; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t bound = bucket_upper_bound(i);
+            return (bound < histogram->max_ns) ? bound : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+void rd_inject_timer_start(rd_inject_timer_t *timer)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->started_ns = timer->mark_ns = rd_inject_clock_ns();
+}
+
+void rd_inject_timer_mark(rd_inject_timer_t *timer, rd_inject_phase_t phase)
+{
+    uint64_t now = rd_inject_clock_ns();
+    timer->timings.phase_ns[phase] += now - timer->mark_ns;
+    timer->seen |= (1u << phase);
+    timer->mark_ns = now;
+}
+
+void rd_inject_timer_target_stopped(rd_inject_timer_t *timer)
+{
+    timer->stopped_ns = rd_inject_clock_ns();
+}
+
+void rd_inject_timer_target_resumed(rd_inject_timer_t *timer)
+{
+    if (timer->stopped_ns == 0) return;
+    timer->timings.phase_ns[RD_PHASE_STOPPED] += rd_inject_clock_ns() - timer->stopped_ns;
+    timer->seen |= (1u << RD_PHASE_STOPPED);
+    timer->stopped_ns = 0;
+}
+
+void rd_inject_timer_finish(rd_inject_timer_t *timer, rd_inject_timings_t *timings)
+{
+    /* We don't know when exactly the target was resumed then, so be pessimistic */
+    rd_inject_timer_target_resumed(timer);
+    timer->timings.phase_ns[RD_PHASE_TOTAL] = rd_inject_clock_ns() - timer->started_ns;
+    timer->seen |= (1u << RD_PHASE_TOTAL);
+    for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+        if (timer->seen & (1u << phase)) {
+            histogram_record(&histograms[phase], timer->timings.phase_ns[phase]);
+        }
+    }
+    if (timings) {
+        *timings = timer->timings;
+    }
+}
+
+static
+void histogram_record(rd_atomic_histogram_t *histogram, uint64_t ns)
+{
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[bucket_for_value(ns)], 1, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&histogram->max_ns, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&histogram->max_ns, &max, ns,
+                                                              memory_order_relaxed,
+                                                              memory_order_relaxed));
+}
+
+/**
+ * @abstract
+ * Maps a value to a histogram bucket.
+ *
+ * @discussion
+ * Values below 4 get a bucket each; every power of two above that is split
+ * into four equal buckets by the two bits following the most significant one.
+ */
+static
+unsigned int bucket_for_value(uint64_t ns)
+{
+    if (ns < 4) {
+        return (unsigned int)ns;
+    }
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(ns);
+    unsigned int sub = (unsigned int)(ns >> (msb - 2)) & 0x3;
+    return 4 + (msb - 2) * 4 + sub;
+}
+
+static
+uint64_t bucket_upper_bound(unsigned int bucket)
+{
+    if (bucket < 4) {
+        return bucket;
+    }
+    unsigned int msb = (bucket - 4) / 4 + 2;
+    uint64_t sub = (bucket - 4) % 4;
+    uint64_t lower = (4 + sub) << (msb - 2);
+    return lower + ((1ull << (msb - 2)) - 1);
+}
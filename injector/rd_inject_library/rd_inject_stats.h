@@ -0,0 +1,150 @@
+//
+//  rd_inject_stats.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Phases of a single injection */
+typedef enum {
+    /* Checking the target and the libraries before touching anything, and starting to
+     * prefetch the libraries (see rd_inject_preflight.h) */
+    RD_PHASE_PREFLIGHT = 0,
+    /* Attaching to the target (task_for_pid(), ptrace() seize) */
+    RD_PHASE_ATTACH,
+    /* Locating dlopen() and friends inside the target */
+    RD_PHASE_RESOLVE,
+    /* Allocating remote memory (a stack, the libraries' paths) */
+    RD_PHASE_ALLOCATE,
+    /* Writing into the target's memory */
+    RD_PHASE_WRITE,
+    /* Creating and setting up a remote thread (OS X only) */
+    RD_PHASE_THREAD,
+    /* The remote dlopen() calls (including the pthread set-up of the remote thread on OS X) */
+    RD_PHASE_DLOPEN,
+    /* Terminating the remote thread or restoring the hijacked one, freeing remote memory */
+    RD_PHASE_TEARDOWN,
+    /* The whole injection */
+    RD_PHASE_TOTAL,
+    /* How long the target's own code was stopped (Linux only: on OS X the target
+     * keeps running while we're busy with our own remote thread). It overlaps the
+     * other phases, see rd_inject_timer_target_stopped() */
+    RD_PHASE_STOPPED,
+    RD_PHASE_COUNT
+} rd_inject_phase_t;
+
+/* Four buckets per power of two, so percentiles are within ~20% of the real value */
+#define kRDInjectHistogramBuckets (252)
+
+/* A latency histogram of a single phase */
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[kRDInjectHistogramBuckets];
+} rd_inject_histogram_t;
+
+/* Timings of a single injection. Phases the injection never went through are zero */
+typedef struct {
+    uint64_t phase_ns[RD_PHASE_COUNT];
+} rd_inject_timings_t;
+
+/**
+ * @abstract
+ * Returns a short name of the phase (e.g. "attach"), suitable for keys and logs.
+ */
+const char *rd_inject_phase_name(rd_inject_phase_t phase);
+
+/**
+ * @abstract
+ * Takes a snapshot of the per-process latency histograms.
+ *
+ * @discussion
+ * Every injection made by this process (succeeded or not) adds its phases' timings
+ * to the histograms. Recording only costs a few relaxed atomic increments per phase,
+ * so it's always on.
+ *
+ * @param histograms
+ * An array of RD_PHASE_COUNT histograms to copy the current state into
+ */
+void rd_inject_stats_snapshot(rd_inject_histogram_t histograms[RD_PHASE_COUNT]);
+
+/**
+ * @abstract
+ * Clears the per-process latency histograms.
+ */
+void rd_inject_stats_reset(void);
+
+/**
+ * @abstract
+ * Estimates a percentile (0...100) of the histogram.
+ *
+ * @return
+ * The upper bound of the bucket the percentile falls into, in nanoseconds
+ * (or zero if the histogram is empty)
+ */
+uint64_t rd_inject_histogram_percentile(const rd_inject_histogram_t *histogram, double percentile);
+
+#pragma mark - For backends
+
+/**
+ * @abstract
+ * Returns the current time of the clock all the timings are taken with
+ * (CLOCK_MONOTONIC), in nanoseconds.
+ */
+uint64_t rd_inject_clock_ns(void);
+
+/* Measures the phases of a single injection */
+typedef struct {
+    uint64_t started_ns;
+    uint64_t mark_ns;
+    uint64_t stopped_ns;
+    /* Phases we went through */
+    uint32_t seen;
+    rd_inject_timings_t timings;
+} rd_inject_timer_t;
+
+/**
+ * @abstract
+ * Starts measuring an injection.
+ */
+void rd_inject_timer_start(rd_inject_timer_t *timer);
+
+/**
+ * @abstract
+ * Attributes the time since the previous mark (or the start) to the given phase.
+ *
+ * @discussion
+ * A phase may be marked more than once, its timings are added up.
+ */
+void rd_inject_timer_mark(rd_inject_timer_t *timer, rd_inject_phase_t phase);
+
+/**
+ * @abstract
+ * Notes that the target has just been stopped.
+ *
+ * @discussion
+ * Unlike the other phases, the time until rd_inject_timer_target_resumed() is
+ * attributed to RD_PHASE_STOPPED without interrupting the sequence of marks.
+ */
+void rd_inject_timer_target_stopped(rd_inject_timer_t *timer);
+
+/**
+ * @abstract
+ * Notes that the target is running again.
+ */
+void rd_inject_timer_target_resumed(rd_inject_timer_t *timer);
+
+/**
+ * @abstract
+ * Finishes measuring an injection and records its timings into the histograms.
+ *
+ * @param timings
+ * An optional pointer to copy the injection timings into
+ */
+void rd_inject_timer_finish(rd_inject_timer_t *timer, rd_inject_timings_t *timings);
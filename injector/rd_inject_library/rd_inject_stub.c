@@ -0,0 +1,203 @@
+//
+//  rd_inject_stub.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <stddef.h>
+
+#include "rd_inject_stub.h"
+
+const unsigned char rd_inject_stub[kRDInjectStubSize] = {
+    0x4d, 0x85, 0xff,               /* 00:      test   r15, r15             */
+    0x74, 0x03,                     /* 03:      je     08                   */
+    0x41, 0xff, 0xd7,               /* 05:      call   r15                  */
+    0x4d, 0x8d, 0x7d, 0x08,         /* 08:      lea    r15, [r13 + 8]       */
+    0x4d, 0x85, 0xe4,               /* 0c: 1:   test   r12, r12             */
+    0x74, 0x22,                     /* 0f:      je     33                   */
+    0x48, 0x89, 0xdf,               /* 11:      mov    rdi, rbx             */
+    0x48, 0x89, 0xee,               /* 14:      mov    rsi, rbp             */
+    0x41, 0xff, 0xd6,               /* 17:      call   r14                  */
+    0x49, 0x89, 0x07,               /* 1a:      mov    [r15], rax           */
+    0x49, 0x83, 0xc7, 0x08,         /* 1d:      add    r15, 8               */
+    0x49, 0xff, 0x45, 0x00,         /* 21:      inc    qword [r13]          */
+    0x80, 0x3b, 0x00,               /* 25: 2:   cmp    byte [rbx], 0        */
+    0x48, 0x8d, 0x5b, 0x01,         /* 28:      lea    rbx, [rbx + 1]       */
+    0x75, 0xf7,                     /* 2c:      jne    2b                   */
+    0x49, 0xff, 0xcc,               /* 2e:      dec    r12                  */
+    0xeb, 0xd9,                     /* 31:      jmp    1b                   */
+    0xcc                            /* 33:      int3                        */
+};
+
+const unsigned char rd_swap_stub[kRDSwapStubSize] = {
+    0x4d, 0x85, 0xff,               /* 00:      test   r15, r15             */
+    0x74, 0x03,                     /* 03:      je     08                   */
+    0x41, 0xff, 0xd7,               /* 05:      call   r15                  */
+    0x48, 0x85, 0xdb,               /* 08:      test   rbx, rbx             */
+    0x75, 0x05,                     /* 0b:      jne    12                   */
+    0x4c, 0x89, 0xe7,               /* 0d:      mov    rdi, r12             */
+    0xeb, 0x46,                     /* 10:      jmp    58                   */
+    0x48, 0x89, 0xdf,               /* 12:      mov    rdi, rbx             */
+    0x48, 0x89, 0xee,               /* 15:      mov    rsi, rbp             */
+    0x41, 0xff, 0xd6,               /* 18:      call   r14                  */
+    0x49, 0x89, 0x45, 0x08,         /* 1b:      mov    [r13 + 8], rax       */
+    0x48, 0x85, 0xc0,               /* 1f:      test   rax, rax             */
+    0x74, 0x41,                     /* 22:      je     65                   */
+    0x48, 0x89, 0xc3,               /* 24:      mov    rbx, rax             */
+    0x31, 0xc0,                     /* 27:      xor    eax, eax             */
+    0x49, 0x8b, 0x75, 0x38,         /* 29:      mov    rsi, [r13 + 56]      */
+    0x48, 0x85, 0xf6,               /* 2d:      test   rsi, rsi             */
+    0x74, 0x18,                     /* 30:      je     4a                   */
+    0x4c, 0x01, 0xee,               /* 32:      add    rsi, r13             */
+    0x48, 0x89, 0xdf,               /* 35:      mov    rdi, rbx             */
+    0x41, 0xff, 0x55, 0x28,         /* 38:      call   [r13 + 40]           */
+    0x49, 0x89, 0x45, 0x10,         /* 3c:      mov    [r13 + 16], rax      */
+    0x48, 0x85, 0xc0,               /* 40:      test   rax, rax             */
+    0x74, 0x05,                     /* 43:      je     4a                   */
+    0x4c, 0x89, 0xe7,               /* 45:      mov    rdi, r12             */
+    0xff, 0xd0,                     /* 48:      call   rax                  */
+    0x49, 0x89, 0x45, 0x18,         /* 4a:      mov    [r13 + 24], rax      */
+    0x4c, 0x89, 0xe7,               /* 4e:      mov    rdi, r12             */
+    0x85, 0xc0,                     /* 51:      test   eax, eax             */
+    0x74, 0x03,                     /* 53:      je     58                   */
+    0x48, 0x89, 0xdf,               /* 55:      mov    rdi, rbx             */
+    0x48, 0x85, 0xff,               /* 58:      test   rdi, rdi             */
+    0x74, 0x08,                     /* 5b:      je     65                   */
+    0x41, 0xff, 0x55, 0x30,         /* 5d:      call   [r13 + 48]           */
+    0x49, 0x89, 0x45, 0x20,         /* 61:      mov    [r13 + 32], rax      */
+    0x49, 0xff, 0x45, 0x00,         /* 65:      inc    qword [r13]          */
+    0xcc                            /* 69:      int3                        */
+};
+
+/* The stub below hardcodes these */
+_Static_assert(sizeof(rd_call_block_t) == 24, "rd_call_block_t layout");
+_Static_assert(sizeof(rd_call_entry_t) == 96, "rd_call_entry_t layout");
+_Static_assert(offsetof(rd_call_entry_t, pointers) == 72, "rd_call_entry_t layout");
+
+const unsigned char rd_call_stub[kRDCallStubSize] = {
+    0x4d, 0x85, 0xff,                               /* 00:      test   r15, r15             */
+    0x74, 0x03,                                     /* 03:      je     08                   */
+    0x41, 0xff, 0xd7,                               /* 05:      call   r15                  */
+    0x49, 0x8d, 0x5d, 0x18,                         /* 08: 1:   lea    rbx, [r13 + 24]      */
+    0x4d, 0x85, 0xe4,                               /* 0c: 2:   test   r12, r12             */
+    0x74, 0x72,                                     /* 0f:      je     83                   */
+    0x48, 0x8b, 0x03,                               /* 11:      mov    rax, [rbx]           */
+    0x48, 0x85, 0xc0,                               /* 14:      test   rax, rax             */
+    0x75, 0x17,                                     /* 17:      jne    30                   */
+    0x48, 0x8b, 0x7b, 0x08,                         /* 19:      mov    rdi, [rbx + 8]       */
+    0x48, 0x8b, 0x73, 0x10,                         /* 1d:      mov    rsi, [rbx + 16]      */
+    0x4c, 0x01, 0xee,                               /* 21:      add    rsi, r13             */
+    0x41, 0xff, 0x55, 0x08,                         /* 24:      call   [r13 + 8]            */
+    0x48, 0x85, 0xc0,                               /* 28:      test   rax, rax             */
+    0x74, 0x49,                                     /* 2b:      je     76                   */
+    0x48, 0x89, 0x03,                               /* 2d:      mov    [rbx], rax           */
+    0x48, 0x8b, 0x4b, 0x48,                         /* 30: 3:   mov    rcx, [rbx + 72]      */
+    0x48, 0x8d, 0x53, 0x18,                         /* 34:      lea    rdx, [rbx + 24]      */
+    0x48, 0x85, 0xc9,                               /* 38: 4:   test   rcx, rcx             */
+    0x74, 0x11,                                     /* 3b:      je     4e                   */
+    0xf6, 0xc1, 0x01,                               /* 3d:      test   cl, 1                */
+    0x74, 0x03,                                     /* 40:      je     45                   */
+    0x4c, 0x01, 0x2a,                               /* 42:      add    [rdx], r13           */
+    0x48, 0x83, 0xc2, 0x08,                         /* 45: 7:   add    rdx, 8               */
+    0x48, 0xd1, 0xe9,                               /* 49:      shr    rcx, 1               */
+    0xeb, 0xea,                                     /* 4c:      jmp    38                   */
+    0x48, 0x8b, 0x7b, 0x18,                         /* 4e: 6:   mov    rdi, [rbx + 24]      */
+    0x48, 0x8b, 0x73, 0x20,                         /* 52:      mov    rsi, [rbx + 32]      */
+    0x48, 0x8b, 0x53, 0x28,                         /* 56:      mov    rdx, [rbx + 40]      */
+    0x48, 0x8b, 0x4b, 0x30,                         /* 5a:      mov    rcx, [rbx + 48]      */
+    0x4c, 0x8b, 0x43, 0x38,                         /* 5e:      mov    r8, [rbx + 56]       */
+    0x4c, 0x8b, 0x4b, 0x40,                         /* 62:      mov    r9, [rbx + 64]       */
+    0x31, 0xc0,                                     /* 66:      xor    eax, eax             */
+    0xff, 0x13,                                     /* 68:      call   [rbx]                */
+    0x48, 0x89, 0x43, 0x50,                         /* 6a:      mov    [rbx + 80], rax      */
+    0x48, 0xc7, 0x43, 0x58, 0x01, 0x00, 0x00, 0x00, /* 6e:      mov    qword [rbx + 88], 1  */
+    0x49, 0xff, 0x45, 0x00,                         /* 76: 5:   inc    qword [r13]          */
+    0x48, 0x83, 0xc3, 0x60,                         /* 7a:      add    rbx, 96              */
+    0x49, 0xff, 0xcc,                               /* 7e:      dec    r12                  */
+    0xeb, 0x89,                                     /* 81:      jmp    0c                   */
+    0xcc                                            /* 83: 9:   int3                        */
+};
+
+#if defined(__linux__)
+/* The stub below hardcodes these */
+_Static_assert(offsetof(rd_memfd_block_t, socket) == 24, "rd_memfd_block_t layout");
+_Static_assert(offsetof(rd_memfd_block_t, path_prefix) == 48, "rd_memfd_block_t layout");
+_Static_assert(offsetof(rd_memfd_block_t, message) == 64, "rd_memfd_block_t layout");
+_Static_assert(offsetof(rd_memfd_block_t, data) == 120, "rd_memfd_block_t layout");
+_Static_assert(offsetof(rd_memfd_block_t, control) == 144, "rd_memfd_block_t layout");
+_Static_assert(offsetof(rd_memfd_block_t, address) == 200, "rd_memfd_block_t layout");
+
+const unsigned char rd_memfd_stub[kRDMemfdStubSize] = {
+    0x4d, 0x85, 0xff,                               /* 000:      test   r15, r15            */
+    0x74, 0x03,                                     /* 003:      je     008                 */
+    0x41, 0xff, 0xd7,                               /* 005:      call   r15                 */
+    0xb8, 0x29, 0x00, 0x00, 0x00,                   /* 008: 1:   mov    eax, 41             */
+    0xbf, 0x01, 0x00, 0x00, 0x00,                   /* 00d:      mov    edi, 1              */
+    0xbe, 0x01, 0x00, 0x08, 0x00,                   /* 012:      mov    esi, 0x80001        */
+    0x31, 0xd2,                                     /* 017:      xor    edx, edx            */
+    0x0f, 0x05,                                     /* 019:      syscall  ; socket          */
+    0x49, 0x89, 0x45, 0x18,                         /* 01b:      mov    [r13 + 24], rax     */
+    0x48, 0x85, 0xc0,                               /* 01f:      test   rax, rax            */
+    0x0f, 0x88, 0xd8, 0x00, 0x00, 0x00,             /* 022:      js     100                 */
+    0x48, 0x89, 0xc7,                               /* 028:      mov    rdi, rax            */
+    0x49, 0x8d, 0xb5, 0xc8, 0x00, 0x00, 0x00,       /* 02b:      lea    rsi, [r13 + 200]    */
+    0x49, 0x8b, 0x55, 0x28,                         /* 032:      mov    rdx, [r13 + 40]     */
+    0xb8, 0x2a, 0x00, 0x00, 0x00,                   /* 036:      mov    eax, 42             */
+    0x0f, 0x05,                                     /* 03b:      syscall  ; connect         */
+    0x48, 0x85, 0xc0,                               /* 03d:      test   rax, rax            */
+    0x0f, 0x85, 0xa9, 0x00, 0x00, 0x00,             /* 040:      jne    0ef                 */
+    0x49, 0x8d, 0x45, 0x78,                         /* 046:      lea    rax, [r13 + 120]    */
+    0x49, 0x89, 0x45, 0x50,                         /* 04a:      mov    [r13 + 80], rax     */
+    0x49, 0x8d, 0x85, 0x90, 0x00, 0x00, 0x00,       /* 04e:      lea    rax, [r13 + 144]    */
+    0x49, 0x89, 0x45, 0x60,                         /* 055:      mov    [r13 + 96], rax     */
+    0x49, 0x8d, 0x85, 0x88, 0x00, 0x00, 0x00,       /* 059:      lea    rax, [r13 + 136]    */
+    0x49, 0x89, 0x45, 0x78,                         /* 060:      mov    [r13 + 120], rax    */
+    0x49, 0x8b, 0x7d, 0x18,                         /* 064:      mov    rdi, [r13 + 24]     */
+    0x49, 0x8d, 0x75, 0x40,                         /* 068:      lea    rsi, [r13 + 64]     */
+    0xba, 0x00, 0x00, 0x00, 0x40,                   /* 06c:      mov    edx, 0x40000000     */
+    0xb8, 0x2f, 0x00, 0x00, 0x00,                   /* 071:      mov    eax, 47             */
+    0x0f, 0x05,                                     /* 076:      syscall  ; recvmsg         */
+    0x48, 0x85, 0xc0,                               /* 078:      test   rax, rax            */
+    0x7e, 0x72,                                     /* 07b:      jle    0ef                 */
+    0x41, 0x83, 0xbd, 0x9c, 0x00, 0x00, 0x00, 0x01, /* 07d:      cmp    dword [r13 + 156], 1*/
+    0x75, 0x68,                                     /* 085:      jne    0ef                 */
+    0x41, 0x8b, 0x85, 0xa0, 0x00, 0x00, 0x00,       /* 087:      mov    eax, [r13 + 160]    */
+    0x49, 0x89, 0x45, 0x10,                         /* 08e:      mov    [r13 + 16], rax     */
+    0x49, 0x8b, 0x7d, 0x18,                         /* 092:      mov    rdi, [r13 + 24]     */
+    0xb8, 0x03, 0x00, 0x00, 0x00,                   /* 096:      mov    eax, 3              */
+    0x0f, 0x05,                                     /* 09b:      syscall  ; close           */
+    0x49, 0x8d, 0xbd, 0xc7, 0x00, 0x00, 0x00,       /* 09d:      lea    rdi, [r13 + 199]    */
+    0xc6, 0x07, 0x00,                               /* 0a4:      mov    byte [rdi], 0       */
+    0x41, 0x8b, 0x45, 0x10,                         /* 0a7:      mov    eax, [r13 + 16]     */
+    0xb9, 0x0a, 0x00, 0x00, 0x00,                   /* 0ab:      mov    ecx, 10             */
+    0x31, 0xd2,                                     /* 0b0: 2:   xor    edx, edx            */
+    0xf7, 0xf1,                                     /* 0b2:      div    ecx                 */
+    0x80, 0xc2, 0x30,                               /* 0b4:      add    dl, 0x30            */
+    0x48, 0xff, 0xcf,                               /* 0b7:      dec    rdi                 */
+    0x88, 0x17,                                     /* 0ba:      mov    byte [rdi], dl      */
+    0x85, 0xc0,                                     /* 0bc:      test   eax, eax            */
+    0x75, 0xf0,                                     /* 0be:      jne    0b0                 */
+    0x48, 0x83, 0xef, 0x0e,                         /* 0c0:      sub    rdi, 14             */
+    0x49, 0x8b, 0x45, 0x30,                         /* 0c4:      mov    rax, [r13 + 48]     */
+    0x48, 0x89, 0x07,                               /* 0c8:      mov    [rdi], rax          */
+    0x49, 0x8b, 0x45, 0x36,                         /* 0cb:      mov    rax, [r13 + 54]     */
+    0x48, 0x89, 0x47, 0x06,                         /* 0cf:      mov    [rdi + 6], rax      */
+    0x48, 0x89, 0xee,                               /* 0d3:      mov    rsi, rbp            */
+    0x41, 0xff, 0xd6,                               /* 0d6:      call   r14                 */
+    0x49, 0x89, 0x45, 0x08,                         /* 0d9:      mov    [r13 + 8], rax      */
+    0x48, 0x85, 0xc0,                               /* 0dd:      test   rax, rax            */
+    0x75, 0x22,                                     /* 0e0:      jne    104                 */
+    0x49, 0x8b, 0x7d, 0x10,                         /* 0e2:      mov    rdi, [r13 + 16]     */
+    0xb8, 0x03, 0x00, 0x00, 0x00,                   /* 0e6:      mov    eax, 3              */
+    0x0f, 0x05,                                     /* 0eb:      syscall  ; close           */
+    0xeb, 0x15,                                     /* 0ed:      jmp    104                 */
+    0x49, 0x89, 0x45, 0x20,                         /* 0ef: 7:   mov    [r13 + 32], rax     */
+    0x49, 0x8b, 0x7d, 0x18,                         /* 0f3:      mov    rdi, [r13 + 24]     */
+    0xb8, 0x03, 0x00, 0x00, 0x00,                   /* 0f7:      mov    eax, 3              */
+    0x0f, 0x05,                                     /* 0fc:      syscall  ; close           */
+    0xeb, 0x04,                                     /* 0fe:      jmp    104                 */
+    0x49, 0x89, 0x45, 0x20,                         /* 100: 8:   mov    [r13 + 32], rax     */
+    0x49, 0xff, 0x45, 0x00,                         /* 104: 9:   inc    qword [r13]         */
+    0xcc                                            /* 108:      int3                       */
+};
+#endif
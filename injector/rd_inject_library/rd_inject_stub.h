@@ -0,0 +1,225 @@
+//
+//  rd_inject_stub.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#if defined(__linux__)
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#endif
+
+#include "rd_inject_stats.h"
+
+#define kRDInjectStubSize       (0x34)
+/* An offset of the instruction pointer after the final trap */
+#define kRDInjectStubTrapOffset (0x34)
+
+#define kRDSwapStubSize         (0x6a)
+#define kRDSwapStubTrapOffset   (0x6a)
+
+#define kRDCallStubSize         (0x84)
+#define kRDCallStubTrapOffset   (0x84)
+
+#define kRDMemfdStubSize        (0x109)
+#define kRDMemfdStubTrapOffset  (0x109)
+
+/* The largest of the stubs */
+#define kRDInjectStubMaxSize    (kRDMemfdStubSize)
+
+/**
+ * @abstract
+ * A position-independent x86_64 routine that loads all the libraries and stops
+ * exactly once.
+ *
+ * @discussion
+ * Registers on entry:
+ *   %rbx - the libraries' paths, one after another
+ *   %r12 - the number of libraries
+ *   %r13 - the address of the completion word, followed by an array of results
+ *   %r14 - dlopen(path, mode)
+ *   %rbp - dlopen() mode
+ *   %r15 - an optional thread set-up routine (or 0)
+ *
+ * The stub calls the thread set-up routine (if any) with the unchanged %rdi, then
+ * calls dlopen() for every path, storing every return value into the results array
+ * and incrementing the completion word after each call. Once it's done, it executes
+ * `int3`, so the injector only has to wait for a single trap at
+ * (stub + kRDInjectStubTrapOffset) and read the completion word and the results
+ * back. The completion word tells how many dlopen() calls have returned if the thread
+ * crashed half way.
+ *
+ * All the registers it uses are callee-saved, so they survive the calls; %rsp must be
+ * 16-byte aligned on entry.
+ */
+extern const unsigned char rd_inject_stub[kRDInjectStubSize];
+
+/* The parameter block of rd_swap_stub (%r13 points to it) */
+typedef struct {
+    uint64_t completion;
+    /* dlopen() of the new library */
+    uint64_t new_handle;
+    /* The handoff routine found in the new library (or 0) */
+    uint64_t handoff;
+    /* What the handoff routine has returned (only the low 32 bits matter) */
+    uint64_t handoff_result;
+    /* dlclose() of whatever library was closed */
+    uint64_t dlclose_result;
+    /* dlsym(handle, symbol) and dlclose(handle) */
+    uint64_t dlsym;
+    uint64_t dlclose;
+    /* An offset of the handoff symbol name from the block itself (or 0) */
+    uint64_t handoff_symbol;
+} rd_swap_block_t;
+
+/**
+ * @abstract
+ * A position-independent x86_64 routine that replaces one library with another
+ * (or just closes a library) and stops exactly once.
+ *
+ * @discussion
+ * Registers on entry:
+ *   %rbx - the new library's path (or 0 to only close the old one)
+ *   %r12 - the old library's handle (or 0)
+ *   %r13 - the address of a rd_swap_block_t
+ *   %r14 - dlopen(path, mode)
+ *   %rbp - dlopen() mode
+ *   %r15 - an optional thread set-up routine (or 0)
+ *
+ * The stub dlopen()s the new library; if that fails, nothing else happens. Otherwise
+ * it looks up the handoff symbol (if any) in the new library and calls it as
+ * `int handoff(void *old_handle)`: a non-zero result vetoes the swap, so the new library
+ * is dlclose()d instead of the old one. Either way the completion word is set to 1
+ * right before the final trap at (stub + kRDSwapStubTrapOffset).
+ */
+extern const unsigned char rd_swap_stub[kRDSwapStubSize];
+
+/* A call made by rd_call_stub */
+typedef struct {
+    /* The routine, or 0 to look `symbol` up with dlsym(handle, symbol) */
+    uint64_t function;
+    uint64_t handle;
+    /* An offset of the symbol name from the parameter block */
+    uint64_t symbol;
+    uint64_t arguments[6];
+    /* Bit N set means arguments[N] is an offset from the parameter block to turn into an address */
+    uint64_t pointers;
+    uint64_t result;
+    /* Set to 1 once the routine has returned, stays 0 if the symbol can't be found */
+    uint64_t called;
+} rd_call_entry_t;
+
+/* The parameter block of rd_call_stub (%r13 points to it), followed by the calls */
+typedef struct {
+    /* How many calls have been dealt with */
+    uint64_t completion;
+    /* dlsym(handle, symbol) */
+    uint64_t dlsym;
+    uint64_t reserved;
+} rd_call_block_t;
+
+/**
+ * @abstract
+ * A position-independent x86_64 routine that makes a number of function calls and stops
+ * exactly once.
+ *
+ * @discussion
+ * Registers on entry:
+ *   %r12 - the number of calls
+ *   %r13 - the address of a rd_call_block_t, followed by an array of rd_call_entry_t
+ *   %r15 - an optional thread set-up routine (or 0)
+ *
+ * For every call the stub looks the routine up (if needed), turns the pointer arguments
+ * into addresses and calls the routine with all six argument registers set (and %al
+ * cleared, for variadic routines), storing what it returns. The completion word is
+ * incremented after every call, so the injector only has to wait for a single trap at
+ * (stub + kRDCallStubTrapOffset).
+ */
+extern const unsigned char rd_call_stub[kRDCallStubSize];
+
+#if defined(__linux__)
+/* The parameter block of rd_memfd_stub (%r13 points to it) */
+typedef struct {
+    uint64_t completion;
+    /* dlopen() of the received descriptor */
+    uint64_t handle;
+    /* The received descriptor; must be -1 on entry */
+    int64_t fd;
+    /* The socket the descriptor comes over (or -errno) */
+    int64_t socket;
+    /* What the failed socket(), connect() or recvmsg() has returned (or 0) */
+    int64_t error;
+    uint64_t address_length;
+    /* "/proc/self/fd/", the stub puts it in front of the descriptor's number */
+    char path_prefix[16];
+    /* Everything below is filled by the stub itself, except for the lengths */
+    struct msghdr message;
+    struct iovec data;
+    uint64_t byte;
+    uint64_t control[3];
+    char path[32];
+    struct sockaddr_un address;
+} rd_memfd_block_t;
+
+/**
+ * @abstract
+ * A position-independent x86_64 routine that receives a file descriptor over a Unix domain
+ * socket, loads the library behind it and stops exactly once.
+ *
+ * @discussion
+ * Registers on entry:
+ *   %r13 - the address of a rd_memfd_block_t
+ *   %r14 - dlopen(path, mode)
+ *   %rbp - dlopen() mode
+ *   %r15 - an optional thread set-up routine (or 0)
+ *
+ * The stub connects to the block's address and receives a single SCM_RIGHTS descriptor,
+ * then dlopen()s it as "/proc/self/fd/<number>". The descriptor stays open if the library
+ * is loaded: the loader knows the library by that path, so the number must not go to
+ * another library. Either way the completion word is set to 1 right before the final
+ * trap at (stub + kRDMemfdStubTrapOffset).
+ */
+extern const unsigned char rd_memfd_stub[kRDMemfdStubSize];
+#endif
+
+/* A stub to run inside a target along with its arguments */
+typedef struct {
+    const unsigned char *code;
+    size_t size;
+    size_t trap_offset;
+    /* Goes into the target's scratch area (at %r13) as is; the completion word first */
+    const void *scratch;
+    size_t scratch_size;
+    /* How much of the scratch area to read back once the stub is done */
+    size_t results_size;
+    /* %rbx is set to (scratch area + rbx_offset), or to zero if the offset is zero */
+    size_t rbx_offset;
+    uint64_t r12;
+    /* The completion word the stub leaves behind when it's done */
+    uint64_t completion;
+} rd_inject_stub_call_t;
+
+/**
+ * @abstract
+ * Runs a stub inside the target the same way rd_inject_libraries() runs rd_inject_stub.
+ *
+ * @discussion
+ * Implemented by each backend.
+ *
+ * @param results
+ * A buffer of `call->results_size` bytes to read the scratch area back into
+ * @param timings
+ * An optional pointer to put the timings into
+ *
+ * @return
+ * KERN_SUCCESS if the stub has run to its final trap with the expected completion word
+ */
+int rd_inject_run_stub(pid_t target, const rd_inject_stub_call_t *call, void *results,
+                       rd_inject_timings_t *timings);
@@ -0,0 +1,180 @@
+//
+//  rd_inject_swap.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "rd_inject_library.h"
+#include "rd_inject_stub.h"
+#include "rd_remote_handles.h"
+#include "rd_inject_preflight.h"
+#if defined(__linux__)
+#include "rd_remote_symbols.h"
+#endif
+
+#pragma mark - Private Interface
+
+static int swap_libraries(pid_t target, uint64_t old_handle, const char *new_library_path,
+                          const char *handoff_symbol, rd_swap_block_t *block,
+                          rd_inject_timings_t *timings);
+static bool locate_loader_routines(pid_t target, rd_swap_block_t *block);
+
+#pragma mark - Implementation
+
+uint64_t rd_injected_library_handle(pid_t target, const char *library_path)
+{
+    return rd_remote_handles_lookup(target, library_path);
+}
+
+int rd_unload_library(pid_t target, const char *library_path)
+{
+    uint64_t handle = rd_remote_handles_lookup(target, library_path);
+    if (handle == 0) {
+        syslog(LOG_NOTICE, "%s has never been injected into %d", library_path, target);
+        return KERN_INVALID_ARGUMENT;
+    }
+    rd_swap_block_t block;
+    int err = swap_libraries(target, handle, NULL, NULL, &block, NULL);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    if (block.dlclose_result != 0) {
+        syslog(LOG_NOTICE, "Remote dlclose() failed for %s", library_path);
+        return KERN_FAILURE;
+    }
+    rd_remote_handles_forget(target, library_path);
+
+    return KERN_SUCCESS;
+}
+
+int rd_swap_library(pid_t target, const char *old_library_path, const char *new_library_path,
+                    const char *handoff_symbol, rd_swap_stats_t *stats)
+{
+    if (stats) memset(stats, 0, sizeof(*stats));
+    if (!old_library_path || !new_library_path || strcmp(old_library_path, new_library_path) == 0) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    uint64_t old_handle = rd_remote_handles_lookup(target, old_library_path);
+    if (old_handle == 0) {
+        syslog(LOG_NOTICE, "%s has never been injected into %d", old_library_path, target);
+        return KERN_INVALID_ARGUMENT;
+    }
+    /* Don't stop the target for a library it won't be able to load */
+    if (rd_inject_preflight_library(target, new_library_path) != KERN_SUCCESS) {
+        return KERN_INVALID_OBJECT;
+    }
+    /* The new version is read in while the target is stopped otherwise */
+    rd_inject_prefetch_library(target, new_library_path);
+
+    rd_swap_block_t block;
+    rd_inject_timings_t timings;
+    int err = swap_libraries(target, old_handle, new_library_path, handoff_symbol, &block, &timings);
+    if (stats) {
+        stats->timings = timings;
+#if defined(__APPLE__)
+        stats->pause_ns = timings.phase_ns[RD_PHASE_DLOPEN];
+#else
+        stats->pause_ns = timings.phase_ns[RD_PHASE_STOPPED];
+#endif
+        stats->handoff_called = (err == KERN_SUCCESS && block.handoff != 0);
+        stats->handoff_result = stats->handoff_called ? (int)(uint32_t)block.handoff_result : 0;
+    }
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    if (block.new_handle == 0) {
+        syslog(LOG_NOTICE, "Remote dlopen() failed for %s", new_library_path);
+        return KERN_INVALID_OBJECT;
+    }
+    if ((int)(uint32_t)block.handoff_result != 0) {
+        syslog(LOG_NOTICE, "The handoff routine of %s has refused to take over", new_library_path);
+        return KERN_ABORTED;
+    }
+    if (block.dlclose_result != 0) {
+        /* The new library is in anyway, so the swap itself has happened */
+        syslog(LOG_NOTICE, "Remote dlclose() failed for %s", old_library_path);
+    }
+    rd_remote_handles_forget(target, old_library_path);
+    rd_remote_handles_record(target, new_library_path, block.new_handle);
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Runs rd_swap_stub inside the target.
+ *
+ * @param new_library_path
+ * A library to load or NULL to only close the old one
+ * @param block
+ * Receives the stub's parameter block with the results
+ */
+static
+int swap_libraries(pid_t target, uint64_t old_handle, const char *new_library_path,
+                   const char *handoff_symbol, rd_swap_block_t *block,
+                   rd_inject_timings_t *timings)
+{
+    memset(block, 0, sizeof(*block));
+    if (timings) memset(timings, 0, sizeof(*timings));
+    if (!locate_loader_routines(target, block)) {
+        syslog(LOG_NOTICE, "Could not locate dlsym() or dlclose() inside the target");
+        return KERN_INVALID_HOST;
+    }
+
+    /* The parameter block goes first, then the new library path and the handoff symbol */
+    size_t path_size = new_library_path ? strlen(new_library_path) + 1 : 0;
+    size_t symbol_size = (new_library_path && handoff_symbol) ? strlen(handoff_symbol) + 1 : 0;
+    size_t scratch_size = sizeof(*block) + path_size + symbol_size;
+    char *scratch = calloc(1, scratch_size);
+    if (!scratch) {
+        return KERN_FAILURE;
+    }
+    if (symbol_size > 0) {
+        block->handoff_symbol = sizeof(*block) + path_size;
+        memcpy(scratch + block->handoff_symbol, handoff_symbol, symbol_size);
+    }
+    if (path_size > 0) {
+        memcpy(scratch + sizeof(*block), new_library_path, path_size);
+    }
+    memcpy(scratch, block, sizeof(*block));
+
+    rd_inject_stub_call_t call = {
+        .code = rd_swap_stub,
+        .size = kRDSwapStubSize,
+        .trap_offset = kRDSwapStubTrapOffset,
+        .scratch = scratch,
+        .scratch_size = scratch_size,
+        .results_size = sizeof(*block),
+        .rbx_offset = path_size ? sizeof(*block) : 0,
+        .r12 = old_handle,
+        .completion = 1
+    };
+    int err = rd_inject_run_stub(target, &call, block, timings);
+    free(scratch);
+
+    return err;
+}
+
+/**
+ * @abstract
+ * Puts the target's dlsym() and dlclose() addresses into the parameter block.
+ */
+static
+bool locate_loader_routines(pid_t target, rd_swap_block_t *block)
+{
+#if defined(__APPLE__)
+    /* The dyld shared cache is mapped at the same address in every process */
+    (void)target;
+    block->dlsym = (uint64_t)&dlsym;
+    block->dlclose = (uint64_t)&dlclose;
+#else
+    block->dlsym = rd_remote_loader_routine(target, "dlsym");
+    block->dlclose = rd_remote_loader_routine(target, "dlclose");
+#endif
+    return (block->dlsym != 0 && block->dlclose != 0);
+}
@@ -0,0 +1,152 @@
+//
+//  rd_remote_arena.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#if defined(__APPLE__)
+#include <mach/mach_vm.h>
+#endif
+
+#include "rd_inject_library.h"
+#include "rd_remote_arena.h"
+
+#pragma mark - Private Interface
+
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_remote_arena_usage_t *usages = NULL;
+static size_t usages_count = 0;
+
+static void account(pid_t target, int64_t bytes);
+
+#pragma mark - Implementation
+
+#if defined(__APPLE__)
+int rd_remote_arena_map(rd_remote_arena_t *arena, pid_t target, task_t task, uint64_t size)
+{
+    memset(arena, 0, sizeof(*arena));
+    mach_vm_address_t base = 0;
+    mach_vm_size_t rounded = mach_vm_round_page(size);
+    int err = mach_vm_allocate(task, &base, rounded, VM_FLAGS_ANYWHERE);
+    if (err != KERN_SUCCESS) {
+        return err;
+    }
+    arena->target = target;
+    arena->task = task;
+    arena->base = base;
+    arena->size = rounded;
+    arena->owned = true;
+    account(target, (int64_t)rounded);
+
+    return KERN_SUCCESS;
+}
+#endif
+
+void rd_remote_arena_borrow(rd_remote_arena_t *arena, pid_t target, uint64_t base, uint64_t size)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->target = target;
+    arena->base = base;
+    arena->size = size;
+    account(target, (int64_t)size);
+}
+
+uint64_t rd_remote_arena_allocate(rd_remote_arena_t *arena, uint64_t size, uint64_t alignment)
+{
+    uint64_t offset = (arena->used + alignment - 1) & ~(alignment - 1);
+    if (arena->size == 0 || offset > arena->size || size > arena->size - offset) {
+        return 0;
+    }
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+int rd_remote_arena_release(rd_remote_arena_t *arena)
+{
+    if (arena->size == 0) {
+        return KERN_SUCCESS;
+    }
+    int err = KERN_SUCCESS;
+#if defined(__APPLE__)
+    if (arena->owned) {
+        err = mach_vm_deallocate(arena->task, arena->base, arena->size);
+    }
+#endif
+    /* Memory of a dead target is gone anyway */
+    if (err != KERN_SUCCESS && kill(arena->target, 0) == 0) {
+        syslog(LOG_NOTICE, "Leaked %llu bytes of remote memory in %d",
+               (unsigned long long)arena->size, arena->target);
+        err = KERN_FAILURE;
+    } else {
+        account(arena->target, -(int64_t)arena->size);
+        err = KERN_SUCCESS;
+    }
+    memset(arena, 0, sizeof(*arena));
+
+    return err;
+}
+
+uint64_t rd_remote_arena_live_bytes(pid_t target)
+{
+    uint64_t bytes = 0;
+    pthread_mutex_lock(&usage_lock);
+    for (size_t i = 0; i < usages_count; i++) {
+        if (usages[i].target == target) {
+            bytes = usages[i].live_bytes;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&usage_lock);
+
+    return bytes;
+}
+
+size_t rd_remote_arena_usage(rd_remote_arena_usage_t usage[], size_t capacity)
+{
+    pthread_mutex_lock(&usage_lock);
+    size_t count = usages_count;
+    if (usage) {
+        memcpy(usage, usages, (count < capacity ? count : capacity) * sizeof(*usage));
+    }
+    pthread_mutex_unlock(&usage_lock);
+
+    return count;
+}
+
+/**
+ * @abstract
+ * Adds (or subtracts) live bytes of the target; targets with none left are dropped.
+ */
+static
+void account(pid_t target, int64_t bytes)
+{
+    pthread_mutex_lock(&usage_lock);
+    size_t i = 0;
+    while (i < usages_count && usages[i].target != target) {
+        i++;
+    }
+    if (i == usages_count) {
+        if (bytes < 0) {
+            /* We've failed to account for it in the first place */
+            pthread_mutex_unlock(&usage_lock);
+            return;
+        }
+        rd_remote_arena_usage_t *grown = realloc(usages, (usages_count + 1) * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&usage_lock);
+            return;
+        }
+        usages = grown;
+        usages[usages_count++] = (rd_remote_arena_usage_t){.target = target, .live_bytes = 0};
+    }
+    usages[i].live_bytes += (uint64_t)bytes;
+    if (usages[i].live_bytes == 0) {
+        usages[i] = usages[--usages_count];
+    }
+    pthread_mutex_unlock(&usage_lock);
+}
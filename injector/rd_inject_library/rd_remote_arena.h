@@ -0,0 +1,118 @@
+//
+//  rd_remote_arena.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#if defined(__APPLE__)
+#include <mach/mach.h>
+#endif
+
+/**
+ * @abstract
+ * A piece of a target's memory an injection works in.
+ *
+ * @discussion
+ * Every injection takes exactly one region of the target's memory and sub-allocates
+ * everything it needs (the stub, the remote stack, the paths and the results) from it,
+ * so there's only one thing to give back: rd_remote_arena_release() is safe to call on
+ * any arena, any number of times, which is what error paths do.
+ *
+ * On OS X the region is a fresh mapping inside the target, and releasing the arena
+ * unmaps it. On Linux the arena is bookkeeping only: nothing is ever mapped into (or
+ * unmapped from) the target. The region is a piece of the hijacked thread's stack (see
+ * rd_linux_injection_t), the arena just sub-allocates and accounts for it, and the
+ * target gets it back when the thread's registers are restored.
+ *
+ * The bytes held by every target's arenas are accounted for (see
+ * rd_remote_arena_live_bytes()), so a leak shows up as a target with live bytes and
+ * no injection in flight. On Linux that's a borrowed stack we haven't given back,
+ * never a leaked mapping; compare the target's /proc/<pid>/maps to check for those.
+ */
+typedef struct {
+    pid_t target;
+    /* The region inside the target */
+    uint64_t base;
+    uint64_t size;
+    /* How much of the region has been handed out */
+    uint64_t used;
+    /* Whether we've mapped the region ourselves (and have to unmap it) */
+    bool owned;
+#if defined(__APPLE__)
+    task_t task;
+#endif
+} rd_remote_arena_t;
+
+/* The live bytes of a single target */
+typedef struct {
+    pid_t target;
+    uint64_t live_bytes;
+} rd_remote_arena_usage_t;
+
+#if defined(__APPLE__)
+/**
+ * @abstract
+ * Maps a new region of (at least) `size` bytes inside the target's task.
+ *
+ * @return
+ * KERN_SUCCESS or a mach_vm_allocate() error (the arena is empty then)
+ */
+int rd_remote_arena_map(rd_remote_arena_t *arena, pid_t target, task_t task, uint64_t size);
+#endif
+
+/**
+ * @abstract
+ * Lends the arena a region of the target's memory that's already there (e.g. a part of
+ * a stack), so it's accounted for until rd_remote_arena_release().
+ */
+void rd_remote_arena_borrow(rd_remote_arena_t *arena, pid_t target, uint64_t base, uint64_t size);
+
+/**
+ * @abstract
+ * Hands out a piece of the arena's region.
+ *
+ * @param alignment
+ * A power of two
+ *
+ * @return
+ * A remote address or (0) if the region has no more room
+ */
+uint64_t rd_remote_arena_allocate(rd_remote_arena_t *arena, uint64_t size, uint64_t alignment);
+
+/**
+ * @abstract
+ * Gives the arena's region back to the target (or just forgets about it if it's borrowed).
+ *
+ * @discussion
+ * An empty (zeroed or already released) arena is fine too. If the region can't be
+ * unmapped while the target is still alive, its bytes stay accounted as live.
+ *
+ * @return
+ * KERN_SUCCESS or KERN_FAILURE if the region has leaked
+ */
+int rd_remote_arena_release(rd_remote_arena_t *arena);
+
+/**
+ * @abstract
+ * Returns how many bytes the arenas of the target currently hold.
+ */
+uint64_t rd_remote_arena_live_bytes(pid_t target);
+
+/**
+ * @abstract
+ * Lists the targets that have live bytes.
+ *
+ * @param usage
+ * An optional array of `capacity` items to put the targets into
+ *
+ * @return
+ * The number of such targets (it may exceed `capacity`)
+ */
+size_t rd_remote_arena_usage(rd_remote_arena_usage_t usage[], size_t capacity);
@@ -0,0 +1,215 @@
+//
+//  rd_remote_call.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <dlfcn.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "rd_inject_library.h"
+#include "rd_inject_stub.h"
+#include "rd_remote_handles.h"
+#if defined(__linux__)
+#include "rd_remote_symbols.h"
+#endif
+
+#pragma mark - Private Interface
+
+static int validate_calls(pid_t target, const rd_remote_call_t calls[], size_t count,
+                          uint64_t handles[]);
+static char *lay_out_calls(const rd_remote_call_t calls[], size_t count, const uint64_t handles[],
+                           size_t *scratch_size);
+static uint64_t locate_dlsym(pid_t target);
+
+#pragma mark - Implementation
+
+int rd_remote_call(pid_t target, const char *symbol, uint64_t address,
+                   const rd_remote_argument_t arguments[], size_t arguments_count, uint64_t *result)
+{
+    rd_remote_call_t call = {
+        .address = address,
+        .symbol = symbol,
+        .arguments = arguments,
+        .arguments_count = arguments_count
+    };
+    int err = rd_remote_calls(target, &call, 1, NULL);
+    if (err == KERN_SUCCESS && result) {
+        *result = call.result;
+    }
+    return err;
+}
+
+int rd_remote_calls(pid_t target, rd_remote_call_t calls[], size_t count,
+                    rd_inject_timings_t *timings)
+{
+    if (timings) memset(timings, 0, sizeof(*timings));
+    if (target <= 0 || !calls || count == 0) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < count; i++) {
+        calls[i].result = 0;
+        calls[i].err = KERN_FAILURE;
+    }
+    uint64_t *handles = calloc(count, sizeof(*handles));
+    if (!handles) {
+        return KERN_FAILURE;
+    }
+    int err = validate_calls(target, calls, count, handles);
+    if (err != KERN_SUCCESS) {
+        for (size_t i = 0; i < count; i++) calls[i].err = err;
+        free(handles);
+        return err;
+    }
+    size_t scratch_size = 0;
+    char *scratch = lay_out_calls(calls, count, handles, &scratch_size);
+    free(handles);
+    if (!scratch) {
+        return KERN_FAILURE;
+    }
+    rd_call_block_t *block = (rd_call_block_t *)scratch;
+    block->dlsym = locate_dlsym(target);
+    if (block->dlsym == 0) {
+        syslog(LOG_NOTICE, "Could not locate dlsym() inside the target");
+        free(scratch);
+        return KERN_INVALID_HOST;
+    }
+
+    size_t results_size = sizeof(rd_call_block_t) + count * sizeof(rd_call_entry_t);
+    char *results = malloc(results_size);
+    if (!results) {
+        free(scratch);
+        return KERN_FAILURE;
+    }
+    rd_inject_stub_call_t call = {
+        .code = rd_call_stub,
+        .size = kRDCallStubSize,
+        .trap_offset = kRDCallStubTrapOffset,
+        .scratch = scratch,
+        .scratch_size = scratch_size,
+        .results_size = results_size,
+        .r12 = count,
+        .completion = count
+    };
+    err = rd_inject_run_stub(target, &call, results, timings);
+    free(scratch);
+    if (err == KERN_SUCCESS) {
+        const rd_call_entry_t *entries = (const rd_call_entry_t *)(results + sizeof(rd_call_block_t));
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].called) {
+                calls[i].result = entries[i].result;
+                calls[i].err = KERN_SUCCESS;
+            } else {
+                syslog(LOG_NOTICE, "%s can't be found inside %d", calls[i].symbol, target);
+                calls[i].err = err = KERN_INVALID_OBJECT;
+            }
+        }
+    }
+    free(results);
+
+    return err;
+}
+
+/**
+ * @abstract
+ * Makes sure every call can be made and finds the handles of the libraries to look
+ * the symbols up in.
+ */
+static
+int validate_calls(pid_t target, const rd_remote_call_t calls[], size_t count, uint64_t handles[])
+{
+    for (size_t i = 0; i < count; i++) {
+        const rd_remote_call_t *call = &calls[i];
+        if ((call->address == 0 && !call->symbol) ||
+            call->arguments_count > kRDRemoteCallMaxArguments ||
+            (call->arguments_count > 0 && !call->arguments)) {
+            return KERN_INVALID_ARGUMENT;
+        }
+        for (size_t argument = 0; argument < call->arguments_count; argument++) {
+            if (call->arguments[argument].size > 0 && !call->arguments[argument].bytes) {
+                return KERN_INVALID_ARGUMENT;
+            }
+        }
+        handles[i] = (uint64_t)(uintptr_t)RTLD_DEFAULT;
+        if (call->address == 0 && call->library_path) {
+            handles[i] = rd_remote_handles_lookup(target, call->library_path);
+            if (handles[i] == 0) {
+                syslog(LOG_NOTICE, "%s has never been injected into %d", call->library_path, target);
+                return KERN_INVALID_ARGUMENT;
+            }
+        }
+    }
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Puts the parameter block, the calls, their symbol names and argument bytes one after
+ * another; every name and argument is referred to by its offset from the block.
+ */
+static
+char *lay_out_calls(const rd_remote_call_t calls[], size_t count, const uint64_t handles[],
+                    size_t *scratch_size)
+{
+    size_t size = sizeof(rd_call_block_t) + count * sizeof(rd_call_entry_t);
+    for (size_t i = 0; i < count; i++) {
+        if (calls[i].address == 0) {
+            size += strlen(calls[i].symbol) + 1;
+        }
+        for (size_t argument = 0; argument < calls[i].arguments_count; argument++) {
+            /* Keep the arguments 8-byte aligned, they're often structures */
+            size = (size + 7) & ~(size_t)7;
+            size += calls[i].arguments[argument].size;
+        }
+    }
+    char *scratch = calloc(1, size);
+    if (!scratch) {
+        return NULL;
+    }
+    rd_call_entry_t *entries = (rd_call_entry_t *)(scratch + sizeof(rd_call_block_t));
+    size_t offset = sizeof(rd_call_block_t) + count * sizeof(rd_call_entry_t);
+    for (size_t i = 0; i < count; i++) {
+        rd_call_entry_t *entry = &entries[i];
+        entry->function = calls[i].address;
+        entry->handle = handles[i];
+        if (calls[i].address == 0) {
+            size_t length = strlen(calls[i].symbol) + 1;
+            memcpy(scratch + offset, calls[i].symbol, length);
+            entry->symbol = offset;
+            offset += length;
+        }
+        for (size_t argument = 0; argument < calls[i].arguments_count; argument++) {
+            const rd_remote_argument_t *source = &calls[i].arguments[argument];
+            if (!source->bytes) {
+                entry->arguments[argument] = source->value;
+                continue;
+            }
+            offset = (offset + 7) & ~(size_t)7;
+            memcpy(scratch + offset, source->bytes, source->size);
+            entry->arguments[argument] = offset;
+            entry->pointers |= (1ULL << argument);
+            offset += source->size;
+        }
+    }
+    *scratch_size = size;
+    return scratch;
+}
+
+/**
+ * @abstract
+ * Returns the address of the target's dlsym() or (0).
+ */
+static
+uint64_t locate_dlsym(pid_t target)
+{
+#if defined(__APPLE__)
+    /* The dyld shared cache is mapped at the same address in every process */
+    (void)target;
+    return (uint64_t)&dlsym;
+#else
+    return rd_remote_loader_routine(target, "dlsym");
+#endif
+}
@@ -0,0 +1,210 @@
+//
+//  rd_remote_handles.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "rd_remote_handles.h"
+#include "rd_inject_preflight.h"
+
+/* Handles are hashed by the target's pid */
+#define kRDRemoteHandlesBuckets         (256)
+/* Dead targets are swept once the registry grows this large, and then every time
+ * it doubles (so sweeping stays amortized O(1) per recorded handle) */
+#define kRDRemoteHandlesSweepThreshold  (1024)
+
+#pragma mark - Private Interface
+
+/* A library loaded into a target */
+typedef struct rd_remote_handle {
+    pid_t target;
+    uint64_t target_start_time;
+    char *library_path;
+    uint64_t handle;
+    size_t references;
+    struct rd_remote_handle *next_in_bucket;
+} rd_remote_handle_t;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_remote_handle_t *buckets[kRDRemoteHandlesBuckets];
+static size_t handles_count = 0;
+static size_t sweep_threshold = kRDRemoteHandlesSweepThreshold;
+
+static rd_remote_handle_t **handle_slot(pid_t target, uint64_t start_time, const char *library_path);
+static rd_remote_handle_t **bucket_for_target(pid_t target);
+static void forget_previous_targets(pid_t target, uint64_t start_time);
+static void forget_dead_targets(void);
+static void free_handle(rd_remote_handle_t **slot);
+
+#pragma mark - Implementation
+
+void rd_remote_handles_record(pid_t target, const char *library_path, uint64_t handle)
+{
+    if (target <= 0 || !library_path || handle == 0) return;
+
+    uint64_t start_time = rd_process_start_time(target);
+    /* It's already gone, so nobody is ever going to look the handle up */
+    if (start_time == 0) return;
+    pthread_mutex_lock(&registry_lock);
+    forget_previous_targets(target, start_time);
+    rd_remote_handle_t **slot = handle_slot(target, start_time, library_path);
+    if (*slot) {
+        (*slot)->handle = handle;
+        (*slot)->references++;
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    rd_remote_handle_t *entry = malloc(sizeof(*entry));
+    char *path = strdup(library_path);
+    if (!entry || !path) {
+        free(entry);
+        free(path);
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    *entry = (rd_remote_handle_t){
+        .target = target,
+        .target_start_time = start_time,
+        .library_path = path,
+        .handle = handle,
+        .references = 1
+    };
+    /* New entries go first, they're the likeliest to be looked up */
+    rd_remote_handle_t **bucket = bucket_for_target(target);
+    entry->next_in_bucket = *bucket;
+    *bucket = entry;
+    if (++handles_count >= sweep_threshold) {
+        forget_dead_targets();
+        sweep_threshold = (handles_count * 2 > kRDRemoteHandlesSweepThreshold) ?
+                          handles_count * 2 : kRDRemoteHandlesSweepThreshold;
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+uint64_t rd_remote_handles_lookup(pid_t target, const char *library_path)
+{
+    if (target <= 0 || !library_path) return 0;
+
+    uint64_t start_time = rd_process_start_time(target);
+    pthread_mutex_lock(&registry_lock);
+    rd_remote_handle_t *entry = *handle_slot(target, start_time, library_path);
+    uint64_t handle = entry ? entry->handle : 0;
+    pthread_mutex_unlock(&registry_lock);
+
+    return handle;
+}
+
+void rd_remote_handles_forget(pid_t target, const char *library_path)
+{
+    if (target <= 0 || !library_path) return;
+
+    uint64_t start_time = rd_process_start_time(target);
+    pthread_mutex_lock(&registry_lock);
+    rd_remote_handle_t **slot = handle_slot(target, start_time, library_path);
+    if (*slot && --(*slot)->references == 0) {
+        free_handle(slot);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+size_t rd_remote_handles_count(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    size_t count = handles_count;
+    pthread_mutex_unlock(&registry_lock);
+
+    return count;
+}
+
+static
+rd_remote_handle_t **bucket_for_target(pid_t target)
+{
+    uint64_t hash = (uint64_t)target * 0x9e3779b97f4a7c15ULL;
+    return &buckets[(hash >> 32) % kRDRemoteHandlesBuckets];
+}
+
+/**
+ * @abstract
+ * Returns a pointer to the slot that holds (or should hold) the handle.
+ *
+ * @discussion
+ * Must be called with the registry lock held.
+ */
+static
+rd_remote_handle_t **handle_slot(pid_t target, uint64_t start_time, const char *library_path)
+{
+    rd_remote_handle_t **slot = bucket_for_target(target);
+    while (*slot && !((*slot)->target == target && (*slot)->target_start_time == start_time &&
+                      strcmp((*slot)->library_path, library_path) == 0)) {
+        slot = &(*slot)->next_in_bucket;
+    }
+    return slot;
+}
+
+/**
+ * @abstract
+ * Drops the handles of a previous process with the same pid.
+ *
+ * @discussion
+ * Must be called with the registry lock held.
+ */
+static
+void forget_previous_targets(pid_t target, uint64_t start_time)
+{
+    rd_remote_handle_t **slot = bucket_for_target(target);
+    while (*slot) {
+        if ((*slot)->target == target && (*slot)->target_start_time != start_time) {
+            free_handle(slot);
+            continue;
+        }
+        slot = &(*slot)->next_in_bucket;
+    }
+}
+
+/**
+ * @abstract
+ * Drops the handles of every process that has exited since we've loaded them.
+ *
+ * @discussion
+ * Handles are recorded for live processes only, so that's every handle whose
+ * target's start time doesn't match anymore. Must be called with the registry lock held.
+ */
+static
+void forget_dead_targets(void)
+{
+    for (size_t i = 0; i < kRDRemoteHandlesBuckets; i++) {
+        rd_remote_handle_t **slot = &buckets[i];
+        /* A target's handles are next to each other more often than not */
+        pid_t checked_target = 0;
+        uint64_t start_time = 0;
+        while (*slot) {
+            if ((*slot)->target != checked_target) {
+                checked_target = (*slot)->target;
+                start_time = rd_process_start_time(checked_target);
+            }
+            if ((*slot)->target_start_time != start_time) {
+                free_handle(slot);
+                continue;
+            }
+            slot = &(*slot)->next_in_bucket;
+        }
+    }
+}
+
+/**
+ * Must be called with the registry lock held.
+ */
+static
+void free_handle(rd_remote_handle_t **slot)
+{
+    rd_remote_handle_t *entry = *slot;
+    *slot = entry->next_in_bucket;
+    free(entry->library_path);
+    free(entry);
+    handles_count--;
+}
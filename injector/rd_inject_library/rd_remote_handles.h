@@ -0,0 +1,50 @@
+//
+//  rd_remote_handles.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * @abstract
+ * Remembers a handle a remote dlopen() has returned for a library.
+ *
+ * @discussion
+ * The registry is keyed by the target's pid and start time (so a recycled pid doesn't
+ * inherit someone else's handles) and the library path. Like dlopen() itself, it counts
+ * references: loading the same library twice takes two rd_remote_handles_forget() calls
+ * to forget it.
+ *
+ * Handles of processes that have exited are dropped when their pid is reused, and by
+ * a sweep whenever the registry has doubled in size, so it only grows with the live
+ * targets. Lookups are hashed by pid.
+ *
+ * The registry is shared by all threads.
+ */
+void rd_remote_handles_record(pid_t target, const char *library_path, uint64_t handle);
+
+/**
+ * @abstract
+ * Looks up a remote handle of a library we've loaded into the target.
+ *
+ * @return
+ * The handle or (0) if we haven't loaded this library into this target
+ */
+uint64_t rd_remote_handles_lookup(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Drops a reference to a library handle (i.e. after a remote dlclose()).
+ */
+void rd_remote_handles_forget(pid_t target, const char *library_path);
+
+/**
+ * @abstract
+ * Returns the number of (target, library) handles the registry holds at the moment.
+ */
+size_t rd_remote_handles_count(void);
@@ -0,0 +1,453 @@
+//
+//  rd_remote_symbols.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rd_remote_symbols.h"
+
+#define kRDMaxBuildIdSize       (40)
+#define kRDMaxSymbolLength      (64)
+#define kRDMaxCachedImages      (64)
+#define kRDMaxCachedSymbols     (256)
+#define kRDSymbolsCacheMagic    (0x43534452) /* "RDSC" */
+
+#pragma mark - Private Interface
+
+/* An image of the target we'd like to look into */
+typedef struct {
+    unsigned long base;
+    char path[PATH_MAX];
+} rd_remote_image_t;
+
+/* Maps an image file to its build-id, so we don't have to read the file again */
+typedef struct {
+    dev_t device;
+    ino_t inode;
+    struct timespec mtime;
+    unsigned char build_id[kRDMaxBuildIdSize];
+    size_t build_id_size;
+} rd_image_identity_t;
+
+/* An offset of a symbol from the image base */
+typedef struct {
+    unsigned char build_id[kRDMaxBuildIdSize];
+    size_t build_id_size;
+    char symbol[kRDMaxSymbolLength];
+    /* (0) means the image has no such symbol */
+    unsigned long offset;
+} rd_symbol_offset_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static rd_image_identity_t cached_images[kRDMaxCachedImages];
+static size_t cached_images_count = 0;
+static rd_symbol_offset_t cached_symbols[kRDMaxCachedSymbols];
+static size_t cached_symbols_count = 0;
+
+/* Images to look through, in order of preference */
+static const char *const kRDSymbolProviders[] = {
+    "libc.so", "libc-", "libdl.so", "libdl-", "ld-linux", "ld-musl", "ld-"
+};
+#define kRDSymbolProvidersCount (sizeof(kRDSymbolProviders) / sizeof(*kRDSymbolProviders))
+
+static size_t find_remote_images(pid_t target, rd_remote_image_t images[kRDSymbolProvidersCount]);
+static bool lookup_cached_offset(const struct stat *info, const char *symbol, unsigned long *offset);
+static bool inspect_image(const char *path, const char *symbol, rd_image_identity_t *identity,
+                          unsigned long *offset);
+static void cache_offset(const struct stat *info, const rd_image_identity_t *identity,
+                         const char *symbol, unsigned long offset);
+
+#pragma mark - Implementation
+
+unsigned long rd_remote_symbol_address(pid_t target, const char *symbol)
+{
+    if (target <= 0 || !symbol || strlen(symbol) >= kRDMaxSymbolLength) {
+        return (0);
+    }
+
+    rd_remote_image_t images[kRDSymbolProvidersCount];
+    size_t count = find_remote_images(target, images);
+    for (size_t i = 0; i < count; i++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "/proc/%d/root%s", target, images[i].path);
+        struct stat info;
+        if (stat(path, &info) != 0) {
+            continue;
+        }
+        unsigned long offset = 0;
+        if (!lookup_cached_offset(&info, symbol, &offset)) {
+            rd_image_identity_t identity;
+            if (!inspect_image(path, symbol, &identity, &offset)) {
+                continue;
+            }
+            cache_offset(&info, &identity, symbol, offset);
+        }
+        if (offset != 0) {
+            return images[i].base + offset;
+        }
+    }
+
+    return (0);
+}
+
+unsigned long rd_remote_loader_routine(pid_t target, const char *routine)
+{
+    static const struct {
+        const char *routine;
+        const char *fallback;
+    } kRDLoaderRoutines[] = {
+        {"dlopen", "__libc_dlopen_mode"},
+        {"dlsym", "__libc_dlsym"},
+        {"dlclose", "__libc_dlclose"}
+    };
+    if (!routine) {
+        return (0);
+    }
+    unsigned long address = rd_remote_symbol_address(target, routine);
+    for (size_t i = 0; !address && i < sizeof(kRDLoaderRoutines) / sizeof(*kRDLoaderRoutines); i++) {
+        if (strcmp(routine, kRDLoaderRoutines[i].routine) == 0) {
+            address = rd_remote_symbol_address(target, kRDLoaderRoutines[i].fallback);
+        }
+    }
+
+    return address;
+}
+
+void rd_remote_symbols_flush_cache(void)
+{
+    pthread_mutex_lock(&cache_lock);
+    cached_images_count = 0;
+    cached_symbols_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/* The header of a saved cache; the sizes catch a layout change between builds */
+typedef struct {
+    uint32_t magic;
+    uint32_t image_size;
+    uint32_t symbol_size;
+    uint32_t images_count;
+    uint32_t symbols_count;
+} rd_symbols_cache_header_t;
+
+bool rd_remote_symbols_save_cache(FILE *file)
+{
+    pthread_mutex_lock(&cache_lock);
+    rd_symbols_cache_header_t header = {
+        .magic = kRDSymbolsCacheMagic,
+        .image_size = sizeof(rd_image_identity_t),
+        .symbol_size = sizeof(rd_symbol_offset_t),
+        .images_count = (uint32_t)cached_images_count,
+        .symbols_count = (uint32_t)cached_symbols_count
+    };
+    bool saved = (fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  fwrite(cached_images, sizeof(*cached_images), cached_images_count, file) == cached_images_count &&
+                  fwrite(cached_symbols, sizeof(*cached_symbols), cached_symbols_count, file) == cached_symbols_count);
+    pthread_mutex_unlock(&cache_lock);
+
+    return saved;
+}
+
+bool rd_remote_symbols_load_cache(FILE *file)
+{
+    rd_symbols_cache_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != kRDSymbolsCacheMagic ||
+        header.image_size != sizeof(rd_image_identity_t) ||
+        header.symbol_size != sizeof(rd_symbol_offset_t) ||
+        header.images_count > kRDMaxCachedImages || header.symbols_count > kRDMaxCachedSymbols) {
+        return false;
+    }
+    rd_image_identity_t *images = calloc(kRDMaxCachedImages, sizeof(*images));
+    rd_symbol_offset_t *symbols = calloc(kRDMaxCachedSymbols, sizeof(*symbols));
+    bool loaded = (images && symbols &&
+                   fread(images, sizeof(*images), header.images_count, file) == header.images_count &&
+                   fread(symbols, sizeof(*symbols), header.symbols_count, file) == header.symbols_count);
+    for (size_t i = 0; loaded && i < header.symbols_count; i++) {
+        loaded = (symbols[i].build_id_size <= kRDMaxBuildIdSize &&
+                  memchr(symbols[i].symbol, '\0', sizeof(symbols[i].symbol)) != NULL);
+    }
+    for (size_t i = 0; loaded && i < header.images_count; i++) {
+        loaded = (images[i].build_id_size <= kRDMaxBuildIdSize);
+    }
+    if (loaded) {
+        pthread_mutex_lock(&cache_lock);
+        memcpy(cached_images, images, header.images_count * sizeof(*images));
+        cached_images_count = header.images_count;
+        memcpy(cached_symbols, symbols, header.symbols_count * sizeof(*symbols));
+        cached_symbols_count = header.symbols_count;
+        pthread_mutex_unlock(&cache_lock);
+    }
+    free(images);
+    free(symbols);
+
+    return loaded;
+}
+
+/**
+ * Finds the first mapping (i.e. the load base) of every symbol provider in the target.
+ *
+ * @return the number of images found; they're sorted by preference
+ */
+static
+size_t find_remote_images(pid_t target, rd_remote_image_t images[kRDSymbolProvidersCount])
+{
+    char maps_path[64];
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", target);
+    FILE *maps = fopen(maps_path, "re");
+    if (!maps) {
+        return (0);
+    }
+    bool found[kRDSymbolProvidersCount] = {false};
+    rd_remote_image_t candidates[kRDSymbolProvidersCount];
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long start, offset, inode;
+        int path_offset = 0;
+        if (sscanf(line, "%lx-%*x %*s %lx %*x:%*x %lu %n", &start, &offset, &inode,
+                   &path_offset) != 3 || offset != 0 || inode == 0 || path_offset == 0) {
+            continue;
+        }
+        char *path = line + path_offset;
+        path[strcspn(path, "\n")] = '\0';
+        if (path[0] != '/' || strstr(path, " (deleted)")) {
+            continue;
+        }
+        const char *name = strrchr(path, '/') + 1;
+        for (size_t i = 0; i < kRDSymbolProvidersCount; i++) {
+            if (found[i] || strncmp(name, kRDSymbolProviders[i], strlen(kRDSymbolProviders[i]))) {
+                continue;
+            }
+            found[i] = true;
+            candidates[i].base = start;
+            snprintf(candidates[i].path, sizeof(candidates[i].path), "%s", path);
+            break;
+        }
+    }
+    fclose(maps);
+
+    size_t count = 0;
+    for (size_t i = 0; i < kRDSymbolProvidersCount; i++) {
+        if (found[i]) images[count++] = candidates[i];
+    }
+    return count;
+}
+
+static
+bool lookup_cached_offset(const struct stat *info, const char *symbol, unsigned long *offset)
+{
+    bool found = false;
+    pthread_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < cached_images_count && !found; i++) {
+        rd_image_identity_t *image = &cached_images[i];
+        if (image->device != info->st_dev || image->inode != info->st_ino ||
+            image->mtime.tv_sec != info->st_mtim.tv_sec ||
+            image->mtime.tv_nsec != info->st_mtim.tv_nsec) {
+            continue;
+        }
+        for (size_t j = 0; j < cached_symbols_count; j++) {
+            rd_symbol_offset_t *entry = &cached_symbols[j];
+            if (entry->build_id_size == image->build_id_size &&
+                memcmp(entry->build_id, image->build_id, image->build_id_size) == 0 &&
+                strcmp(entry->symbol, symbol) == 0) {
+                *offset = entry->offset;
+                found = true;
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return found;
+}
+
+static
+void cache_offset(const struct stat *info, const rd_image_identity_t *identity,
+                  const char *symbol, unsigned long offset)
+{
+    pthread_mutex_lock(&cache_lock);
+    /* The cache is tiny, so don't bother with eviction: just start over */
+    if (cached_images_count == kRDMaxCachedImages || cached_symbols_count == kRDMaxCachedSymbols) {
+        cached_images_count = 0;
+        cached_symbols_count = 0;
+    }
+    bool known_image = false;
+    for (size_t i = 0; i < cached_images_count; i++) {
+        if (cached_images[i].device == info->st_dev && cached_images[i].inode == info->st_ino) {
+            cached_images[i] = *identity;
+            known_image = true;
+            break;
+        }
+    }
+    if (!known_image) {
+        cached_images[cached_images_count++] = *identity;
+    }
+    /* Different files (e.g. in different containers) may share a build-id */
+    bool known_symbol = false;
+    for (size_t i = 0; i < cached_symbols_count; i++) {
+        if (cached_symbols[i].build_id_size == identity->build_id_size &&
+            memcmp(cached_symbols[i].build_id, identity->build_id, identity->build_id_size) == 0 &&
+            strcmp(cached_symbols[i].symbol, symbol) == 0) {
+            known_symbol = true;
+            break;
+        }
+    }
+    if (!known_symbol) {
+        rd_symbol_offset_t *entry = &cached_symbols[cached_symbols_count++];
+        memcpy(entry->build_id, identity->build_id, identity->build_id_size);
+        entry->build_id_size = identity->build_id_size;
+        snprintf(entry->symbol, sizeof(entry->symbol), "%s", symbol);
+        entry->offset = offset;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @abstract
+ * Reads an image's identity and looks up a symbol in its dynamic symbol table.
+ *
+ * @discussion
+ * If the image has no build-id, we use its device, inode, size and mtime as one.
+ * Symbol versions hidden from the static linker (i.e. compatibility ones) are skipped.
+ *
+ * @return
+ * false if the file is not a valid 64-bit ELF image; otherwise `offset` is an offset
+ * of the symbol from the image's load base, or (0) if the image has no such symbol
+ */
+static
+bool inspect_image(const char *path, const char *symbol, rd_image_identity_t *identity,
+                   unsigned long *offset)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(Elf64_Ehdr)) {
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)info.st_size;
+    const uint8_t *file = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED) {
+        return false;
+    }
+#define RDInBounds(offset, length) ((uint64_t)(offset) <= size && (uint64_t)(length) <= size - (uint64_t)(offset))
+
+    bool valid = false;
+    const Elf64_Ehdr *header = (const Elf64_Ehdr *)file;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+        !RDInBounds(header->e_phoff, (uint64_t)header->e_phnum * sizeof(Elf64_Phdr)) ||
+        !RDInBounds(header->e_shoff, (uint64_t)header->e_shnum * sizeof(Elf64_Shdr))) {
+        goto end;
+    }
+
+    memset(identity, 0, sizeof(*identity));
+    identity->device = info.st_dev;
+    identity->inode = info.st_ino;
+    identity->mtime = info.st_mtim;
+
+    /* The load base is the first PT_LOAD's page, and the build-id is in one of PT_NOTEs */
+    unsigned long first_vaddr = ~0UL;
+    const Elf64_Phdr *segments = (const Elf64_Phdr *)(file + header->e_phoff);
+    for (Elf64_Half i = 0; i < header->e_phnum; i++) {
+        if (segments[i].p_type == PT_LOAD && segments[i].p_vaddr < first_vaddr) {
+            first_vaddr = segments[i].p_vaddr & ~(segments[i].p_align ? segments[i].p_align - 1 : 0);
+        }
+        if (segments[i].p_type != PT_NOTE || !RDInBounds(segments[i].p_offset, segments[i].p_filesz)) {
+            continue;
+        }
+        size_t position = 0;
+        while (position + sizeof(Elf64_Nhdr) <= segments[i].p_filesz) {
+            const Elf64_Nhdr *note = (const Elf64_Nhdr *)(file + segments[i].p_offset + position);
+            size_t name_size = (note->n_namesz + 3) & ~3UL;
+            size_t desc_size = (note->n_descsz + 3) & ~3UL;
+            const uint8_t *desc = (const uint8_t *)(note + 1) + name_size;
+            if (position + sizeof(*note) + name_size + desc_size > segments[i].p_filesz) {
+                break;
+            }
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                memcmp(note + 1, "GNU", 4) == 0 && note->n_descsz <= kRDMaxBuildIdSize) {
+                memcpy(identity->build_id, desc, note->n_descsz);
+                identity->build_id_size = note->n_descsz;
+            }
+            position += sizeof(*note) + name_size + desc_size;
+        }
+    }
+    if (first_vaddr == ~0UL) {
+        goto end;
+    }
+    if (identity->build_id_size == 0) {
+        /* No build-id: make one up */
+        uint64_t fallback[] = {
+            info.st_dev, info.st_ino, (uint64_t)info.st_size,
+            (uint64_t)info.st_mtim.tv_sec, (uint64_t)info.st_mtim.tv_nsec
+        };
+        _Static_assert(sizeof(fallback) <= kRDMaxBuildIdSize, "the fallback id is too large");
+        memcpy(identity->build_id, fallback, sizeof(fallback));
+        identity->build_id_size = sizeof(fallback);
+    }
+
+    /* Look through .dynsym, honoring .gnu.version if any */
+    *offset = 0;
+    valid = true;
+    const Elf64_Shdr *sections = (const Elf64_Shdr *)(file + header->e_shoff);
+    const Elf64_Shdr *dynsym = NULL, *versym = NULL;
+    for (Elf64_Half i = 0; i < header->e_shnum; i++) {
+        if (sections[i].sh_type == SHT_DYNSYM) dynsym = &sections[i];
+        if (sections[i].sh_type == SHT_GNU_versym) versym = &sections[i];
+    }
+    if (!dynsym || dynsym->sh_link >= header->e_shnum || dynsym->sh_entsize != sizeof(Elf64_Sym) ||
+        !RDInBounds(dynsym->sh_offset, dynsym->sh_size)) {
+        goto end;
+    }
+    const Elf64_Shdr *dynstr = &sections[dynsym->sh_link];
+    if (!RDInBounds(dynstr->sh_offset, dynstr->sh_size)) {
+        goto end;
+    }
+    size_t symbols_count = dynsym->sh_size / sizeof(Elf64_Sym);
+    if (versym && (!RDInBounds(versym->sh_offset, versym->sh_size) ||
+                   versym->sh_size < symbols_count * sizeof(Elf64_Half))) {
+        versym = NULL;
+    }
+    const Elf64_Sym *symbols = (const Elf64_Sym *)(file + dynsym->sh_offset);
+    const char *strings = (const char *)(file + dynstr->sh_offset);
+    size_t symbol_length = strlen(symbol) + 1;
+    for (size_t i = 0; i < symbols_count; i++) {
+        if (symbols[i].st_shndx == SHN_UNDEF || symbols[i].st_value == 0 ||
+            ELF64_ST_TYPE(symbols[i].st_info) != STT_FUNC ||
+            !RDInBounds(symbols[i].st_name, symbol_length) ||
+            memcmp(strings + symbols[i].st_name, symbol, symbol_length) != 0) {
+            continue;
+        }
+        if (versym && (((const Elf64_Half *)(file + versym->sh_offset))[i] & 0x8000)) {
+            continue;
+        }
+        *offset = symbols[i].st_value - first_vaddr;
+        break;
+    }
+#undef RDInBounds
+
+end:
+    munmap((void *)file, size);
+    return valid;
+}
+
+#endif // defined(__linux__)
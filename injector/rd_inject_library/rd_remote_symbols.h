@@ -0,0 +1,85 @@
+//
+//  rd_remote_symbols.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * @abstract
+ * Looks up a dynamic symbol inside a target process (Linux only).
+ *
+ * @discussion
+ * Unlike dlsym() in our own process, this function doesn't assume that the target
+ * has the same libraries as we do: it finds the target's libc, libdl and dynamic
+ * loader (in this order) in /proc/<pid>/maps and reads their dynamic symbol tables
+ * through /proc/<pid>/root, so it works for containerized targets too.
+ *
+ * Resolved symbol offsets are cached by the image's build-id (or by its device, inode
+ * and mtime if it has no build-id), so once an image has been seen, a lookup only costs
+ * a read of the target's maps and a stat() of the image.
+ *
+ * The cache is shared by all threads.
+ *
+ * @param target
+ * The identifier of the target process
+ * @param symbol
+ * The name of a symbol to look up
+ *
+ * @return
+ * An address of the symbol in the target's address space or (0) if it couldn't be found
+ */
+unsigned long rd_remote_symbol_address(pid_t target, const char *symbol);
+
+/**
+ * @abstract
+ * Looks up one of the dynamic loader's routines (dlopen(), dlsym() or dlclose()) inside
+ * a target process (Linux only).
+ *
+ * @discussion
+ * Older glibc versions only have these routines in libdl which the target might not have
+ * loaded, but libc always has internal __libc_dlopen_mode(path, mode), __libc_dlsym() and
+ * __libc_dlclose() with the same calling convention, so they're looked up if the public
+ * routine isn't there.
+ *
+ * @param routine
+ * "dlopen", "dlsym" or "dlclose"
+ *
+ * @return
+ * Same as rd_remote_symbol_address()
+ */
+unsigned long rd_remote_loader_routine(pid_t target, const char *routine);
+
+/**
+ * @abstract
+ * Drops all the cached symbol offsets.
+ */
+void rd_remote_symbols_flush_cache(void);
+
+/**
+ * @abstract
+ * Writes the cached symbol offsets into a file.
+ *
+ * @discussion
+ * So that another process (i.e. the next launch of the daemon) can start with a warm
+ * cache, see rd_remote_symbols_load_cache().
+ */
+bool rd_remote_symbols_save_cache(FILE *file);
+
+/**
+ * @abstract
+ * Replaces the cached symbol offsets with the ones saved by rd_remote_symbols_save_cache().
+ *
+ * @discussion
+ * Saved images are still checked against their device, inode and mtime on every
+ * lookup, so a cache of a library that has been replaced since is harmless.
+ *
+ * @return false if the file has no valid cache (the cache is left as it was)
+ */
+bool rd_remote_symbols_load_cache(FILE *file);
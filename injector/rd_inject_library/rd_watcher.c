@@ -0,0 +1,890 @@
+//
+//  rd_watcher.c
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <elf.h>
+#include <arpa/inet.h>
+#include <sys/user.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#endif
+
+#include "rd_watcher.h"
+#if defined(__linux__)
+#include "rd_inject_library_linux.h"
+#endif
+
+/* How often to scan /proc without the proc connector */
+#define kRDWatcherScanIntervalMs    (5)
+/* How long after we've first seen a process it may still exec (when scanning /proc) */
+#define kRDWatcherExecWindowNs      (50ULL * 1000000ULL)
+/* How long the loader may take to get to the entry point */
+#define kRDWatcherEntryTimeoutNs    (1000ULL * 1000000ULL)
+/* How long a process past its loader may take to get idle */
+#define kRDWatcherIdleTimeoutNs     (10ULL * 1000000ULL)
+/* Room for a burst of execs while we're busy injecting */
+#define kRDWatcherReceiveBuffer     (4 * 1024 * 1024)
+
+#if defined(__linux__)
+
+/* A matching process waiting to be injected */
+typedef struct rd_watch_match {
+    pid_t target;
+    size_t rule;
+    struct rd_watch_match *next;
+} rd_watch_match_t;
+
+/* A process we've seen lately (when scanning /proc), in case it execs */
+typedef struct {
+    pid_t pid;
+    uint64_t seen_ns;
+    dev_t device;
+    ino_t inode;
+} rd_young_process_t;
+
+struct rd_watcher {
+    rd_watch_rule_t *rules;
+    size_t count;
+    /* Which fields the rules look at, so we never read the others */
+    bool fields[RD_WATCH_CGROUP + 1];
+    rd_watcher_handler_t handler;
+    void *context;
+    /* The proc connector socket or (-1) if we're scanning /proc */
+    int netlink;
+    /* Wakes the events thread up to stop */
+    int wakeup;
+    pthread_t events_thread;
+    pthread_t injections_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+    rd_watch_match_t *queue_head;
+    rd_watch_match_t *queue_tail;
+    bool stopping;
+    /* The pids seen by the last /proc scan (sorted) and the young ones among them */
+    pid_t *known;
+    size_t known_count;
+    rd_young_process_t *young;
+    size_t young_count;
+    size_t young_capacity;
+    rd_watcher_stats_t stats;
+};
+
+#endif
+
+#pragma mark - Private Interface
+
+#if defined(__linux__)
+static int open_proc_connector(void);
+static void *watch_proc_connector(void *context);
+static void *watch_proc_scans(void *context);
+static void scan_proc(rd_watcher_t *watcher, bool initial);
+static void see_process(rd_watcher_t *watcher, pid_t pid);
+static bool match_process(const rd_watcher_t *watcher, pid_t pid, size_t *rule);
+static bool read_proc_file(pid_t pid, const char *name, char *buffer, size_t size);
+static void *run_injections(void *context);
+static int stop_for_injection(pid_t target, bool *held);
+static int stop_while_waiting(pid_t target, struct user_regs_struct *regs);
+static bool is_waiting_syscall(unsigned long long syscall);
+static bool loader_contains(pid_t target, unsigned long base, unsigned long address);
+static bool executable_id(pid_t pid, dev_t *device, ino_t *inode);
+static int compare_pids(const void *a, const void *b);
+static void count(uint64_t *counter);
+#endif
+
+#pragma mark - Implementation
+
+#if defined(__APPLE__)
+
+int rd_watcher_start(const rd_watch_rule_t rules[], size_t count, bool scan_only,
+                     rd_watcher_handler_t handler, void *context, rd_watcher_t **watcher)
+{
+    (void)rules;
+    (void)count;
+    (void)scan_only;
+    (void)handler;
+    (void)context;
+    if (watcher) *watcher = NULL;
+    syslog(LOG_NOTICE, "Process watchers are only supported on Linux");
+    return KERN_FAILURE;
+}
+
+void rd_watcher_stop(rd_watcher_t *watcher)
+{
+    (void)watcher;
+}
+
+void rd_watcher_statistics(rd_watcher_t *watcher, rd_watcher_stats_t *stats)
+{
+    (void)watcher;
+    if (stats) memset(stats, 0, sizeof(*stats));
+}
+
+#else
+
+int rd_watcher_start(const rd_watch_rule_t rules[], size_t count, bool scan_only,
+                     rd_watcher_handler_t handler, void *context, rd_watcher_t **watcher)
+{
+    if (!watcher) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    *watcher = NULL;
+    if (!rules || count == 0) {
+        return KERN_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!rules[i].pattern || !rules[i].library_path || rules[i].field > RD_WATCH_CGROUP) {
+            return KERN_INVALID_ARGUMENT;
+        }
+    }
+    rd_watcher_t *new_watcher = calloc(1, sizeof(*new_watcher));
+    rd_watch_rule_t *copies = calloc(count, sizeof(*copies));
+    if (!new_watcher || !copies) {
+        free(new_watcher);
+        free(copies);
+        return KERN_FAILURE;
+    }
+    new_watcher->rules = copies;
+    new_watcher->count = count;
+    bool copied = true;
+    for (size_t i = 0; i < count; i++) {
+        copies[i].field = rules[i].field;
+        copies[i].pattern = strdup(rules[i].pattern);
+        copies[i].library_path = strdup(rules[i].library_path);
+        copied = copied && copies[i].pattern && copies[i].library_path;
+        new_watcher->fields[rules[i].field] = true;
+    }
+    new_watcher->handler = handler;
+    new_watcher->context = context;
+    new_watcher->netlink = scan_only ? -1 : open_proc_connector();
+    new_watcher->stats.netlink = (new_watcher->netlink >= 0);
+    new_watcher->wakeup = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pthread_mutex_init(&new_watcher->lock, NULL);
+    pthread_cond_init(&new_watcher->condition, NULL);
+    if (new_watcher->netlink < 0) {
+        /* Processes that are already running aren't new */
+        scan_proc(new_watcher, true);
+    }
+
+    bool started = false;
+    if (copied && new_watcher->wakeup >= 0 &&
+        pthread_create(&new_watcher->injections_thread, NULL, run_injections, new_watcher) == 0) {
+        started = (pthread_create(&new_watcher->events_thread, NULL,
+                                  new_watcher->netlink >= 0 ? watch_proc_connector : watch_proc_scans,
+                                  new_watcher) == 0);
+        if (!started) {
+            pthread_mutex_lock(&new_watcher->lock);
+            new_watcher->stopping = true;
+            pthread_cond_signal(&new_watcher->condition);
+            pthread_mutex_unlock(&new_watcher->lock);
+            pthread_join(new_watcher->injections_thread, NULL);
+        }
+    }
+    if (!started) {
+        syslog(LOG_NOTICE, "Failed to start a process watcher");
+        /* Nothing has been started, so it's safe to tear everything down right away */
+        new_watcher->events_thread = pthread_self();
+        new_watcher->injections_thread = pthread_self();
+        rd_watcher_stop(new_watcher);
+        return KERN_FAILURE;
+    }
+    *watcher = new_watcher;
+
+    return KERN_SUCCESS;
+}
+
+void rd_watcher_stop(rd_watcher_t *watcher)
+{
+    if (!watcher) {
+        return;
+    }
+    pthread_mutex_lock(&watcher->lock);
+    watcher->stopping = true;
+    pthread_cond_signal(&watcher->condition);
+    pthread_mutex_unlock(&watcher->lock);
+    if (watcher->wakeup >= 0) {
+        eventfd_write(watcher->wakeup, 1);
+    }
+    if (!pthread_equal(watcher->events_thread, pthread_self())) {
+        pthread_join(watcher->events_thread, NULL);
+    }
+    if (!pthread_equal(watcher->injections_thread, pthread_self())) {
+        pthread_join(watcher->injections_thread, NULL);
+    }
+
+    while (watcher->queue_head) {
+        rd_watch_match_t *match = watcher->queue_head;
+        watcher->queue_head = match->next;
+        free(match);
+    }
+    for (size_t i = 0; i < watcher->count; i++) {
+        free((char *)watcher->rules[i].pattern);
+        free((char *)watcher->rules[i].library_path);
+    }
+    if (watcher->netlink >= 0) close(watcher->netlink);
+    if (watcher->wakeup >= 0) close(watcher->wakeup);
+    pthread_cond_destroy(&watcher->condition);
+    pthread_mutex_destroy(&watcher->lock);
+    free(watcher->rules);
+    free(watcher->known);
+    free(watcher->young);
+    free(watcher);
+}
+
+void rd_watcher_statistics(rd_watcher_t *watcher, rd_watcher_stats_t *stats)
+{
+    if (!stats) {
+        return;
+    }
+    memset(stats, 0, sizeof(*stats));
+    if (!watcher) {
+        return;
+    }
+    stats->netlink = watcher->stats.netlink;
+    stats->events = __atomic_load_n(&watcher->stats.events, __ATOMIC_RELAXED);
+    stats->matched = __atomic_load_n(&watcher->stats.matched, __ATOMIC_RELAXED);
+    stats->injected = __atomic_load_n(&watcher->stats.injected, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&watcher->stats.failed, __ATOMIC_RELAXED);
+    stats->held = __atomic_load_n(&watcher->stats.held, __ATOMIC_RELAXED);
+    stats->overruns = __atomic_load_n(&watcher->stats.overruns, __ATOMIC_RELAXED);
+}
+
+/**
+ * @abstract
+ * Subscribes to the exec events of the proc connector.
+ *
+ * @return
+ * The connector socket or (-1) if the connector isn't available to us
+ */
+static
+int open_proc_connector(void)
+{
+    int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_CONNECTOR);
+    if (fd < 0) {
+        return -1;
+    }
+    /* Every fork and exit of the system is an event as well, so drop all but the execs
+     * before they're even queued. The connector sends a single event per message */
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                 NLMSG_LENGTH(0) + offsetof(struct cn_msg, data) + offsetof(struct proc_event, what)),
+        /* Absolute loads are in the network byte order */
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, htonl(PROC_EVENT_EXEC), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+        BPF_STMT(BPF_RET | BPF_K, 0)
+    };
+    struct sock_fprog filter = {.len = sizeof(code) / sizeof(*code), .filter = code};
+    int buffer_size = kRDWatcherReceiveBuffer;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &buffer_size, sizeof(buffer_size)) != 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    }
+    struct sockaddr_nl address = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = CN_IDX_PROC,
+        .nl_pid = 0
+    };
+    struct __attribute__((packed)) {
+        struct nlmsghdr header;
+        struct cn_msg message;
+        enum proc_cn_mcast_op operation;
+    } request = {
+        .header = {.nlmsg_len = sizeof(request), .nlmsg_type = NLMSG_DONE},
+        .message = {.id = {.idx = CN_IDX_PROC, .val = CN_VAL_PROC}, .len = sizeof(request.operation)},
+        .operation = PROC_CN_MCAST_LISTEN
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        send(fd, &request, sizeof(request), 0) != (ssize_t)sizeof(request)) {
+        syslog(LOG_NOTICE, "The proc connector isn't available (%s), scanning /proc instead",
+               strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @abstract
+ * The events thread: matches processes as the proc connector reports their execs.
+ */
+static
+void *watch_proc_connector(void *context)
+{
+    rd_watcher_t *watcher = context;
+    char buffer[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+    struct pollfd fds[2] = {
+        {.fd = watcher->netlink, .events = POLLIN},
+        {.fd = watcher->wakeup, .events = POLLIN}
+    };
+    while (true) {
+        if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+        if (fds[1].revents) {
+            break;
+        }
+        ssize_t size;
+        while ((size = recv(watcher->netlink, buffer, sizeof(buffer), 0)) != 0) {
+            if (size < 0) {
+                if (errno == ENOBUFS) {
+                    /* We've fallen behind and the kernel has dropped some events */
+                    count(&watcher->stats.overruns);
+                    continue;
+                }
+                break;
+            }
+            for (struct nlmsghdr *header = (struct nlmsghdr *)buffer; NLMSG_OK(header, (size_t)size);
+                 header = NLMSG_NEXT(header, size)) {
+                const struct cn_msg *message = NLMSG_DATA(header);
+                const struct proc_event *event = (const struct proc_event *)message->data;
+                if (event->what == PROC_EVENT_EXEC) {
+                    see_process(watcher, event->event_data.exec.process_tgid);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @abstract
+ * The events thread without the proc connector: matches the processes new to /proc.
+ */
+static
+void *watch_proc_scans(void *context)
+{
+    rd_watcher_t *watcher = context;
+    struct pollfd wakeup = {.fd = watcher->wakeup, .events = POLLIN};
+    while (true) {
+        int ready = poll(&wakeup, 1, kRDWatcherScanIntervalMs);
+        if (ready > 0 || (ready < 0 && errno != EINTR)) {
+            break;
+        }
+        scan_proc(watcher, false);
+    }
+    return NULL;
+}
+
+/**
+ * @abstract
+ * Looks for processes that weren't there on the previous scan, and for young ones that
+ * have exec'd since.
+ *
+ * @param initial
+ * Only take note of the processes that are there
+ */
+static
+void scan_proc(rd_watcher_t *watcher, bool initial)
+{
+    DIR *proc = opendir("/proc");
+    if (!proc) {
+        return;
+    }
+    size_t capacity = watcher->known_count + 64, current_count = 0;
+    pid_t *current = malloc(capacity * sizeof(*current));
+    struct dirent *entry;
+    while (current && (entry = readdir(proc)) != NULL) {
+        char *end = NULL;
+        long pid = strtol(entry->d_name, &end, 10);
+        if (pid <= 0 || *end != '\0') {
+            continue;
+        }
+        if (current_count == capacity) {
+            pid_t *grown = realloc(current, (capacity *= 2) * sizeof(*current));
+            if (!grown) {
+                break;
+            }
+            current = grown;
+        }
+        current[current_count++] = (pid_t)pid;
+    }
+    closedir(proc);
+    if (!current) {
+        return;
+    }
+    /* procfs lists them in order anyway */
+    qsort(current, current_count, sizeof(*current), compare_pids);
+
+    uint64_t now = rd_inject_clock_ns();
+    /* A young process may have exec'd since we've matched it */
+    size_t kept = 0;
+    for (size_t i = 0; !initial && i < watcher->young_count; i++) {
+        rd_young_process_t young = watcher->young[i];
+        dev_t device;
+        ino_t inode;
+        if (now - young.seen_ns > kRDWatcherExecWindowNs || !executable_id(young.pid, &device, &inode)) {
+            continue;
+        }
+        if (device != young.device || inode != young.inode) {
+            see_process(watcher, young.pid);
+            young.device = device;
+            young.inode = inode;
+        }
+        watcher->young[kept++] = young;
+    }
+    watcher->young_count = kept;
+    for (size_t i = 0, known = 0; !initial && i < current_count; i++) {
+        while (known < watcher->known_count && watcher->known[known] < current[i]) known++;
+        if (known < watcher->known_count && watcher->known[known] == current[i]) {
+            continue;
+        }
+        rd_young_process_t young = {.pid = current[i], .seen_ns = now};
+        if (!executable_id(young.pid, &young.device, &young.inode)) {
+            continue;
+        }
+        see_process(watcher, young.pid);
+        if (watcher->young_count == watcher->young_capacity) {
+            size_t grown_capacity = watcher->young_capacity ? watcher->young_capacity * 2 : 64;
+            rd_young_process_t *grown = realloc(watcher->young, grown_capacity * sizeof(*grown));
+            if (!grown) {
+                continue;
+            }
+            watcher->young = grown;
+            watcher->young_capacity = grown_capacity;
+        }
+        watcher->young[watcher->young_count++] = young;
+    }
+    free(watcher->known);
+    watcher->known = current;
+    watcher->known_count = current_count;
+}
+
+/**
+ * @abstract
+ * Matches a process that has just exec'd and queues its injection.
+ */
+static
+void see_process(rd_watcher_t *watcher, pid_t pid)
+{
+    count(&watcher->stats.events);
+    size_t rule = 0;
+    if (pid == getpid() || !match_process(watcher, pid, &rule)) {
+        return;
+    }
+    count(&watcher->stats.matched);
+    rd_watch_match_t *match = malloc(sizeof(*match));
+    if (!match) {
+        count(&watcher->stats.failed);
+        return;
+    }
+    match->target = pid;
+    match->rule = rule;
+    match->next = NULL;
+    pthread_mutex_lock(&watcher->lock);
+    if (watcher->queue_tail) {
+        watcher->queue_tail->next = match;
+    } else {
+        watcher->queue_head = match;
+    }
+    watcher->queue_tail = match;
+    pthread_cond_signal(&watcher->condition);
+    pthread_mutex_unlock(&watcher->lock);
+}
+
+/**
+ * @abstract
+ * Finds the first rule the process matches.
+ *
+ * @discussion
+ * Only the fields the rules look at are read, once each. A process that is already
+ * gone matches nothing.
+ */
+static
+bool match_process(const rd_watcher_t *watcher, pid_t pid, size_t *rule)
+{
+    char executable[PATH_MAX] = "", cmdline[4096] = "", cgroups[4096] = "";
+    if (watcher->fields[RD_WATCH_EXECUTABLE]) {
+        char link_path[64];
+        snprintf(link_path, sizeof(link_path), "/proc/%d/exe", pid);
+        ssize_t length = readlink(link_path, executable, sizeof(executable) - 1);
+        executable[length > 0 ? length : 0] = '\0';
+    }
+    if (watcher->fields[RD_WATCH_CMDLINE]) {
+        read_proc_file(pid, "cmdline", cmdline, sizeof(cmdline));
+    }
+    if (watcher->fields[RD_WATCH_CGROUP]) {
+        read_proc_file(pid, "cgroup", cgroups, sizeof(cgroups));
+    }
+
+    for (size_t i = 0; i < watcher->count; i++) {
+        const rd_watch_rule_t *candidate = &watcher->rules[i];
+        bool matches = false;
+        switch (candidate->field) {
+            case RD_WATCH_EXECUTABLE:
+                matches = executable[0] && fnmatch(candidate->pattern, executable, 0) == 0;
+                break;
+            case RD_WATCH_CMDLINE:
+                matches = cmdline[0] && fnmatch(candidate->pattern, cmdline, 0) == 0;
+                break;
+            case RD_WATCH_CGROUP:
+                /* Lines of "<hierarchy>:<controllers>:<path>" */
+                for (char *line = cgroups; !matches && line && *line; ) {
+                    char *next = strchr(line, '\n');
+                    if (next) *next = '\0';
+                    char *path = strchr(line, ':');
+                    path = path ? strchr(path + 1, ':') : NULL;
+                    matches = path && fnmatch(candidate->pattern, path + 1, 0) == 0;
+                    if (next) *next = '\n';
+                    line = next ? next + 1 : NULL;
+                }
+                break;
+        }
+        if (matches) {
+            *rule = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @abstract
+ * Reads a /proc/<pid>/<name> file into a string, replacing zeroes with spaces.
+ *
+ * @discussion
+ * E.g. the arguments in cmdline are separated (and terminated) by zeroes.
+ */
+static
+bool read_proc_file(pid_t pid, const char *name, char *buffer, size_t size)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length <= 0) {
+        buffer[0] = '\0';
+        return false;
+    }
+    while (length > 0 && buffer[length - 1] == '\0') length--;
+    for (ssize_t i = 0; i < length; i++) {
+        if (buffer[i] == '\0') buffer[i] = ' ';
+    }
+    buffer[length] = '\0';
+    return true;
+}
+
+/**
+ * @abstract
+ * The injections thread: injects the matching processes one after another.
+ */
+static
+void *run_injections(void *context)
+{
+    rd_watcher_t *watcher = context;
+    while (true) {
+        pthread_mutex_lock(&watcher->lock);
+        while (!watcher->queue_head && !watcher->stopping) {
+            pthread_cond_wait(&watcher->condition, &watcher->lock);
+        }
+        if (watcher->stopping) {
+            pthread_mutex_unlock(&watcher->lock);
+            break;
+        }
+        rd_watch_match_t *match = watcher->queue_head;
+        watcher->queue_head = match->next;
+        if (!watcher->queue_head) watcher->queue_tail = NULL;
+        pthread_mutex_unlock(&watcher->lock);
+
+        const rd_watch_rule_t *rule = &watcher->rules[match->rule];
+        bool held = false;
+        int err = stop_for_injection(match->target, &held);
+        if (held) {
+            count(&watcher->stats.held);
+        }
+        if (err == KERN_SUCCESS) {
+            const char *library_path = rule->library_path;
+            err = rd_linux_inject_held(match->target, &library_path, 1, NULL, NULL);
+        }
+        count(err == KERN_SUCCESS ? &watcher->stats.injected : &watcher->stats.failed);
+        if (watcher->handler) {
+            watcher->handler(match->target, match->rule, err, watcher->context);
+        }
+        free(match);
+    }
+    return NULL;
+}
+
+/**
+ * @abstract
+ * Stops a new process where it's safe to inject it.
+ *
+ * @discussion
+ * Right after an exec the loader hasn't even mapped libc yet, let alone initialized
+ * it, so there's nothing to dlopen() with. A process that is still inside its loader
+ * is run to its entry point, where libc is all set (see run_to_entry_point() in
+ * rd_inject_spawn.c), and held there. It's never let go in between: a short-lived
+ * process could otherwise be interrupted halfway through its exit(), with its locks
+ * taken. Processes that are past their loader already are stopped once they're idle
+ * (see stop_while_waiting()).
+ *
+ * @param held
+ * Receives whether the process has been held at its entry point
+ *
+ * @return KERN_SUCCESS
+ * Means the process is stopped and traced by the calling thread
+ */
+static
+int stop_for_injection(pid_t target, bool *held)
+{
+    char auxv_path[64];
+    snprintf(auxv_path, sizeof(auxv_path), "/proc/%d/auxv", target);
+    int fd = open(auxv_path, O_RDONLY | O_CLOEXEC);
+    Elf64_auxv_t auxv[64];
+    ssize_t size = (fd >= 0) ? read(fd, auxv, sizeof(auxv)) : -1;
+    if (fd >= 0) close(fd);
+    unsigned long entry = 0, base = 0;
+    for (ssize_t i = 0; size > 0 && i < size / (ssize_t)sizeof(*auxv); i++) {
+        if (auxv[i].a_type == AT_ENTRY) entry = auxv[i].a_un.a_val;
+        if (auxv[i].a_type == AT_BASE) base = auxv[i].a_un.a_val;
+        if (auxv[i].a_type == AT_NULL) break;
+    }
+    int status = 0;
+    if (entry == 0 || ptrace(PTRACE_SEIZE, target, NULL, NULL) != 0) {
+        return KERN_FAILURE;
+    }
+    pid_t waited = -1;
+    if (ptrace(PTRACE_INTERRUPT, target, NULL, NULL) == 0) {
+        do {
+            waited = waitpid(target, &status, __WALL);
+        } while (waited < 0 && errno == EINTR);
+    }
+    if (waited != target || !WIFSTOPPED(status)) {
+        /* Don't leave it seized by us (unless it's gone already) */
+        ptrace(PTRACE_DETACH, target, NULL, NULL);
+        return KERN_FAILURE;
+    }
+    struct user_regs_struct regs;
+    if (ptrace(PTRACE_GETREGS, target, NULL, &regs) != 0) {
+        ptrace(PTRACE_DETACH, target, NULL, NULL);
+        return KERN_FAILURE;
+    }
+    /* A static executable has no loader (and no base) */
+    if (base == 0 || !loader_contains(target, base, regs.rip)) {
+        return stop_while_waiting(target, &regs);
+    }
+    errno = 0;
+    long original = ptrace(PTRACE_PEEKTEXT, target, entry, NULL);
+    if (errno != 0 || ptrace(PTRACE_POKETEXT, target, entry, (original & ~0xffL) | 0xcc) != 0) {
+        syslog(LOG_NOTICE, "Failed to set a breakpoint at the entry point of (%d)", target);
+        ptrace(PTRACE_DETACH, target, NULL, NULL);
+        return KERN_FAILURE;
+    }
+
+    /* The process may get stuck in its loader: don't hold the other injections up */
+    uint64_t deadline = rd_inject_clock_ns() + kRDWatcherEntryTimeoutNs;
+    int signal = 0;
+    bool reached = false, timed_out = false;
+    while (!reached && !timed_out) {
+        if (ptrace(PTRACE_CONT, target, NULL, signal) != 0) {
+            /* We've lost it with a breakpoint in its code */
+            kill(target, SIGKILL);
+            return KERN_FAILURE;
+        }
+        pid_t waited = 0;
+        while ((waited = waitpid(target, &status, WNOHANG | __WALL)) == 0 &&
+               rd_inject_clock_ns() < deadline) {
+            struct timespec nap = {.tv_sec = 0, .tv_nsec = 20000};
+            nanosleep(&nap, NULL);
+        }
+        if (waited == 0) {
+            syslog(LOG_NOTICE, "(%d) hasn't got to its entry point in time", target);
+            timed_out = true;
+            if (ptrace(PTRACE_INTERRUPT, target, NULL, NULL) != 0 ||
+                waitpid(target, &status, __WALL) != target) {
+                kill(target, SIGKILL);
+                return KERN_FAILURE;
+            }
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            return KERN_FAILURE;
+        }
+        signal = WSTOPSIG(status);
+        reached = (ptrace(PTRACE_GETREGS, target, NULL, &regs) == 0 && regs.rip == entry + 1);
+        /* Signals other than our breakpoint (and group stops) are the process' own business */
+        if (signal == SIGTRAP || (status >> 16) == PTRACE_EVENT_STOP) signal = 0;
+    }
+    if (reached) regs.rip = entry;
+    if (ptrace(PTRACE_POKETEXT, target, entry, original) != 0 ||
+        (reached && ptrace(PTRACE_SETREGS, target, NULL, &regs) != 0)) {
+        /* The process can't go on without its first instruction */
+        kill(target, SIGKILL);
+        waitpid(target, NULL, __WALL);
+        return KERN_FAILURE;
+    }
+    if (!reached) {
+        /* Leave the process alone, its loader is still busy */
+        ptrace(PTRACE_DETACH, target, NULL, NULL);
+        return KERN_OPERATION_TIMED_OUT;
+    }
+    *held = true;
+
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Lets a stopped process run until it can be stopped while waiting for something.
+ *
+ * @discussion
+ * Stopped in the middle of its own code (e.g. inside free() on its way out), a process
+ * may hold a lock dlopen() is going to need, and so it may inside most syscalls: malloc()
+ * calls brk() and mmap() with its arena locked. A process blocked in one of the waiting
+ * syscalls (poll(), read(), nanosleep() and alike) is idle, not halfway through libc.
+ * A process that doesn't get to one in time is left alone.
+ *
+ * @return KERN_SUCCESS
+ * Means the process is stopped and still traced
+ * @return KERN_OPERATION_TIMED_OUT
+ * Means it's never been idle, so we've let it go
+ */
+static
+int stop_while_waiting(pid_t target, struct user_regs_struct *regs)
+{
+    uint64_t deadline = rd_inject_clock_ns() + kRDWatcherIdleTimeoutNs;
+    int signal = 0, status = 0;
+    while (!is_waiting_syscall(regs->orig_rax)) {
+        if (rd_inject_clock_ns() >= deadline) {
+            ptrace(PTRACE_DETACH, target, NULL, signal);
+            return KERN_OPERATION_TIMED_OUT;
+        }
+        if (ptrace(PTRACE_CONT, target, NULL, signal) != 0) {
+            return KERN_FAILURE;
+        }
+        struct timespec nap = {.tv_sec = 0, .tv_nsec = 50000};
+        nanosleep(&nap, NULL);
+        if (ptrace(PTRACE_INTERRUPT, target, NULL, NULL) != 0 ||
+            waitpid(target, &status, __WALL) != target || !WIFSTOPPED(status) ||
+            ptrace(PTRACE_GETREGS, target, NULL, regs) != 0) {
+            /* It's gone, most likely */
+            return KERN_FAILURE;
+        }
+        /* The process' own signals get delivered on the next go */
+        signal = ((status >> 16) == PTRACE_EVENT_STOP) ? 0 : WSTOPSIG(status);
+    }
+    return KERN_SUCCESS;
+}
+
+/**
+ * @abstract
+ * Tells whether a thread stopped inside this syscall is just waiting for something.
+ *
+ * @param syscall
+ * The orig_rax of the thread: the number of the syscall, or -1 outside of any
+ */
+static
+bool is_waiting_syscall(unsigned long long syscall)
+{
+    switch ((long long)syscall) {
+        case SYS_read: case SYS_readv: case SYS_pread64:
+        case SYS_poll: case SYS_ppoll: case SYS_select: case SYS_pselect6:
+        case SYS_epoll_wait: case SYS_epoll_pwait: case SYS_epoll_pwait2:
+        case SYS_nanosleep: case SYS_clock_nanosleep: case SYS_pause:
+        case SYS_futex: case SYS_wait4: case SYS_waitid:
+        case SYS_accept: case SYS_accept4: case SYS_recvfrom: case SYS_recvmsg:
+        case SYS_rt_sigsuspend: case SYS_rt_sigtimedwait: case SYS_msgrcv: case SYS_semtimedop:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @abstract
+ * Checks whether an address belongs to the loader mapped at `base`.
+ */
+static
+bool loader_contains(pid_t target, unsigned long base, unsigned long address)
+{
+    char maps_path[64];
+    snprintf(maps_path, sizeof(maps_path), "/proc/%d/maps", target);
+    FILE *maps = fopen(maps_path, "re");
+    if (!maps) {
+        return false;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned long loader_inode = 0;
+    bool contains = false;
+    while (!contains && getline(&line, &line_size, maps) > 0) {
+        unsigned long start = 0, end = 0, inode = 0;
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %lu", &start, &end, &inode) != 3) {
+            continue;
+        }
+        /* The loader's mappings come one after another, starting at its base */
+        if (start == base) {
+            loader_inode = inode;
+        } else if (loader_inode == 0) {
+            continue;
+        } else if (inode != loader_inode) {
+            break;
+        }
+        contains = (address >= start && address < end);
+    }
+    free(line);
+    fclose(maps);
+    return contains;
+}
+
+/**
+ * @abstract
+ * Identifies the executable of a process, to tell whether it has exec'd.
+ */
+static
+bool executable_id(pid_t pid, dev_t *device, ino_t *inode)
+{
+    char link_path[64];
+    snprintf(link_path, sizeof(link_path), "/proc/%d/exe", pid);
+    struct stat info;
+    if (stat(link_path, &info) != 0) {
+        /* Kernel threads have no executable, and neither do zombies */
+        return false;
+    }
+    *device = info.st_dev;
+    *inode = info.st_ino;
+    return true;
+}
+
+static
+int compare_pids(const void *a, const void *b)
+{
+    pid_t left = *(const pid_t *)a, right = *(const pid_t *)b;
+    return (left > right) - (left < right);
+}
+
+static
+void count(uint64_t *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+#endif
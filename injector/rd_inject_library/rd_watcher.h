@@ -0,0 +1,115 @@
+//
+//  rd_watcher.h
+//  rd_inject_library
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rd_inject_library.h"
+
+/* A watcher of new processes */
+typedef struct rd_watcher rd_watcher_t;
+
+typedef enum {
+    /* The full path of the executable (/proc/<pid>/exe) */
+    RD_WATCH_EXECUTABLE = 0,
+    /* The command line, its arguments separated by spaces */
+    RD_WATCH_CMDLINE,
+    /* Any of the process' cgroups paths, e.g. "/system.slice/foo.service" */
+    RD_WATCH_CGROUP
+} rd_watch_field_t;
+
+typedef struct {
+    rd_watch_field_t field;
+    /* A shell wildcard pattern (see fnmatch(3)); `*` matches slashes too */
+    const char *pattern;
+    /* The payload to inject into matching processes */
+    const char *library_path;
+} rd_watch_rule_t;
+
+/**
+ * @abstract
+ * Is called for every matching process once the injection is over.
+ *
+ * @param rule
+ * The index of the first rule the process has matched
+ * @param err
+ * The rd_inject_library() result, or KERN_OPERATION_TIMED_OUT if the process has never
+ * got to a point where it was safe to inject
+ */
+typedef void (*rd_watcher_handler_t)(pid_t target, size_t rule, int err, void *context);
+
+/* Statistics of a watcher */
+typedef struct {
+    /* Whether the events come from the proc connector rather than /proc scans */
+    bool netlink;
+    /* Execs seen (or new processes, when scanning /proc) */
+    uint64_t events;
+    uint64_t matched;
+    uint64_t injected;
+    uint64_t failed;
+    /* Matching processes caught inside the loader and held at their entry point */
+    uint64_t held;
+    /* How many times the kernel has dropped events because we've fallen behind */
+    uint64_t overruns;
+} rd_watcher_stats_t;
+
+/**
+ * @abstract
+ * Starts injecting payloads into new processes that match the rules.
+ *
+ * @discussion
+ * Exec events come from the netlink proc connector (which needs CAP_NET_ADMIN), with
+ * a socket filter that keeps forks and exits in the kernel. Without it, /proc is
+ * scanned every few milliseconds instead; the processes that exec shortly after being
+ * forked are looked at again, but the ones that live less than a scan are missed.
+ *
+ * A process is matched right after its exec, long before its loader has mapped libc,
+ * so it's held at its entry point until the loader is done and then injected. One caught
+ * past its loader (mostly by a scan) is injected once it's idle in a waiting syscall, or
+ * not at all if it doesn't get there in a few ms.
+ *
+ * Every process is matched once, against the rules in order. Processes we've missed the
+ * exec of (e.g. ones running when the watcher starts) aren't injected.
+ *
+ * The injections are done one after another on a thread of the watcher's own, which
+ * becomes their tracer for the time being: don't waitpid() for matching children of
+ * yours meanwhile.
+ *
+ * Linux only: on OS X the function fails with KERN_FAILURE.
+ *
+ * @param rules
+ * The rules to match new processes against (copied)
+ * @param scan_only
+ * Scan /proc even if the proc connector is there
+ * @param handler
+ * An optional handler of finished injections, called on the watcher's thread
+ * @param watcher
+ * Receives the new watcher
+ *
+ * @return KERN_SUCCESS
+ * Means the watcher is running
+ * @return KERN_INVALID_ARGUMENT
+ * Means some rule has no pattern or payload
+ */
+int rd_watcher_start(const rd_watch_rule_t rules[], size_t count, bool scan_only,
+                     rd_watcher_handler_t handler, void *context, rd_watcher_t **watcher);
+
+/**
+ * @abstract
+ * Stops the watcher and waits for an injection in progress to finish.
+ */
+void rd_watcher_stop(rd_watcher_t *watcher);
+
+/**
+ * @abstract
+ * Takes a snapshot of the watcher's statistics.
+ */
+void rd_watcher_statistics(rd_watcher_t *watcher, rd_watcher_stats_t *stats);
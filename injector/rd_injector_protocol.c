@@ -0,0 +1,300 @@
+//
+//  rd_injector_protocol.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <stdlib.h>
+#include <string.h>
+
+#include "rd_injector_protocol.h"
+
+#define kRDInjectorRequestHeaderSize    (16)
+#define kRDInjectorResultHeaderSize     (32)
+
+#pragma mark - Private Interface
+
+static void put_u16(unsigned char *bytes, uint16_t value);
+static void put_u32(unsigned char *bytes, uint32_t value);
+static void put_u64(unsigned char *bytes, uint64_t value);
+static uint16_t get_u16(const unsigned char *bytes);
+static uint32_t get_u32(const unsigned char *bytes);
+static uint64_t get_u64(const unsigned char *bytes);
+static void put_header(unsigned char *bytes, rd_injector_frame_type_t type, size_t length, size_t count);
+static size_t padded_path_size(const char *path);
+
+#pragma mark - Implementation
+
+bool rd_injector_is_frame(const void *bytes, size_t available)
+{
+    return (available >= 4 && get_u32(bytes) == kRDInjectorProtocolMagic);
+}
+
+ssize_t rd_injector_frame_length(const void *bytes, size_t available)
+{
+    if (available < kRDInjectorFrameHeaderSize) {
+        return 0;
+    }
+    const unsigned char *header = bytes;
+    uint32_t length = get_u32(header + 8);
+    uint16_t type = get_u16(header + 6);
+    if (get_u32(header) != kRDInjectorProtocolMagic ||
+        get_u16(header + 4) != kRDInjectorProtocolVersion ||
+        (type != RD_INJECTOR_FRAME_REQUESTS && type != RD_INJECTOR_FRAME_RESULTS) ||
+        length < kRDInjectorFrameHeaderSize || length > kRDInjectorMaxFrameLength ||
+        get_u32(header + 12) > kRDInjectorMaxBatchCount) {
+        return -1;
+    }
+    return (ssize_t)length;
+}
+
+rd_injector_frame_type_t rd_injector_frame_type(const void *frame)
+{
+    return (rd_injector_frame_type_t)get_u16((const unsigned char *)frame + 6);
+}
+
+size_t rd_injector_requests_frame_length(const rd_injector_request_t requests[], size_t count)
+{
+    size_t length = kRDInjectorFrameHeaderSize;
+    for (size_t i = 0; i < count; i++) {
+        length += kRDInjectorRequestHeaderSize + padded_path_size(requests[i].payload_path);
+    }
+    return length;
+}
+
+size_t rd_injector_results_frame_length(size_t count)
+{
+    return kRDInjectorFrameHeaderSize +
+           count * (kRDInjectorResultHeaderSize + RD_PHASE_COUNT * sizeof(uint64_t));
+}
+
+size_t rd_injector_encode_requests(const rd_injector_request_t requests[], size_t count,
+                                   void *buffer, size_t capacity)
+{
+    size_t length = rd_injector_requests_frame_length(requests, count);
+    if (length > capacity || length > kRDInjectorMaxFrameLength || count > kRDInjectorMaxBatchCount) {
+        return 0;
+    }
+    unsigned char *bytes = buffer;
+    memset(bytes, 0, length);
+    put_header(bytes, RD_INJECTOR_FRAME_REQUESTS, length, count);
+    unsigned char *entry = bytes + kRDInjectorFrameHeaderSize;
+    for (size_t i = 0; i < count; i++) {
+        size_t path_length = requests[i].payload_path ? strlen(requests[i].payload_path) + 1 : 0;
+        if (path_length > UINT16_MAX) {
+            return 0;
+        }
+        put_u64(entry, requests[i].id);
+        put_u32(entry + 8, (uint32_t)requests[i].target);
+        put_u16(entry + 12, (uint16_t)path_length);
+        if (path_length > 0) {
+            memcpy(entry + kRDInjectorRequestHeaderSize, requests[i].payload_path, path_length);
+        }
+        entry += kRDInjectorRequestHeaderSize + padded_path_size(requests[i].payload_path);
+    }
+
+    return length;
+}
+
+size_t rd_injector_encode_results(const rd_injector_result_t results[], size_t count,
+                                  void *buffer, size_t capacity)
+{
+    size_t length = rd_injector_results_frame_length(count);
+    if (length > capacity || length > kRDInjectorMaxFrameLength || count > kRDInjectorMaxBatchCount) {
+        return 0;
+    }
+    unsigned char *bytes = buffer;
+    memset(bytes, 0, length);
+    put_header(bytes, RD_INJECTOR_FRAME_RESULTS, length, count);
+    unsigned char *entry = bytes + kRDInjectorFrameHeaderSize;
+    for (size_t i = 0; i < count; i++) {
+        put_u64(entry, results[i].id);
+        put_u32(entry + 8, (uint32_t)results[i].target);
+        put_u32(entry + 12, (uint32_t)results[i].error);
+        put_u16(entry + 16, (uint16_t)results[i].error_class);
+        put_u16(entry + 18, RD_PHASE_COUNT);
+        put_u64(entry + 24, results[i].handle);
+        entry += kRDInjectorResultHeaderSize;
+        for (int phase = 0; phase < RD_PHASE_COUNT; phase++) {
+            put_u64(entry, results[i].timings.phase_ns[phase]);
+            entry += sizeof(uint64_t);
+        }
+    }
+
+    return length;
+}
+
+bool rd_injector_decode_requests(const void *frame, size_t length,
+                                 rd_injector_request_t **requests, size_t *count)
+{
+    if (rd_injector_frame_length(frame, length) != (ssize_t)length ||
+        rd_injector_frame_type(frame) != RD_INJECTOR_FRAME_REQUESTS) {
+        return false;
+    }
+    const unsigned char *bytes = frame;
+    size_t entries = get_u32(bytes + 12);
+    rd_injector_request_t *decoded = calloc(entries ? entries : 1, sizeof(*decoded));
+    if (!decoded) {
+        return false;
+    }
+    size_t offset = kRDInjectorFrameHeaderSize;
+    for (size_t i = 0; i < entries; i++) {
+        if (length - offset < kRDInjectorRequestHeaderSize) {
+            free(decoded);
+            return false;
+        }
+        const unsigned char *entry = bytes + offset;
+        size_t path_length = get_u16(entry + 12);
+        size_t padded_length = (path_length + 7) & ~(size_t)7;
+        offset += kRDInjectorRequestHeaderSize;
+        if (length - offset < padded_length ||
+            (path_length > 0 && entry[kRDInjectorRequestHeaderSize + path_length - 1] != '\0')) {
+            free(decoded);
+            return false;
+        }
+        decoded[i].id = get_u64(entry);
+        decoded[i].target = (pid_t)get_u32(entry + 8);
+        decoded[i].payload_path = path_length ? (const char *)entry + kRDInjectorRequestHeaderSize : NULL;
+        offset += padded_length;
+    }
+    if (offset != length) {
+        free(decoded);
+        return false;
+    }
+    *requests = decoded;
+    *count = entries;
+
+    return true;
+}
+
+bool rd_injector_decode_results(const void *frame, size_t length,
+                                rd_injector_result_t **results, size_t *count)
+{
+    if (rd_injector_frame_length(frame, length) != (ssize_t)length ||
+        rd_injector_frame_type(frame) != RD_INJECTOR_FRAME_RESULTS) {
+        return false;
+    }
+    const unsigned char *bytes = frame;
+    size_t entries = get_u32(bytes + 12);
+    rd_injector_result_t *decoded = calloc(entries ? entries : 1, sizeof(*decoded));
+    if (!decoded) {
+        return false;
+    }
+    size_t offset = kRDInjectorFrameHeaderSize;
+    for (size_t i = 0; i < entries; i++) {
+        if (length - offset < kRDInjectorResultHeaderSize) {
+            free(decoded);
+            return false;
+        }
+        const unsigned char *entry = bytes + offset;
+        size_t phases = get_u16(entry + 18);
+        offset += kRDInjectorResultHeaderSize;
+        if ((length - offset) / sizeof(uint64_t) < phases) {
+            free(decoded);
+            return false;
+        }
+        decoded[i].id = get_u64(entry);
+        decoded[i].target = (pid_t)get_u32(entry + 8);
+        decoded[i].error = (int)get_u32(entry + 12);
+        decoded[i].error_class = (rd_injector_error_class_t)get_u16(entry + 16);
+        decoded[i].handle = get_u64(entry + 24);
+        for (size_t phase = 0; phase < phases && phase < RD_PHASE_COUNT; phase++) {
+            decoded[i].timings.phase_ns[phase] = get_u64(bytes + offset + phase * sizeof(uint64_t));
+        }
+        offset += phases * sizeof(uint64_t);
+    }
+    if (offset != length) {
+        free(decoded);
+        return false;
+    }
+    *results = decoded;
+    *count = entries;
+
+    return true;
+}
+
+rd_injector_error_class_t rd_injector_error_class(int error)
+{
+    switch (error) {
+        case KERN_SUCCESS: return RD_INJECTOR_ERROR_NONE;
+        case KERN_INVALID_ARGUMENT: return RD_INJECTOR_ERROR_REQUEST;
+        case KERN_INVALID_OBJECT: return RD_INJECTOR_ERROR_PAYLOAD;
+        case KERN_OPERATION_TIMED_OUT: return RD_INJECTOR_ERROR_TIMEOUT;
+        case KERN_ABORTED: return RD_INJECTOR_ERROR_ABORTED;
+        default: return RD_INJECTOR_ERROR_TARGET;
+    }
+}
+
+const char *rd_injector_error_class_name(rd_injector_error_class_t error_class)
+{
+    static const char *names[RD_INJECTOR_ERROR_CLASS_COUNT] = {
+        [RD_INJECTOR_ERROR_NONE] = "none",
+        [RD_INJECTOR_ERROR_REQUEST] = "request",
+        [RD_INJECTOR_ERROR_TARGET] = "target",
+        [RD_INJECTOR_ERROR_PAYLOAD] = "payload",
+        [RD_INJECTOR_ERROR_TIMEOUT] = "timeout",
+        [RD_INJECTOR_ERROR_ABORTED] = "aborted",
+        [RD_INJECTOR_ERROR_INTERNAL] = "internal"
+    };
+    return ((unsigned)error_class < RD_INJECTOR_ERROR_CLASS_COUNT) ? names[error_class] : "unknown";
+}
+
+static
+void put_header(unsigned char *bytes, rd_injector_frame_type_t type, size_t length, size_t count)
+{
+    put_u32(bytes, kRDInjectorProtocolMagic);
+    put_u16(bytes + 4, kRDInjectorProtocolVersion);
+    put_u16(bytes + 6, (uint16_t)type);
+    put_u32(bytes + 8, (uint32_t)length);
+    put_u32(bytes + 12, (uint32_t)count);
+}
+
+/**
+ * @abstract
+ * Returns how many bytes a path (with its NUL terminator) takes in a requests frame.
+ */
+static
+size_t padded_path_size(const char *path)
+{
+    size_t size = path ? strlen(path) + 1 : 0;
+    return (size + 7) & ~(size_t)7;
+}
+
+static
+void put_u16(unsigned char *bytes, uint16_t value)
+{
+    bytes[0] = (unsigned char)value;
+    bytes[1] = (unsigned char)(value >> 8);
+}
+
+static
+void put_u32(unsigned char *bytes, uint32_t value)
+{
+    put_u16(bytes, (uint16_t)value);
+    put_u16(bytes + 2, (uint16_t)(value >> 16));
+}
+
+static
+void put_u64(unsigned char *bytes, uint64_t value)
+{
+    put_u32(bytes, (uint32_t)value);
+    put_u32(bytes + 4, (uint32_t)(value >> 32));
+}
+
+static
+uint16_t get_u16(const unsigned char *bytes)
+{
+    return (uint16_t)(bytes[0] | (bytes[1] << 8));
+}
+
+static
+uint32_t get_u32(const unsigned char *bytes)
+{
+    return get_u16(bytes) | ((uint32_t)get_u16(bytes + 2) << 16);
+}
+
+static
+uint64_t get_u64(const unsigned char *bytes)
+{
+    return get_u32(bytes) | ((uint64_t)get_u32(bytes + 4) << 32);
+}
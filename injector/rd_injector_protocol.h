@@ -0,0 +1,203 @@
+//
+//  rd_injector_protocol.h
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  A compact binary protocol for talking to the injector daemon.
+//
+//  Everything is sent in frames. A frame starts with a 16-byte header (all the
+//  integers are little-endian):
+//
+//    u32 magic ("RDIW") | u16 version | u16 type | u32 length | u32 count
+//
+//  where `length` is the length of the whole frame including the header and `count`
+//  is the number of entries that follow. A requests frame carries `count` entries of
+//
+//    u64 id | i32 target | u16 path length | u16 flags (0) | path (NUL-terminated,
+//    zero-padded up to a multiple of 8 bytes)
+//
+//  and the daemon answers it with a single results frame once all of its requests
+//  are done; that frame carries a result per request, in the same order:
+//
+//    u64 id | i32 target | i32 error | u16 error class | u16 phase count |
+//    u32 reserved (0) | u64 handle | u64 phase timings[phase count]
+//
+//  Request ids are chosen by the client and are only echoed back. A client may send
+//  any number of frames without waiting for the replies; as requests for different
+//  targets run in parallel, results frames may come back in any order.
+//
+//  A requests frame of the same payload for many targets is how a binary client fans
+//  out: every request goes to its target's lane of the daemon's request queue, and the
+//  results frame is the fan-out's answer. There's no separate fan-out frame, the
+//  aggregate statistics are just the results' timings added up.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rd_inject_library.h"
+
+#define kRDInjectorProtocolMagic        (0x57494452) /* "RDIW" */
+#define kRDInjectorProtocolVersion      (1)
+#define kRDInjectorFrameHeaderSize      (16)
+/* Limits of a single frame: larger ones are treated as malformed */
+#define kRDInjectorMaxFrameLength       (256 * 1024)
+#define kRDInjectorMaxBatchCount        (1024)
+
+typedef enum {
+    RD_INJECTOR_FRAME_REQUESTS = 1,
+    RD_INJECTOR_FRAME_RESULTS = 2
+} rd_injector_frame_type_t;
+
+/* A coarse classification of injection errors, so clients don't have to know every error code */
+typedef enum {
+    RD_INJECTOR_ERROR_NONE = 0,
+    /* The request itself makes no sense (e.g. an invalid pid or no payload) */
+    RD_INJECTOR_ERROR_REQUEST,
+    /* We can't get into the target (it's gone, it's not 64 bit, no dlopen() inside) */
+    RD_INJECTOR_ERROR_TARGET,
+    /* The target can't load the payload (rejected by the preflight or by dlopen()) */
+    RD_INJECTOR_ERROR_PAYLOAD,
+    /* The target didn't get to run the injection in time */
+    RD_INJECTOR_ERROR_TIMEOUT,
+    /* The injection was cancelled */
+    RD_INJECTOR_ERROR_ABORTED,
+    /* The daemon couldn't process the request (e.g. it's out of memory) */
+    RD_INJECTOR_ERROR_INTERNAL,
+    RD_INJECTOR_ERROR_CLASS_COUNT
+} rd_injector_error_class_t;
+
+/* A single injection request */
+typedef struct {
+    uint64_t id;
+    pid_t target;
+    const char *payload_path;
+} rd_injector_request_t;
+
+/* The result of a single injection request */
+typedef struct {
+    uint64_t id;
+    pid_t target;
+    /* A KERN_* code of rd_inject_library() */
+    int error;
+    rd_injector_error_class_t error_class;
+    /* The payload's dlopen() handle inside the target, 0 on failure */
+    uint64_t handle;
+    rd_inject_timings_t timings;
+} rd_injector_result_t;
+
+/**
+ * @abstract
+ * Checks whether the bytes look like the beginning of a frame.
+ *
+ * @discussion
+ * Only the magic is checked, so it tells a binary client from a text one (see
+ * main_linux.c) by its very first bytes.
+ */
+bool rd_injector_is_frame(const void *bytes, size_t available);
+
+/**
+ * @abstract
+ * Validates the header of a frame at the beginning of a buffer.
+ *
+ * @param available
+ * The number of bytes in the buffer; it doesn't need to hold the whole frame yet
+ *
+ * @return
+ * The length of the whole frame, 0 if there're not enough bytes to tell yet,
+ * or (-1) if the header is malformed
+ */
+ssize_t rd_injector_frame_length(const void *bytes, size_t available);
+
+/**
+ * @abstract
+ * Returns the type of a frame validated with rd_injector_frame_length().
+ */
+rd_injector_frame_type_t rd_injector_frame_type(const void *frame);
+
+/**
+ * @abstract
+ * Returns the length of a requests frame carrying the given requests.
+ */
+size_t rd_injector_requests_frame_length(const rd_injector_request_t requests[], size_t count);
+
+/**
+ * @abstract
+ * Returns the length of a results frame carrying the given number of results.
+ */
+size_t rd_injector_results_frame_length(size_t count);
+
+/**
+ * @abstract
+ * Puts the requests into a requests frame.
+ *
+ * @return
+ * The length of the frame or 0 if it doesn't fit into `capacity` bytes (or the
+ * requests can't be encoded at all, e.g. there're too many of them)
+ */
+size_t rd_injector_encode_requests(const rd_injector_request_t requests[], size_t count,
+                                   void *buffer, size_t capacity);
+
+/**
+ * @abstract
+ * Puts the results into a results frame.
+ *
+ * @return
+ * The length of the frame or 0 if it doesn't fit into `capacity` bytes
+ */
+size_t rd_injector_encode_results(const rd_injector_result_t results[], size_t count,
+                                  void *buffer, size_t capacity);
+
+/**
+ * @abstract
+ * Extracts the requests from a whole requests frame.
+ *
+ * @discussion
+ * The payload paths of the requests point into the frame itself.
+ *
+ * @param requests
+ * Receives a new array of requests (free() it)
+ * @param count
+ * Receives the number of requests
+ *
+ * @return
+ * false if the frame is malformed
+ */
+bool rd_injector_decode_requests(const void *frame, size_t length,
+                                 rd_injector_request_t **requests, size_t *count);
+
+/**
+ * @abstract
+ * Extracts the results from a whole results frame.
+ *
+ * @discussion
+ * Phases the sender knows nothing about are left zero, and the ones we don't know
+ * about are dropped.
+ *
+ * @param results
+ * Receives a new array of results (free() it)
+ * @param count
+ * Receives the number of results
+ *
+ * @return
+ * false if the frame is malformed
+ */
+bool rd_injector_decode_results(const void *frame, size_t length,
+                                rd_injector_result_t **results, size_t *count);
+
+/**
+ * @abstract
+ * Classifies a KERN_* code returned by rd_inject_library().
+ */
+rd_injector_error_class_t rd_injector_error_class(int error);
+
+/**
+ * @abstract
+ * Returns a short name of the error class (e.g. "payload"), suitable for keys and logs.
+ */
+const char *rd_injector_error_class_name(rd_injector_error_class_t error_class);
@@ -0,0 +1,55 @@
+//
+//  rd_log_decode.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+//  Turns a binary log file of the injector (see rd_inject_log.h) back into text,
+//  a line per record. Every thread's records come in order, but the threads' records
+//  are interleaved as they have been drained, so mind the timestamps.
+//
+//  Usage: rd_log_decode [<log file>]
+//
+//  Reads the standard input when there's no file given.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rd_inject_log.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [<log file>]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    FILE *input = (argc == 2) ? fopen(argv[1], "rb") : stdin;
+    if (!input) {
+        perror(argv[1]);
+        exit(EXIT_FAILURE);
+    }
+    rd_log_file_header_t header;
+    if (fread(&header, sizeof(header), 1, input) != 1 ||
+        memcmp(header.magic, kRDLogFileMagic, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "Not an injector log file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (header.version != kRDLogFileVersion || header.record_size != sizeof(rd_log_record_t)) {
+        fprintf(stderr, "Unsupported log file version %u (records of %u bytes)\n",
+                header.version, header.record_size);
+        exit(EXIT_FAILURE);
+    }
+    rd_log_record_t record;
+    char line[256];
+    /* A daemon that's been killed may leave a partial record behind, it's skipped */
+    while (fread(&record, sizeof(record), 1, input) == 1) {
+        rd_log_format(&record, true, line, sizeof(line));
+        puts(line);
+    }
+    if (ferror(input)) {
+        perror("fread");
+        exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,332 @@
+//
+//  rd_request_coalescer.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "rd_request_coalescer.h"
+#include "rd_inject_preflight.h"
+
+#define kRDCoalescerBuckets     (256)
+/* How many successful injections to remember at most */
+#define kRDCoalescerMaxCached   (4096)
+
+#pragma mark - Private Interface
+
+typedef struct {
+    pid_t target;
+    uint64_t start_time;
+    dev_t device;
+    ino_t inode;
+    off_t size;
+    time_t mtime_sec;
+    long mtime_nsec;
+} rd_coalescer_key_t;
+
+typedef struct rd_coalesced_waiter {
+    rd_coalescer_callback_t callback;
+    void *context;
+    struct rd_coalesced_waiter *next;
+} rd_coalesced_waiter_t;
+
+/* An injection is in the table while it's in flight and, once it has succeeded, as
+ * long as it's cached. Injections of payloads we can't identify are never there. */
+struct rd_coalesced_injection {
+    rd_coalescer_key_t key;
+    bool is_listed;
+    bool is_done;
+    /* The path the injection is remembered under (see rd_injected_library_handle()) */
+    char *payload_path;
+    uint64_t handle;
+    /* The one who runs the injection comes first */
+    rd_coalesced_waiter_t *waiters;
+    rd_coalesced_waiter_t **waiters_tail;
+    struct rd_coalesced_injection *next_in_bucket;
+};
+
+struct rd_coalescer {
+    pthread_mutex_t lock;
+    rd_coalesced_injection_t *buckets[kRDCoalescerBuckets];
+    size_t cached_count;
+    rd_coalescer_stats_t stats;
+};
+
+static bool identify_request(pid_t target, const char *payload_path, rd_coalescer_key_t *key);
+static rd_coalesced_injection_t **injection_slot(rd_coalescer_t *coalescer, const rd_coalescer_key_t *key);
+static bool same_keys(const rd_coalescer_key_t *first, const rd_coalescer_key_t *second);
+static void unlist_injection(rd_coalescer_t *coalescer, rd_coalesced_injection_t *injection);
+static void forget_dead_targets(rd_coalescer_t *coalescer);
+static void free_injection(rd_coalesced_injection_t *injection);
+
+#pragma mark - Implementation
+
+rd_coalescer_t *rd_coalescer_create(void)
+{
+    rd_coalescer_t *coalescer = calloc(1, sizeof(*coalescer));
+    if (!coalescer) {
+        return NULL;
+    }
+    pthread_mutex_init(&coalescer->lock, NULL);
+
+    return coalescer;
+}
+
+void rd_coalescer_destroy(rd_coalescer_t *coalescer)
+{
+    if (!coalescer) return;
+
+    for (size_t i = 0; i < kRDCoalescerBuckets; i++) {
+        rd_coalesced_injection_t *injection = coalescer->buckets[i];
+        while (injection) {
+            rd_coalesced_injection_t *next = injection->next_in_bucket;
+            free_injection(injection);
+            injection = next;
+        }
+    }
+    pthread_mutex_destroy(&coalescer->lock);
+    free(coalescer);
+}
+
+bool rd_coalescer_join(rd_coalescer_t *coalescer, pid_t target, const char *payload_path,
+                       rd_coalescer_callback_t callback, void *context,
+                       rd_coalesced_injection_t **injection)
+{
+    rd_coalesced_waiter_t *waiter = calloc(1, sizeof(*waiter));
+    rd_coalesced_injection_t *created = calloc(1, sizeof(*created));
+    if (!waiter || !created) {
+        free(waiter);
+        free(created);
+        rd_coalesced_result_t result = {.err = KERN_FAILURE};
+        callback(&result, context);
+        *injection = NULL;
+        return false;
+    }
+    waiter->callback = callback;
+    waiter->context = context;
+    created->waiters = waiter;
+    created->waiters_tail = &waiter->next;
+
+    /* An invalid request or a payload that isn't there is not our business */
+    rd_coalescer_key_t key;
+    if (!payload_path || !identify_request(target, payload_path, &key)) {
+        pthread_mutex_lock(&coalescer->lock);
+        coalescer->stats.ran++;
+        pthread_mutex_unlock(&coalescer->lock);
+        *injection = created;
+        return true;
+    }
+
+    pthread_mutex_lock(&coalescer->lock);
+    rd_coalesced_injection_t **slot = injection_slot(coalescer, &key);
+    rd_coalesced_injection_t *existing = *slot;
+    /* A cached injection is only good as long as the payload is still loaded */
+    if (existing && existing->is_done &&
+        rd_injected_library_handle(target, existing->payload_path) == 0) {
+        unlist_injection(coalescer, existing);
+        free_injection(existing);
+        existing = NULL;
+    }
+    if (existing && !existing->is_done) {
+        coalescer->stats.joined++;
+        *existing->waiters_tail = waiter;
+        existing->waiters_tail = &waiter->next;
+        pthread_mutex_unlock(&coalescer->lock);
+        free(created);
+        *injection = NULL;
+        return false;
+    }
+    if (existing) {
+        coalescer->stats.cached++;
+        rd_coalesced_result_t result = {
+            .err = KERN_SUCCESS,
+            .handle = existing->handle,
+            .origin = RD_COALESCED_CACHED
+        };
+        pthread_mutex_unlock(&coalescer->lock);
+        free(waiter);
+        free(created);
+        callback(&result, context);
+        *injection = NULL;
+        return false;
+    }
+    created->key = key;
+    created->payload_path = strdup(payload_path);
+    if (created->payload_path) {
+        created->is_listed = true;
+        created->next_in_bucket = *slot;
+        *slot = created;
+    }
+    coalescer->stats.ran++;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    *injection = created;
+    return true;
+}
+
+void rd_coalescer_complete(rd_coalescer_t *coalescer, rd_coalesced_injection_t *injection,
+                           int err, const rd_inject_timings_t *timings)
+{
+    if (!injection) return;
+
+    rd_coalesced_result_t result = {
+        .err = err,
+        .origin = RD_COALESCED_RAN
+    };
+    if (timings) {
+        result.timings = *timings;
+    }
+    /* Whoever wants the handle wants it now, while we know the payload is loaded */
+    if (err == KERN_SUCCESS && injection->payload_path) {
+        result.handle = rd_injected_library_handle(injection->key.target, injection->payload_path);
+    }
+
+    pthread_mutex_lock(&coalescer->lock);
+    /* Nobody can join it once it's done, so the waiters list is ours from now on */
+    rd_coalesced_waiter_t *waiters = injection->waiters;
+    injection->waiters = NULL;
+    injection->waiters_tail = &injection->waiters;
+    injection->handle = result.handle;
+    bool is_cached = false;
+    if (injection->is_listed) {
+        if (err == KERN_SUCCESS && coalescer->cached_count >= kRDCoalescerMaxCached) {
+            forget_dead_targets(coalescer);
+        }
+        if (err == KERN_SUCCESS && coalescer->cached_count < kRDCoalescerMaxCached) {
+            coalescer->cached_count++;
+            coalescer->stats.cache_size = coalescer->cached_count;
+            is_cached = true;
+        } else {
+            unlist_injection(coalescer, injection);
+        }
+    }
+    injection->is_done = true;
+    pthread_mutex_unlock(&coalescer->lock);
+
+    while (waiters) {
+        rd_coalesced_waiter_t *next = waiters->next;
+        waiters->callback(&result, waiters->context);
+        free(waiters);
+        result.origin = RD_COALESCED_JOINED;
+        waiters = next;
+    }
+    if (!is_cached) {
+        free_injection(injection);
+    }
+}
+
+void rd_coalescer_statistics(rd_coalescer_t *coalescer, rd_coalescer_stats_t *stats)
+{
+    pthread_mutex_lock(&coalescer->lock);
+    *stats = coalescer->stats;
+    pthread_mutex_unlock(&coalescer->lock);
+}
+
+/**
+ * @abstract
+ * Tells which process and which payload file the request is about.
+ *
+ * @return false if either of them is gone
+ */
+static
+bool identify_request(pid_t target, const char *payload_path, rd_coalescer_key_t *key)
+{
+    struct stat info;
+    if (target <= 0 || stat(payload_path, &info) != 0) {
+        return false;
+    }
+    key->target = target;
+    key->start_time = rd_process_start_time(target);
+    key->device = info.st_dev;
+    key->inode = info.st_ino;
+    key->size = info.st_size;
+#if defined(__APPLE__)
+    key->mtime_sec = info.st_mtimespec.tv_sec;
+    key->mtime_nsec = info.st_mtimespec.tv_nsec;
+#else
+    key->mtime_sec = info.st_mtim.tv_sec;
+    key->mtime_nsec = info.st_mtim.tv_nsec;
+#endif
+    return (key->start_time != 0);
+}
+
+/**
+ * Returns a pointer to the hash table slot that holds (or should hold) the injection for `key`.
+ */
+static
+rd_coalesced_injection_t **injection_slot(rd_coalescer_t *coalescer, const rd_coalescer_key_t *key)
+{
+    uint64_t hash = (uint64_t)key->target * 0x9e3779b97f4a7c15ULL ^ (uint64_t)key->inode;
+    rd_coalesced_injection_t **slot = &coalescer->buckets[(hash >> 32) % kRDCoalescerBuckets];
+    while (*slot && !same_keys(&(*slot)->key, key)) {
+        slot = &(*slot)->next_in_bucket;
+    }
+    return slot;
+}
+
+static
+bool same_keys(const rd_coalescer_key_t *first, const rd_coalescer_key_t *second)
+{
+    return (first->target == second->target && first->start_time == second->start_time &&
+            first->device == second->device && first->inode == second->inode &&
+            first->size == second->size && first->mtime_sec == second->mtime_sec &&
+            first->mtime_nsec == second->mtime_nsec);
+}
+
+/**
+ * Takes the injection out of the table (the coalescer must be locked).
+ */
+static
+void unlist_injection(rd_coalescer_t *coalescer, rd_coalesced_injection_t *injection)
+{
+    rd_coalesced_injection_t **slot = injection_slot(coalescer, &injection->key);
+    if (*slot == injection) {
+        *slot = injection->next_in_bucket;
+    }
+    if (injection->is_listed && injection->is_done) {
+        coalescer->cached_count--;
+        coalescer->stats.cache_size = coalescer->cached_count;
+    }
+    injection->is_listed = false;
+    injection->next_in_bucket = NULL;
+}
+
+/**
+ * Forgets the cached injections into processes that have exited (the coalescer must
+ * be locked). Running injections stay where they are.
+ */
+static
+void forget_dead_targets(rd_coalescer_t *coalescer)
+{
+    for (size_t i = 0; i < kRDCoalescerBuckets; i++) {
+        rd_coalesced_injection_t **slot = &coalescer->buckets[i];
+        while (*slot) {
+            rd_coalesced_injection_t *injection = *slot;
+            if (!injection->is_done ||
+                rd_process_start_time(injection->key.target) == injection->key.start_time) {
+                slot = &injection->next_in_bucket;
+                continue;
+            }
+            *slot = injection->next_in_bucket;
+            coalescer->cached_count--;
+            free_injection(injection);
+        }
+    }
+    coalescer->stats.cache_size = coalescer->cached_count;
+}
+
+static
+void free_injection(rd_coalesced_injection_t *injection)
+{
+    while (injection->waiters) {
+        rd_coalesced_waiter_t *next = injection->waiters->next;
+        free(injection->waiters);
+        injection->waiters = next;
+    }
+    free(injection->payload_path);
+    free(injection);
+}
@@ -0,0 +1,107 @@
+//
+//  rd_request_coalescer.h
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "rd_inject_library.h"
+
+typedef struct rd_coalescer rd_coalescer_t;
+/* An injection that one or more requests are waiting for */
+typedef struct rd_coalesced_injection rd_coalesced_injection_t;
+
+/* How a request has got its result */
+typedef enum {
+    /* Its own injection */
+    RD_COALESCED_RAN = 0,
+    /* An identical injection that was already in flight */
+    RD_COALESCED_JOINED,
+    /* An identical injection that has succeeded before (the timings are all zeros) */
+    RD_COALESCED_CACHED
+} rd_coalesced_origin_t;
+
+typedef struct {
+    int err;
+    /* The remote dlopen() handle of the payload, if it's loaded */
+    uint64_t handle;
+    rd_inject_timings_t timings;
+    rd_coalesced_origin_t origin;
+} rd_coalesced_result_t;
+
+typedef void (*rd_coalescer_callback_t)(const rd_coalesced_result_t *result, void *context);
+
+typedef struct {
+    /* Injections actually run */
+    uint64_t ran;
+    /* Requests answered by someone else's injection */
+    uint64_t joined;
+    uint64_t cached;
+    /* Successful injections remembered at the moment */
+    uint64_t cache_size;
+} rd_coalescer_stats_t;
+
+/**
+ * @abstract
+ * Creates a coalescer of identical injection requests.
+ *
+ * @return a new coalescer or NULL
+ */
+rd_coalescer_t *rd_coalescer_create(void);
+
+/**
+ * @abstract
+ * Destroys the coalescer; there must be no injections in flight.
+ */
+void rd_coalescer_destroy(rd_coalescer_t *coalescer);
+
+/**
+ * @abstract
+ * Finds out whether a request has to be run, or is answered by an identical one.
+ *
+ * @discussion
+ * Requests are identical when they're for the same process (the pid and its start time)
+ * and the same payload file (its device, inode, size and mtime), so two staged copies of a
+ * payload aren't, but hard links to it are.
+ *
+ * A request identical to an injection in flight waits for it, and gets its result along
+ * with the request that runs it. A request identical to an injection that has succeeded
+ * is answered right away (the callback is called before this function returns), as long
+ * as the process is alive and the payload hasn't been unloaded from it since: no second
+ * dlopen() is made, so a single rd_unload_library() unloads the payload for both.
+ *
+ * @param callback
+ * Receives the result of the request; it's called exactly once, on whichever thread
+ * completes the injection
+ * @param injection
+ * Receives the injection to complete if the request has to be run
+ *
+ * @return
+ * true if the caller has to run the injection and then pass its result to
+ * rd_coalescer_complete()
+ */
+bool rd_coalescer_join(rd_coalescer_t *coalescer, pid_t target, const char *payload_path,
+                       rd_coalescer_callback_t callback, void *context,
+                       rd_coalesced_injection_t **injection);
+
+/**
+ * @abstract
+ * Hands the result of an injection out to every request that's been waiting for it.
+ *
+ * @param timings
+ * The injection's timings or NULL
+ */
+void rd_coalescer_complete(rd_coalescer_t *coalescer, rd_coalesced_injection_t *injection,
+                           int err, const rd_inject_timings_t *timings);
+
+/**
+ * @abstract
+ * Takes a snapshot of the coalescer's counters.
+ */
+void rd_coalescer_statistics(rd_coalescer_t *coalescer, rd_coalescer_stats_t *stats);
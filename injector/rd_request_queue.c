@@ -0,0 +1,263 @@
+//
+//  rd_request_queue.c
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "rd_request_queue.h"
+
+#define kRDRequestQueueBuckets      (256)
+#define kRDRequestQueueMinWorkers   (4)
+
+#pragma mark - Private Interface
+
+typedef struct rd_request {
+    rd_request_function_t function;
+    void *context;
+    struct rd_request *next;
+} rd_request_t;
+
+/* A FIFO of requests for a single key. A lane is either waiting in the ready list,
+ * or being run by a worker, or (when it has no requests left) it's gone. */
+typedef struct rd_request_lane {
+    pid_t key;
+    rd_request_t *head;
+    rd_request_t *tail;
+    bool running;
+    /* Ready list linkage */
+    struct rd_request_lane *next_ready;
+    /* Hash bucket linkage */
+    struct rd_request_lane *next_in_bucket;
+} rd_request_lane_t;
+
+struct rd_request_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t has_ready_lanes;
+    pthread_cond_t is_drained;
+    rd_request_lane_t *buckets[kRDRequestQueueBuckets];
+    rd_request_lane_t *ready_head;
+    rd_request_lane_t *ready_tail;
+    size_t in_flight;
+    bool stopping;
+    rd_request_queue_activity_handler_t handler;
+    void *handler_context;
+    unsigned int workers_count;
+    pthread_t *workers;
+};
+
+static void *request_queue_worker(void *queue);
+static rd_request_lane_t **lane_slot(rd_request_queue_t *queue, pid_t key);
+static void push_ready_lane(rd_request_queue_t *queue, rd_request_lane_t *lane);
+
+#pragma mark - Implementation
+
+rd_request_queue_t *rd_request_queue_create(unsigned int workers,
+                                            rd_request_queue_activity_handler_t handler,
+                                            void *handler_context)
+{
+    if (workers == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        /* Injections mostly wait for targets, so don't be shy */
+        workers = (cpus > 0) ? (unsigned int)cpus * 2 : 1;
+        if (workers < kRDRequestQueueMinWorkers) workers = kRDRequestQueueMinWorkers;
+    }
+    rd_request_queue_t *queue = calloc(1, sizeof(*queue));
+    if (!queue) {
+        return NULL;
+    }
+    queue->workers = calloc(workers, sizeof(*queue->workers));
+    if (!queue->workers) {
+        free(queue);
+        return NULL;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->has_ready_lanes, NULL);
+    pthread_cond_init(&queue->is_drained, NULL);
+    queue->handler = handler;
+    queue->handler_context = handler_context;
+
+    for (unsigned int i = 0; i < workers; i++) {
+        if (pthread_create(&queue->workers[i], NULL, request_queue_worker, queue) != 0) {
+            break;
+        }
+        queue->workers_count++;
+    }
+    if (queue->workers_count == 0) {
+        rd_request_queue_destroy(queue);
+        return NULL;
+    }
+
+    return queue;
+}
+
+bool rd_request_queue_submit(rd_request_queue_t *queue, pid_t key,
+                             rd_request_function_t function, void *context)
+{
+    if (!queue || !function) {
+        return false;
+    }
+    rd_request_t *request = calloc(1, sizeof(*request));
+    if (!request) {
+        return false;
+    }
+    request->function = function;
+    request->context = context;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->stopping) {
+        pthread_mutex_unlock(&queue->lock);
+        free(request);
+        return false;
+    }
+    rd_request_lane_t *lane = NULL;
+    rd_request_lane_t **slot = (key > 0) ? lane_slot(queue, key) : NULL;
+    if (slot && *slot) {
+        lane = *slot;
+    } else {
+        lane = calloc(1, sizeof(*lane));
+        if (!lane) {
+            pthread_mutex_unlock(&queue->lock);
+            free(request);
+            return false;
+        }
+        lane->key = key;
+        if (slot) {
+            *slot = lane;
+        }
+    }
+
+    bool lane_was_idle = (lane->head == NULL && !lane->running);
+    if (lane->tail) {
+        lane->tail->next = request;
+    } else {
+        lane->head = request;
+    }
+    lane->tail = request;
+    if (lane_was_idle) {
+        push_ready_lane(queue, lane);
+        pthread_cond_signal(&queue->has_ready_lanes);
+    }
+
+    if (queue->in_flight++ == 0 && queue->handler) {
+        queue->handler(true, queue->handler_context);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return true;
+}
+
+size_t rd_request_queue_in_flight(rd_request_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    size_t in_flight = queue->in_flight;
+    pthread_mutex_unlock(&queue->lock);
+
+    return in_flight;
+}
+
+unsigned int rd_request_queue_workers(rd_request_queue_t *queue)
+{
+    return queue->workers_count;
+}
+
+void rd_request_queue_destroy(rd_request_queue_t *queue)
+{
+    if (!queue) return;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->in_flight > 0) {
+        pthread_cond_wait(&queue->is_drained, &queue->lock);
+    }
+    queue->stopping = true;
+    pthread_cond_broadcast(&queue->has_ready_lanes);
+    pthread_mutex_unlock(&queue->lock);
+
+    for (unsigned int i = 0; i < queue->workers_count; i++) {
+        pthread_join(queue->workers[i], NULL);
+    }
+    pthread_cond_destroy(&queue->is_drained);
+    pthread_cond_destroy(&queue->has_ready_lanes);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->workers);
+    free(queue);
+}
+
+static
+void *request_queue_worker(void *ctx)
+{
+    rd_request_queue_t *queue = ctx;
+
+    pthread_mutex_lock(&queue->lock);
+    while (1) {
+        while (!queue->ready_head && !queue->stopping) {
+            pthread_cond_wait(&queue->has_ready_lanes, &queue->lock);
+        }
+        if (!queue->ready_head) {
+            break;
+        }
+        rd_request_lane_t *lane = queue->ready_head;
+        queue->ready_head = lane->next_ready;
+        if (!queue->ready_head) queue->ready_tail = NULL;
+        lane->next_ready = NULL;
+
+        rd_request_t *request = lane->head;
+        lane->head = request->next;
+        if (!lane->head) lane->tail = NULL;
+        lane->running = true;
+        pthread_mutex_unlock(&queue->lock);
+
+        request->function(request->context);
+        free(request);
+
+        pthread_mutex_lock(&queue->lock);
+        lane->running = false;
+        if (lane->head) {
+            /* Let other lanes run before the next request for this key */
+            push_ready_lane(queue, lane);
+            pthread_cond_signal(&queue->has_ready_lanes);
+        } else {
+            rd_request_lane_t **slot = (lane->key > 0) ? lane_slot(queue, lane->key) : NULL;
+            if (slot) {
+                *slot = lane->next_in_bucket;
+            }
+            free(lane);
+        }
+        if (--queue->in_flight == 0) {
+            if (queue->handler) {
+                queue->handler(false, queue->handler_context);
+            }
+            pthread_cond_broadcast(&queue->is_drained);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return NULL;
+}
+
+/**
+ * Returns a pointer to the hash table slot that holds (or should hold) the lane for `key`.
+ */
+static
+rd_request_lane_t **lane_slot(rd_request_queue_t *queue, pid_t key)
+{
+    rd_request_lane_t **slot = &queue->buckets[(unsigned int)key % kRDRequestQueueBuckets];
+    while (*slot && (*slot)->key != key) {
+        slot = &(*slot)->next_in_bucket;
+    }
+    return slot;
+}
+
+static
+void push_ready_lane(rd_request_queue_t *queue, rd_request_lane_t *lane)
+{
+    if (queue->ready_tail) {
+        queue->ready_tail->next_ready = lane;
+    } else {
+        queue->ready_head = lane;
+    }
+    queue->ready_tail = lane;
+}
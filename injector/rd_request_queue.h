@@ -0,0 +1,83 @@
+//
+//  rd_request_queue.h
+//  injector
+//
+//  Copyright (c) 2014 rodionovd. All rights reserved.
+//
+
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+typedef struct rd_request_queue rd_request_queue_t;
+
+typedef void (*rd_request_function_t)(void *context);
+
+/**
+ * @abstract
+ * A callback for tracking whether there're requests in flight.
+ *
+ * @discussion
+ * It's called with `busy = true` when the first request is submitted into an empty
+ * queue and with `busy = false` once the last request in flight has completed.
+ * Calls are serialized and always come in this order.
+ */
+typedef void (*rd_request_queue_activity_handler_t)(bool busy, void *context);
+
+/**
+ * @abstract
+ * Creates a request queue backed by a pool of worker threads.
+ *
+ * @discussion
+ * Requests submitted with different keys (target pids) run in parallel, while requests
+ * with the same key run one after another in submission order.
+ *
+ * @param workers
+ * The number of worker threads; pass 0 to pick a default based on the number of CPUs
+ * @param handler
+ * An optional activity handler
+ * @param handler_context
+ * A context to pass into the activity handler
+ *
+ * @return a new queue or NULL
+ */
+rd_request_queue_t *rd_request_queue_create(unsigned int workers,
+                                            rd_request_queue_activity_handler_t handler,
+                                            void *handler_context);
+
+/**
+ * @abstract
+ * Submits a request into the queue.
+ *
+ * @param key
+ * A serialization key (i.e. a target pid). Requests with non-positive keys
+ * are not serialized against anything
+ * @param function
+ * The request itself
+ * @param context
+ * An argument for `function`
+ *
+ * @return false if the request could not be queued
+ */
+bool rd_request_queue_submit(rd_request_queue_t *queue, pid_t key,
+                             rd_request_function_t function, void *context);
+
+/**
+ * @abstract
+ * Returns the number of requests that are queued or running at the moment.
+ */
+size_t rd_request_queue_in_flight(rd_request_queue_t *queue);
+
+/**
+ * @abstract
+ * Returns the number of worker threads, i.e. how many requests may run at once.
+ */
+unsigned int rd_request_queue_workers(rd_request_queue_t *queue);
+
+/**
+ * @abstract
+ * Waits for every submitted request to complete and destroys the queue.
+ */
+void rd_request_queue_destroy(rd_request_queue_t *queue);